@@ -807,7 +807,11 @@ namespace {
          * state by running delta* on larger and larger prefixes.
          *
          * TODO: This system assumes all input characters are single UTF-8 bytes.
+         *
+         * The states we get back point into the NFA, so it needs to stick around until
+         * we're done printing them.
          */
+        auto nfa = data.automaton->toNFA();
         for (size_t i = 0; i <= input.size(); i++) {
             if (i == 0) {
                 cout << "The automaton, at start-up, ";
@@ -815,7 +819,7 @@ namespace {
                 cout << "The automaton, after reading character " << input[i - 1] << ", ";
             }
 
-            auto states = Automata::deltaStar(data.automaton->toNFA(), input.substr(0, i));
+            auto states = Automata::deltaStar(nfa, input.substr(0, i));
             cout << "is in " << (states.size() == 1? "this state: " : "these states: ");
 
             for (auto* state: states) {
@@ -826,7 +830,7 @@ namespace {
         }
 
         /* See if we're accepting. */
-        cout << "Overall, the automaton " << (Automata::accepts(data.automaton->toNFA(), input)? "accepts" : "rejects") << " the input." << endl;
+        cout << "Overall, the automaton " << (Automata::accepts(nfa, input)? "accepts" : "rejects") << " the input." << endl;
     }
 
     const vector<Command> kCommands = {
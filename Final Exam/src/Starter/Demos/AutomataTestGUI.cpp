@@ -596,12 +596,15 @@ namespace {
         auto tests = toTestCases(input);
 
         cout << "There " << (tests.size() == 1? "is one custom test case" : "are " + to_string(tests.size()) + " custom test cases") << " for this automaton." << endl;
+
+        /* The automaton doesn't change while the tests run, so only convert it once. */
+        auto nfa = data.automaton->toNFA();
         for (const auto& test: tests) {
             /* Convert epsilons back to empty strings. */
             string input = test.input;
             if (input == "ε") input = "";
 
-            auto result = Automata::accepts(data.automaton->toNFA(), input);
+            auto result = Automata::accepts(nfa, input);
 
             cout << "Input:    " << test.input << endl;
             cout << "Accepted? " << boolalpha << result << endl;
@@ -3,12 +3,16 @@
 #include "Languages.h"
 #include "Automaton.h"
 #include <string>
+#include <string_view>
 #include <memory>
 #include <vector>
 #include <set>
 #include <ostream>
 #include <functional>
 #include <map>
+#include <unordered_map>
+#include <random>
+#include <cstdint>
 
 namespace CFG {
     /* A symbol in a production. */
@@ -53,28 +57,302 @@ namespace CFG {
      */
     using Derivation = std::vector<std::pair<Production, std::size_t>>;
 
-    /* Input is a string, output is a boolean for whether we match. */
+    /* Input is a string, output is a boolean for whether we match. A matcher (and its
+     * copies) may be called from several threads at once.
+     */
     using Matcher = std::function<bool(const std::string&)>;
 
     /* Input is a string, output is a derivation. */
     using Deriver = std::function<Derivation (const std::string&)>;
 
-    /* Input is a length, output is a pair of "can we make it?" and a string. */
-    using Generator = std::function<std::pair<bool, std::string>(std::size_t)>;
+    /* Input is a length, output is a pair of "can we make it?" and a string.
+     *
+     * Each generator has its own random number generator, so its output is reproducible
+     * given its seed. Copies of a generator share the (read-only) tables computed from
+     * the grammar, so they're cheap to make, and different copies may be used from
+     * different threads at the same time. A single generator may not.
+     */
+    class Generator {
+    public:
+        struct Impl;
+        Generator() = default;
+        Generator(std::shared_ptr<const Impl> impl, std::uint_fast32_t seed);
+
+        std::pair<bool, std::string> operator()(std::size_t length);
+
+        /* Reseeds the random number generator. */
+        void seed(std::uint_fast32_t seed);
+
+        /* Produces count strings of the given length, spread across the given number of
+         * threads (zero means one per core). The result depends only on the state of this
+         * generator, not on the number of threads. Returns an empty list if there are no
+         * strings of that length.
+         */
+        std::vector<std::string> generateBatch(std::size_t length, std::size_t count, std::size_t threads = 0);
+
+    private:
+        std::shared_ptr<const Impl> impl;
+        std::mt19937 rng;
+    };
+
+    /* A shared packed parse forest (SPPF). This compactly represents every parse tree
+     * of a string, sharing common subtrees, and takes at most cubic space in the length
+     * of the string even when there are exponentially many parse trees.
+     */
+    class ParseForest {
+    public:
+        struct Impl; // Internal representation; see CFG.cpp.
+
+        ParseForest() = default;
+        explicit ParseForest(std::shared_ptr<const Impl> impl);
+
+        /* Does the string have a parse at all? */
+        bool accepts() const;
+
+        /* Does the string have more than one parse tree? */
+        bool isAmbiguous() const;
 
-    /* We support three different matchers. */
+        /* Number of nodes in the forest. */
+        std::size_t size() const;
+
+        /* Lazily enumerates derivations of the string, one per parse tree. Derivations
+         * are leftmost, in the same format as those produced by a Deriver. Trees in which
+         * a nonterminal derives the same piece of the string from itself (which can only
+         * happen in grammars with cycles like A -> A, and which would otherwise give
+         * infinitely many trees) are skipped.
+         */
+        class Enumerator {
+        public:
+            /* Stores the next derivation in result, returning false if there are none
+             * left.
+             */
+            bool next(Derivation& result);
+
+        private:
+            friend class ParseForest;
+            explicit Enumerator(std::shared_ptr<const Impl> impl);
+
+            std::shared_ptr<const Impl> impl;
+            std::vector<std::size_t> choices; // Which packed node we picked at each choice point
+            std::vector<std::size_t> options; // How many packed nodes were available there
+            bool started = false;
+            bool done    = false;
+        };
+        Enumerator derivations() const;
+
+    private:
+        std::shared_ptr<const Impl> impl;
+    };
+
+    /* Input is a string, output is a parse forest for it. */
+    using Parser = std::function<ParseForest (const std::string&)>;
+
+    /* We support five different matchers. */
     enum class MatcherType {
-        EARLEY_LR0, // General purpose, time-optimized. Use as default.
+        EARLEY_LR0, // General purpose, time-optimized.
         EARLEY,     // General purpose, fast for unambiguous grammars, slower as it gets more ambiguous
         CYK,        // Only works on (weak) CNF; somewhat slow.
+        VALIANT,    // Experimental. Matrix-multiplication based; only pays off on very long inputs.
+        GLL,        // General purpose; matches without building a parse forest, at about EARLEY's speed.
+        AUTOMATIC,  // Linear-time fast path if the grammar has one (see classify), else EARLEY_LR0. Use as default.
     };
 
-    Matcher   matcherFor(const CFG& cfg, MatcherType type = MatcherType::EARLEY_LR0);
+    Matcher   matcherFor(const CFG& cfg, MatcherType type = MatcherType::AUTOMATIC);
     Deriver   deriverFor(const CFG& cfg);    // Earley
+    Parser    parserFor(const CFG& cfg);     // GLL
     Generator generatorFor(const CFG& cfg);  // McKenzie
+    Generator generatorFor(const CFG& cfg, std::uint_fast32_t seed);
+
+    /* Deterministic grammar classes the AUTOMATIC matcher knows how to speed up. These
+     * are checked in this order, and the first one that fits is what's reported.
+     */
+    enum class GrammarClass {
+        REGULAR, // Right-linear or left-linear; matched with a minimal DFA
+        LL1,     // Matched with a table-driven predictive parser
+        LR0,     // These three are matched with a shift-reduce parser
+        SLR1,
+        LALR1,
+        GENERAL, // None of the above; matched with EARLEY_LR0
+    };
+
+    /* Which class the grammar falls into. This is judged after removing useless and
+     * duplicate productions, so e.g. a grammar that's only LL(1) once its unreachable
+     * nonterminals are ignored counts as LL(1). A grammar that's regular only in some
+     * subtler way (say, mixing right- and left-linear productions) isn't detected.
+     */
+    GrammarClass classify(const CFG& cfg);
+
+    /* A grammar compiled for matching many strings, using the same algorithm as the
+     * EARLEY_LR0 matcher. This holds on to the memory used while matching and reuses it
+     * for later strings, so once it has seen its longest input, matching doesn't
+     * allocate anything.
+     *
+     * Copies share the compiled grammar but get their own scratch space, so different
+     * copies may be used from different threads at once. Unlike a Matcher, a single one
+     * may not.
+     */
+    class CompiledGrammar {
+    public:
+        explicit CompiledGrammar(const CFG& cfg);
+
+        CompiledGrammar(const CompiledGrammar& rhs);
+        CompiledGrammar(CompiledGrammar&& rhs);
+        CompiledGrammar& operator= (CompiledGrammar rhs);
+        ~CompiledGrammar();
+
+        bool match(std::u32string_view input);
+        bool match(const std::string& input); // UTF-8
+
+        std::vector<bool> matchBatch(const std::vector<std::string>& inputs);
+
+        struct Impl;
+        struct Scratch;
+
+    private:
+        std::shared_ptr<const Impl> impl;
+        std::unique_ptr<Scratch> scratch;
+    };
+
+    /* An Earley parser for interactive tools, where the grammar and the strings being
+     * tested change a little at a time. It remembers the parse of each string it's given,
+     * filed under a caller-chosen id (say, the line number of a test case). Parsing a new
+     * string under the same id only redoes the work from the first character that differs,
+     * and changing the grammar only redoes each parse from the first point where one of
+     * the changed productions could have been used.
+     *
+     * Both matches and derive throw if the input contains characters outside the alphabet.
+     */
+    class IncrementalParser {
+    public:
+        explicit IncrementalParser(const CFG& cfg);
+
+        IncrementalParser(IncrementalParser &&);
+        IncrementalParser& operator= (IncrementalParser &&);
+        ~IncrementalParser();
+
+        void setGrammar(const CFG& cfg);
+
+        bool       matches(std::size_t id, const std::string& input);
+        Derivation derive (std::size_t id, const std::string& input); // Empty if none exists
+
+        /* Discards the parses for ids numIds and up. */
+        void forget(std::size_t numIds);
+
+        struct Impl;
+
+    private:
+        std::unique_ptr<Impl> impl;
+    };
 
     /* * * * * CFG Utility Functions * * * * */
 
+    /* Basic facts about the nonterminals of a grammar, all worked out up front. Each
+     * property is computed with a worklist, so the whole analysis takes time linear in
+     * the size of the grammar (times the number of terminals, in 64-bit words, for the
+     * FIRST and FOLLOW sets).
+     *
+     * Nonterminals are numbered 0, 1, 2, ..., starting with those in cfg.nonterminals
+     * in order, then the start symbol, then any that show up only in productions.
+     * Terminals are numbered the same way, starting with the alphabet. Sets of either
+     * are bitsets indexed by those numbers.
+     */
+    class GrammarAnalysis {
+    public:
+        /* Fixed-size set of small nonnegative integers. */
+        class Bitset {
+        public:
+            Bitset() = default;
+            explicit Bitset(std::size_t size);
+
+            std::size_t size()  const; // Largest element allowed, plus one
+            std::size_t count() const; // Number of elements
+
+            bool contains(std::size_t index) const;
+            void insert(std::size_t index);
+
+            /* Adds everything from rhs, which must be the same size, returning whether
+             * that added anything new.
+             */
+            bool insertAll(const Bitset& rhs);
+            bool intersects(const Bitset& rhs) const;
+
+            /* Calls the given function on each element, in increasing order. */
+            template <typename Callback> void forEach(Callback callback) const {
+                for (std::size_t i = 0; i < words.size(); i++) {
+                    for (std::uint64_t word = words[i]; word != 0; word &= word - 1) {
+                        callback(i * 64 + lowestBitOf(word));
+                    }
+                }
+            }
+
+            bool operator== (const Bitset& rhs) const;
+            bool operator!= (const Bitset& rhs) const;
+
+        private:
+            std::size_t numBits = 0;
+            std::vector<std::uint64_t> words;
+
+            static std::size_t lowestBitOf(std::uint64_t word);
+        };
+
+        explicit GrammarAnalysis(const CFG& cfg);
+
+        std::size_t numNonterminals() const;
+        std::size_t numTerminals() const;
+
+        /* Conversions between symbols and their numbers. idOf and terminalIdOf throw if
+         * the symbol doesn't appear in the grammar.
+         */
+        std::size_t idOf(char32_t nonterminal) const;
+        std::size_t terminalIdOf(char32_t terminal) const;
+        char32_t    nonterminalAt(std::size_t id) const;
+        char32_t    terminalAt(std::size_t id) const;
+
+        /* Sets of nonterminals. */
+        const Bitset& nullable()   const; // A =>* ε
+        const Bitset& productive() const; // A =>* w for some string of terminals w
+        const Bitset& reachable()  const; // S =>* αAβ
+        const Bitset& useful()     const; // Productive, and reachable using only productive symbols
+        const Bitset& cyclic()     const; // A =>+ A using unit productions (A -> B) alone
+
+        /* Convenience wrapper; false for anything that isn't a nullable nonterminal. */
+        bool isNullable(char32_t nonterminal) const;
+
+        /* For a nullable nonterminal, the index in cfg.productions of a production to
+         * apply first when deriving ε. Following these never loops.
+         */
+        std::size_t nullingProductionOf(std::size_t id) const;
+
+        /* FIRST and FOLLOW sets, as sets of terminal numbers. FOLLOW sets have one more
+         * element, endOfInput(), which is present if the nonterminal can come last in a
+         * sentential form.
+         */
+        const Bitset& first(std::size_t id)  const;
+        const Bitset& follow(std::size_t id) const;
+        std::size_t endOfInput() const;
+
+        /* Nonterminals reachable from the given one using unit productions alone,
+         * including itself.
+         */
+        const Bitset& unitClosure(std::size_t id) const;
+
+        /* Strongly connected components of the graph with an edge A -> B for each unit
+         * production A -> B, in reverse topological order: each component comes after
+         * every component reachable from it.
+         */
+        const std::vector<std::vector<std::size_t>>& unitComponents() const;
+
+    private:
+        std::vector<char32_t> nonterminals, terminals;
+        std::unordered_map<char32_t, std::size_t> nonterminalIds, terminalIds;
+
+        Bitset nullableSet, productiveSet, reachableSet, usefulSet, cyclicSet;
+        std::vector<std::size_t> nullingProductions;
+
+        std::vector<Bitset> firstSets, followSets, unitClosures;
+        std::vector<std::vector<std::size_t>> components;
+    };
+
     /* Converts a grammar to Chomsky normal form. The nonterminals in the resulting
      * grammar may have names that bear no resemblance to the original grammar's
      * nonterminal names.
@@ -87,6 +365,51 @@ namespace CFG {
      */
     CFG toWeakCNF(const CFG& cfg);
 
+    /* How the grammar looked after one step of a CNF conversion. */
+    struct CNFStage {
+        std::string name;              // "INPUT", "START", "TERM", "BIN", "DEL", "CLEAN", or "UNIT"
+        std::size_t nonterminals = 0;
+        std::size_t productions  = 0;
+        std::size_t size         = 0;  // Symbols in all productions, counting left-hand sides
+        double seconds           = 0;  // Time spent on this step
+    };
+
+    /* Versions of the above that also report on each step of the conversion, in the
+     * order they happen. Useful for seeing which step is making a grammar blow up.
+     */
+    CFG toCNF(const CFG& cfg, std::vector<CNFStage>& stages);
+    CFG toWeakCNF(const CFG& cfg, std::vector<CNFStage>& stages);
+
+    /* Lazily lists the strings of length at most maxLength in a grammar's language, in
+     * shortlex order: shorter strings first, and strings of the same length in order by
+     * code point. Each string is listed once, however many derivations it has.
+     *
+     * The strings of each length are worked out together the first time one of them is
+     * needed, built up from memoized sets of the strings each nonterminal derives at each
+     * shorter length. Strings are handed out straight from those sets rather than copied,
+     * and stopping early skips all the work for longer lengths.
+     *
+     * Copies have their own positions but share the memoized sets, so different copies
+     * can't be used from different threads at once.
+     */
+    class LanguageEnumerator {
+    public:
+        struct Impl; // Internal representation; see CFG.cpp.
+
+        /* Stores the next string in result, returning false if there are none left. */
+        bool next(std::string& result);
+
+    private:
+        friend LanguageEnumerator enumerate(const CFG& cfg, std::size_t maxLength);
+        explicit LanguageEnumerator(std::shared_ptr<Impl> impl);
+
+        std::shared_ptr<Impl> impl;
+        std::size_t length = 0;                          // Next length to work out
+        const std::set<std::string>* strings = nullptr;  // Strings of the previous length...
+        std::set<std::string>::const_iterator position;  // ...and the next one to hand out
+    };
+    LanguageEnumerator enumerate(const CFG& cfg, std::size_t maxLength);
+
     /* * * * * Language Transforms * * * * */
 
     /* Returns a new CFG whose language is the intersection of the languages of the
@@ -108,6 +431,74 @@ namespace CFG {
      */
     CFG unionOf(const CFG& lhs, const CFG& rhs);
 
+    /* * * * * Language Comparisons * * * * */
+
+    /* Tuning knobs for probablyEquivalent. */
+    struct EquivalenceOptions {
+        std::size_t maxLength       = 15;   // Test lengths 0, 1, ..., maxLength - 1
+        std::size_t trialsPerLength = 350;  // Strings sampled from each grammar at each length
+        std::size_t threads         = 0;    // Zero means one per core
+        std::uint_fast32_t seed     = std::mt19937::default_seed;
+        MatcherType matcherType     = MatcherType::AUTOMATIC;
+    };
+
+    /* Outcome of probablyEquivalent, with how long each phase took. */
+    struct EquivalenceReport {
+        bool equivalent = true;     // Whether no counterexample was found
+        std::string counterexample; // If not, a string one grammar generates and the other doesn't
+
+        std::size_t stringsTested = 0;   // Distinct strings actually run through a matcher
+
+        double matcherSeconds   = 0;
+        double generatorSeconds = 0;
+        double testingSeconds   = 0;
+    };
+
+    /* Fuzz-tests two CFGs against one another by sampling strings from each and checking
+     * that the other grammar generates them too. A counterexample proves the grammars
+     * differ; the absence of one is merely good evidence that they're the same. (It's
+     * undecidable whether two CFGs are equivalent, so this is the best we can do in
+     * general.)
+     *
+     * The work is spread across a pool of threads, which all stop as soon as any of them
+     * finds a counterexample. Which counterexample gets reported may depend on timing.
+     */
+    EquivalenceReport probablyEquivalent(const CFG& one, const CFG& two,
+                                         const EquivalenceOptions& options = {});
+
+    /* Tuning knobs for boundedEquivalent. */
+    struct BoundedEquivalenceOptions {
+        std::size_t enumerationLimit = 4096; // List strings outright if there are at most this many
+        std::size_t prefixLimit      = 64;   // Most prefixes to examine at any one length
+    };
+
+    /* Outcome of boundedEquivalent. */
+    struct BoundedEquivalenceReport {
+        bool equivalent = true;          // Whether no difference was found
+        std::size_t firstDifference = 0; // If not, the shortest length where one was found
+        std::string counterexample;      // ...and a string of that length in exactly one language
+
+        /* Lengths that couldn't be fully checked within the prefix limit. If this is empty,
+         * the answer is exact for all lengths checked.
+         */
+        std::vector<std::size_t> unsettledLengths;
+    };
+
+    /* Deterministically compares the sets of strings of lengths 0, 1, 2, ..., maxLength - 1
+     * generated by the two grammars, stopping at the first length where they differ. These
+     * are the same lengths probablyEquivalent tests given the same maxLength.
+     *
+     * Each length is examined by counting the strings of that length each grammar can
+     * derive. Where those sets are small, they're listed and compared directly. Otherwise,
+     * the strings are split up by prefix (by intersecting each grammar with a DFA for
+     * strings of that length with that prefix) and the pieces examined individually,
+     * with pieces whose counts disagree examined first. For unambiguous grammars, counts
+     * disagree exactly when the sets do, so a counterexample is found after examining
+     * polynomially many prefixes.
+     */
+    BoundedEquivalenceReport boundedEquivalent(const CFG& one, const CFG& two, std::size_t maxLength,
+                                               const BoundedEquivalenceOptions& options = {});
+
 
     /* * * * * C++ Utility Functions * * * * */
     bool operator== (const Symbol& lhs, const Symbol& rhs);
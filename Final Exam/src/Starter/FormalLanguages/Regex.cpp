@@ -1,10 +1,16 @@
 #include "Regex.h"
 #include "RegexScanner.h"
+#include "Automaton.h"
 #include "Utilities/Unicode.h"
 #include <typeinfo>
 #include <sstream>
 #include <unordered_map>
 #include <limits>
+#include <map>
+#include <queue>
+#include <tuple>
+#include <vector>
+#include <algorithm>
 using namespace std;
 
 namespace Regex {
@@ -238,53 +244,486 @@ namespace Regex {
         return c.used;
     }
 
+    /* Hash-consing factory. */
+    bool Factory::Key::operator== (const Key& rhs) const {
+        return kind == rhs.kind && left == rhs.left && right == rhs.right && value == rhs.value;
+    }
+
+    size_t Factory::KeyHash::operator() (const Key& key) const {
+        size_t result = static_cast<size_t>(key.kind);
+        result = result * 31 + hash<ASTNode*>()(key.left);
+        result = result * 31 + hash<ASTNode*>()(key.right);
+        result = result * 31 + hash<size_t>()(key.value);
+        return result;
+    }
+
+    Factory::Factory() {
+        theSigma    = make(Key{ Kind::SIGMA,     nullptr, nullptr, 0 }, [] { return make_shared<Sigma>(); },    nullptr, nullptr, 1, false);
+        theEpsilon  = make(Key{ Kind::EPSILON,   nullptr, nullptr, 0 }, [] { return make_shared<Epsilon>(); },  nullptr, nullptr, 0, true);
+        theEmptySet = make(Key{ Kind::EMPTY_SET, nullptr, nullptr, 0 }, [] { return make_shared<EmptySet>(); }, nullptr, nullptr, 0, false);
+    }
+
+    const Factory::Info& Factory::infoFor(Regex regex) {
+        auto itr = info.find(regex.get());
+        if (itr == info.end()) {
+            throw runtime_error("Regex did not come from this factory.");
+        }
+        return itr->second;
+    }
+
+    /* Returns the node for the given key, creating and recording it if this is the
+     * first time we've seen it.
+     */
+    Regex Factory::make(const Key& key, function<Regex()> create,
+                        Regex left, Regex right, size_t size, bool isNullable) {
+        auto itr = nodes.find(key);
+        if (itr != nodes.end()) return itr->second;
+
+        Regex result = create();
+        nodes.insert(make_pair(key, result));
+        info.insert(make_pair(result.get(), Info{ key.kind, key.value, left, right, size, isNullable, nullptr }));
+        return result;
+    }
+
+    Regex Factory::character(char32_t ch) {
+        return make(Key{ Kind::CHARACTER, nullptr, nullptr, ch }, [&] { return make_shared<Character>(ch); },
+                    nullptr, nullptr, 1, false);
+    }
+    Regex Factory::sigma() {
+        return theSigma;
+    }
+    Regex Factory::epsilon() {
+        return theEpsilon;
+    }
+    Regex Factory::emptySet() {
+        return theEmptySet;
+    }
+
+    /* Whether needle is one of the top-level alternatives of haystack. Unions may be
+     * nested either way, e.g. (a ∪ b) ∪ c or a ∪ (b ∪ c), so we look down both sides.
+     */
+    bool Factory::isAlternativeOf(Regex needle, Regex haystack) {
+        vector<Regex> worklist = { haystack };
+        while (!worklist.empty()) {
+            auto curr = worklist.back();
+            worklist.pop_back();
+            if (curr == needle) return true;
+
+            const auto& entry = infoFor(curr);
+            if (entry.kind == Kind::UNION) {
+                worklist.push_back(entry.right);
+                worklist.push_back(entry.left);
+            }
+        }
+        return false;
+    }
+
+    Regex Factory::unionOf(Regex lhs, Regex rhs) {
+        /* ∅ ∪ r = r ∪ ∅ = r */
+        if (lhs == theEmptySet) return rhs;
+        if (rhs == theEmptySet) return lhs;
+
+        /* r ∪ r = r, including when r is already one of the alternatives. */
+        if (lhs == rhs || isAlternativeOf(rhs, lhs)) return lhs;
+        if (isAlternativeOf(lhs, rhs)) return rhs;
+
+        /* ε ∪ r = r ∪ ε = r if r already matches ε. */
+        if (lhs == theEpsilon && isNullable(rhs)) return rhs;
+        if (rhs == theEpsilon && isNullable(lhs)) return lhs;
+
+        return make(Key{ Kind::UNION, lhs.get(), rhs.get(), 0 }, [&] { return make_shared<Union>(lhs, rhs); },
+                    lhs, rhs, sizeOf(lhs) + sizeOf(rhs), isNullable(lhs) || isNullable(rhs));
+    }
+
+    Regex Factory::concat(Regex lhs, Regex rhs) {
+        /* ∅r = r∅ = ∅ */
+        if (lhs == theEmptySet || rhs == theEmptySet) return theEmptySet;
+
+        /* εr = rε = r */
+        if (lhs == theEpsilon) return rhs;
+        if (rhs == theEpsilon) return lhs;
+
+        return make(Key{ Kind::CONCAT, lhs.get(), rhs.get(), 0 }, [&] { return make_shared<Concat>(lhs, rhs); },
+                    lhs, rhs, sizeOf(lhs) + sizeOf(rhs), isNullable(lhs) && isNullable(rhs));
+    }
+
+    Regex Factory::star(Regex expr) {
+        /* ∅* = ε* = ε */
+        if (expr == theEmptySet || expr == theEpsilon) return theEpsilon;
+
+        /* r** = r*, and r+* = r?* = r* */
+        const auto& entry = infoFor(expr);
+        if (entry.kind == Kind::STAR) return expr;
+        if (entry.kind == Kind::PLUS || entry.kind == Kind::QUESTION) return star(entry.left);
+
+        return make(Key{ Kind::STAR, expr.get(), nullptr, 0 }, [&] { return make_shared<Star>(expr); },
+                    expr, nullptr, entry.size, true);
+    }
+
+    Regex Factory::plus(Regex expr) {
+        /* ∅+ = ∅, ε+ = ε, r*+ = r*, r++ = r+ */
+        if (expr == theEmptySet || expr == theEpsilon) return expr;
+
+        const auto& entry = infoFor(expr);
+        if (entry.kind == Kind::STAR || entry.kind == Kind::PLUS) return expr;
+
+        return make(Key{ Kind::PLUS, expr.get(), nullptr, 0 }, [&] { return make_shared<Plus>(expr); },
+                    expr, nullptr, entry.size, entry.isNullable);
+    }
+
+    Regex Factory::question(Regex expr) {
+        /* ∅? = ε, and r? = r if r already matches ε. */
+        if (expr == theEmptySet) return theEpsilon;
+        if (isNullable(expr))    return expr;
+
+        return make(Key{ Kind::QUESTION, expr.get(), nullptr, 0 }, [&] { return make_shared<Question>(expr); },
+                    expr, nullptr, sizeOf(expr), true);
+    }
+
+    Regex Factory::power(Regex expr, size_t repeats) {
+        /* r⁰ = ε, r¹ = r, εⁿ = ε, ∅ⁿ = ∅ for n > 0 */
+        if (repeats == 0) return theEpsilon;
+        if (repeats == 1 || expr == theEpsilon || expr == theEmptySet) return expr;
+
+        /* Saturate rather than overflow on silly exponents. */
+        size_t size = sizeOf(expr);
+        size = (size > numeric_limits<size_t>::max() / repeats)? numeric_limits<size_t>::max() : size * repeats;
+
+        return make(Key{ Kind::POWER, expr.get(), nullptr, repeats }, [&] { return make_shared<Power>(expr, repeats); },
+                    expr, nullptr, size, isNullable(expr));
+    }
+
+    Regex Factory::intern(Regex regex) {
+        struct Interner: public Calculator<Regex> {
+            Factory& factory;
+            Interner(Factory& factory) : factory(factory) {}
+
+            Regex handle(Character* c) override {
+                return factory.character(c->ch);
+            }
+            Regex handle(Sigma*) override {
+                return factory.sigma();
+            }
+            Regex handle(Epsilon*) override {
+                return factory.epsilon();
+            }
+            Regex handle(EmptySet*) override {
+                return factory.emptySet();
+            }
+            Regex handle(Union*, Regex left, Regex right) override {
+                return factory.unionOf(left, right);
+            }
+            Regex handle(Concat*, Regex left, Regex right) override {
+                return factory.concat(left, right);
+            }
+            Regex handle(Star*, Regex child) override {
+                return factory.star(child);
+            }
+            Regex handle(Plus*, Regex child) override {
+                return factory.plus(child);
+            }
+            Regex handle(Question*, Regex child) override {
+                return factory.question(child);
+            }
+            Regex handle(Power* p, Regex child) override {
+                return factory.power(child, p->repeats);
+            }
+        };
+
+        /* Already ours? Then there's nothing to do. */
+        if (info.count(regex.get())) return regex;
+        return Interner(*this).calculate(regex);
+    }
+
+    bool Factory::isNullable(Regex regex) {
+        return infoFor(regex).isNullable;
+    }
+
+    size_t Factory::sizeOf(Regex regex) {
+        return infoFor(regex).size;
+    }
+
+    /* Core alphabets are computed on demand and shared with children whenever
+     * they'd be identical, so long chains over the same few characters don't each
+     * carry their own copy.
+     */
+    shared_ptr<const Languages::Alphabet> Factory::alphabetOf(Regex regex) {
+        auto& entry = info.at(regex.get());
+        if (entry.alphabet) return entry.alphabet;
+
+        if (entry.kind == Kind::CHARACTER) {
+            entry.alphabet = make_shared<const Languages::Alphabet>(Languages::Alphabet{ static_cast<char32_t>(entry.value) });
+        } else if (!entry.left) {
+            entry.alphabet = make_shared<const Languages::Alphabet>();
+        } else if (!entry.right) {
+            entry.alphabet = alphabetOf(entry.left);
+        } else {
+            auto left  = alphabetOf(entry.left);
+            auto right = alphabetOf(entry.right);
+
+            if (left == right || Languages::isSubsetOf(*right, *left)) {
+                entry.alphabet = left;
+            } else if (Languages::isSubsetOf(*left, *right)) {
+                entry.alphabet = right;
+            } else {
+                auto both = make_shared<Languages::Alphabet>(*left);
+                both->insert(right->begin(), right->end());
+                entry.alphabet = both;
+            }
+        }
+        return entry.alphabet;
+    }
+
+    const Languages::Alphabet& Factory::coreAlphabetOf(Regex regex) {
+        infoFor(regex);
+        return *alphabetOf(regex);
+    }
+
     /* "Desugars" a regex into one that uses just the basic core operators. */
     Regex desugar(Regex regex, const Languages::Alphabet& alphabet) {
         struct Desugarer: public Calculator<Regex> {
+            Factory factory;
             Languages::Alphabet alphabet;
+            Regex sigma;  // Expansion of Σ, built on first use
             Desugarer(Languages::Alphabet alphabet) : alphabet(alphabet) {}
 
             Regex handle(Character* c) override {
-                return make_shared<Character>(c->ch);
+                return factory.character(c->ch);
             }
             Regex handle(Epsilon*) override {
-                return make_shared<Epsilon>();
+                return factory.epsilon();
             }
             Regex handle(EmptySet*) override {
-                return make_shared<EmptySet>();
+                return factory.emptySet();
             }
             Regex handle(Sigma*) override {
                 /* Return a union of many possible characters. */
-                Regex result = make_shared<EmptySet>();
-                for (char32_t ch: alphabet) {
-                    result = make_shared<Union>(result, make_shared<Character>(ch));
+                if (!sigma) {
+                    sigma = factory.emptySet();
+                    for (char32_t ch: alphabet) {
+                        sigma = factory.unionOf(sigma, factory.character(ch));
+                    }
                 }
-                return result;
+                return sigma;
             }
             Regex handle(Union*, Regex left, Regex right) override {
-                return make_shared<Union>(left, right);
+                return factory.unionOf(left, right);
             }
             Regex handle(Concat*, Regex left, Regex right) override {
-                return make_shared<Concat>(left, right);
+                return factory.concat(left, right);
             }
             Regex handle(Star*, Regex child) override {
-                return make_shared<Star>(child);
+                return factory.star(child);
             }
             Regex handle(Plus*, Regex child) override {
-                return make_shared<Concat>(child, make_shared<Star>(child));
+                return factory.concat(child, factory.star(child));
             }
             Regex handle(Question*, Regex child) override {
-                return make_shared<Union>(child, make_shared<Epsilon>());
+                return factory.unionOf(child, factory.epsilon());
             }
             Regex handle(Power* p, Regex child) override {
-                Regex result = make_shared<Epsilon>();
-                for (size_t i = 0; i < p->repeats; i++) {
-                    result = make_shared<Concat>(result, child);
+                return powerOf(child, p->repeats);
+            }
+
+            /* r^n by repeated squaring. Since the factory shares equal subtrees,
+             * r^2k is one node pointing twice at r^k.
+             */
+            Regex powerOf(Regex child, size_t repeats) {
+                if (repeats == 0) return factory.epsilon();
+
+                Regex half   = powerOf(child, repeats / 2);
+                Regex result = factory.concat(half, half);
+                return repeats % 2 == 0? result : factory.concat(result, child);
+            }
+        };
+
+        return Desugarer(alphabet).calculate(regex);
+    }
+
+    /* State elimination. */
+    namespace {
+        /* Merges two alternatives for a GNFA edge. On top of what the factory does,
+         * this folds ε alternatives into ?, which reads better than ∪ ε.
+         */
+        Regex alternativesOf(Factory& factory, Regex lhs, Regex rhs) {
+            auto optional = [](Regex regex) {
+                return dynamic_cast<Question*>(regex.get());
+            };
+
+            /* ε ∪ r = r ∪ ε = r? */
+            if (lhs == factory.epsilon()) return factory.question(rhs);
+            if (rhs == factory.epsilon()) return factory.question(lhs);
+
+            /* r? ∪ s = r ∪ s? = (r ∪ s)? */
+            if (auto q = optional(lhs)) return factory.question(alternativesOf(factory, q->expr, rhs));
+            if (auto q = optional(rhs)) return factory.question(alternativesOf(factory, lhs, q->expr));
+
+            return factory.unionOf(lhs, rhs);
+        }
+
+        /* A generalized NFA: an automaton whose edges are labeled with regexes. There
+         * is at most one edge between any pair of states; parallel edges are merged
+         * by union as they're added. Edges are indexed both ways so that eliminating
+         * a state only touches its neighbors.
+         */
+        struct GNFA {
+            vector<map<size_t, Regex>> out, in;
+
+            explicit GNFA(size_t numStates) : out(numStates), in(numStates) {}
+
+            void addEdge(size_t from, size_t to, Regex label, Factory& factory) {
+                auto itr = out[from].find(to);
+                if (itr != out[from].end()) label = alternativesOf(factory, itr->second, label);
+                out[from][to] = label;
+                in[to][from]  = label;
+            }
+
+            void removeState(size_t state) {
+                for (const auto& entry: in[state])  out[entry.first].erase(state);
+                for (const auto& entry: out[state]) in[entry.first].erase(state);
+                in[state].clear();
+                out[state].clear();
+            }
+
+            /* Estimated growth in total regex size from eliminating this state. This
+             * is the weight of Delgado and Morais: each incoming label is copied once
+             * per outgoing edge, each outgoing label once per incoming edge, and the
+             * self-loop once per in/out pair, minus the copies that disappear.
+             */
+            long long weightOf(size_t state, Factory& factory) const {
+                long long numIn  = in[state].size();
+                long long numOut = out[state].size();
+                long long loop   = 0;
+
+                auto loopItr = out[state].find(state);
+                if (loopItr != out[state].end()) {
+                    numIn--;
+                    numOut--;
+                    loop = factory.sizeOf(loopItr->second);
+                }
+
+                long long result = loop * (numIn * numOut - 1);
+                for (const auto& entry: in[state]) {
+                    if (entry.first != state) result += factory.sizeOf(entry.second) * (numOut - 1);
+                }
+                for (const auto& entry: out[state]) {
+                    if (entry.first != state) result += factory.sizeOf(entry.second) * (numIn - 1);
                 }
                 return result;
             }
         };
+    }
 
-        return Desugarer(alphabet).calculate(regex);
+    Regex fromAutomaton(const Automata::NFA& nfa) {
+        Factory factory;
+
+        /* Number the states reachable from the start states in BFS order, beginning
+         * from the start states sorted by name. That way the output doesn't depend
+         * on where the states happen to live in memory.
+         */
+        vector<Automata::State*> starts;
+        for (const auto& state: nfa.states) {
+            if (state->isStart) starts.push_back(state.get());
+        }
+        sort(starts.begin(), starts.end(), [](Automata::State* lhs, Automata::State* rhs) {
+            return lhs->name < rhs->name;
+        });
+
+        unordered_map<Automata::State*, size_t> indices;
+        vector<Automata::State*> states;
+        for (auto state: starts) {
+            indices.insert(make_pair(state, states.size()));
+            states.push_back(state);
+        }
+        for (size_t i = 0; i < states.size(); i++) {
+            for (const auto& transition: states[i]->transitions) {
+                if (!indices.count(transition.second)) {
+                    indices.insert(make_pair(transition.second, states.size()));
+                    states.push_back(transition.second);
+                }
+            }
+        }
+
+        /* Build the GNFA, adding a fresh source and sink so that there is one start
+         * state with no incoming edges and one accepting state with no outgoing ones.
+         */
+        const size_t source = states.size();
+        const size_t sink   = states.size() + 1;
+        GNFA gnfa(states.size() + 2);
+
+        for (size_t i = 0; i < states.size(); i++) {
+            if (states[i]->isStart)     gnfa.addEdge(source, i, factory.epsilon(), factory);
+            if (states[i]->isAccepting) gnfa.addEdge(i, sink, factory.epsilon(), factory);
+
+            for (const auto& transition: states[i]->transitions) {
+                Regex label = (transition.first == Automata::EPSILON_TRANSITION?
+                               factory.epsilon() : factory.character(transition.first));
+                gnfa.addEdge(i, indices.at(transition.second), label, factory);
+            }
+        }
+
+        /* Drop states that can't reach the sink; they contribute nothing but would
+         * still cost something to eliminate.
+         */
+        vector<char> useful(states.size() + 2);
+        queue<size_t> worklist;
+        worklist.push(sink);
+        useful[sink] = true;
+        while (!worklist.empty()) {
+            size_t curr = worklist.front();
+            worklist.pop();
+
+            for (const auto& entry: gnfa.in[curr]) {
+                if (!useful[entry.first]) {
+                    useful[entry.first] = true;
+                    worklist.push(entry.first);
+                }
+            }
+        }
+
+        vector<size_t> remaining;
+        for (size_t i = 0; i < states.size(); i++) {
+            if (useful[i]) remaining.push_back(i);
+            else gnfa.removeState(i);
+        }
+
+        /* Eliminate states one at a time, always choosing the one whose removal
+         * is estimated to grow the regex the least. Ties go to the lowest-numbered
+         * state, which keeps the output deterministic.
+         */
+        while (!remaining.empty()) {
+            size_t bestIndex = 0;
+            long long bestWeight = gnfa.weightOf(remaining[0], factory);
+            for (size_t i = 1; i < remaining.size(); i++) {
+                long long weight = gnfa.weightOf(remaining[i], factory);
+                if (weight < bestWeight) {
+                    bestIndex  = i;
+                    bestWeight = weight;
+                }
+            }
+
+            size_t state = remaining[bestIndex];
+            remaining.erase(remaining.begin() + bestIndex);
+
+            /* Route every path p -> state -> r around the state as p -> r. */
+            auto loopItr = gnfa.out[state].find(state);
+            Regex loop = (loopItr == gnfa.out[state].end()? factory.epsilon() : factory.star(loopItr->second));
+
+            for (const auto& incoming: gnfa.in[state]) {
+                if (incoming.first == state) continue;
+
+                Regex prefix = factory.concat(incoming.second, loop);
+                for (const auto& outgoing: gnfa.out[state]) {
+                    if (outgoing.first == state) continue;
+                    gnfa.addEdge(incoming.first, outgoing.first, factory.concat(prefix, outgoing.second), factory);
+                }
+            }
+
+            gnfa.removeState(state);
+        }
+
+        /* All that's left is the edge from the source to the sink, if there is one. */
+        auto itr = gnfa.out[source].find(sink);
+        return itr == gnfa.out[source].end()? factory.emptySet() : itr->second;
     }
 }
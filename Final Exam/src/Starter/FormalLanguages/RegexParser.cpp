@@ -6,6 +6,7 @@
 #include <map>
 #include <functional>
 #include <iostream>
+#include <algorithm>
 using namespace std;
 
 #define PARSER_IS_VERBOSE (false)
@@ -62,7 +63,7 @@ namespace Regex {
 
       /* Type representing data aggregated so far. */
       struct StackData {
-        Token     token;  // Only active if the item is a terminal
+        TokenView token;  // Only active if the item is a terminal
         AuxData   data;   // Only active if the item is a nonterminal
       };
 
@@ -139,20 +140,20 @@ namespace Regex {
       /* Unused argument type. */
       struct _unused_ {};
 
-      std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_CHARACTER(const std::string& _parserArg1);
-  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_EMPTYSET(const std::string&);
-  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_EPSILON(const std::string&);
-  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_LPAREN_OREXPR_RPAREN(const std::string&, std::shared_ptr<ASTNode> _parserArg2, const std::string&);
-  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_SIGMA(const std::string&);
+      std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_CHARACTER(std::string_view _parserArg1);
+  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_EMPTYSET(std::string_view);
+  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_EPSILON(std::string_view);
+  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_LPAREN_OREXPR_RPAREN(std::string_view, std::shared_ptr<ASTNode> _parserArg2, std::string_view);
+  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_SIGMA(std::string_view);
   std::shared_ptr<ASTNode> reduce_CONCATEXPR_from_STAREXPR(std::shared_ptr<ASTNode> _parserArg1);
   std::shared_ptr<ASTNode> reduce_CONCATEXPR_from_STAREXPR_CONCATEXPR(std::shared_ptr<ASTNode> _parserArg1, std::shared_ptr<ASTNode> _parserArg2);
   std::shared_ptr<ASTNode> reduce_OREXPR_from_CONCATEXPR(std::shared_ptr<ASTNode> _parserArg1);
-  std::shared_ptr<ASTNode> reduce_OREXPR_from_CONCATEXPR_UNION_OREXPR(std::shared_ptr<ASTNode> _parserArg1, const std::string&, std::shared_ptr<ASTNode> _parserArg3);
+  std::shared_ptr<ASTNode> reduce_OREXPR_from_CONCATEXPR_UNION_OREXPR(std::shared_ptr<ASTNode> _parserArg1, std::string_view, std::shared_ptr<ASTNode> _parserArg3);
   std::shared_ptr<ASTNode> reduce_STAREXPR_from_ATOMEXPR(std::shared_ptr<ASTNode> _parserArg1);
-  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_PLUS(std::shared_ptr<ASTNode> _parserArg1, const std::string&);
-  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_POWER_NUMBER(std::shared_ptr<ASTNode> _parserArg1, const std::string&, const std::string& _parserArg3);
-  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_QUESTION(std::shared_ptr<ASTNode> _parserArg1, const std::string&);
-  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_STAR(std::shared_ptr<ASTNode> _parserArg1, const std::string&);
+  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_PLUS(std::shared_ptr<ASTNode> _parserArg1, std::string_view);
+  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_POWER_NUMBER(std::shared_ptr<ASTNode> _parserArg1, std::string_view, std::size_t _parserArg3);
+  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_QUESTION(std::shared_ptr<ASTNode> _parserArg1, std::string_view);
+  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_STAR(std::shared_ptr<ASTNode> _parserArg1, std::string_view);
 
 
       AuxData reduce_ATOMEXPR_from_CHARACTER__thunk(StackData a0) {
@@ -223,7 +224,7 @@ namespace Regex {
 
   AuxData reduce_STAREXPR_from_STAREXPR_POWER_NUMBER__thunk(StackData a0, StackData a1, StackData a2) {
     AuxData result;
-    result.field0 = reduce_STAREXPR_from_STAREXPR_POWER_NUMBER(a0.data.field0, a1.token.data, a2.token.data);
+    result.field0 = reduce_STAREXPR_from_STAREXPR_POWER_NUMBER(a0.data.field0, a1.token.data, a2.token.value);
     return result;
   }
 
@@ -489,16 +490,17 @@ namespace Regex {
       }
 
       /* Internal parsing routine */
-      AuxData parseInternal(queue<Token>& tokens) {
+      AuxData parseInternal(const vector<TokenView>& tokens) {
         stack<StackItem> s;
 
         /* Seed the stack with the initial state. */
         s.push({ 0, {} });
 
         /* Run the parser! */
-        while (!tokens.empty()) {
+        size_t next = 0;
+        while (next < tokens.size()) {
           /* Look at the next token. We only consume it in a shift. */
-          auto curr  = tokens.front();
+          const auto& curr = tokens[next];
           int  state = s.top().state;
 
           #if PARSER_IS_VERBOSE
@@ -522,7 +524,7 @@ namespace Regex {
               cout << "  Action: Shift to " << shift->target << endl;
             #endif
             s.push( { shift->target, {curr, {}} } ); // No special data.
-            tokens.pop();
+            next++;
           } else if (auto* reduce = dynamic_cast<ReduceAction*>(action)) {
             #if PARSER_IS_VERBOSE
               cout << "  Action: Reduce" << endl;
@@ -541,31 +543,32 @@ namespace Regex {
         throw runtime_error("Out of tokens, but parser hasn't finished.");
       }
 
-      std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_CHARACTER(const std::string& _parserArg1) {
+      std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_CHARACTER(std::string_view _parserArg1) {
     std::shared_ptr<ASTNode> _parserArg0;
-    _parserArg0 = make_shared<Character>(fromUTF8(_parserArg1));
+    std::size_t pos = 0;
+    _parserArg0 = make_shared<Character>(readChar(_parserArg1, pos));
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_EMPTYSET(const std::string&) {
+  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_EMPTYSET(std::string_view) {
     std::shared_ptr<ASTNode> _parserArg0;
     _parserArg0 = make_shared<EmptySet>();
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_EPSILON(const std::string&) {
+  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_EPSILON(std::string_view) {
     std::shared_ptr<ASTNode> _parserArg0;
     _parserArg0 = make_shared<Epsilon>();
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_LPAREN_OREXPR_RPAREN(const std::string&, std::shared_ptr<ASTNode> _parserArg2, const std::string&) {
+  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_LPAREN_OREXPR_RPAREN(std::string_view, std::shared_ptr<ASTNode> _parserArg2, std::string_view) {
     std::shared_ptr<ASTNode> _parserArg0;
     _parserArg0 = _parserArg2;
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_SIGMA(const std::string&) {
+  std::shared_ptr<ASTNode> reduce_ATOMEXPR_from_SIGMA(std::string_view) {
     std::shared_ptr<ASTNode> _parserArg0;
     _parserArg0 = make_shared<Sigma>();
     return _parserArg0;
@@ -589,7 +592,7 @@ namespace Regex {
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_OREXPR_from_CONCATEXPR_UNION_OREXPR(std::shared_ptr<ASTNode> _parserArg1, const std::string&, std::shared_ptr<ASTNode> _parserArg3) {
+  std::shared_ptr<ASTNode> reduce_OREXPR_from_CONCATEXPR_UNION_OREXPR(std::shared_ptr<ASTNode> _parserArg1, std::string_view, std::shared_ptr<ASTNode> _parserArg3) {
     std::shared_ptr<ASTNode> _parserArg0;
     _parserArg0 = make_shared<Union>(_parserArg1, _parserArg3);
     return _parserArg0;
@@ -601,25 +604,25 @@ namespace Regex {
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_PLUS(std::shared_ptr<ASTNode> _parserArg1, const std::string&) {
+  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_PLUS(std::shared_ptr<ASTNode> _parserArg1, std::string_view) {
     std::shared_ptr<ASTNode> _parserArg0;
     _parserArg0 = make_shared<Plus>(_parserArg1);
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_POWER_NUMBER(std::shared_ptr<ASTNode> _parserArg1, const std::string&, const std::string& _parserArg3) {
+  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_POWER_NUMBER(std::shared_ptr<ASTNode> _parserArg1, std::string_view, std::size_t _parserArg3) {
     std::shared_ptr<ASTNode> _parserArg0;
-    _parserArg0 = make_shared<Power>(_parserArg1, stoi(_parserArg3));
+    _parserArg0 = make_shared<Power>(_parserArg1, _parserArg3);
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_QUESTION(std::shared_ptr<ASTNode> _parserArg1, const std::string&) {
+  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_QUESTION(std::shared_ptr<ASTNode> _parserArg1, std::string_view) {
     std::shared_ptr<ASTNode> _parserArg0;
     _parserArg0 = make_shared<Question>(_parserArg1);
     return _parserArg0;
   }
 
-  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_STAR(std::shared_ptr<ASTNode> _parserArg1, const std::string&) {
+  std::shared_ptr<ASTNode> reduce_STAREXPR_from_STAREXPR_STAR(std::shared_ptr<ASTNode> _parserArg1, std::string_view) {
     std::shared_ptr<ASTNode> _parserArg0;
     _parserArg0 = make_shared<Star>(_parserArg1);
     return _parserArg0;
@@ -628,11 +631,65 @@ namespace Regex {
 
     }
 
+    namespace {
+      /* Largest regex we'll accept, measured in characters and Σ's once every
+       * repetition has been written out in full. Automata are built from the
+       * expanded regex, so without this, nesting a few repetitions (say,
+       * ((a^1000)^1000)^1000) would ask for billions of states.
+       */
+      const size_t kMaxExpandedSize = 100000;
+
+      /* Expanded size of a regex, capped at one more than the limit so that it
+       * can't overflow.
+       */
+      size_t expandedSizeOf(std::shared_ptr<ASTNode> regex) {
+        struct Sizer: public Calculator<size_t> {
+          size_t cap(size_t size) {
+            return min(size, kMaxExpandedSize + 1);
+          }
+
+          size_t handle(Character *) override { return 1; }
+          size_t handle(Sigma *)     override { return 1; }
+          size_t handle(Epsilon *)   override { return 0; }
+          size_t handle(EmptySet *)  override { return 0; }
+          size_t handle(Union *, size_t left, size_t right)  override { return cap(left + right); }
+          size_t handle(Concat *, size_t left, size_t right) override { return cap(left + right); }
+          size_t handle(Star *, size_t child)     override { return child; }
+          size_t handle(Plus *, size_t child)     override { return child; }
+          size_t handle(Question *, size_t child) override { return child; }
+          size_t handle(Power* expr, size_t child) override {
+            if (child != 0 && expr->repeats > kMaxExpandedSize / child) return kMaxExpandedSize + 1;
+            return child * expr->repeats;
+          }
+        };
+
+        Sizer sizer;
+        return sizer.calculate(regex);
+      }
+    }
+
     /* Public parsing routine. */
+    std::shared_ptr<ASTNode> parse(const vector<TokenView>& tokens) {
+      auto result = parseInternal(tokens).field0;
+      if (expandedSizeOf(result) > kMaxExpandedSize) {
+        throw runtime_error("Regular expression is too large once its repetitions are expanded.");
+      }
+      return result;
+    }
     std::shared_ptr<ASTNode> parse(queue<Token>& q) {
-      return parseInternal(q).field0;
+      /* Take ownership of the tokens, then parse views of them. */
+      vector<Token> owned;
+      for (; !q.empty(); q.pop()) {
+        owned.push_back(std::move(q.front()));
+      }
+
+      vector<TokenView> tokens;
+      for (const auto& token: owned) {
+        tokens.push_back({ token.type, token.data, token.type == TokenType::NUMBER? stoul(token.data) : 0 });
+      }
+      return parse(tokens);
     }
     std::shared_ptr<ASTNode> parse(queue<Token>&& q) {
-      return parseInternal(q).field0;
+      return parse(q);
     }
 }
@@ -2,7 +2,9 @@
 #define Scanner_Included
 
 #include <string>
+#include <string_view>
 #include <queue>
+#include <vector>
 #include <istream>
 
 namespace Regex {
@@ -29,7 +31,18 @@ namespace Regex {
         std::string data;
     };
 
+    /* A token that refers back into the source text rather than owning a copy of
+     * it. Tokens that don't appear literally in the source (the end-of-input marker,
+     * and the implicit ^ before a superscript) view static text instead.
+     */
+    struct TokenView {
+        TokenType        type;
+        std::string_view data;
+        std::size_t      value;  // Repeat count, for NUMBER tokens
+    };
+
     std::string to_string(const Token& t);
+    std::string to_string(const TokenView& t);
 
     /* Scans the input stream, producing a queue of tokens. If the scan fails, an
      * exception is generateed.
@@ -39,6 +52,14 @@ namespace Regex {
     std::queue<Token> scan(std::istream& input);
     std::queue<Token> scan(const std::string& sourceText);
 
+    /* Scans the source text in place, replacing the contents of the given vector with
+     * its tokens. Nothing is copied out of the source, which must outlive the tokens,
+     * and passing the same vector in each time reuses its storage across calls.
+     *
+     * The tokens are the same as those from the other scan() overloads.
+     */
+    void scan(std::string_view sourceText, std::vector<TokenView>& tokens);
+
     /* Used when serializing a regex: is the given character something we need
      * to escape?
      */
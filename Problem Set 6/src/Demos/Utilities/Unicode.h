@@ -5,6 +5,7 @@
 #include <ostream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <iterator>
 
@@ -20,6 +21,26 @@ inline char32_t readChar(std::istream& source);
  */
 inline char32_t peekChar(std::istream& source);
 
+/* Given a string encoded in UTF-8 and a byte offset into it, decodes the character that
+ * starts at that offset and advances the offset past it. This works in place, without
+ * copying anything. If the bytes there aren't a proper encoding of a character - including
+ * if the offset is at the end of the string - this reports an error by throwing a
+ * UTFException.
+ */
+inline char32_t readChar(std::string_view source, std::size_t& pos);
+
+/* Decodes an entire UTF-8 string at once, reporting an error by throwing a UTFException if
+ * it isn't properly encoded. This accepts exactly the encodings readChar does, but runs of
+ * ASCII text are handled in bulk (with SSE2 or AVX2 where the processor supports them), so
+ * it's much faster than decoding one character at a time.
+ */
+inline std::u32string decodeUTF8(std::string_view source);
+
+/* Returns whether the given string is properly encoded UTF-8 by the same rules as
+ * decodeUTF8, without decoding it.
+ */
+inline bool isValidUTF8(std::string_view source);
+
 /* Given a Unicode character in UTF-32, returns a UTF-8 representation of that character. */
 inline std::string toUTF8(char32_t ch);
 
@@ -55,26 +76,91 @@ public:
  *     for (char32_t ch: utf8Reader(str)) {
  *          ...
  *     }
+ *
+ * Characters are decoded in place as the iteration proceeds, so this doesn't copy
+ * the string or allocate any memory. The reader only views the string it's given,
+ * so that string must outlive it; temporaries (const or not) are stored in the
+ * reader so that iterating over, say, the result of a function call works as
+ * expected.
  */
 class utf8Reader {
 public:
-    explicit utf8Reader(const std::string& str) : in(str) {}
+    explicit utf8Reader(std::string_view str) : text(str) {}
+    explicit utf8Reader(const char* str) : text(str) {}
+    explicit utf8Reader(std::string&& str) : owned(std::move(str)), text(owned) {}
+    explicit utf8Reader(const std::string&& str) : owned(str), text(owned) {} // Const temporaries can't be moved from
+
+    /* The reader may view its own storage, so it can't be copied or moved. */
+    utf8Reader(const utf8Reader &) = delete;
+    utf8Reader& operator= (const utf8Reader &) = delete;
 
     class const_iterator;
-    const_iterator begin();
-    const_iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
 
 private:
-    std::istringstream in;
-    friend class const_iterator;
+    std::string owned;
+    std::string_view text;
 };
 
+/* Forward iterator over the characters of a UTF-8 string. The character under the
+ * iterator is decoded when the iterator arrives at it, so malformed input is reported,
+ * by throwing a UTFException, on the increment that reaches it.
+ */
+class utf8Reader::const_iterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type        = char32_t;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = const char32_t*;
+    using reference         = const char32_t&;
 
+    const_iterator() = default;
 
+    bool operator== (const const_iterator& rhs) const {
+        return pos == rhs.pos;
+    }
+    bool operator!= (const const_iterator& rhs) const {
+        return !(*this == rhs);
+    }
 
+    reference operator* () const {
+        return staged;
+    }
+    pointer operator-> () const {
+        return &staged;
+    }
 
+    const_iterator& operator++() {
+        pos = next;
+        read();
+        return *this;
+    }
 
+    const_iterator operator++(int) {
+        auto result = *this;
+        ++*this;
+        return result;
+    }
 
+    /* Byte offset of the current character within the underlying string. */
+    std::size_t offset() const {
+        return pos;
+    }
+
+private:
+    const_iterator(std::string_view source, std::size_t pos) : source(source), pos(pos), next(pos) {
+        read();
+    }
+
+    inline void read();
+
+    friend class utf8Reader;
+    std::string_view source;
+    std::size_t pos  = 0;  // Start of the current character
+    std::size_t next = 0;  // Start of the character after it
+    char32_t staged  = 0;
+};
 
 
 
@@ -84,6 +170,10 @@ private:
 #include <iomanip>
 #include <cctype>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#include <immintrin.h>
+#endif
+
 namespace MiniData_UnicodeImpl {
     /* Reports a UTF error. */
     [[ noreturn ]] inline void utfError(const std::string& message) {
@@ -253,6 +343,205 @@ inline char32_t peekChar(std::istream& source) {
     return result;
 }
 
+namespace MiniData_UnicodeImpl {
+    /* Outcomes of decoding a single character in place. */
+    enum class DecodeStatus {
+        OK, END_OF_INPUT, BAD_HEADER, BAD_FOLLOW_BYTE
+    };
+
+    /* Decodes the character starting at the given offset. On success, advances the offset
+     * past it. On failure, leaves the offset at the offending byte.
+     */
+    inline DecodeStatus decodeAt(std::string_view source, std::size_t& pos, char32_t& result) {
+        if (pos >= source.size()) return DecodeStatus::END_OF_INPUT;
+
+        /* If this character doesn't have a high bit set, that's all there is to read. */
+        unsigned char header = source[pos];
+        if ((header & 0b10000000) == 0) {
+            result = header;
+            pos++;
+            return DecodeStatus::OK;
+        }
+
+        /* Otherwise, see how many follow bytes there are and what the header contributes. */
+        std::size_t followBytes;
+        if      ((header & 0b11100000) == 0b11000000) { followBytes = 1; result = header & 0b00011111; }
+        else if ((header & 0b11110000) == 0b11100000) { followBytes = 2; result = header & 0b00001111; }
+        else if ((header & 0b11111000) == 0b11110000) { followBytes = 3; result = header & 0b00000111; }
+        else return DecodeStatus::BAD_HEADER;
+
+        for (std::size_t i = 1; i <= followBytes; i++) {
+            if (pos + i >= source.size()) {
+                pos += i;
+                return DecodeStatus::END_OF_INPUT;
+            }
+            if (!isFollowByte(source[pos + i])) {
+                pos += i;
+                return DecodeStatus::BAD_FOLLOW_BYTE;
+            }
+
+            result = (result << 6) | (source[pos + i] & 0b00111111);
+        }
+
+        pos += followBytes + 1;
+        return DecodeStatus::OK;
+    }
+
+    /* Bulk ASCII kernels. Each handles the longest prefix of its input made purely of
+     * ASCII bytes and returns that prefix's length; the "widen" versions also write those
+     * bytes out as char32_ts. There's a portable version of each, an SSE2 version (SSE2 is
+     * part of every x86-64 processor), and an AVX2 version selected at runtime if the
+     * processor supports it.
+     */
+    inline std::size_t skipASCIIScalar(const char* in, std::size_t length) {
+        std::size_t i = 0;
+        while (i < length && (in[i] & 0b10000000) == 0) i++;
+        return i;
+    }
+    inline std::size_t widenASCIIScalar(const char* in, std::size_t length, char32_t* out) {
+        std::size_t i = 0;
+        for (; i < length && (in[i] & 0b10000000) == 0; i++) {
+            out[i] = in[i];
+        }
+        return i;
+    }
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #define MiniData_Unicode_HasSSE2
+    inline std::size_t skipASCIISSE2(const char* in, std::size_t length) {
+        std::size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            if (_mm_movemask_epi8(block) != 0) break;
+        }
+        return i + skipASCIIScalar(in + i, length - i);
+    }
+    inline std::size_t widenASCIISSE2(const char* in, std::size_t length, char32_t* out) {
+        const __m128i zero = _mm_setzero_si128();
+
+        std::size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            if (_mm_movemask_epi8(block) != 0) break;
+
+            /* Zero-extend bytes to 16 bits, then to 32 bits. */
+            __m128i low  = _mm_unpacklo_epi8(block, zero);
+            __m128i high = _mm_unpackhi_epi8(block, zero);
+
+            __m128i* dest = reinterpret_cast<__m128i*>(out + i);
+            _mm_storeu_si128(dest + 0, _mm_unpacklo_epi16(low,  zero));
+            _mm_storeu_si128(dest + 1, _mm_unpackhi_epi16(low,  zero));
+            _mm_storeu_si128(dest + 2, _mm_unpacklo_epi16(high, zero));
+            _mm_storeu_si128(dest + 3, _mm_unpackhi_epi16(high, zero));
+        }
+        return i + widenASCIIScalar(in + i, length - i, out + i);
+    }
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define MiniData_Unicode_HasAVX2
+    __attribute__((target("avx2")))
+    inline std::size_t skipASCIIAVX2(const char* in, std::size_t length) {
+        std::size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+            if (_mm256_movemask_epi8(block) != 0) break;
+        }
+        return i + skipASCIIScalar(in + i, length - i);
+    }
+    __attribute__((target("avx2")))
+    inline std::size_t widenASCIIAVX2(const char* in, std::size_t length, char32_t* out) {
+        std::size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+            if (_mm256_movemask_epi8(block) != 0) break;
+
+            /* Zero-extend eight bytes at a time straight to 32 bits. */
+            __m256i* dest = reinterpret_cast<__m256i*>(out + i);
+            for (std::size_t j = 0; j < 4; j++) {
+                __m128i eight = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + 8 * j));
+                _mm256_storeu_si256(dest + j, _mm256_cvtepu8_epi32(eight));
+            }
+        }
+        return i + widenASCIIScalar(in + i, length - i, out + i);
+    }
+#endif
+
+    struct ASCIIKernels {
+        std::size_t (*skip)(const char* in, std::size_t length);
+        std::size_t (*widen)(const char* in, std::size_t length, char32_t* out);
+    };
+
+    /* Picks the best kernels for this processor, once. */
+    inline const ASCIIKernels& asciiKernels() {
+        static const ASCIIKernels kernels = [] {
+#ifdef MiniData_Unicode_HasAVX2
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) return ASCIIKernels{ skipASCIIAVX2, widenASCIIAVX2 };
+#endif
+#ifdef MiniData_Unicode_HasSSE2
+            return ASCIIKernels{ skipASCIISSE2, widenASCIISSE2 };
+#else
+            return ASCIIKernels{ skipASCIIScalar, widenASCIIScalar };
+#endif
+        }();
+        return kernels;
+    }
+}
+
+inline char32_t readChar(std::string_view source, std::size_t& pos) {
+    using MiniData_UnicodeImpl::DecodeStatus;
+    using MiniData_UnicodeImpl::utfError;
+
+    std::size_t next = pos;
+    char32_t result;
+    switch (MiniData_UnicodeImpl::decodeAt(source, next, result)) {
+        case DecodeStatus::OK:              pos = next; return result;
+        case DecodeStatus::END_OF_INPUT:    utfError("Unexpected end of stream.");
+        case DecodeStatus::BAD_HEADER:      utfError("Byte header doesn't match UTF-8 patterns.");
+        case DecodeStatus::BAD_FOLLOW_BYTE: utfError("Expected follow byte, got " + MiniData_UnicodeImpl::toHex(source[next]));
+    }
+    utfError("Unknown decoding status.");
+}
+
+inline std::u32string decodeUTF8(std::string_view source) {
+    const auto& kernels = MiniData_UnicodeImpl::asciiKernels();
+
+    /* There can't be more characters than bytes. */
+    std::u32string result(source.size(), U'\0');
+
+    std::size_t in = 0, out = 0;
+    while (in < source.size()) {
+        /* Copy over the ASCII run here, then decode the one character that ended it. */
+        std::size_t run = kernels.widen(source.data() + in, source.size() - in, &result[out]);
+        in  += run;
+        out += run;
+
+        if (in < source.size()) {
+            result[out++] = readChar(source, in);
+        }
+    }
+
+    result.resize(out);
+    return result;
+}
+
+inline bool isValidUTF8(std::string_view source) {
+    const auto& kernels = MiniData_UnicodeImpl::asciiKernels();
+
+    std::size_t pos = 0;
+    while (pos < source.size()) {
+        pos += kernels.skip(source.data() + pos, source.size() - pos);
+
+        char32_t ignored;
+        if (pos < source.size() &&
+            MiniData_UnicodeImpl::decodeAt(source, pos, ignored) != MiniData_UnicodeImpl::DecodeStatus::OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
 inline std::string utf16EscapeFor(char32_t ch) {
     /* If this character is in the range where we can just directly convert it, go do so. */
     if (ch <= 0xD7FF || (ch >= 0xE000 && ch <= 0xFFFF)) {
@@ -339,65 +628,18 @@ inline UTFException::UTFException(const std::string& message) : std::logic_error
 
 }
 
-class utf8Reader::const_iterator: public std::iterator<std::input_iterator_tag, const char32_t> {
-public:
-    const_iterator() = default;
-
-    /* We're only equal if we're end-of-range iterators or if both of us are at the end. */
-    bool operator== (const_iterator rhs) const {
-        bool us   =     !owner ||     done;
-        bool them = !rhs.owner || rhs.done;
-
-        return us == them;
-    }
-    bool operator!= (const_iterator rhs) const {
-        return !(*this == rhs);
-    }
-
-    reference operator* () const {
-        return staged;
-    }
-
-    const_iterator& operator++() {
-        read();
-        return *this;
-    }
-
-    const_iterator operator++(int) {
-        auto result = *this;
-        ++*this;
-        return result;
-    }
-
-private:
-    const_iterator(utf8Reader* source) : owner(source) {
-        if (owner) {
-            read();
-        } else {
-            done = true;
-        }
+inline void utf8Reader::const_iterator::read() {
+    if (next < source.size()) {
+        staged = readChar(source, next);
     }
+}
 
-    void read() {
-        if (owner->in.peek() != EOF) {
-            staged = readChar(owner->in);
-        } else {
-            done = true;
-        }
-    }
-
-    friend class utf8Reader;
-    utf8Reader* owner = nullptr;
-    char32_t staged;
-    bool done = false;
-};
-
-inline utf8Reader::const_iterator utf8Reader::begin() {
-    return const_iterator(this);
+inline utf8Reader::const_iterator utf8Reader::begin() const {
+    return const_iterator(text, 0);
 }
 
-inline utf8Reader::const_iterator utf8Reader::end() {
-    return const_iterator();
+inline utf8Reader::const_iterator utf8Reader::end() const {
+    return const_iterator(text, text.size());
 }
 
 #endif
@@ -0,0 +1,103 @@
+/* A process-wide cache of compiled artifacts: parsing tables for grammars, automata
+ * for regexes, minimal DFAs, and the like.
+ *
+ * The tools tend to rebuild the same things over and over (the CFG tester recompiles
+ * the grammar on every refresh, the regex tester rebuilds its NFA on every keystroke),
+ * even though the input usually hasn't changed since last time. Everything stored
+ * here is filed under a canonical encoding of whatever it was built from, so building
+ * something from an input that's structurally identical to an earlier one just hands
+ * back the earlier result.
+ *
+ * Entries are shared, and either immutable or internally synchronized, so they may be
+ * used from several threads at once. Least-recently-used entries are dropped once the
+ * total size of the cache passes its byte budget. Sizes are estimates made by whoever
+ * built the entry. Entries that grow after they're added (for example, generator tables,
+ * which are filled in on demand) report their new sizes through resize().
+ */
+#pragma once
+#include <string>
+#include <memory>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace Cache {
+    /* Canonical encoding of an input. Keys are compared by their full encoding, not
+     * just a hash of it, so two inputs share an entry only if their encodings match
+     * exactly. The kind passed to the constructor keeps different sorts of artifacts
+     * built from the same input apart.
+     */
+    class Key {
+    public:
+        explicit Key(const std::string& kind);
+
+        Key& add(std::uint64_t value);
+        Key& add(const std::string& value);
+
+        const std::string& bytes() const;
+
+    private:
+        std::string encoding;
+    };
+
+    /* Looks up the entry with the given key. If there isn't one, make() is called to
+     * build it; it should return the new entry along with an estimate of its size
+     * in bytes. Whatever make() throws is passed along, and nothing is cached.
+     */
+    template <typename T, typename Make>
+    std::shared_ptr<const T> lookup(const Key& key, Make make);
+
+    /* Updates the size estimate of an entry that has grown or shrunk since it was built,
+     * dropping entries as needed to get back within budget. An entry too big for the whole
+     * budget is dropped outright, as it wouldn't have been cached in the first place. Does
+     * nothing unless the entry with the given key is the given object, so it's safe to
+     * call for something that was never cached or has since been dropped.
+     */
+    void resize(const Key& key, const void* value, std::size_t bytes);
+
+    struct Stats {
+        std::size_t entries;
+        std::size_t bytes;
+        std::size_t hits;
+        std::size_t misses;
+        std::size_t evictions;
+    };
+    Stats stats();
+
+    /* The default budget is 64MB. A budget of zero turns caching off. */
+    void        setByteBudget(std::size_t bytes);
+    std::size_t byteBudget();
+
+    /* Empties the cache. Entries still in use elsewhere stay alive until they're
+     * released.
+     */
+    void clear();
+
+    /* Rough size of a vector's contents, for size estimates. */
+    template <typename T> std::size_t bytesOf(const std::vector<T>& v) {
+        return sizeof(v) + v.capacity() * sizeof(T);
+    }
+    template <typename T> std::size_t bytesOf(const std::vector<std::vector<T>>& v) {
+        std::size_t result = sizeof(v) + (v.capacity() - v.size()) * sizeof(std::vector<T>);
+        for (const auto& elem: v) {
+            result += bytesOf(elem);
+        }
+        return result;
+    }
+
+    /* * * * * Implementation Below This Point * * * * */
+    namespace Internal {
+        using Entry = std::pair<std::shared_ptr<const void>, std::size_t>;
+        std::shared_ptr<const void> lookup(const Key& key, const std::function<Entry()>& make);
+    }
+
+    template <typename T, typename Make>
+    std::shared_ptr<const T> lookup(const Key& key, Make make) {
+        return std::static_pointer_cast<const T>(Internal::lookup(key, [&] {
+            std::pair<std::shared_ptr<const T>, std::size_t> made = make();
+            return Internal::Entry(made.first, made.second);
+        }));
+    }
+}
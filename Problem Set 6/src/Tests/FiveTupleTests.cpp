@@ -42,16 +42,7 @@ namespace {
 
     /* UTF-aware string comparsion. */
     bool utf8Compare(const string& lhs, const string& rhs) {
-        vector<char32_t> l;
-        for (char32_t ch: utf8Reader(lhs)) {
-            l.push_back(ch);
-        }
-
-        vector<char32_t> r;
-        for (char32_t ch: utf8Reader(rhs)) {
-            r.push_back(ch);
-        }
-
+        utf8Reader l(lhs), r(rhs);
         return lexicographical_compare(l.begin(), l.end(), r.begin(), r.end());
     }
 
@@ -7,6 +7,7 @@
 #include <unordered_set>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace Automata {
     /* char32_t value representing an epsilon transition. */
@@ -46,6 +47,38 @@ namespace Automata {
     /* A DFA is a specific type of NFA. */
     struct DFA: NFA {};
 
+    /* Flattened, index-based snapshot of an automaton's transition graph. States
+     * are numbered 0, 1, 2, ..., and the edges leaving (or entering) each state are
+     * stored contiguously, so walking the graph is a matter of scanning arrays
+     * rather than chasing State pointers through multimaps.
+     *
+     * A CompiledNFA is immutable. Its pieces are held in reference-counted blocks,
+     * so copying one is O(1), and transformations build new automata that share
+     * whatever blocks they didn't change with their inputs. (For example, the
+     * reverse of an automaton shares all of its edges with the original; it just
+     * swaps which block is "forward" and which is "backward.")
+     */
+    struct CompiledNFA {
+        /* One direction's worth of edges. The edges of state i live at positions
+         * [begin[i], begin[i+1]) of neighbor / label. Epsilon edges are labeled
+         * EPSILON_TRANSITION.
+         */
+        struct Edges {
+            std::vector<std::size_t> begin;
+            std::vector<std::size_t> neighbor;
+            std::vector<char32_t>    label;
+        };
+
+        std::size_t numStates = 0;
+        std::shared_ptr<const Languages::Alphabet> alphabet;
+
+        std::shared_ptr<const std::vector<char>> isStart;
+        std::shared_ptr<const std::vector<char>> isAccepting;
+
+        std::shared_ptr<const Edges> forward;   // Outgoing edges
+        std::shared_ptr<const Edges> backward;  // Incoming edges
+    };
+
 
     /* Helper routines for automata. */
 
@@ -72,5 +105,22 @@ namespace Automata {
     DFA  xorConstruct(const DFA& lhs, const DFA& rhs);
     bool shortestStringIn(const NFA& lhs, std::string& result);
 
+    /* Converts between the pointer-based and flat representations. States in the
+     * decompiled automaton are named q0, q1, q2, ... by index.
+     */
+    CompiledNFA compile(const NFA& nfa);
+    NFA         decompile(const CompiledNFA& nfa);
+
+    /* Transformations on flat automata. These never copy edge blocks they don't
+     * need to change.
+     */
+    CompiledNFA reverseOf(const CompiledNFA& nfa);
+    CompiledNFA subsetConstruct(const CompiledNFA& nfa);
+
+    /* Finds a shortest string accepted by the automaton using a bidirectional
+     * breadth-first search, returning whether one exists.
+     */
+    bool shortestWitnessIn(const CompiledNFA& nfa, std::u32string& result);
+
     bool areEquivalent(const DFA& lhs, const DFA& rhs, std::string& counterexample);
 }
@@ -0,0 +1,180 @@
+#include "Cache.h"
+#include <list>
+#include <unordered_map>
+#include <string_view>
+#include <mutex>
+using namespace std;
+
+namespace Cache {
+    namespace {
+        const size_t kDefaultByteBudget = size_t(64) << 20;
+
+        /* Bookkeeping cost of an entry over and above its key and value, roughly. */
+        const size_t kEntryOverhead = 128;
+
+        struct Entry {
+            string key;
+            shared_ptr<const void> value;
+            size_t bytes;
+        };
+
+        /* Entries live in a list ordered from most to least recently used, with a
+         * hash table pointing into it. The table's keys are views of the strings in
+         * the list, which never move.
+         */
+        struct Store {
+            mutex lock;
+
+            list<Entry> entries;
+            unordered_map<string_view, list<Entry>::iterator> index;
+
+            size_t budget    = kDefaultByteBudget;
+            size_t bytes     = 0;
+            size_t hits      = 0;
+            size_t misses    = 0;
+            size_t evictions = 0;
+
+            /* Drops least recently used entries until we're within the given size. */
+            void shrinkTo(size_t limit) {
+                while (bytes > limit) {
+                    auto& victim = entries.back();
+                    bytes -= victim.bytes;
+                    index.erase(victim.key);
+                    entries.pop_back();
+                    evictions++;
+                }
+            }
+        };
+
+        Store& theStore() {
+            static Store result;
+            return result;
+        }
+    }
+
+    /* Keys are a sequence of fields, each of which is self-delimiting, so that no
+     * two different sequences encode the same way. Numbers are written in base 128,
+     * low digits first, with the high bit of each byte set if there's more to come.
+     * Strings are written as their length followed by their contents.
+     */
+    Key::Key(const string& kind) {
+        add(kind);
+    }
+
+    Key& Key::add(uint64_t value) {
+        while (value >= 0x80) {
+            encoding += char(0x80 | (value & 0x7F));
+            value >>= 7;
+        }
+        encoding += char(value);
+        return *this;
+    }
+
+    Key& Key::add(const string& value) {
+        add(uint64_t(value.size()));
+        encoding += value;
+        return *this;
+    }
+
+    const string& Key::bytes() const {
+        return encoding;
+    }
+
+    shared_ptr<const void> Internal::lookup(const Key& key, const function<Internal::Entry()>& make) {
+        auto& store = theStore();
+        {
+            lock_guard<mutex> guard(store.lock);
+            auto itr = store.index.find(key.bytes());
+            if (itr != store.index.end()) {
+                store.entries.splice(store.entries.begin(), store.entries, itr->second);
+                store.hits++;
+                return itr->second->value;
+            }
+            store.misses++;
+        }
+
+        /* Build the entry without holding the lock. This can take a while, and building
+         * one entry might need to look up others.
+         */
+        auto made = make();
+        size_t bytes = made.second + key.bytes().size() + kEntryOverhead;
+
+        lock_guard<mutex> guard(store.lock);
+
+        /* Someone else may have built the same thing while we were working. If so,
+         * use theirs, so that everyone shares one copy.
+         */
+        auto itr = store.index.find(key.bytes());
+        if (itr != store.index.end()) {
+            store.entries.splice(store.entries.begin(), store.entries, itr->second);
+            return itr->second->value;
+        }
+
+        /* Anything bigger than the whole budget would just evict everything else and
+         * then itself, so don't bother.
+         */
+        if (bytes > store.budget) return made.first;
+
+        store.entries.push_front({ key.bytes(), made.first, bytes });
+        store.index[store.entries.front().key] = store.entries.begin();
+        store.bytes += bytes;
+        store.shrinkTo(store.budget);
+
+        return made.first;
+    }
+
+    void resize(const Key& key, const void* value, size_t bytes) {
+        auto& store = theStore();
+        lock_guard<mutex> guard(store.lock);
+
+        auto itr = store.index.find(key.bytes());
+        if (itr == store.index.end() || itr->second->value.get() != value) return;
+
+        auto entry = itr->second;
+        store.bytes -= entry->bytes;
+        entry->bytes = bytes + key.bytes().size() + kEntryOverhead;
+        store.bytes += entry->bytes;
+
+        if (entry->bytes > store.budget) {
+            store.bytes -= entry->bytes;
+            store.index.erase(itr);
+            store.entries.erase(entry);
+            store.evictions++;
+        }
+        store.shrinkTo(store.budget);
+    }
+
+    Stats stats() {
+        auto& store = theStore();
+        lock_guard<mutex> guard(store.lock);
+        return { store.entries.size(), store.bytes, store.hits, store.misses, store.evictions };
+    }
+
+    void setByteBudget(size_t bytes) {
+        auto& store = theStore();
+        lock_guard<mutex> guard(store.lock);
+        store.budget = bytes;
+        store.shrinkTo(bytes);
+    }
+
+    size_t byteBudget() {
+        auto& store = theStore();
+        lock_guard<mutex> guard(store.lock);
+        return store.budget;
+    }
+
+    void clear() {
+        auto& store = theStore();
+
+        /* Release the entries after unlocking, since destroying them can take a
+         * while.
+         */
+        list<Entry> entries;
+        {
+            lock_guard<mutex> guard(store.lock);
+            store.index.clear();
+            entries.swap(store.entries);
+            store.bytes = 0;
+        }
+    }
+}
@@ -35,7 +35,7 @@ PROVIDED_TEST("Q3.ii") {
 
 
 /* * * * * Implementation Below This Point * * * * */
-#include <chrono>
+#include <iostream>
 
 namespace {
     const size_t kMaxSize      = 15;
@@ -45,49 +45,21 @@ namespace {
 
     /* Fuzz-tests two CFGs against one another. Returns whether they seem to match, and if
      * not outputs a string that they disagree on.
-     *
-     * It's, in general, undecidable whether two CFGs are equal to one another, so there
-     * isn't some magic nice procedure we can use to speed this up.
      */
     bool areProbablyEquivalent(const CFG::CFG& one, const CFG::CFG& two, string& out) {
-        auto now = chrono::high_resolution_clock::now();
-        auto match1 = CFG::matcherFor(one);
-        auto match2 = CFG::matcherFor(two);
-
-        auto time = chrono::high_resolution_clock::now() - now;
-        if (kDebugTimingOn) cout << "Matchers: " << chrono::duration_cast<chrono::milliseconds>(time).count() << endl;
-        now = chrono::high_resolution_clock::now();
-
-        auto gen1   = CFG::generatorFor(one);
-        auto gen2   = CFG::generatorFor(two);
-
-        time = chrono::high_resolution_clock::now() - now;
-        if (kDebugTimingOn) cout << "Generators: " << chrono::duration_cast<chrono::milliseconds>(time).count() << endl;
-        now = chrono::high_resolution_clock::now();
-
-
-        for (size_t i = 0; i < kMaxSize; i++) {
-            for (size_t trial = 0; trial < kTestsPerSize; trial++) {
-                /* L(one) subset L(two)? */
-                auto str1 = gen1(i);
-                if (str1.first && !match2(str1.second)) {
-                    out = str1.second;
-                    return false;
-                }
-
-                /* L(two) subset L(one)? */
-                auto str2 = gen2(i);
-                if (str2.first && !match1(str2.second)) {
-                    out = str2.second;
-                    return false;
-                }
-            }
+        CFG::EquivalenceOptions options;
+        options.maxLength       = kMaxSize;
+        options.trialsPerLength = kTestsPerSize;
+
+        auto report = CFG::probablyEquivalent(one, two, options);
+        if (kDebugTimingOn) {
+            cout << "Matchers:   " << report.matcherSeconds   << "s" << endl;
+            cout << "Generators: " << report.generatorSeconds << "s" << endl;
+            cout << "Tests:      " << report.testingSeconds   << "s (" << report.stringsTested << " strings)" << endl;
         }
 
-        time = chrono::high_resolution_clock::now() - now;
-        if (kDebugTimingOn) cout << "Tests: " << chrono::duration_cast<chrono::milliseconds>(time).count() << endl;
-
-        return true;
+        out = report.counterexample;
+        return report.equivalent;
     }
 
     void runTests(const string& sectionHeader) {
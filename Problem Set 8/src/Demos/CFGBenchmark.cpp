@@ -0,0 +1,166 @@
+#include "../GUI/MiniGUI.h"
+#include "../FormalLanguages/CFG.h"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+using namespace std;
+
+/* Times the different CFG matchers against one another on inputs of increasing
+ * length. This is mostly useful for seeing where the experimental matrix-based
+ * matcher starts to pull ahead of the cubic ones.
+ */
+namespace {
+    /* Once a matcher takes longer than this on some input, we stop running it on
+     * longer ones.
+     */
+    const double kTimeLimit = 10.0;
+
+    /* Longest input to try. */
+    const size_t kMaxLength = 8192;
+
+    struct Benchmark {
+        string name;
+        CFG::CFG cfg;
+        string (*inputOfLength)(size_t length);
+    };
+
+    struct MatcherInfo {
+        string name;
+        CFG::MatcherType type;
+    };
+
+    const vector<MatcherInfo> kMatchers = {
+        { "EARLEY_LR0", CFG::MatcherType::EARLEY_LR0 },
+        { "CYK",        CFG::MatcherType::CYK        },
+        { "VALIANT",    CFG::MatcherType::VALIANT    },
+        { "AUTOMATIC",  CFG::MatcherType::AUTOMATIC  },
+    };
+
+    /* S -> SS | a | aSb. Massively ambiguous, which is the worst case for Earley. */
+    CFG::CFG ambiguousGrammar() {
+        auto a = CFG::terminal('a'), b = CFG::terminal('b'), S = CFG::nonterminal('S');
+
+        CFG::CFG result;
+        result.alphabet     = { 'a', 'b' };
+        result.nonterminals = { 'S' };
+        result.startSymbol  = 'S';
+        result.productions  = {
+            { 'S', { S, S } },
+            { 'S', { a } },
+            { 'S', { a, S, b } },
+        };
+        return result;
+    }
+    string ambiguousInput(size_t length) {
+        string result(length, 'a');
+        result.back() = 'b';
+        return result;
+    }
+
+    /* S -> (S)S | epsilon. Unambiguous, so Earley should do well here. */
+    CFG::CFG parenthesesGrammar() {
+        auto open = CFG::terminal('('), close = CFG::terminal(')'), S = CFG::nonterminal('S');
+
+        CFG::CFG result;
+        result.alphabet     = { '(', ')' };
+        result.nonterminals = { 'S' };
+        result.startSymbol  = 'S';
+        result.productions  = {
+            { 'S', { open, S, close, S } },
+            { 'S', { } },
+        };
+        return result;
+    }
+    string parenthesesInput(size_t length) {
+        string result;
+        while (result.size() + 4 <= length) result += "(())";
+        while (result.size() + 2 <= length) result += "()";
+        return result;
+    }
+
+    void runBenchmark(const Benchmark& benchmark) {
+        cout << benchmark.name << endl;
+        cout << setw(8) << "Length";
+        for (const auto& matcher: kMatchers) {
+            cout << setw(14) << matcher.name;
+        }
+        cout << endl;
+
+        vector<CFG::Matcher> matchers;
+        for (const auto& matcher: kMatchers) {
+            matchers.push_back(CFG::matcherFor(benchmark.cfg, matcher.type));
+        }
+        vector<bool> tooSlow(kMatchers.size());
+
+        for (size_t length = 64; length <= kMaxLength && count(tooSlow.begin(), tooSlow.end(), false) != 0; length *= 2) {
+            auto input = benchmark.inputOfLength(length);
+
+            cout << setw(8) << input.size();
+            for (size_t i = 0; i < matchers.size(); i++) {
+                if (tooSlow[i]) {
+                    cout << setw(14) << "-";
+                    continue;
+                }
+
+                auto start = chrono::high_resolution_clock::now();
+                matchers[i](input);
+                double time = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+                cout << setw(13) << fixed << setprecision(3) << time << "s" << flush;
+                if (time > kTimeLimit) tooSlow[i] = true;
+            }
+            cout << endl;
+        }
+        cout << endl;
+    }
+
+    /* S -> AAA...A | a, A -> a | ε, with the given number of A's. Converting this to
+     * CNF by removing epsilons before binarizing takes exponential time.
+     */
+    CFG::CFG nullableGrammar(size_t numNullables) {
+        auto a = CFG::terminal('a'), A = CFG::nonterminal('A');
+
+        CFG::CFG result;
+        result.alphabet     = { 'a' };
+        result.nonterminals = { 'S', 'A' };
+        result.startSymbol  = 'S';
+        result.productions  = {
+            { 'S', vector<CFG::Symbol>(numNullables, A) },
+            { 'S', { a } },
+            { 'A', { a } },
+            { 'A', { } },
+        };
+        return result;
+    }
+
+    /* Shows how big the grammar gets at each step of converting it to CNF. */
+    void runCNFReport(const string& name, const CFG::CFG& cfg) {
+        cout << name << endl;
+        cout << setw(8) << "Stage" << setw(14) << "Nonterminals" << setw(14) << "Productions"
+             << setw(14) << "Size" << setw(14) << "Time" << endl;
+
+        vector<CFG::CNFStage> stages;
+        CFG::toCNF(cfg, stages);
+        for (const auto& stage: stages) {
+            cout << setw(8) << stage.name << setw(14) << stage.nonterminals << setw(14) << stage.productions
+                 << setw(14) << stage.size << setw(13) << fixed << setprecision(3) << stage.seconds << "s" << endl;
+        }
+        cout << endl;
+    }
+}
+
+CONSOLE_HANDLER("CFG Matcher Benchmark") {
+    cout << "This tool times each of the CFG matchers on inputs of increasing length. "
+            "Once a matcher takes more than " << kTimeLimit << " seconds, it's dropped "
+            "from the remaining rounds." << endl << endl;
+
+    runBenchmark({ "Ambiguous grammar (S -> SS | a | aSb)", ambiguousGrammar(),   ambiguousInput   });
+    runBenchmark({ "Balanced parentheses (S -> (S)S | ε)",  parenthesesGrammar(), parenthesesInput });
+
+    cout << "Converting to CNF, step by step:" << endl << endl;
+    runCNFReport("Ambiguous grammar (S -> SS | a | aSb)",   ambiguousGrammar());
+    runCNFReport("Forty nullables (S -> A⁴⁰ | a, A -> a | ε)", nullableGrammar(40));
+}
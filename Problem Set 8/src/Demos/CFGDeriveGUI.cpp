@@ -48,8 +48,11 @@ namespace {
         /* CFG selector at the bottom. */
         Temporary<GComboBox> selector;
 
-        /* Current deriver, or nullptr if there was an error */
-        CFG::Deriver deriver;
+        /* Current parser, or nullptr if there was an error. This is kept across
+         * reloads of the grammar and edits to the input so that it only has to
+         * reparse what changed.
+         */
+        shared_ptr<CFG::IncrementalParser> parser;
 
         /* Display message - either an error or the actual CFG. */
         string messageHTML;
@@ -171,12 +174,12 @@ R"(<html>
         return builder.str();
     }
 
-    string styleResults(CFG::Deriver deriver, const string& input) {
+    string styleResults(shared_ptr<CFG::IncrementalParser> parser, const string& input) {
         /* Don't do anything if the CFG failed to load. */
-        if (!deriver) return "";
+        if (!parser) return "";
 
         try {
-            auto derivation = deriver(input);
+            auto derivation = parser->derive(0, input);
             if (derivation.empty()) return format(kNoDerivation, "Grammar does not derive " + prettyString(input));
 
             /* There is a derivation. Trace it out. */
@@ -215,7 +218,7 @@ R"(<html>
         content << format(kHTMLTemplate,
                           std::to_string(kFontSize),
                           messageHTML,
-                          styleResults(deriver, input->getText()));
+                          styleResults(parser, input->getText()));
 
         console->readTextFromFile(content);
     }
@@ -235,9 +238,13 @@ R"(<html>
 
         messageHTML = styleCFG(result);
         if (result.cfg != nullptr) {
-            deriver = CFG::deriverFor(*result.cfg);
+            if (parser) {
+                parser->setGrammar(*result.cfg);
+            } else {
+                parser = make_shared<CFG::IncrementalParser>(*result.cfg);
+            }
         } else {
-            deriver = nullptr;
+            parser = nullptr;
         }
 
         updateDisplay();
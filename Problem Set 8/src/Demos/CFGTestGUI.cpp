@@ -62,10 +62,17 @@ namespace {
         /* CFG selector at the bottom. */
         Temporary<GComboBox> selector;
 
-        /* Current matcher, or nullptr if there was an error */
-        CFG::Matcher matcher;
+        /* Current parser, or nullptr if there was an error. Each test case's parse is
+         * filed under its row number.
+         */
+        shared_ptr<CFG::IncrementalParser> parser;
         Languages::Alphabet alphabet;
 
+        /* Parsers for each CFG we've loaded, so that reloading one only reparses what
+         * the edits to it could have affected.
+         */
+        unordered_map<string, shared_ptr<CFG::IncrementalParser>> pastParsers;
+
         /* Display message - either an error or the actual CFG. */
         string messageHTML;
 
@@ -197,7 +204,7 @@ R"(<html>
     }
 
     /* Runs one test, styling the result. */
-    string styleTestRow(CFG::Matcher matcher, const Languages::Alphabet& alphabet, const TestCase& test, int row) {
+    string styleTestRow(CFG::IncrementalParser& parser, const Languages::Alphabet& alphabet, const TestCase& test, int row) {
         /* Confirm this string works with the alphabet. */
         if (test.input != "ε") {
             istringstream input(test.input);
@@ -210,7 +217,7 @@ R"(<html>
         }
 
         /* Run the tests. */
-        auto result = matcher(test.input == "ε" ? "" : test.input);
+        auto result = parser.matches(row, test.input == "ε" ? "" : test.input);
 
         /* Report results. */
         if ((result && test.expected == Expected::FALSE) || (!result && test.expected == Expected::TRUE)) {
@@ -221,16 +228,19 @@ R"(<html>
     }
 
     /* Runs the tests, styling the results. */
-    string styleResults(CFG::Matcher matcher, const Languages::Alphabet& alphabet, const vector<TestCase>& testCases) {
+    string styleResults(shared_ptr<CFG::IncrementalParser> parser, const Languages::Alphabet& alphabet, const vector<TestCase>& testCases) {
         /* Could be that there was an error loading things. If so, do nothing. */
-        if (!matcher) return "";
+        if (!parser) return "";
 
         string result;
         int row = 0;
         for (const auto& entry: testCases) {
-            result += styleTestRow(matcher, alphabet, entry, row);
+            result += styleTestRow(*parser, alphabet, entry, row);
             ++row;
         }
+
+        /* Don't hang on to parses of test cases that were deleted. */
+        parser->forget(testCases.size());
         return result;
     }
 
@@ -287,7 +297,7 @@ R"(<html>
         content << format(kHTMLTemplate,
                           std::to_string(kFontSize),
                           messageHTML,
-                          styleResults(matcher, alphabet, testCases()));
+                          styleResults(parser, alphabet, testCases()));
 
         console->readTextFromFile(content);
     }
@@ -312,10 +322,17 @@ R"(<html>
 
         messageHTML = styleCFG(result);
         if (result.cfg != nullptr) {
-            matcher = CFG::matcherFor(*result.cfg);
+            auto& past = pastParsers[toString(currCFG)];
+            if (past) {
+                past->setGrammar(*result.cfg);
+            } else {
+                past = make_shared<CFG::IncrementalParser>(*result.cfg);
+            }
+
+            parser = past;
             alphabet = result.cfg->alphabet;
         } else {
-            matcher = nullptr;
+            parser = nullptr;
             alphabet = {};
         }
 
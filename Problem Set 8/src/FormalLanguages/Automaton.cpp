@@ -1,4 +1,5 @@
 #include "Automaton.h"
+#include "Cache.h"
 #include "Utilities/Unicode.h"
 #include "Utilities/JSON.h"
 #include <unordered_map>
@@ -8,6 +9,8 @@
 #include <set>
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <tuple>
 using namespace std;
 
 namespace Automata {
@@ -317,149 +320,302 @@ namespace Automata {
         return builder.str();
     }
 
-    /* Thompson's algorithm for converting a regular expression into an NFA.
-     * This works by replacing each regex with a new automaton with exactly
-     * one accepting state, no transitions into the start state, and no
-     * transitions out of the accepting state.
-     */
-    NFA fromRegex(Regex::Regex regex, const Languages::Alphabet& alphabet) {
-        /* Confirm compatibility.*/
-        if (!Languages::isSubsetOf(Regex::coreAlphabetOf(regex), alphabet)) {
-            throw runtime_error("Regular expression has wrong alphabet.");
-        }
-
-        /* Desugar the regex to make it a "pure" regex. */
-        regex = Regex::desugar(regex, alphabet);
-
-        struct ThompsonPair {
-            shared_ptr<State> start;
-            shared_ptr<State> end;
-        };
-
-        /* Builder that knows how to process each type into a ThompsonPair.
+    namespace {
+        /* Thompson's algorithm for converting a regular expression into an NFA.
+         * This works by replacing each regex with a new automaton with exactly
+         * one accepting state, no transitions into the start state, and no
+         * transitions out of the accepting state.
+         *
+         * Two refinements keep the automaton small, which matters most for counted
+         * repetitions like (a|b)^500 that expand into many copies of their child:
          *
-         * For simplicity, we will NOT mark any of the states as accepting.
-         * That's okay, because we know that only one state at the end will
-         * be accepting, and it's the second pair of the Thompson pair.
+         * 1. A union of characters (including the expansion of Σ) becomes a single
+         *    pair of states joined by one edge per character, rather than a tree of
+         *    epsilon-linked pairs.
+         *
+         * 2. Concatenation fuses the left piece's accepting state with the right
+         *    piece's start state instead of joining them with an epsilon edge. The
+         *    invariants above guarantee that's safe: nothing leaves the one and
+         *    nothing enters the other.
+         *
+         * Together these make r^n cost n copies of r's states and no more, so (a|b)^n
+         * has n + 1 states and no epsilon transitions at all.
          */
-        struct Builder: public Regex::Calculator<ThompsonPair> {
-            NFA& out;
-            Builder(NFA& out) : out(out) {}
-
-            shared_ptr<State> newState() {
-                auto result = make_shared<State>();
-                result->name = "q" + to_string(out.states.size());
-                out.states.insert(result);
-                return result;
+        NFA thompsonNFAFor(Regex::Regex regex, const Languages::Alphabet& alphabet) {
+            /* Confirm compatibility.*/
+            if (!Languages::isSubsetOf(Regex::coreAlphabetOf(regex), alphabet)) {
+                throw runtime_error("Regular expression has wrong alphabet.");
             }
 
-            ThompsonPair handle(Regex::Character* expr) override {
-                /*
-                 *  [   ] -- ch -->  [[ ]]
-                 */
-                auto start = newState();
-                auto end   = newState();
-                addTransition(start, end, expr->ch);
-                return { start, end };
-            }
+            /* Desugar the regex to make it a "pure" regex. */
+            regex = Regex::desugar(regex, alphabet);
 
-            ThompsonPair handle(Regex::Sigma *) override {
-                abort(); // Logic error!
-            }
+            struct ThompsonPair {
+                shared_ptr<State> start;
+                shared_ptr<State> end;
 
-            ThompsonPair handle(Regex::Epsilon *) override {
-                /*
-                 *  [   ] -- eps -->  [[ ]]
+                /* Whether this piece is just start and end joined by zero or more
+                 * character transitions, i.e. a character class.
                  */
-                auto start = newState();
-                auto end   = newState();
-                addTransition(start, end, EPSILON_TRANSITION);
-                return { start, end };
-            }
+                bool isClass;
+            };
+
+            /* Builder that knows how to process each type into a ThompsonPair.
+             *
+             * For simplicity, we will NOT mark any of the states as accepting.
+             * That's okay, because we know that only one state at the end will
+             * be accepting, and it's the second pair of the Thompson pair.
+             */
+            struct Builder: public Regex::Calculator<ThompsonPair> {
+                NFA& out;
+                Builder(NFA& out) : out(out) {}
+
+                shared_ptr<State> newState() {
+                    auto result = make_shared<State>();
+                    out.states.insert(result);
+                    return result;
+                }
 
-            ThompsonPair handle(Regex::EmptySet *) override {
-                /*
-                 *  [   ]           [[ ]]
+                /* Moves all transitions out of one state onto another, then deletes
+                 * the state that was emptied out.
                  */
-                return { newState(), newState() };
-            }
+                void absorb(shared_ptr<State> into, shared_ptr<State> from) {
+                    for (const auto& transition: from->transitions) {
+                        addTransition(into.get(), transition.second, transition.first);
+                    }
+                    out.states.erase(from);
+                }
 
-            ThompsonPair handle(Regex::Union *, ThompsonPair left, ThompsonPair right) override {
-                /*
-                 *            [   ]  --->  [[ ]]
-                 *           /                  \
-                 *        [  ]                 [[ ]]
-                 *           \                  /
-                 *            [   ]  --->  [[ ]]
-                 *
-                 */
-                auto start = newState();
-                auto end   = newState();
+                ThompsonPair handle(Regex::Character* expr) override {
+                    /*
+                     *  [   ] -- ch -->  [[ ]]
+                     */
+                    auto start = newState();
+                    auto end   = newState();
+                    addTransition(start, end, expr->ch);
+                    return { start, end, true };
+                }
+
+                ThompsonPair handle(Regex::Sigma *) override {
+                    abort(); // Logic error!
+                }
 
-                /* Epsilons out of start. */
-                addTransition(start, left.start,  EPSILON_TRANSITION);
-                addTransition(start, right.start, EPSILON_TRANSITION);
+                ThompsonPair handle(Regex::Epsilon *) override {
+                    /*
+                     *  [   ] -- eps -->  [[ ]]
+                     */
+                    auto start = newState();
+                    auto end   = newState();
+                    addTransition(start, end, EPSILON_TRANSITION);
+                    return { start, end, false };
+                }
 
-                /* Epsilons into end. */
-                addTransition(left.end,  end, EPSILON_TRANSITION);
-                addTransition(right.end, end, EPSILON_TRANSITION);
+                ThompsonPair handle(Regex::EmptySet *) override {
+                    /*
+                     *  [   ]           [[ ]]
+                     */
+                    return { newState(), newState(), true };
+                }
 
-                return { start, end };
-            }
+                ThompsonPair handle(Regex::Union *, ThompsonPair left, ThompsonPair right) override {
+                    /* Two character classes merge into one:
+                     *
+                     *  [   ] -- a, b, ... -->  [[ ]]
+                     */
+                    if (left.isClass && right.isClass) {
+                        for (const auto& transition: right.start->transitions) {
+                            auto range = left.start->transitions.equal_range(transition.first);
+                            if (range.first == range.second) {
+                                addTransition(left.start, left.end, transition.first);
+                            }
+                        }
+                        out.states.erase(right.start);
+                        out.states.erase(right.end);
+                        return left;
+                    }
 
-            ThompsonPair handle(Regex::Concat *, ThompsonPair left, ThompsonPair right) override {
-                /*
-                 * [   ] ---> [[ ]] -- eps -> [   ] --> [[ ]]
-                 */
+                    /*
+                     *            [   ]  --->  [[ ]]
+                     *           /                  \
+                     *        [  ]                 [[ ]]
+                     *           \                  /
+                     *            [   ]  --->  [[ ]]
+                     *
+                     */
+                    auto start = newState();
+                    auto end   = newState();
+
+                    /* Epsilons out of start. */
+                    addTransition(start, left.start,  EPSILON_TRANSITION);
+                    addTransition(start, right.start, EPSILON_TRANSITION);
+
+                    /* Epsilons into end. */
+                    addTransition(left.end,  end, EPSILON_TRANSITION);
+                    addTransition(right.end, end, EPSILON_TRANSITION);
+
+                    return { start, end, false };
+                }
 
-                /* Epsilons out of start. */
-                addTransition(left.end, right.start,  EPSILON_TRANSITION);
-                return { left.start, right.end };
-            }
+                ThompsonPair handle(Regex::Concat *, ThompsonPair left, ThompsonPair right) override {
+                    /*
+                     * [   ] ---> [ ] ---> [[ ]]
+                     *
+                     * The middle state is left's end and right's start fused together.
+                     */
+                    absorb(left.end, right.start);
+                    return { left.start, right.end, false };
+                }
 
-            ThompsonPair handle(Regex::Star *, ThompsonPair child) override {
-                /*
-                 *   +-------------------------------------------------+
-                 *   |                                                 v
-                 * [   ]  -- eps -->   [   ] ---> [[ ]]  -- eps -->  [[ ]]
-                 *                       ^          |
-                 *                       |          |
-                 *                       +----------+
-                 */
+                ThompsonPair handle(Regex::Star *, ThompsonPair child) override {
+                    /*
+                     *   +-------------------------------------------------+
+                     *   |                                                 v
+                     * [   ]  -- eps -->   [   ] ---> [[ ]]  -- eps -->  [[ ]]
+                     *                       ^          |
+                     *                       |          |
+                     *                       +----------+
+                     */
+
+                    auto start = newState();
+                    auto end   = newState();
+
+                    addTransition(start, child.start, EPSILON_TRANSITION);
+                    addTransition(child.end, end, EPSILON_TRANSITION);
+                    addTransition(child.end, child.start, EPSILON_TRANSITION);
+                    addTransition(start, end, EPSILON_TRANSITION);
+
+                    return { start, end, false };
+                }
 
-                auto start = newState();
-                auto end   = newState();
+                ThompsonPair handle(Regex::Plus *, ThompsonPair) override {
+                    abort(); // Logic error!
+                }
 
-                addTransition(start, child.start, EPSILON_TRANSITION);
-                addTransition(child.end, end, EPSILON_TRANSITION);
-                addTransition(child.end, child.start, EPSILON_TRANSITION);
-                addTransition(start, end, EPSILON_TRANSITION);
+                ThompsonPair handle(Regex::Question *, ThompsonPair) override {
+                    abort(); // Logic error!
+                }
 
-                return { start, end };
-            }
+                ThompsonPair handle(Regex::Power *, ThompsonPair) override {
+                    abort(); // Logic error!
+                }
+            };
+
+            NFA result;
+            result.alphabet = alphabet;
+            Builder builder(result);
+            ThompsonPair final = builder.calculate(regex);
 
-            ThompsonPair handle(Regex::Plus *, ThompsonPair) override {
-                abort(); // Logic error!
+            final.start->isStart = true;
+            final.end->isAccepting = true;
+
+            /* Name the states in BFS order; anything the search misses can't be
+             * reached anyway, but still gets a name.
+             */
+            size_t next = 0;
+            bfs({ final.start.get() }, [&](State* s) {
+                s->name = "q" + to_string(next++);
+            });
+            for (const auto& state: result.states) {
+                if (state->name.empty()) state->name = "q" + to_string(next++);
             }
 
-            ThompsonPair handle(Regex::Question *, ThompsonPair) override {
-                abort(); // Logic error!
+            return result;
+        }
+    }
+
+    namespace {
+        /* Cache key for something of the given kind built from a regex. The regex is
+         * written out in prefix order, which is unambiguous since each type of node has
+         * a fixed number of children.
+         */
+        Cache::Key keyFor(const string& kind, Regex::Regex regex, const Languages::Alphabet& alphabet) {
+            struct Writer: public Regex::Walker {
+                Cache::Key& key;
+                explicit Writer(Cache::Key& key) : key(key) {}
+
+                void handle(Regex::Character* expr) override { key.add(0).add(expr->ch); }
+                void handle(Regex::Sigma *)         override { key.add(1); }
+                void handle(Regex::Epsilon *)       override { key.add(2); }
+                void handle(Regex::EmptySet *)      override { key.add(3); }
+                void handle(Regex::Union *)         override { key.add(4); }
+                void handle(Regex::Concat *)        override { key.add(5); }
+                void handle(Regex::Star *)          override { key.add(6); }
+                void handle(Regex::Plus *)          override { key.add(7); }
+                void handle(Regex::Question *)      override { key.add(8); }
+                void handle(Regex::Power* expr)     override { key.add(9).add(expr->repeats); }
+            };
+
+            Cache::Key result(kind);
+            result.add(alphabet.size());
+            for (char32_t ch: alphabet) result.add(ch);
+
+            Writer writer(result);
+            regex->accept(writer);
+            return result;
+        }
+
+        /* Cache key for something of the given kind built from an automaton. States are
+         * listed in order of name, so copies of an automaton get the same key no matter
+         * how their states happen to be laid out in memory. States with the same name
+         * (and flags) are ordered by address, which is still correct, but means that two
+         * copies of such an automaton may not share an entry.
+         */
+        Cache::Key keyFor(const string& kind, const NFA& nfa) {
+            vector<const State*> states;
+            for (const auto& state: nfa.states) {
+                states.push_back(state.get());
             }
+            sort(states.begin(), states.end(), [](const State* lhs, const State* rhs) {
+                return tie(lhs->name, lhs->isStart, lhs->isAccepting, lhs) <
+                       tie(rhs->name, rhs->isStart, rhs->isAccepting, rhs);
+            });
 
-            ThompsonPair handle(Regex::Power *, ThompsonPair) override {
-                abort(); // Logic error!
+            unordered_map<const State*, size_t> indices;
+            for (const State* state: states) {
+                indices.insert(make_pair(state, indices.size()));
             }
-        };
 
-        NFA result;
-        result.alphabet = alphabet;
-        Builder builder(result);
-        ThompsonPair final = builder.calculate(regex);
+            Cache::Key result(kind);
+            result.add(nfa.alphabet.size());
+            for (char32_t ch: nfa.alphabet) result.add(ch);
 
-        final.start->isStart = true;
-        final.end->isAccepting = true;
+            result.add(states.size());
+            for (const State* state: states) {
+                result.add(state->name).add(state->isStart).add(state->isAccepting);
 
-        return result;
+                /* Transitions on the same character are in no particular order. */
+                vector<pair<char32_t, size_t>> transitions;
+                for (const auto& transition: state->transitions) {
+                    transitions.push_back(make_pair(transition.first, indices.at(transition.second)));
+                }
+                sort(transitions.begin(), transitions.end());
+
+                result.add(transitions.size());
+                for (const auto& transition: transitions) {
+                    result.add(transition.first).add(transition.second);
+                }
+            }
+            return result;
+        }
+
+        /* Rough number of bytes taken up by an automaton, for the cache. Each state and
+         * transition costs about the size of a tree or hash node on top of its contents.
+         */
+        size_t bytesOf(const NFA& nfa) {
+            size_t result = sizeof(NFA) + 48 * nfa.alphabet.size();
+            for (const auto& state: nfa.states) {
+                result += sizeof(State) + 48 + state->name.capacity() + 48 * state->transitions.size();
+            }
+            return result;
+        }
+    }
+
+    NFA fromRegex(Regex::Regex regex, const Languages::Alphabet& alphabet) {
+        auto result = Cache::lookup<NFA>(keyFor("Thompson", regex, alphabet), [&] {
+            auto nfa = make_shared<NFA>(thompsonNFAFor(regex, alphabet));
+            return make_pair(shared_ptr<const NFA>(nfa), bytesOf(*nfa));
+        });
+        return *result;
     }
 
     namespace {
@@ -482,9 +638,7 @@ namespace Automata {
     unordered_set<State*> deltaStar(const NFA& automaton, const string& str) {
         unordered_set<State*> curr = epsilonClosureOf(startStatesOf(automaton));
 
-        for (istringstream input(str); input.peek() != EOF; ) {
-            /* Read the next character. */
-            char32_t ch = readChar(input);
+        for (char32_t ch: decodeUTF8(str)) {
             if (!automaton.alphabet.count(ch)) {
                 throw runtime_error("Character not in alphabet: " + toUTF8(ch));
             }
@@ -606,32 +760,22 @@ namespace Automata {
 
     /* Given an automaton, constructs the reverse of that automaton. */
     NFA reverseOf(const NFA& nfa) {
-        /* Copy the automaton. */
-        NFA result = nfa;
-
-        /* Record and remove all transitions. */
-        struct Transition {
-            State* from;
-            State* to;
-            char32_t ch;
-        };
-        vector<Transition> transitions;
-
-        for (const auto& state: result.states) {
-            for (const auto& transition: state->transitions) {
-                transitions.push_back({ state.get(), transition.second, transition.first });
-            }
-            state->transitions.clear();
-        }
+        /* Build fresh states with start / accepting swapped rather than copying
+         * the automaton and then tearing out all its transitions.
+         */
+        NFA result;
+        result.alphabet = nfa.alphabet;
 
-        /* Insert them in reverse. */
-        for (const auto& transition: transitions) {
-            addTransition(transition.to, transition.from, transition.ch);
+        unordered_map<const State*, State*> translation;
+        for (const auto& state: nfa.states) {
+            translation[state.get()] = result.newState(state->name, state->isAccepting, state->isStart);
         }
 
-        /* Change which states are accepting / starting. */
-        for (const auto& state: result.states) {
-            swap(state->isStart, state->isAccepting);
+        /* Insert transitions in reverse. */
+        for (const auto& state: nfa.states) {
+            for (const auto& transition: state->transitions) {
+                addTransition(translation[transition.second], translation[state.get()], transition.first);
+            }
         }
 
         return result;
@@ -650,16 +794,18 @@ namespace Automata {
          * TODO: For efficiency's sake, it might be a good idea to prune the automaton
          * just before doing a reverse step. This will remove some states that otherwise
          * would be factored into the subset construction.
+         *
+         * The intermediate automata are all flat, so the two reversals are free (they
+         * just swap edge blocks) and nothing gets deep-copied between the stages.
+         * States come out of the subset construction numbered in BFS order, which
+         * gives them the nice names q0, q1, q2, ... on the way back out.
          */
-        auto result = subsetConstruct(reverseOf(subsetConstruct(reverseOf(nfa))));
-
-        /* Just to be nice, rename all the states in some nice fashion. */
-        size_t next = 0;
-        bfs(startStatesOf(result), [&](State* s) {
-            s->name = "q" + to_string(next++);
+        auto result = Cache::lookup<DFA>(keyFor("Minimal DFA", nfa), [&] {
+            auto dfa = make_shared<DFA>();
+            static_cast<NFA&>(*dfa) = decompile(subsetConstruct(reverseOf(subsetConstruct(reverseOf(compile(nfa))))));
+            return make_pair(shared_ptr<const DFA>(dfa), bytesOf(*dfa));
         });
-
-        return result;
+        return *result;
     }
 
     namespace {
@@ -736,51 +882,351 @@ namespace Automata {
         return result;
     }
 
-    /* Finds the shortest string accepted by the automaton, or reports that
-     * the automaton doesn't accept anything.
+    namespace {
+        /* Builds the reverse of a block of edges: every edge u -> v becomes v -> u. */
+        CompiledNFA::Edges reverseEdges(const CompiledNFA::Edges& edges, size_t numStates) {
+            CompiledNFA::Edges result;
+
+            /* Count in-degrees so we know where each state's edges begin. */
+            result.begin.assign(numStates + 1, 0);
+            for (size_t dest: edges.neighbor) {
+                result.begin[dest + 1]++;
+            }
+            for (size_t i = 0; i < numStates; i++) {
+                result.begin[i + 1] += result.begin[i];
+            }
+
+            /* Drop each edge into its slot. */
+            result.neighbor.resize(edges.neighbor.size());
+            result.label.resize(edges.label.size());
+
+            vector<size_t> next(result.begin.begin(), result.begin.end() - 1);
+            for (size_t from = 0; from < numStates; from++) {
+                for (size_t e = edges.begin[from]; e < edges.begin[from + 1]; e++) {
+                    size_t slot = next[edges.neighbor[e]]++;
+                    result.neighbor[slot] = from;
+                    result.label[slot]    = edges.label[e];
+                }
+            }
+
+            return result;
+        }
+    }
+
+    /* Flattens an automaton into CSR form. */
+    CompiledNFA compile(const NFA& nfa) {
+        CompiledNFA result;
+        result.numStates = nfa.states.size();
+        result.alphabet  = make_shared<const Languages::Alphabet>(nfa.alphabet);
+
+        /* Number the states. */
+        unordered_map<const State*, size_t> indices;
+        vector<const State*> states;
+        vector<char> isStart, isAccepting;
+        for (const auto& state: nfa.states) {
+            indices.insert(make_pair(state.get(), states.size()));
+            states.push_back(state.get());
+            isStart.push_back(state->isStart);
+            isAccepting.push_back(state->isAccepting);
+        }
+
+        /* Lay out the outgoing edges. */
+        auto forward = make_shared<CompiledNFA::Edges>();
+        forward->begin.push_back(0);
+        for (const State* state: states) {
+            for (const auto& transition: state->transitions) {
+                forward->neighbor.push_back(indices.at(transition.second));
+                forward->label.push_back(transition.first);
+            }
+            forward->begin.push_back(forward->neighbor.size());
+        }
+
+        result.isStart     = make_shared<const vector<char>>(std::move(isStart));
+        result.isAccepting = make_shared<const vector<char>>(std::move(isAccepting));
+        result.backward    = make_shared<const CompiledNFA::Edges>(reverseEdges(*forward, result.numStates));
+        result.forward     = std::move(forward);
+        return result;
+    }
+
+    /* Rebuilds a pointer-based automaton from a flat one. */
+    NFA decompile(const CompiledNFA& nfa) {
+        NFA result;
+        result.alphabet = *nfa.alphabet;
+
+        vector<State*> states;
+        for (size_t i = 0; i < nfa.numStates; i++) {
+            states.push_back(result.newState("q" + to_string(i), (*nfa.isStart)[i], (*nfa.isAccepting)[i]));
+        }
+
+        const auto& edges = *nfa.forward;
+        for (size_t from = 0; from < nfa.numStates; from++) {
+            for (size_t e = edges.begin[from]; e < edges.begin[from + 1]; e++) {
+                addTransition(states[from], states[edges.neighbor[e]], edges.label[e]);
+            }
+        }
+
+        return result;
+    }
+
+    /* Reversal swaps the roles of the edge blocks and of the start/accept flags;
+     * nothing is copied.
      */
-    bool shortestStringIn(const NFA& nfa, string& result) {
-        NFA dfa = subsetConstruct(nfa);
-        queue<State*> worklist;
+    CompiledNFA reverseOf(const CompiledNFA& nfa) {
+        CompiledNFA result = nfa;
+        swap(result.forward, result.backward);
+        swap(result.isStart, result.isAccepting);
+        return result;
+    }
+
+    namespace {
+        /* Epsilon closure of a single state in a flat automaton, as a sorted list. */
+        vector<size_t> epsilonClosureOf(const CompiledNFA::Edges& edges, size_t state, vector<char>& scratch) {
+            vector<size_t> result = { state };
+            scratch[state] = true;
+            for (size_t i = 0; i < result.size(); i++) {
+                for (size_t e = edges.begin[result[i]]; e < edges.begin[result[i] + 1]; e++) {
+                    if (edges.label[e] == EPSILON_TRANSITION && !scratch[edges.neighbor[e]]) {
+                        scratch[edges.neighbor[e]] = true;
+                        result.push_back(edges.neighbor[e]);
+                    }
+                }
+            }
 
-        /* Predecessor map. */
-        unordered_map<State*, pair<char32_t, State*>> predecessors;
+            /* Reset the scratch space for next time. */
+            for (size_t s: result) {
+                scratch[s] = false;
+            }
+            sort(result.begin(), result.end());
+            return result;
+        }
+    }
 
-        /* Add all start states. */
-        for (auto state: startStatesOf(dfa)) {
-            worklist.push(state);
-            predecessors[state] = make_pair(-1, nullptr);
+    /* Subset construction over flat automata. This is the same algorithm as the
+     * pointer-based version, except that epsilon closures are computed once per
+     * state up front and DFA states are numbered in the order the BFS finds them.
+     * Each DFA state gets one edge per alphabet character, in alphabet order.
+     */
+    CompiledNFA subsetConstruct(const CompiledNFA& nfa) {
+        const auto& edges = *nfa.forward;
+
+        /* Precompute all epsilon closures. */
+        vector<vector<size_t>> closures;
+        vector<char> scratch(nfa.numStates);
+        for (size_t i = 0; i < nfa.numStates; i++) {
+            closures.push_back(epsilonClosureOf(edges, i, scratch));
         }
 
-        /* Run the BFS. */
-        while (!worklist.empty()) {
-            auto curr = worklist.front();
-            worklist.pop();
+        /* Table mapping from sets of NFA states to DFA states, along with the
+         * sets themselves in DFA state order (which doubles as the worklist).
+         */
+        map<vector<size_t>, size_t> translation;
+        vector<vector<size_t>> subsets;
+        auto indexOf = [&](vector<size_t>& subset) {
+            sort(subset.begin(), subset.end());
+            subset.erase(unique(subset.begin(), subset.end()), subset.end());
+
+            auto itr = translation.find(subset);
+            if (itr != translation.end()) return itr->second;
+
+            translation.insert(make_pair(subset, subsets.size()));
+            subsets.push_back(subset);
+            return subsets.size() - 1;
+        };
+
+        /* Seed with the closure of the start states. */
+        vector<size_t> initial;
+        for (size_t i = 0; i < nfa.numStates; i++) {
+            if ((*nfa.isStart)[i]) initial.insert(initial.end(), closures[i].begin(), closures[i].end());
+        }
+        indexOf(initial);
+
+        auto forward = make_shared<CompiledNFA::Edges>();
+        forward->begin.push_back(0);
+        vector<char> isAccepting;
 
-            /* Found an accepting state? Then we're done! */
-            if (curr->isAccepting) {
-                /* Track backwards until we hit a start state. */
-                result = "";
-                while (!curr->isStart) {
-                    auto prev =  predecessors[curr];
-                    result    += toUTF8(prev.first);
-                    curr      =  prev.second;
+        /* Search outward! */
+        map<char32_t, vector<size_t>> successors;
+        for (size_t curr = 0; curr < subsets.size(); curr++) {
+            /* Bucket every non-epsilon move out of this set by character. */
+            successors.clear();
+            bool accepting = false;
+            for (size_t state: subsets[curr]) {
+                accepting |= bool((*nfa.isAccepting)[state]);
+                for (size_t e = edges.begin[state]; e < edges.begin[state + 1]; e++) {
+                    if (edges.label[e] != EPSILON_TRANSITION) {
+                        const auto& closure = closures[edges.neighbor[e]];
+                        auto& bucket = successors[edges.label[e]];
+                        bucket.insert(bucket.end(), closure.begin(), closure.end());
+                    }
                 }
-                reverse(result.begin(), result.end());
+            }
+            isAccepting.push_back(accepting);
+
+            for (char32_t ch: *nfa.alphabet) {
+                auto itr = successors.find(ch);
+                vector<size_t> none;
+                size_t dest = indexOf(itr == successors.end()? none : itr->second);
+
+                forward->neighbor.push_back(dest);
+                forward->label.push_back(ch);
+            }
+            forward->begin.push_back(forward->neighbor.size());
+        }
+
+        CompiledNFA result;
+        result.numStates   = subsets.size();
+        result.alphabet    = nfa.alphabet;
+        result.isAccepting = make_shared<const vector<char>>(std::move(isAccepting));
+
+        vector<char> isStart(result.numStates);
+        isStart[0] = true;
+        result.isStart  = make_shared<const vector<char>>(std::move(isStart));
+        result.backward = make_shared<const CompiledNFA::Edges>(reverseEdges(*forward, result.numStates));
+        result.forward  = std::move(forward);
+        return result;
+    }
+
+    namespace {
+        const size_t kNoState = numeric_limits<size_t>::max();
+
+        /* One half of a bidirectional search. The forward half walks edges from the
+         * start states; the backward half walks edges in reverse from the accepting
+         * states. Each remembers, per state, which state it was reached from and
+         * along which character so that the witness can be read back off.
+         */
+        struct SearchHalf {
+            const vector<size_t>&   begin;
+            const vector<size_t>&   neighbor;
+            const vector<char32_t>& label;
+
+            vector<char>     seen;
+            vector<size_t>   parent;
+            vector<char32_t> via;
+
+            /* States first reached in the most recent layer. */
+            vector<size_t> frontier;
+
+            SearchHalf(const CompiledNFA::Edges& edges, size_t numStates)
+                : begin(edges.begin), neighbor(edges.neighbor), label(edges.label),
+                  seen(numStates), parent(numStates, kNoState),
+                  via(numStates, EPSILON_TRANSITION) {}
+
+            /* Marks a state as reached. Returns whether it's new. */
+            bool reach(size_t state, size_t from, char32_t ch, vector<size_t>& layer) {
+                if (seen[state]) return false;
+                seen[state]   = true;
+                parent[state] = from;
+                via[state]    = ch;
+                layer.push_back(state);
                 return true;
             }
 
-            /* Expand outward. */
-            for (const auto& entry: curr->transitions) {
-                if (!predecessors.count(entry.second)) {
-                    predecessors[entry.second] = make_pair(entry.first, curr);
-                    worklist.push(entry.second);
+            /* Extends a layer with everything reachable from it via epsilons. The
+             * layer doubles as its own worklist.
+             */
+            void closeOver(vector<size_t>& layer) {
+                for (size_t i = 0; i < layer.size(); i++) {
+                    size_t curr = layer[i];
+                    for (size_t e = begin[curr]; e < begin[curr + 1]; e++) {
+                        if (label[e] == EPSILON_TRANSITION) {
+                            reach(neighbor[e], curr, EPSILON_TRANSITION, layer);
+                        }
+                    }
+                }
+            }
+
+            /* Advances the search by one character. */
+            void expand() {
+                vector<size_t> next;
+                for (size_t curr: frontier) {
+                    for (size_t e = begin[curr]; e < begin[curr + 1]; e++) {
+                        if (label[e] != EPSILON_TRANSITION) {
+                            reach(neighbor[e], curr, label[e], next);
+                        }
+                    }
+                }
+                closeOver(next);
+                frontier = std::move(next);
+            }
+
+            /* Returns some state on the frontier that the other half has seen, if any. */
+            size_t meetingPointWith(const SearchHalf& other) const {
+                for (size_t state: frontier) {
+                    if (other.seen[state]) return state;
+                }
+                return kNoState;
+            }
+
+            /* Returns the characters read walking from the given state back to the root. */
+            u32string pathFrom(size_t state) const {
+                u32string result;
+                for (; parent[state] != kNoState; state = parent[state]) {
+                    if (via[state] != EPSILON_TRANSITION) result += via[state];
                 }
+                return result;
+            }
+        };
+    }
+
+    /* Bidirectional BFS. Each half expands one whole layer (one character, plus
+     * epsilon closure) at a time, and we always grow whichever frontier is smaller.
+     *
+     * Why does the first meeting yield a shortest string? Suppose the forward half has
+     * explored to depth F and the backward half to depth B, and nothing has met yet.
+     * Then any accepted string has length at least F + B (otherwise some state along
+     * its path would be within F of the start and B of the end and would already be a
+     * meeting point). If expanding the forward half to depth F + 1 hits a state the
+     * backward half has seen, that state lies on a path of length at most F + 1 + B,
+     * which is therefore optimal. The same holds with the roles swapped.
+     *
+     * On a product automaton with branching factor b and shortest witness of length d,
+     * this touches about 2b^(d/2) states rather than b^d.
+     */
+    bool shortestWitnessIn(const CompiledNFA& nfa, u32string& result) {
+        SearchHalf forward (*nfa.forward,  nfa.numStates);
+        SearchHalf backward(*nfa.backward, nfa.numStates);
+
+        /* Seed each half and take epsilon closures. */
+        for (size_t i = 0; i < nfa.numStates; i++) {
+            if ((*nfa.isStart)[i])     forward.reach (i, kNoState, EPSILON_TRANSITION, forward.frontier);
+            if ((*nfa.isAccepting)[i]) backward.reach(i, kNoState, EPSILON_TRANSITION, backward.frontier);
+        }
+        forward.closeOver(forward.frontier);
+        backward.closeOver(backward.frontier);
+
+        size_t meet = forward.meetingPointWith(backward);
+        while (meet == kNoState) {
+            /* If either side has run dry, nothing is accepted. */
+            if (forward.frontier.empty() || backward.frontier.empty()) return false;
+
+            if (forward.frontier.size() <= backward.frontier.size()) {
+                forward.expand();
+                meet = forward.meetingPointWith(backward);
+            } else {
+                backward.expand();
+                meet = backward.meetingPointWith(forward);
             }
         }
 
-        /* Oops, didn't find anything. */
-        return false;
+        /* The forward path comes out backwards; the backward path comes out in order. */
+        result = forward.pathFrom(meet);
+        reverse(result.begin(), result.end());
+        result += backward.pathFrom(meet);
+        return true;
+    }
+
+    /* Finds the shortest string accepted by the automaton, or reports that
+     * the automaton doesn't accept anything.
+     */
+    bool shortestStringIn(const NFA& nfa, string& result) {
+        u32string witness;
+        if (!shortestWitnessIn(compile(nfa), witness)) return false;
+
+        result.clear();
+        for (char32_t ch: witness) {
+            result += toUTF8(ch);
+        }
+        return true;
     }
 
     /* Checks for equivalence, giving a counterexample if the automata aren't
@@ -1,8 +1,11 @@
 #include "CFG.h"
+#include "Cache.h"
 #include "Utilities/Unicode.h"
 #include <vector>
 #include <set>
 #include <queue>
+#include <deque>
+#include <iterator>
 #include <sstream>
 #include <iostream>
 #include <cctype>
@@ -12,6 +15,12 @@
 #include <random>
 #include <unordered_map>
 #include <unordered_set>
+#include <thread>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 using namespace std;
 
 namespace CFG {
@@ -88,36 +97,10 @@ namespace CFG {
 
     namespace {
         /* Nullablity information is a map from nullable nonterminals to the production
-         * they should use as their first step toward null.
+         * they should use as their first step toward null. See nullablesOf, below.
          */
         using Nulls = std::map<char32_t, const Production*>;
 
-        Nulls nullablesOf(const CFG& cfg) {
-           Nulls result;
-
-           bool changed;
-           do {
-               changed = false;
-
-               /* Loop over all productions and see if any of them give us a new way to null. */
-               for (const auto& p: cfg.productions) {
-                   /* Already nullable? Skip. */
-                   if (result.count(p.nonterminal)) continue;
-
-                   /* See if all terms in the production are nullable. */
-                   if (all_of(p.replacement.begin(), p.replacement.end(), [&](Symbol s) {
-                       return s.type == Symbol::Type::NONTERMINAL && result.count(s.ch);
-                   })) {
-                       result[p.nonterminal] = &p;
-                       changed = true;
-                   }
-               }
-
-           } while (changed);
-
-           return result;
-        }
-
         string toString(const set<char32_t>& s) {
             ostringstream result;
             result << "{ ";
@@ -127,6 +110,44 @@ namespace CFG {
             result << "}";
             return result.str();
         }
+
+        /* Cache key for something of the given kind built from the grammar. Production
+         * order matters to some of what gets built (say, which derivation comes out of
+         * a deriver), so the productions are encoded in order.
+         */
+        Cache::Key keyFor(const string& kind, const CFG& cfg) {
+            Cache::Key result(kind);
+            result.add(cfg.alphabet.size());
+            for (char32_t ch: cfg.alphabet) result.add(ch);
+
+            result.add(cfg.nonterminals.size());
+            for (char32_t ch: cfg.nonterminals) result.add(ch);
+
+            result.add(cfg.startSymbol);
+
+            result.add(cfg.productions.size());
+            for (const auto& prod: cfg.productions) {
+                result.add(prod.nonterminal);
+                result.add(prod.replacement.size());
+                for (const auto& symbol: prod.replacement) {
+                    result.add(uint64_t(symbol.ch) * 2 + (symbol.type == Symbol::Type::NONTERMINAL));
+                }
+            }
+            return result;
+        }
+
+        using Cache::bytesOf;
+
+        /* Rough number of bytes taken up by a grammar, for the cache. Set elements
+         * cost about the size of a tree node.
+         */
+        size_t bytesOf(const CFG& cfg) {
+            size_t result = sizeof(CFG) + 48 * (cfg.alphabet.size() + cfg.nonterminals.size());
+            for (const auto& prod: cfg.productions) {
+                result += sizeof(Production) + prod.replacement.capacity() * sizeof(Symbol);
+            }
+            return result;
+        }
     }
 
     ostream& operator<< (ostream& out, const CFG& cfg) {
@@ -140,6 +161,491 @@ namespace CFG {
         return out;
     }
 
+    /**************************************************************************
+     **************************************************************************
+     ***                  Grammar Analysis Implementation                   ***
+     **************************************************************************
+     **************************************************************************
+
+     Nearly everything else in here needs to know some basic facts about a
+     grammar - which nonterminals are nullable, which ones are productive, etc.
+     These used to be computed by looping over all the productions until
+     nothing changed, which is quadratic in the worst case and was being redone
+     by each transformation that needed it.
+
+     GrammarAnalysis instead numbers the nonterminals and works out everything
+     at once with worklist algorithms. The nullable and productive sets use the
+     classic counter-based approach (see Knuth's "A Generalization of
+     Dijkstra's Algorithm"): each production keeps a count of the symbols on its
+     right-hand side not yet known to have the property, and once that count
+     hits zero, the nonterminal on the left gets the property. Each symbol
+     occurrence is then touched once.
+
+     FIRST and FOLLOW sets and the unit closure are all "this set contains that
+     set" systems of inclusions. We solve those by finding strongly connected
+     components of the inclusion graph (everything in a component has the same
+     set) and then filling the components in reverse topological order, so each
+     set is built exactly once.
+
+     *************************************************************************/
+
+    GrammarAnalysis::Bitset::Bitset(size_t size) : numBits(size), words((size + 63) / 64) {
+
+    }
+
+    size_t GrammarAnalysis::Bitset::size() const {
+        return numBits;
+    }
+
+    size_t GrammarAnalysis::Bitset::count() const {
+        size_t result = 0;
+        forEach([&](size_t) {
+            result++;
+        });
+        return result;
+    }
+
+    bool GrammarAnalysis::Bitset::contains(size_t index) const {
+        return index < numBits && (words[index / 64] & (uint64_t(1) << (index % 64)));
+    }
+
+    void GrammarAnalysis::Bitset::insert(size_t index) {
+        if (index >= numBits) abort(); // Logic error!
+        words[index / 64] |= uint64_t(1) << (index % 64);
+    }
+
+    bool GrammarAnalysis::Bitset::insertAll(const Bitset& rhs) {
+        if (rhs.numBits != numBits) abort(); // Logic error!
+
+        bool changed = false;
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t merged = words[i] | rhs.words[i];
+            if (merged != words[i]) {
+                words[i] = merged;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool GrammarAnalysis::Bitset::intersects(const Bitset& rhs) const {
+        for (size_t i = 0; i < min(words.size(), rhs.words.size()); i++) {
+            if (words[i] & rhs.words[i]) return true;
+        }
+        return false;
+    }
+
+    bool GrammarAnalysis::Bitset::operator== (const Bitset& rhs) const {
+        return numBits == rhs.numBits && words == rhs.words;
+    }
+
+    bool GrammarAnalysis::Bitset::operator!= (const Bitset& rhs) const {
+        return !(*this == rhs);
+    }
+
+    size_t GrammarAnalysis::Bitset::lowestBitOf(uint64_t word) {
+#if defined(__GNUC__)
+        return __builtin_ctzll(word);
+#else
+        size_t result = 0;
+        while (!(word & 1)) {
+            word >>= 1;
+            result++;
+        }
+        return result;
+#endif
+    }
+
+    namespace {
+        const size_t kNotNullable = numeric_limits<size_t>::max();
+
+        /* A production with its symbols replaced by numbers. */
+        struct NumberedProduction {
+            size_t lhs;
+            vector<pair<Symbol::Type, size_t>> rhs;
+        };
+
+        /* Returns the strongly connected components of a graph given as adjacency
+         * lists, in reverse topological order. This is Tarjan's algorithm, done with an
+         * explicit stack so that long chains in big grammars don't overflow the call
+         * stack.
+         */
+        vector<vector<size_t>> componentsOf(const vector<vector<size_t>>& graph) {
+            const size_t kUnvisited = numeric_limits<size_t>::max();
+
+            vector<size_t> index(graph.size(), kUnvisited), lowLink(graph.size());
+            vector<char>   onStack(graph.size(), false);
+            vector<size_t> stack;
+            vector<vector<size_t>> result;
+            size_t nextIndex = 0;
+
+            /* Call stack: node, plus how many of its edges we've looked at. */
+            vector<pair<size_t, size_t>> calls;
+
+            for (size_t root = 0; root < graph.size(); root++) {
+                if (index[root] != kUnvisited) continue;
+
+                calls.push_back({ root, 0 });
+                while (!calls.empty()) {
+                    size_t node = calls.back().first;
+                    size_t& edge = calls.back().second;
+
+                    /* First time here? */
+                    if (edge == 0) {
+                        index[node] = lowLink[node] = nextIndex++;
+                        stack.push_back(node);
+                        onStack[node] = true;
+                    }
+
+                    /* Descend into the next unvisited child, if there is one. */
+                    bool descended = false;
+                    while (edge < graph[node].size()) {
+                        size_t next = graph[node][edge++];
+                        if (index[next] == kUnvisited) {
+                            calls.push_back({ next, 0 });
+                            descended = true;
+                            break;
+                        } else if (onStack[next]) {
+                            lowLink[node] = min(lowLink[node], index[next]);
+                        }
+                    }
+                    if (descended) continue;
+
+                    /* Done with this node. If it's the root of a component, pop it. */
+                    if (lowLink[node] == index[node]) {
+                        vector<size_t> component;
+                        size_t member;
+                        do {
+                            member = stack.back();
+                            stack.pop_back();
+                            onStack[member] = false;
+                            component.push_back(member);
+                        } while (member != node);
+                        result.push_back(component);
+                    }
+
+                    calls.pop_back();
+                    if (!calls.empty()) {
+                        size_t parent = calls.back().first;
+                        lowLink[parent] = min(lowLink[parent], lowLink[node]);
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        /* Solves a system of inclusions of the form "sets[u] contains sets[v] for each
+         * edge u -> v," where sets starts out holding what each set must contain
+         * directly.
+         */
+        void solveInclusions(const vector<vector<size_t>>& graph, vector<GrammarAnalysis::Bitset>& sets) {
+            /* Components come sinks first, so everything a component depends on is ready
+             * by the time we get to it.
+             */
+            for (const auto& component: componentsOf(graph)) {
+                auto merged = sets[component[0]];
+                for (size_t node: component) {
+                    merged.insertAll(sets[node]);
+                    for (size_t next: graph[node]) {
+                        merged.insertAll(sets[next]);
+                    }
+                }
+                for (size_t node: component) {
+                    sets[node] = merged;
+                }
+            }
+        }
+
+        /* Worklist propagation for the nullable and productive sets. A nonterminal has
+         * the property if some production for it has a right-hand side whose symbols all
+         * have it. Terminals have it iff terminalsCount is set. Returns, for each
+         * nonterminal, the index of the first production found to give it the property,
+         * or kNotNullable if none does.
+         */
+        vector<size_t> propagate(const vector<NumberedProduction>& productions,
+                                 const vector<vector<size_t>>& occurrences,
+                                 size_t numNonterminals,
+                                 bool terminalsCount) {
+            vector<size_t> remaining(productions.size());
+            vector<size_t> result(numNonterminals, kNotNullable);
+            vector<size_t> worklist;
+
+            auto mark = [&](size_t p) {
+                size_t lhs = productions[p].lhs;
+                if (result[lhs] == kNotNullable) {
+                    result[lhs] = p;
+                    worklist.push_back(lhs);
+                }
+            };
+
+            for (size_t p = 0; p < productions.size(); p++) {
+                for (const auto& symbol: productions[p].rhs) {
+                    if (symbol.first == Symbol::Type::NONTERMINAL || !terminalsCount) remaining[p]++;
+                }
+                if (remaining[p] == 0) mark(p);
+            }
+
+            for (size_t head = 0; head < worklist.size(); head++) {
+                for (size_t p: occurrences[worklist[head]]) {
+                    if (--remaining[p] == 0) mark(p);
+                }
+            }
+
+            return result;
+        }
+    }
+
+    GrammarAnalysis::GrammarAnalysis(const CFG& cfg) {
+        /* Number everything. */
+        auto idOf = [&](char32_t nonterminal) {
+            auto result = nonterminalIds.insert(make_pair(nonterminal, nonterminals.size()));
+            if (result.second) nonterminals.push_back(nonterminal);
+            return result.first->second;
+        };
+        auto terminalIdOf = [&](char32_t terminal) {
+            auto result = terminalIds.insert(make_pair(terminal, terminals.size()));
+            if (result.second) terminals.push_back(terminal);
+            return result.first->second;
+        };
+
+        for (char32_t nonterminal: cfg.nonterminals) {
+            idOf(nonterminal);
+        }
+        idOf(cfg.startSymbol);
+        for (char32_t terminal: cfg.alphabet) {
+            terminalIdOf(terminal);
+        }
+
+        vector<NumberedProduction> productions;
+        for (const auto& prod: cfg.productions) {
+            NumberedProduction numbered;
+            numbered.lhs = idOf(prod.nonterminal);
+            for (const auto& symbol: prod.replacement) {
+                if (symbol.type == Symbol::Type::TERMINAL) {
+                    numbered.rhs.push_back({ symbol.type, terminalIdOf(symbol.ch) });
+                } else {
+                    numbered.rhs.push_back({ symbol.type, idOf(symbol.ch) });
+                }
+            }
+            productions.push_back(numbered);
+        }
+
+        size_t numNonterminals = nonterminals.size();
+        size_t numTerminals    = terminals.size();
+        size_t start           = nonterminalIds.at(cfg.startSymbol);
+
+        /* Productions per nonterminal, and the productions each nonterminal appears in
+         * (once per appearance).
+         */
+        vector<vector<size_t>> productionsFor(numNonterminals), occurrences(numNonterminals);
+        for (size_t p = 0; p < productions.size(); p++) {
+            productionsFor[productions[p].lhs].push_back(p);
+            for (const auto& symbol: productions[p].rhs) {
+                if (symbol.first == Symbol::Type::NONTERMINAL) occurrences[symbol.second].push_back(p);
+            }
+        }
+
+        /* Nullable and productive. */
+        nullingProductions = propagate(productions, occurrences, numNonterminals, false);
+        auto productiveVia = propagate(productions, occurrences, numNonterminals, true);
+
+        nullableSet   = Bitset(numNonterminals);
+        productiveSet = Bitset(numNonterminals);
+        for (size_t id = 0; id < numNonterminals; id++) {
+            if (nullingProductions[id] != kNotNullable) nullableSet.insert(id);
+            if (productiveVia[id]      != kNotNullable) productiveSet.insert(id);
+        }
+
+        /* Reachable, both in general and using only productive productions. */
+        auto search = [&](bool productiveOnly) {
+            Bitset result(numNonterminals);
+            if (productiveOnly && !productiveSet.contains(start)) return result;
+
+            vector<size_t> worklist = { start };
+            result.insert(start);
+            for (size_t head = 0; head < worklist.size(); head++) {
+                for (size_t p: productionsFor[worklist[head]]) {
+                    const auto& rhs = productions[p].rhs;
+                    if (productiveOnly && any_of(rhs.begin(), rhs.end(), [&](const pair<Symbol::Type, size_t>& s) {
+                        return s.first == Symbol::Type::NONTERMINAL && !productiveSet.contains(s.second);
+                    })) continue;
+
+                    for (const auto& symbol: rhs) {
+                        if (symbol.first == Symbol::Type::NONTERMINAL && !result.contains(symbol.second)) {
+                            result.insert(symbol.second);
+                            worklist.push_back(symbol.second);
+                        }
+                    }
+                }
+            }
+            return result;
+        };
+        reachableSet = search(false);
+        usefulSet    = search(true);
+
+        /* Unit graph, its components, and closures. */
+        vector<vector<size_t>> unitGraph(numNonterminals);
+        cyclicSet = Bitset(numNonterminals);
+        for (const auto& prod: productions) {
+            if (prod.rhs.size() == 1 && prod.rhs[0].first == Symbol::Type::NONTERMINAL) {
+                unitGraph[prod.lhs].push_back(prod.rhs[0].second);
+                if (prod.rhs[0].second == prod.lhs) cyclicSet.insert(prod.lhs);
+            }
+        }
+
+        components = componentsOf(unitGraph);
+        for (const auto& component: components) {
+            if (component.size() > 1) {
+                for (size_t id: component) {
+                    cyclicSet.insert(id);
+                }
+            }
+        }
+
+        unitClosures.assign(numNonterminals, Bitset(numNonterminals));
+        for (size_t id = 0; id < numNonterminals; id++) {
+            unitClosures[id].insert(id);
+        }
+        solveInclusions(unitGraph, unitClosures);
+
+        /* FIRST sets. FIRST(A) contains FIRST(X) for every X that can come first in
+         * something A produces, which means every symbol in a production for A that
+         * comes after only nullable ones.
+         */
+        vector<vector<size_t>> firstGraph(numNonterminals);
+        firstSets.assign(numNonterminals, Bitset(numTerminals));
+        for (const auto& prod: productions) {
+            for (const auto& symbol: prod.rhs) {
+                if (symbol.first == Symbol::Type::TERMINAL) {
+                    firstSets[prod.lhs].insert(symbol.second);
+                    break;
+                }
+
+                firstGraph[prod.lhs].push_back(symbol.second);
+                if (!nullableSet.contains(symbol.second)) break;
+            }
+        }
+        solveInclusions(firstGraph, firstSets);
+
+        /* FOLLOW sets. Walking each production right to left, we keep track of what can
+         * come right after the current position (trailer) and whether the rest of the
+         * production can vanish (atEnd), in which case FOLLOW of the current symbol
+         * contains FOLLOW of the nonterminal on the left.
+         */
+        vector<vector<size_t>> followGraph(numNonterminals);
+        followSets.assign(numNonterminals, Bitset(numTerminals + 1));
+        followSets[start].insert(endOfInput());
+        for (const auto& prod: productions) {
+            Bitset trailer(numTerminals + 1);
+            bool atEnd = true;
+
+            for (size_t i = prod.rhs.size(); i > 0; i--) {
+                const auto& symbol = prod.rhs[i - 1];
+                if (symbol.first == Symbol::Type::TERMINAL) {
+                    trailer = Bitset(numTerminals + 1);
+                    trailer.insert(symbol.second);
+                    atEnd = false;
+                    continue;
+                }
+
+                followSets[symbol.second].insertAll(trailer);
+                if (atEnd) followGraph[symbol.second].push_back(prod.lhs);
+
+                /* FIRST sets are one smaller, since they never hold the end marker. */
+                Bitset first(numTerminals + 1);
+                firstSets[symbol.second].forEach([&](size_t terminal) {
+                    first.insert(terminal);
+                });
+
+                if (nullableSet.contains(symbol.second)) {
+                    trailer.insertAll(first);
+                } else {
+                    trailer = first;
+                    atEnd = false;
+                }
+            }
+        }
+        solveInclusions(followGraph, followSets);
+    }
+
+    size_t GrammarAnalysis::numNonterminals() const {
+        return nonterminals.size();
+    }
+    size_t GrammarAnalysis::numTerminals() const {
+        return terminals.size();
+    }
+
+    size_t GrammarAnalysis::idOf(char32_t nonterminal) const {
+        auto itr = nonterminalIds.find(nonterminal);
+        if (itr == nonterminalIds.end()) throw runtime_error("Not a nonterminal: " + toUTF8(nonterminal));
+        return itr->second;
+    }
+    size_t GrammarAnalysis::terminalIdOf(char32_t terminal) const {
+        auto itr = terminalIds.find(terminal);
+        if (itr == terminalIds.end()) throw runtime_error("Not a terminal: " + toUTF8(terminal));
+        return itr->second;
+    }
+    char32_t GrammarAnalysis::nonterminalAt(size_t id) const {
+        return nonterminals.at(id);
+    }
+    char32_t GrammarAnalysis::terminalAt(size_t id) const {
+        return terminals.at(id);
+    }
+
+    const GrammarAnalysis::Bitset& GrammarAnalysis::nullable() const {
+        return nullableSet;
+    }
+    const GrammarAnalysis::Bitset& GrammarAnalysis::productive() const {
+        return productiveSet;
+    }
+    const GrammarAnalysis::Bitset& GrammarAnalysis::reachable() const {
+        return reachableSet;
+    }
+    const GrammarAnalysis::Bitset& GrammarAnalysis::useful() const {
+        return usefulSet;
+    }
+    const GrammarAnalysis::Bitset& GrammarAnalysis::cyclic() const {
+        return cyclicSet;
+    }
+
+    bool GrammarAnalysis::isNullable(char32_t nonterminal) const {
+        auto itr = nonterminalIds.find(nonterminal);
+        return itr != nonterminalIds.end() && nullableSet.contains(itr->second);
+    }
+
+    size_t GrammarAnalysis::nullingProductionOf(size_t id) const {
+        if (!nullableSet.contains(id)) throw runtime_error("Nonterminal isn't nullable.");
+        return nullingProductions[id];
+    }
+
+    const GrammarAnalysis::Bitset& GrammarAnalysis::first(size_t id) const {
+        return firstSets.at(id);
+    }
+    const GrammarAnalysis::Bitset& GrammarAnalysis::follow(size_t id) const {
+        return followSets.at(id);
+    }
+    size_t GrammarAnalysis::endOfInput() const {
+        return terminals.size();
+    }
+
+    const GrammarAnalysis::Bitset& GrammarAnalysis::unitClosure(size_t id) const {
+        return unitClosures.at(id);
+    }
+    const vector<vector<size_t>>& GrammarAnalysis::unitComponents() const {
+        return components;
+    }
+
+    namespace {
+        Nulls nullablesOf(const CFG& cfg, const GrammarAnalysis& analysis) {
+            Nulls result;
+            analysis.nullable().forEach([&](size_t id) {
+                result[analysis.nonterminalAt(id)] = &cfg.productions[analysis.nullingProductionOf(id)];
+            });
+            return result;
+        }
+    }
+
     /**************************************************************************
      **************************************************************************
      ***                   Earley Parser Implementation                     ***
@@ -166,16 +672,13 @@ namespace CFG {
             size_t itemPos; // Where this item starts
         };
 
-        /* State of the Earley parse. */
+        /* State of the Earley parse, in the form the deriver wants it. */
         struct EarleyState {
             /* Earley items per slot. */
             vector<set<EarleyItem>> items;
 
-            /* Nullable nonterminals; used for quick lookup during prediction. */
+            /* Nullable nonterminals; used to reconstruct epsilon derivations. */
             Nulls nullable;
-
-            /* Productions by nonterminal; used for quick lookup during prediction. */
-            map<char32_t, vector<const Production*>> grammar;
         };
 
         /* For debugging. */
@@ -217,8 +720,14 @@ namespace CFG {
          * represented as strings with UTF-8 formatting.
          */
         vector<char32_t> utf8Decode(const string& input, const Languages::Alphabet& alphabet) {
+            /* Decode in bulk, which skips through runs of ASCII much faster than going a
+             * character at a time.
+             */
+            auto decoded = decodeUTF8(input);
+
             vector<char32_t> result;
-            for (char32_t ch: utf8Reader(input)) {
+            result.reserve(decoded.size());
+            for (char32_t ch: decoded) {
                 if (isSpace(ch)) continue;
                 if (!alphabet.count(ch)) throw runtime_error("Invalid character: " + toUTF8(ch));
                 result.push_back(ch);
@@ -256,244 +765,422 @@ namespace CFG {
 
         const bool kParserVerbose = false;
 
-        /* Adds an item to an Earley parser. */
-        bool addItem(EarleyState& state, size_t index, const EarleyItem& item) {
-            if (index > state.items.size() || item.itemPos > index) abort(); // Logic error!
-            return state.items[index].insert(item).second;
-        }
+        /* The Earley parser proper works on a compiled form of the grammar. Nonterminals
+         * are numbered 0, 1, 2, ..., and each "dotted production" (a production plus a
+         * dot position) gets its own number, so an Earley item is just a pair of integers.
+         * Dotted productions are numbered so that advancing the dot adds one.
+         *
+         * The grammar is augmented with a fresh start production S' -> S, which can't be
+         * skipped over by the Leo optimization below. The input is accepted if the item
+         * S' -> S. @0 is in the last slot.
+         */
+        struct EarleyGrammar {
+            /* Productions, indexed by number. The last is the augmented start production,
+             * which isn't part of the original grammar.
+             */
+            vector<const Production*> productions;
+            Production augmentedStart;
 
-        /* "Scan" step of the Earley algorithm. */
-        void scan(EarleyState& state, size_t index, char32_t ch) {
-            if (kParserVerbose) cout << "SCAN " << index << endl;
-            /* See if anything here needs to have the dot shifted. */
-            for (const auto& item: state.items[index]) {
-                /* Item after the dot matches this character. */
-                if (kParserVerbose) cout << "Considering " << item << endl;
-                if (!dotAtEnd(item) && afterDot(item) == Symbol{Symbol::Type::TERMINAL, ch}) {
-                    if (kParserVerbose) cout << "    Will scan." << endl;
-                    /* Shift the dot over. */
-                    auto next = advanceDot(item);
-                    if (kParserVerbose) cout << "    Result: " << next << endl;
-                    addItem(state, index + 1, next);
-                }
-            }
+            /* Per-nonterminal information. */
+            vector<char32_t>       names;          // Nonterminal with this number
+            vector<vector<size_t>> productionsFor; // Productions with this on the left
+            vector<char>           isNullable;
 
-            if (kParserVerbose) cout << endl;
-        }
+            /* Dotted production number of each production with the dot at the front. */
+            vector<size_t> firstDotted;
 
-        /* "Complete" step of the Earley algorithm. Returns whether anything
-         * changed in the course of running this process.
-         */
-        bool complete(EarleyState& state, size_t index) {
-            bool result = false;
-            if (kParserVerbose) cout << "COMPLETE " << index << endl;
+            /* Per dotted production. */
+            vector<size_t>   productionOf;
+            vector<size_t>   lhsOf;     // Nonterminal on the left
+            vector<int>      postDot;   // Nonterminal after the dot, or one of the constants below
+            vector<char32_t> terminal;  // Terminal after the dot, if postDot == kTerminal
+            vector<char>     isLast;    // Is the symbol after the dot the last one?
 
-            /* Create a worklist of items to process. */
-            queue<EarleyItem> worklist;
-            for (const auto& item: state.items[index]) {
-                if (kParserVerbose) cout << "  Considering " << item << endl;
-                if (dotAtEnd(item)) { // At end
-                    if (kParserVerbose) cout << "    Adding to worklist." << endl;
-                    worklist.push(item);
-                }
-            }
+            /* Dotted production number of S' -> .S */
+            size_t start;
 
-            /* Keep processing items until none are left. */
-            while (!worklist.empty()) {
-                auto item = worklist.front();
-                worklist.pop();
+            /* For the deriver. */
+            Nulls nullable;
 
-                if (kParserVerbose) cout << "  Processing " << item << endl;
+            /* The grammar this was compiled from, which the Production pointers above
+             * point into.
+             */
+            shared_ptr<const CFG> source;
+        };
 
-                /* Track back to where this item came from and push all dots before
-                 * this nonterminal forward.
-                 */
-                for (const auto& pred: state.items[item.itemPos]) {
-                    if (kParserVerbose) cout << "    Possible predecessor: " << pred << endl;
-                    /* Dot not at end, and is before this nonterminal. */
-                    if (!dotAtEnd(pred) && afterDot(pred) == Symbol{Symbol::Type::NONTERMINAL, item.production->nonterminal}) {
-                        if (kParserVerbose) cout << "      Will complete." << endl;
-                        /* Shift the dot forward. */
-                        auto next = advanceDot(pred);
-                        if (kParserVerbose) cout << "      Completes to " << next << endl;
-
-                        /* If we haven't already seen this, and if it's at the end, we need to
-                         * process it too.
-                         */
-                        if (addItem(state, index, next)) {
-                            result = true;
-                            if (kParserVerbose) cout << "      This is new - do we need to process?" << endl;
-                            if (dotAtEnd(next)) {
-                                if (kParserVerbose) cout << "        Yes!" << endl;
-                                worklist.push(next);
-                            }
-                            else if (kParserVerbose) cout << "      No" << endl;
-                        }
-                    }
-                }
-            }
+        const int kAtEnd    = -1;
+        const int kTerminal = -2;
 
-            if (kParserVerbose) cout << endl;
-            return result;
-        }
+        /* An Earley item, in compiled form. */
+        struct DenseItem {
+            size_t dotted; // Dotted production
+            size_t origin; // Where this item starts
+        };
 
-        /* "Predict" step of Earley parser. */
-        bool predict(EarleyState& state, size_t index) {
-            bool result = false;
-            if (kParserVerbose) cout << "PREDICT " << index << endl;
+        /* The Earley chart for one input. This lives apart from the parser so that
+         * it can be kept around and resumed later; see IncrementalParser.
+         */
+        struct EarleyChart {
+            vector<char32_t> input;
 
-            /* Worklist; we may discover many things. */
-            queue<EarleyItem> worklist;
+            vector<vector<DenseItem>> items;
 
-            /* Seed queue with all items with dots before nonterminals. */
-            for (const auto& item: state.items[index]) {
-                if (kParserVerbose) cout << "  Considering " << item << endl;
-                if (!dotAtEnd(item) && afterDot(item).type == Symbol::Type::NONTERMINAL) {
-                    if (kParserVerbose) cout << "    Adding to worklist." << endl;
-                    worklist.push(item);
-                }
+            /* For each finished slot, the items there, grouped by the nonterminal after the
+             * dot: the items waiting on nonterminal A are at positions
+             * [waitingBegin[A], waitingBegin[A + 1]) of waitingItems.
+             */
+            vector<vector<size_t>>    waitingBegin;
+            vector<vector<DenseItem>> waitingItems;
+        };
+
+        shared_ptr<EarleyGrammar> toEarleyGrammar(shared_ptr<const CFG> cfg) {
+            GrammarAnalysis analysis(*cfg);
+
+            auto result = make_shared<EarleyGrammar>();
+            result->source   = cfg;
+            result->nullable = nullablesOf(*cfg, analysis);
+
+            /* Number nonterminals, including any that show up only in productions. */
+            map<char32_t, size_t> ids;
+            auto idOf = [&](char32_t nonterminal) {
+                auto itr = ids.find(nonterminal);
+                if (itr != ids.end()) return itr->second;
+
+                size_t id = ids.size();
+                ids[nonterminal] = id;
+                result->names.push_back(nonterminal);
+                result->productionsFor.emplace_back();
+                result->isNullable.push_back(analysis.isNullable(nonterminal));
+                return id;
+            };
+            for (char32_t nonterminal: cfg->nonterminals) {
+                idOf(nonterminal);
             }
+            idOf(cfg->startSymbol);
 
-            /* Keep processing until done. */
-            while (!worklist.empty()) {
-                auto item = worklist.front();
-                worklist.pop();
+            for (const auto& prod: cfg->productions) {
+                result->productions.push_back(&prod);
+            }
 
-                if (dotAtEnd(item) || afterDot(item).type == Symbol::Type::TERMINAL) abort(); // Logic error!
+            /* Augmented start symbol; its name doesn't matter since we never look at it. */
+            result->augmentedStart = { 0, { Symbol{Symbol::Type::NONTERMINAL, cfg->startSymbol} } };
+            result->productions.push_back(&result->augmentedStart);
 
-                if (kParserVerbose) cout << "  Processing " << item << endl;
+            for (size_t p = 0; p < result->productions.size(); p++) {
+                const auto* prod = result->productions[p];
+                bool isAugmented = (p + 1 == result->productions.size());
 
-                /* Find all productions we can use here. */
-                char32_t nonterminal = afterDot(item).ch;
-                for (const auto* prod: state.grammar[nonterminal]) {
-                    if (kParserVerbose) cout << "    Considering production " << prod << endl;
-                    /* If we haven't yet seen this, we may need to put it into the queue
-                     * too for nonterminals at the front.
-                     */
-                    if (kParserVerbose) cout << "      Match!" << endl;
-                    EarleyItem predicted = { prod, 0, index };
-                    if (kParserVerbose) cout << "      Produced " << predicted << endl;
-                    if (addItem(state, index, predicted)) {
-                        result = true;
-
-                        if (kParserVerbose) cout << "      This is new. Process it?" << endl;
-                        /* Nonterminal at the front? Add it in. */
-                        if (!dotAtEnd(predicted) && afterDot(predicted).type == Symbol::Type::NONTERMINAL) {
-                            if (kParserVerbose) cout << "        Yes!" << endl;
-                            worklist.push(predicted);
+                /* The augmented start symbol gets an ID past all the others, since nothing
+                 * ever predicts it.
+                 */
+                size_t lhs = isAugmented? result->productionsFor.size() : idOf(prod->nonterminal);
+                if (!isAugmented) result->productionsFor[lhs].push_back(p);
+
+                result->firstDotted.push_back(result->productionOf.size());
+
+                for (size_t dot = 0; dot <= prod->replacement.size(); dot++) {
+                    result->productionOf.push_back(p);
+                    result->lhsOf.push_back(lhs);
+
+                    if (dot == prod->replacement.size()) {
+                        result->postDot.push_back(kAtEnd);
+                        result->terminal.push_back(0);
+                        result->isLast.push_back(false);
+                    } else {
+                        const auto& symbol = prod->replacement[dot];
+                        if (symbol.type == Symbol::Type::TERMINAL) {
+                            result->postDot.push_back(kTerminal);
+                            result->terminal.push_back(symbol.ch);
+                        } else {
+                            result->postDot.push_back(idOf(symbol.ch));
+                            result->terminal.push_back(0);
                         }
-                        else if (kParserVerbose) cout << "        No" << endl;
+                        result->isLast.push_back(dot + 1 == prod->replacement.size());
                     }
                 }
             }
-            if (kParserVerbose) cout << endl;
 
+            result->start = result->firstDotted.back();
             return result;
         }
 
-        void completeAndPredict(EarleyState& state, size_t index) {
-            /* Run predictor and completer until convergence. */
-            bool completeUpdate;
-            bool predictUpdate;
-            do {
-                completeUpdate = complete(state, index);
-                predictUpdate  = predict(state, index);
-            } while (completeUpdate || predictUpdate);
-        }
-
-        /* For debugging. */
-        void printItems(const EarleyState& state, size_t index) {
-            cout << "Items at index " << index << ": " << endl;
-            for (const auto& item: state.items.at(index)) {
-                cout << "  " << item << endl;
-            }
+        /* Compiled grammar, shared with everyone else who has compiled the same one. */
+        shared_ptr<const EarleyGrammar> earleyGrammarFor(const CFG& cfg) {
+            return Cache::lookup<EarleyGrammar>(keyFor("Earley", cfg), [&] {
+                auto result = toEarleyGrammar(make_shared<CFG>(cfg));
+                size_t bytes = sizeof(EarleyGrammar) + bytesOf(*result->source) + 48 * result->nullable.size() +
+                               bytesOf(result->productions) + bytesOf(result->names) +
+                               bytesOf(result->productionsFor) + bytesOf(result->isNullable) +
+                               bytesOf(result->firstDotted) + bytesOf(result->productionOf) +
+                               bytesOf(result->lhsOf) + bytesOf(result->postDot) +
+                               bytesOf(result->terminal) + bytesOf(result->isLast);
+                return make_pair(shared_ptr<const EarleyGrammar>(result), bytes);
+            });
         }
 
-        /* Earley parsing algorithm. We run in a loop of scan/complete/predict, starting
-         * at predict, and see if we find the proper Earley item in the last column.
+        /* The Earley parser. This follows the approach from "Practical Earley Parsing" by
+         * Aycock and Horspool: each slot's item list is its own worklist, processed front
+         * to back, and when predicting a nullable nonterminal we also immediately move the
+         * dot over it. That makes a single pass over each slot enough, with no need to loop
+         * the predictor and completer until nothing changes.
+         *
+         * Duplicate items are filtered with a table indexed by (dotted production, origin)
+         * that records the last slot each item was added to. Items only ever get added to
+         * the slot being processed or the one after it, so one table serves for all slots.
          *
-         * We use a slightly different indexing system than the traditional Earley position.
-         * Position 0 is just before the first character, and position i+1 is just after the
-         * ith character.
+         * If useLeo is set, completion uses Joop Leo's optimization for right recursion.
+         * If a completed item A -> gamma. @j is waited on by exactly one item in slot j,
+         * and that item is B -> beta .A @i (with A at the very end), then completing A
+         * inevitably completes B, and we can look at who's waiting on B in slot i, etc.
+         * We jump straight to the top of that chain, skipping the items in between. This
+         * makes right-recursive grammars run in linear time, but it means the chart is
+         * missing items, so the deriver can't use it.
          *
-         * TODO: This can be cleaned up / optimized as follows. Iterate over the item sets
-         * as usual, but use the sets themselves as the worklist! Use the idea from "Practical
-         * Earley Parsing" of running predict (shifting dots over nullables), then complete,
-         * then scan. This avoids the tight loop of complete/predict.
+         * Slot k of the chart depends only on the first k characters of the input, so a
+         * chart can be picked up partway through: keep slots 0 through k, change the rest
+         * of the input, and rerun from slot k + 1.
          */
-        EarleyState earley(char32_t start,
-                           const Nulls& nullable,
-                           const map<char32_t, vector<const Production*>>& grammar,
-                           const vector<char32_t>& input) {
-            EarleyState state;
-            state.nullable = nullable;
-            state.grammar  = grammar;
-            state.items.resize(input.size() + 1);
-
-            /* Seed with the initial Earley items. */
-            if (kParserVerbose) cout << "SEEDING" << endl;
-            for (const auto* prod: state.grammar[start]) {
-                if (kParserVerbose) cout << "Including this production." << endl;
-                addItem(state, 0, { prod, 0, 0 });
+        class EarleyParser {
+        public:
+            EarleyParser(const EarleyGrammar& grammar, EarleyChart& chart, bool useLeo) :
+                grammar(grammar), input(chart.input), useLeo(useLeo),
+                items(chart.items),
+                lastSlot(grammar.postDot.size() * (input.size() + 1)),
+                waitingBegin(chart.waitingBegin),
+                waitingItems(chart.waitingItems),
+                leoTops(input.size() + 1) {
             }
 
-            /* Run the Earley parser. */
-            for (size_t i = 0; i <= input.size(); i++) {
-                if (kParserVerbose) printItems(state, i);
-                completeAndPredict(state, i);
-                if (i != input.size()) scan(state, i, input[i]);
-            }
-            if (kParserVerbose) cout << endl;
+            /* Fills in the chart, keeping slots 0 through from - 1 as they are. */
+            void run(size_t from = 0) {
+                items.resize(input.size() + 1);
+                waitingBegin.resize(input.size() + 1);
+                waitingItems.resize(input.size() + 1);
+                for (size_t slot = from; slot <= input.size(); slot++) {
+                    items[slot].clear();
+                }
 
-            return state;
-        }
+                if (from == 0) {
+                    add(0, { grammar.start, 0 });
+                } else if (from <= input.size()) {
+                    scan(from - 1);
+                }
 
-        /* Given the result of an Earley parse, returns some final item from that
-         * parse (or null if one doesn't exist).
-         */
-        const EarleyItem* acceptingItem(const EarleyState& state, char32_t start) {
-            /* See if we match. */
-            for (const auto& item: state.items.back()) {
-                if (kParserVerbose) cout << "Final item: " << item << endl;
-                if (item.production->nonterminal == start &&     // Start symbol
-                    item.itemPos == 0 &&                                   // occurs at the beginning
-                    item.dotPos == item.production->replacement.size()) {  // is complete
-                    if (kParserVerbose) cout << "  Success!" << endl;
-                    return &item;
+                for (size_t slot = from; slot <= input.size(); slot++) {
+                    process(slot);
+                    if (slot != input.size()) scan(slot);
                 }
             }
-            return nullptr;
-        }
 
-        /* Acceptance works by running Earley and seeing if we have any matching items. */
-        bool accepts(char32_t start,
-                     const Nulls& nullable,
-                     const map<char32_t, vector<const Production*>>& grammar,
-                     const vector<char32_t>& input) {
-            return acceptingItem(earley(start, nullable, grammar, input), start) != nullptr;
-        }
+        private:
+            /* Top of a deterministic reduction path, or a marker saying there isn't one. */
+            struct LeoTop {
+                enum class Status : char { UNKNOWN, NONE, FOUND } status = Status::UNKNOWN;
+                DenseItem top;
+            };
 
-        /* Given a nonterminal and a position, creates a sequence of Earley items corresponding
-         * to that nonterminal getting replaced by epsilon.
-         */
-        vector<EarleyItem> nullingSequenceFor(const EarleyState& state,
-                                              char32_t nonterminal,
-                                              size_t position) {
-            if (!state.nullable.count(nonterminal)) abort(); // Logic error!
+            const EarleyGrammar& grammar;
+            const vector<char32_t>& input;
+            bool useLeo;
 
-            /* Seed things with an initial Earley item. */
-            vector<EarleyItem> result = { { state.nullable.at(nonterminal), 0, position } };
+            vector<vector<DenseItem>>& items;
+            vector<size_t> lastSlot; // 1 + last slot each item was added to, or 0 for none
 
-            /* Keep appending. */
-            while (!dotAtEnd(result[0])) {
-                auto next = nullingSequenceFor(state, afterDot(result[0]).ch, position);
-                result.insert(result.end(), next.begin(), next.end());
+            /* See EarleyChart. */
+            vector<vector<size_t>>&    waitingBegin;
+            vector<vector<DenseItem>>& waitingItems;
 
-                result[0] = advanceDot(result[0]);
+            /* Memoized Leo chain tops, per slot and nonterminal. */
+            vector<vector<LeoTop>> leoTops;
+
+            size_t keyFor(const DenseItem& item) const {
+                return item.dotted * (input.size() + 1) + item.origin;
             }
 
-            return result;
-        }
+            void add(size_t slot, const DenseItem& item) {
+                size_t& last = lastSlot[keyFor(item)];
+                if (last != slot + 1) {
+                    last = slot + 1;
+                    items[slot].push_back(item);
+                }
+            }
+
+            void process(size_t slot) {
+                /* The list may grow as we go, so don't hold references into it. */
+                for (size_t i = 0; i < items[slot].size(); i++) {
+                    DenseItem item = items[slot][i];
+                    int next = grammar.postDot[item.dotted];
+
+                    if (next == kAtEnd) {
+                        complete(slot, item);
+                    } else if (next != kTerminal) {
+                        for (size_t production: grammar.productionsFor[next]) {
+                            add(slot, { grammar.firstDotted[production], slot });
+                        }
+                        if (grammar.isNullable[next]) {
+                            add(slot, { item.dotted + 1, item.origin });
+                        }
+                    }
+                }
+
+                indexWaiting(slot);
+            }
+
+            void complete(size_t slot, const DenseItem& item) {
+                /* Empty completions were handled when the nullable was predicted. */
+                if (item.origin == slot) return;
+
+                /* Nothing waits on the augmented start symbol. */
+                size_t nonterminal = grammar.lhsOf[item.dotted];
+                if (nonterminal == grammar.productionsFor.size()) return;
+                if (useLeo) {
+                    const auto& leo = leoTopFor(item.origin, nonterminal);
+                    if (leo.status == LeoTop::Status::FOUND) {
+                        add(slot, leo.top);
+                        return;
+                    }
+                }
+
+                const auto& begin = waitingBegin[item.origin];
+                for (size_t i = begin[nonterminal]; i < begin[nonterminal + 1]; i++) {
+                    const auto& waiting = waitingItems[item.origin][i];
+                    add(slot, { waiting.dotted + 1, waiting.origin });
+                }
+            }
+
+            void scan(size_t slot) {
+                for (const auto& item: items[slot]) {
+                    if (grammar.postDot[item.dotted] == kTerminal && grammar.terminal[item.dotted] == input[slot]) {
+                        add(slot + 1, { item.dotted + 1, item.origin });
+                    }
+                }
+            }
+
+            /* Groups the items in a finished slot by the nonterminal after their dots. */
+            void indexWaiting(size_t slot) {
+                size_t numNonterminals = grammar.productionsFor.size();
+                auto& begin = waitingBegin[slot];
+                begin.assign(numNonterminals + 2, 0);
+
+                for (const auto& item: items[slot]) {
+                    int next = grammar.postDot[item.dotted];
+                    if (next >= 0) begin[next + 2]++;
+                }
+                for (size_t i = 2; i < begin.size(); i++) {
+                    begin[i] += begin[i - 1];
+                }
+
+                auto& waiting = waitingItems[slot];
+                waiting.resize(begin.back());
+                for (const auto& item: items[slot]) {
+                    int next = grammar.postDot[item.dotted];
+                    if (next >= 0) waiting[begin[next + 1]++] = item;
+                }
+                begin.pop_back();
+            }
+
+            /* Top of the deterministic reduction path for a completed nonterminal A
+             * starting at the given slot. To keep things terminating, we only follow the
+             * path through items that start strictly earlier; the chain of origins then
+             * strictly decreases.
+             */
+            const LeoTop& leoTopFor(size_t slot, size_t nonterminal) {
+                /* Walk down the chain, filling in entries as we go, until we hit an entry
+                 * whose answer we know.
+                 */
+                vector<LeoTop*> path;
+                LeoTop* known = nullptr;
+                while (true) {
+                    auto& tops = leoTops[slot];
+                    if (tops.empty()) tops.resize(grammar.productionsFor.size());
+
+                    auto& entry = tops[nonterminal];
+                    if (entry.status != LeoTop::Status::UNKNOWN) {
+                        known = &entry;
+                        break;
+                    }
+
+                    /* Is there exactly one item waiting on this nonterminal, with the
+                     * nonterminal at the end of its production?
+                     */
+                    const auto& begin = waitingBegin[slot];
+                    if (begin[nonterminal + 1] - begin[nonterminal] != 1 ||
+                        !grammar.isLast[waitingItems[slot][begin[nonterminal]].dotted]) {
+                        entry.status = LeoTop::Status::NONE;
+                        known = &entry;
+                        break;
+                    }
+
+                    /* If so, completing that item is a step along the chain. */
+                    const auto& waiting = waitingItems[slot][begin[nonterminal]];
+                    entry.status = LeoTop::Status::FOUND;
+                    entry.top    = { waiting.dotted + 1, waiting.origin };
+                    path.push_back(&entry);
+
+                    if (waiting.origin == slot) break;
+                    nonterminal = grammar.lhsOf[waiting.dotted];
+                    slot        = waiting.origin;
+                }
+
+                if (path.empty()) return *known;
+
+                /* Everything on the path shares the same top: either the top of the chain
+                 * we ran into, or the last step we took.
+                 */
+                DenseItem top = (known && known->status == LeoTop::Status::FOUND)? known->top : path.back()->top;
+                for (auto* entry: path) {
+                    entry->top = top;
+                }
+                return *path[0];
+            }
+        };
+
+        /* Was the input of a finished chart accepted? */
+        bool isAccepted(const EarleyGrammar& grammar, const EarleyChart& chart) {
+            for (const auto& item: chart.items.back()) {
+                if (item.dotted == grammar.start + 1 && item.origin == 0) return true;
+            }
+            return false;
+        }
+
+        /* Exports a finished chart, minus the augmented start production. */
+        EarleyState toState(const EarleyGrammar& grammar, const EarleyChart& chart) {
+            EarleyState result;
+            result.nullable = grammar.nullable;
+            result.items.resize(chart.items.size());
+
+            for (size_t slot = 0; slot < chart.items.size(); slot++) {
+                for (const auto& item: chart.items[slot]) {
+                    size_t p = grammar.productionOf[item.dotted];
+                    if (p + 1 == grammar.productions.size()) continue;
+
+                    result.items[slot].insert({ grammar.productions[p], item.dotted - grammar.firstDotted[p], item.origin });
+                }
+            }
+            return result;
+        }
+
+        /* Given a nonterminal and a position, creates a sequence of Earley items corresponding
+         * to that nonterminal getting replaced by epsilon.
+         */
+        vector<EarleyItem> nullingSequenceFor(const EarleyState& state,
+                                              char32_t nonterminal,
+                                              size_t position) {
+            if (!state.nullable.count(nonterminal)) abort(); // Logic error!
+
+            /* Seed things with an initial Earley item. */
+            vector<EarleyItem> result = { { state.nullable.at(nonterminal), 0, position } };
+
+            /* Keep appending. */
+            while (!dotAtEnd(result[0])) {
+                auto next = nullingSequenceFor(state, afterDot(result[0]).ch, position);
+                result.insert(result.end(), next.begin(), next.end());
+
+                result[0] = advanceDot(result[0]);
+            }
+
+            return result;
+        }
 
         const bool kDeriverVerbose = false;
 
@@ -693,18 +1380,21 @@ namespace CFG {
             return { {}, false };
         }
 
+        /* Given a chart built without the Leo optimization, returns a derivation of its
+         * input, or an empty derivation if there isn't one.
+         */
         Derivation derivationOf(char32_t start,
-                                const Nulls& nullable,
-                                const map<char32_t, vector<const Production*>>& grammar,
-                                const vector<char32_t>& input) {
-            auto state = earley(start, nullable, grammar, input);
+                                const EarleyGrammar& grammar,
+                                const EarleyChart& chart) {
+            auto state = toState(grammar, chart);
+            size_t length = chart.input.size();
 
             /* Try all possible derivations from the end and see if any of them work. */
             for (const auto& item: state.items.back()) {
                 if (kDeriverVerbose) cout << "Inspecting item " << item << endl;
                 if (dotAtEnd(item) && item.itemPos == 0 && item.production->nonterminal == start) {
                     /* See if we can find a derivation here. */
-                    auto derivation = derivationOfRec(state, item, input.size(), { item.production->nonterminal });
+                    auto derivation = derivationOfRec(state, item, length, { item.production->nonterminal });
                     if (!derivation.second) continue;
 
                     /* Fencepost issue; this first one isn't added in. */
@@ -722,819 +1412,851 @@ namespace CFG {
             return {};
         }
 
-        /* Given a CFG, converts it to a format usable in Earley parsing. */
-        map<char32_t, vector<const Production*>> toEarleyGrammar(const CFG& cfg) {
-            map<char32_t, vector<const Production*>> result;
-            for (const auto& prod: cfg.productions) {
-                result[prod.nonterminal].push_back(&prod);
-            }
-            return result;
-        }
-
         Matcher earleyMatcherFor(const CFG& cfg) {
-            /* Clone the grammar locally so that internal pointers stay valid. */
-            auto grammarRef = make_shared<CFG>(cfg);
-            auto nullable   = nullablesOf(*grammarRef);
-            auto grammar    = toEarleyGrammar(*grammarRef);
+            auto grammar = earleyGrammarFor(cfg);
 
             return [=](const string& input) {
-                return accepts(grammarRef->startSymbol, nullable, grammar, utf8Decode(input, grammarRef->alphabet));
+                EarleyChart chart;
+                chart.input = utf8Decode(input, grammar->source->alphabet);
+
+                EarleyParser parser(*grammar, chart, true);
+                parser.run();
+                return isAccepted(*grammar, chart);
             };
         }
     }
 
     Deriver deriverFor(const CFG& cfg) {
-        /* Clone the grammar locally so that internal pointers stay valid. */
-        auto grammarRef = make_shared<CFG>(cfg);
-        auto nullable   = nullablesOf(*grammarRef);
-        auto grammar    = toEarleyGrammar(*grammarRef);
+        auto grammar = earleyGrammarFor(cfg);
 
         return [=](const string& input) {
-            return derivationOf(grammarRef->startSymbol, nullable, grammar, utf8Decode(input, grammarRef->alphabet));
+            EarleyChart chart;
+            chart.input = utf8Decode(input, grammar->source->alphabet);
+
+            /* No Leo optimization here; we need every item. */
+            EarleyParser parser(*grammar, chart, false);
+            parser.run();
+            return derivationOf(grammar->source->startSymbol, *grammar, chart);
         };
     }
 
-    /**************************************************************************
-     **************************************************************************
-     ***               McKenzie Generator Implementation                    ***
-     **************************************************************************
-     **************************************************************************
+    /* The incremental parser keeps a finished Earley chart (without the Leo optimization,
+     * so that derivations can be read off of it) for each input it's been given. Two
+     * facts let it avoid redoing most of the work:
+     *
+     *   1. Slot k depends only on the first k characters of the input. When the input
+     *      changes, everything up to and including the slot at the end of the longest
+     *      common prefix carries over.
+     *
+     *   2. A production can only affect a slot if its nonterminal was predicted there
+     *      or earlier, which shows up as an item in the chart waiting on that nonterminal.
+     *      When the grammar changes, we find the nonterminals whose productions changed
+     *      (or that became or stopped being nullable) and keep every slot before the
+     *      first one with an item waiting on any of them. The kept items just need to be
+     *      renumbered to match the new grammar.
+     */
+    namespace {
+        const size_t kNoProduction = numeric_limits<size_t>::max();
 
-     The logic below is for the algorithm to generate random strings from a CFG
-     using McKenzie's algorithm.
+        /* Pairs off the productions of two grammars with the same nonterminals. Returns
+         * the new number of each old production, or kNoProduction if it was removed, and
+         * marks the nonterminals whose productions or nullability differ.
+         */
+        vector<size_t> matchProductions(const EarleyGrammar& oldGrammar,
+                                        const EarleyGrammar& newGrammar,
+                                        vector<char>& isChanged) {
+            isChanged.assign(newGrammar.productionsFor.size(), false);
+
+            /* Duplicate productions are legal, so hold on to all copies. */
+            map<Production, vector<size_t>> unmatched;
+            for (size_t p = 0; p + 1 < oldGrammar.productions.size(); p++) {
+                unmatched[*oldGrammar.productions[p]].push_back(p);
+            }
 
-     Routines to sample strings from a CFG. I am indebted to former CS103 TA and
-     all-around superstar Kevin Gibbons for sourcing the paper "Generating
-     Strings at Random from a Context-Free Grammar" by Bruce McKenzie, for
-     spotting typos in the paper and correcting them, and for working out that
-     it's necessary to eliminate epsilon productions and self-loops in the
-     grammar before first running this algorithm.
+            vector<size_t> result(oldGrammar.productions.size(), kNoProduction);
+            for (size_t p = 0; p + 1 < newGrammar.productions.size(); p++) {
+                auto itr = unmatched.find(*newGrammar.productions[p]);
+                if (itr != unmatched.end() && !itr->second.empty()) {
+                    result[itr->second.back()] = p;
+                    itr->second.pop_back();
+                } else {
+                    isChanged[newGrammar.lhsOf[newGrammar.firstDotted[p]]] = true;
+                }
+            }
 
-     *************************************************************************/
+            /* The augmented start production always carries over. */
+            result.back() = newGrammar.productions.size() - 1;
 
-    namespace {
-        /* Type representing the 5D (!) Tail table.
-         *
-         * Nonterminal x Length x Production x Start -> [ numbers ]
+            for (size_t p = 0; p + 1 < oldGrammar.productions.size(); p++) {
+                if (result[p] == kNoProduction) {
+                    isChanged[oldGrammar.lhsOf[oldGrammar.firstDotted[p]]] = true;
+                }
+            }
+            for (size_t nonterminal = 0; nonterminal < isChanged.size(); nonterminal++) {
+                if (oldGrammar.isNullable[nonterminal] != newGrammar.isNullable[nonterminal]) {
+                    isChanged[nonterminal] = true;
+                }
+            }
+
+            return result;
+        }
+
+        /* Cuts a chart back to the slots that don't depend on any changed nonterminal,
+         * renumbering what's left to use the new grammar.
          */
-        using TailTable = map<char32_t, map<size_t, map<const Production*, map<size_t, vector<size_t>>>>>;
+        void carryOver(EarleyChart& chart,
+                       const EarleyGrammar& oldGrammar,
+                       const EarleyGrammar& newGrammar,
+                       const vector<size_t>& newProduction,
+                       const vector<char>& isChanged) {
+            size_t keep = 0;
+            for (; keep < chart.items.size(); keep++) {
+                bool affected = false;
+                for (const auto& item: chart.items[keep]) {
+                    int next = oldGrammar.postDot[item.dotted];
+                    if (next >= 0 && isChanged[next]) {
+                        affected = true;
+                        break;
+                    }
+                }
+                if (affected) break;
+            }
+
+            chart.items.resize(keep);
+            chart.waitingBegin.resize(keep);
+            chart.waitingItems.resize(keep);
+
+            /* Nothing in the kept slots involves a changed production, so every item
+             * has a counterpart in the new grammar.
+             */
+            auto renumber = [&](DenseItem& item) {
+                size_t p = oldGrammar.productionOf[item.dotted];
+                if (newProduction[p] == kNoProduction) abort(); // Logic error!
+
+                item.dotted = newGrammar.firstDotted[newProduction[p]] + (item.dotted - oldGrammar.firstDotted[p]);
+            };
+            for (size_t slot = 0; slot < keep; slot++) {
+                for (auto& item: chart.items[slot]) {
+                    renumber(item);
+                }
+                for (auto& item: chart.waitingItems[slot]) {
+                    renumber(item);
+                }
+            }
+        }
+    }
 
-        /* Representation of a grammar, optimized for fast lookups of productions for a nonterminal. */
-        using McKenzieGrammar = map<char32_t, vector<Production>>;
+    struct IncrementalParser::Impl {
+        shared_ptr<const EarleyGrammar> grammar;
+        vector<EarleyChart> charts;
 
-        struct McKenzieGenerator {
-            McKenzieGenerator(const CFG& cfg);
-            pair<bool, string> operator()(size_t) const;
+        /* Brings the chart for the given id up to date with the input and returns it. */
+        const EarleyChart& chartFor(size_t id, const string& input) {
+            auto decoded = utf8Decode(input, grammar->source->alphabet);
+            if (id >= charts.size()) charts.resize(id + 1);
+            auto& chart = charts[id];
 
-            /* Cleaned grammar; used for generation. It's stored this way because
-             * we need the ability to index productions by number.
+            /* Slots 0 through the length of the common prefix are still good, assuming we
+             * had them in the first place.
              */
-            McKenzieGrammar grammar;
+            size_t common = mismatch(decoded.begin(), decoded.end(),
+                                     chart.input.begin(), chart.input.end()).first - decoded.begin();
+            size_t from = min(common + 1, chart.items.size());
+
+            chart.input = std::move(decoded);
+            if (from <= chart.input.size()) {
+                EarleyParser parser(*grammar, chart, false);
+                parser.run(from);
+            } else {
+                /* Nothing to recompute, though the input may have gotten shorter. */
+                chart.items.resize(chart.input.size() + 1);
+                chart.waitingBegin.resize(chart.input.size() + 1);
+                chart.waitingItems.resize(chart.input.size() + 1);
+            }
+            return chart;
+        }
+    };
 
-            /* Start symbol. */
-            char32_t start;
+    IncrementalParser::IncrementalParser(const CFG& cfg) : impl(new Impl()) {
+        impl->grammar = earleyGrammarFor(cfg);
+    }
 
-            /* Stored tail table (see below). This is mutable because it can be populated on demand. */
-            mutable TailTable tail;
+    IncrementalParser::IncrementalParser(IncrementalParser &&) = default;
+    IncrementalParser& IncrementalParser::operator= (IncrementalParser &&) = default;
+    IncrementalParser::~IncrementalParser() = default;
 
-            /* Grammar can generate empty string. Is that the case? */
-            bool hasEpsilon;
-        };
+    void IncrementalParser::setGrammar(const CFG& cfg) {
+        auto oldGrammar = impl->grammar;
+        auto newGrammar = earleyGrammarFor(cfg);
+        impl->grammar = newGrammar;
 
-        namespace {
-            /* The random number generator. */
-            mt19937 theGenerator;
+        /* Same grammar as before, so all the charts are still good. */
+        if (newGrammar == oldGrammar) return;
 
-            /* Given a production, produces all nonempty productions that can be formed by
-             * taking subsets of the nullable nonterminals.
-             */
-            void generateSubsetsOf(const Production& p,
-                                   const Nulls& nullable,
-                                   set<Production>& result) {
-                std::function<void(Production&, size_t)> rec =
-                [&](Production& soFar, size_t index) {
-                    /* If at end, add unless we're empty. */
-                    if (index == p.replacement.size()) {
-                        if (!soFar.replacement.empty()) result.insert(soFar);
-                        return;
-                    }
-                    /* Include next character. */
-                    soFar.replacement.push_back(p.replacement[index]);
-                    rec(soFar, index+1);
-                    soFar.replacement.pop_back();
+        /* If the nonterminals were renumbered or the start symbol changed, nothing is
+         * salvageable.
+         */
+        if (oldGrammar->names != newGrammar->names ||
+            oldGrammar->source->startSymbol != newGrammar->source->startSymbol) {
+            impl->charts.clear();
+            return;
+        }
 
-                    /* If next is nullable, skip it. */
-                    if (p.replacement[index].type == Symbol::Type::NONTERMINAL &&
-                        nullable.count(p.replacement[index].ch)) {
-                        rec(soFar, index + 1);
-                    }
-                };
+        vector<char> isChanged;
+        auto newProduction = matchProductions(*oldGrammar, *newGrammar, isChanged);
+        for (auto& chart: impl->charts) {
+            carryOver(chart, *oldGrammar, *newGrammar, newProduction, isChanged);
+        }
+    }
 
-                Production builder;
-                builder.nonterminal = p.nonterminal;
-                rec(builder, 0);
-            }
+    bool IncrementalParser::matches(size_t id, const string& input) {
+        return isAccepted(*impl->grammar, impl->chartFor(id, input));
+    }
 
-            /* Given a CFG, returns the epsilon normal form of that CFG. This is formed by
-             * replacing all epsilon productions with new productions by "dropping out"
-             * nonterminals that are nullable in all (nonempty) combinations.
-             *
-             * TODO: This is misleading because it doesn't add epsilon back in at the end
-             * if the start symbol is nullable. Be careful!
-             */
-            CFG epsilonNormalFormOf(const CFG& cfg, const Nulls& nullable) {
-                set<Production> newProds;
+    Derivation IncrementalParser::derive(size_t id, const string& input) {
+        const auto& chart = impl->chartFor(id, input);
+        return derivationOf(impl->grammar->source->startSymbol, *impl->grammar, chart);
+    }
 
-                for (const auto& prod: cfg.productions) {
-                    generateSubsetsOf(prod, nullable, newProds);
-                }
+    void IncrementalParser::forget(size_t numIds) {
+        if (impl->charts.size() > numIds) impl->charts.resize(numIds);
+    }
+    /**************************************************************************
+     **************************************************************************
+     ***                    GLL Parser Implementation                       ***
+     **************************************************************************
+     **************************************************************************
 
-                auto result = cfg;
-                result.productions.assign(newProds.begin(), newProds.end());
-                return result;
-            }
+     GLL parsing (Scott and Johnstone) is a generalization of recursive-descent
+     parsing to arbitrary grammars, including ambiguous and left-recursive ones.
+     Rather than following one path through the grammar, it keeps a set of
+     "descriptors," each saying "resume at this point in this production, at
+     this position in the input, with this call stack." Call stacks are shared
+     in a graph-structured stack (GSS), so there are only polynomially many of
+     them.
+
+     As it runs, the parser builds a shared packed parse forest (SPPF) holding
+     every parse tree of the input. The SPPF has three sorts of nodes:
+
+       * Symbol nodes (X, i, j), saying X derives input[i, j). For terminals and
+         epsilon there's only one way to do this; for nonterminals there may be
+         many, each represented by a packed child.
+       * Intermediate nodes (X -> alpha . beta, i, j), saying alpha derives
+         input[i, j). These binarize the forest, keeping it cubic in size.
+       * Packed nodes, the children of the above, each representing one way of
+         splitting the span: a left child covering [i, k) and a right child
+         covering [k, j).
+
+     This follows the formulation in "GLL Parse-Tree Generation" by Scott and
+     Johnstone, interpreting the grammar directly rather than generating code
+     for it. The grammar is compiled the same way as for the Earley parser,
+     with grammar slots (the paper's term for dotted productions) numbered so
+     that moving the dot adds one.
 
-            CFG epsilonNormalFormOf(const CFG& cfg) {
-                return epsilonNormalFormOf(cfg, nullablesOf(cfg));
-            }
+     *************************************************************************/
 
-            /* Given a CFG in epsilon normal form, returns a new CFG such that if there any
-             * unit productions, they form a DAG.
-             *
-             * A unit production is one of the form A -> B. The basic idea is to replace all
-             * productions of the form A -> B by finding productions of the form B -> alpha
-             * and then directly writing A -> alpha, replacing the A -> B production.
-             *
-             * The challenge here is that we can have chains of nonterminals, such as
-             * A -> B -> C, where A needs to absorb items out of C.
-             *
-             * Making this more complicated, we also have to worry about chains of
-             * the form A -> B -> A, in which we get a cycle from a nonterminal back to
-             * itself. In that case, A needs to take on B's productions, and B needs to take
-             * on A's productions as well. (This includes a special case of A -> A, nonterminals
-             * that immediately produce themselves.)
-             *
-             * The most general version of this problem goes like this: we have a graph where
-             * each node is a nonterminal and there's an edge from A to B if A -> B is a unit
-             * production. We need to duplicate productions while also respecting cycles.
-             *
-             * Our approach is to use a strongly-connected-components algorithm to find SCC's of
-             * nonterminals that can produce one another. We'll then process them in reverse
-             * topological order (deepest first, topmost last). We'll then pick one representative
-             * of each of the nonterminals in an SCC and combine all the productions together
-             * under that representative.
-             *
-             * The resulting graph may still have unit productions in it, but those units will
-             * form a DAG, which is all we need.
-             */
-            using Graph = map<char32_t, set<char32_t>>;
+    namespace {
+        const size_t kNoNode = size_t(-1);
 
-            /* Returns whether something is a unit production. */
-            bool isNonterminalUnit(const Production& p) {
-                return p.replacement.size() == 1 && p.replacement[0].type == Symbol::Type::NONTERMINAL;
-            }
-            bool isTerminalUnit(const Production& p) {
-                return p.replacement.size() == 1 && p.replacement[0].type == Symbol::Type::TERMINAL;
-            }
+        enum class SPPFKind {
+            TERMINAL,
+            EPSILON,
+            NONTERMINAL,
+            INTERMEDIATE
+        };
+    }
 
-            /* Constructs the graph where A -> B is an edge if A -> B is a production. */
-            Graph unitGraphOf(const CFG& cfg) {
-                Graph result;
+    struct ParseForest::Impl {
+        struct Node {
+            SPPFKind kind;
+            size_t label;         // Nonterminal number or grammar slot, as appropriate
+            size_t left, right;   // Span [left, right)
+            vector<size_t> packed;
+        };
 
-                /* Ensure a node for each nonterminal. */
-                for (char32_t nonterminal: cfg.nonterminals) {
-                    (void) result[nonterminal];
-                }
+        struct PackedNode {
+            size_t slot;          // Grammar slot this split came from
+            size_t pivot;         // Split point
+            size_t leftChild;     // May be kNoNode
+            size_t rightChild;
+        };
 
-                for (const auto& p: cfg.productions) {
-                    if (isNonterminalUnit(p)) {
-                        /* Insert both nodes and an edge one way. */
-                        result[p.nonterminal].insert(p.replacement[0].ch);
-                    }
-                }
-                return result;
-            }
+        vector<Node>       nodes;
+        vector<PackedNode> packed;
+        size_t root = kNoNode;
 
-            /* Runs a DFS, recording the finishing times in the output vector. */
-            void dfs(char32_t nonterminal, const Graph& graph, vector<char32_t>& order, set<char32_t>& visited) {
-                if (!visited.insert(nonterminal).second) return;
+        /* Grammar the forest came from. */
+        shared_ptr<const EarleyGrammar> grammar;
+    };
 
-                for (char32_t next: graph.at(nonterminal)) {
-                    dfs(next, graph, order, visited);
-                }
+    namespace {
+        /* The compiled grammar, plus a numbering of each nonterminal's grammar slots. The
+         * parser keeps tables for each call of a nonterminal with one row per input position
+         * and one column per slot in that nonterminal's productions, and this says which
+         * column each slot gets.
+         */
+        struct GLLGrammar {
+            shared_ptr<const EarleyGrammar> grammar;
 
-                order.push_back(nonterminal);
-            }
+            /* Per nonterminal: one more than its number of slots. Column 0 is for the
+             * nonterminal itself.
+             */
+            vector<size_t> width;
 
-            /* Given a graph, reverses that graph. */
-            Graph reverseOf(const Graph& input) {
-                Graph result;
-                for (const auto& src: input) {
-                    /* Clone nodes. */
-                    (void) result[src.first];
+            /* Per slot: its column in the tables for its nonterminal. */
+            vector<size_t> column;
+        };
 
-                    for (char32_t dst: src.second) {
-                        result[dst].insert(src.first);
+        shared_ptr<const GLLGrammar> gllGrammarFor(const CFG& cfg) {
+            return Cache::lookup<GLLGrammar>(keyFor("GLL", cfg), [&] {
+                auto result = make_shared<GLLGrammar>();
+                result->grammar = earleyGrammarFor(cfg);
+
+                const auto& grammar = *result->grammar;
+                result->width.assign(grammar.names.size(), 1);
+                result->column.resize(grammar.lhsOf.size());
+                for (size_t slot = 0; slot < grammar.lhsOf.size(); slot++) {
+                    /* The augmented start production is never run, so it needs no column. */
+                    size_t lhs = grammar.lhsOf[slot];
+                    if (lhs < result->width.size()) {
+                        result->column[slot] = result->width[lhs]++;
                     }
                 }
-                return result;
-            }
 
-            /* Returns the SCCs of a given graph in reverse topological order. This uses Kosaraju's
-             * SCC algorithm.
-             */
-            vector<vector<char32_t>> sccsOf(const Graph& graph) {
-                /* Work with the reverse of the graph so that we find SCCs in reverse topological order. */
-                Graph rev = reverseOf(graph);
+                size_t bytes = sizeof(GLLGrammar) + bytesOf(result->width) + bytesOf(result->column);
+                return make_pair(shared_ptr<const GLLGrammar>(result), bytes);
+            });
+        }
 
-                /* Run the inital DFS. */
-                vector<char32_t> order;
-                set<char32_t> visited;
-                for (const auto& entry: rev) {
-                    dfs(entry.first, rev, order, visited);
+        /* GSS nodes here are identified by the nonterminal called and where the call was
+         * made, rather than by the slot to return to. This is the variant from "Faster,
+         * Practical GLL Parsing" by Afroozeh and Izmaylova, and it means each nonterminal
+         * is run only once at each position no matter how many places call it.
+         *
+         * It also means that everything run under a given call starts where that call did.
+         * A descriptor is then pinned down by its slot, call, and position, and so is the
+         * SPPF node it carries, since that node spans from the call to the position. So
+         * each call keeps a table with a row per position it has reached and a column per
+         * slot, saying which descriptors it has seen and which SPPF nodes it has built;
+         * column 0 records where the call has returned and the nonterminal node for that
+         * span. Calls are found through a table indexed by (nonterminal, position), and
+         * terminal and epsilon nodes through tables indexed by position, so nothing needs
+         * hashing.
+         *
+         * Each descriptor is processed once and each call returns at most once per
+         * position, so every GSS edge and every packed node is made exactly once, with no
+         * need to check for duplicates.
+         *
+         * When only asked whether the input matches, the parser skips the SPPF entirely and
+         * stops as soon as the start symbol returns having read the whole input.
+         */
+        class GLLParser {
+        public:
+            GLLParser(shared_ptr<const GLLGrammar> gll, const vector<char32_t>& input, bool buildForest) :
+                gll(*gll), grammar(*gll->grammar), input(input), buildForest(buildForest),
+                callAt(grammar.names.size() * (input.size() + 1), kNoNode) {
+                if (buildForest) {
+                    forest = make_shared<ParseForest::Impl>();
+                    forest->grammar = gll->grammar;
+                    terminalAt.resize(input.size(), kNoNode);
+                    epsilonAt.resize(input.size() + 1, kNoNode);
                 }
+            }
 
-                /* Run the reverse DFS's. */
-                vector<vector<char32_t>> result;
+            /* Runs the parser, returning whether the input matches. */
+            bool run() {
+                /* The augmented start production S' -> .S tells us what S is. */
+                startCall = callOf(grammar.postDot[grammar.start], 0);
 
-                reverse(order.begin(), order.end());
-                visited.clear();
-                for (char32_t nonterminal: order) {
-                    vector<char32_t> scc;
-                    dfs(nonterminal, graph, scc, visited);
+                while (!worklist.empty() && !(accepted && !buildForest)) {
+                    auto descriptor = worklist.back();
+                    worklist.pop_back();
+                    process(descriptor.slot, descriptor.gssNode, descriptor.position, descriptor.sppfNode);
+                }
 
-                    /* SCC can be empty if the node was already visited. */
-                    if (!scc.empty()) result.push_back(std::move(scc));
+                if (buildForest && accepted) {
+                    size_t cell = cellOf(startCall, input.size(), 0);
+                    forest->root = gss[startCall].nodes[cell];
                 }
+                return accepted;
+            }
 
-                return result;
+            /* The forest built by run(), if we were asked to build one. */
+            shared_ptr<const ParseForest::Impl> parseForest() const {
+                return forest;
             }
 
+        private:
+            struct Descriptor {
+                size_t slot;
+                size_t gssNode;
+                size_t position;
+                size_t sppfNode;
+            };
 
-            CFG unitNormalForm(const CFG& cfg) {
-                /* Map from each nonterminal to its representative. */
-                map<char32_t, char32_t> reps;
+            struct Edge {
+                size_t slot;      // Where to resume on return
+                size_t sppfNode;  // What the caller had parsed before the call
+                size_t parent;    // The caller's GSS node
+            };
 
-                /* Loop over SCCs, combining productions together. */
-                for (const auto& scc: sccsOf(unitGraphOf(cfg))) {
-                    /* The first becomes the representative for all of these. */
-                    auto rep = scc.front();
-                    for (char32_t nonterminal: scc) {
-                        reps[nonterminal] = rep;
-                    }
-                }
+            struct GSSNode {
+                size_t nonterminal;
+                size_t position;            // Where this call began
+                vector<Edge> edges;
+                vector<size_t> popped;      // Positions this call has returned at
 
-                /* Rebuild the productions list. */
-                set<Production> productions;
-                for (const auto& p: cfg.productions) {
-                    /* Replace all nonterminals with their representatives. */
-                    auto newP = p;
-                    newP.nonterminal = reps.at(newP.nonterminal);
-                    for (auto& s: newP.replacement) {
-                        if (s.type == Symbol::Type::NONTERMINAL) {
-                            s.ch = reps.at(s.ch);
-                        }
-                    }
+                /* Rows are for positions from this->position on. */
+                vector<char>   seen;        // Descriptors added, or in column 0, returns made
+                vector<size_t> nodes;       // SPPF nodes built
+            };
 
-                    /* If this is a unit, include it if it's not a loop. */
-                    if (!isNonterminalUnit(newP) || newP.replacement[0].ch != newP.nonterminal) {
-                        productions.insert(newP);
-                    }
-                }
+            const GLLGrammar& gll;
+            const EarleyGrammar& grammar;
+            const vector<char32_t>& input;
+            bool buildForest;
 
-                /* Form the new grammar. */
-                auto result = cfg;
+            vector<GSSNode> gss;
+            vector<size_t>  callAt;         // (nonterminal, position) -> GSS node
+            size_t          startCall;
+            bool            accepted = false;
 
-                /* Nonterminals are the reps. */
-                result.nonterminals.clear();
-                for (const auto& entry: reps) {
-                    result.nonterminals.insert(entry.second);
-                }
+            vector<Descriptor> worklist;
 
-                /* Change start symbol to rep. */
-                result.startSymbol = reps.at(result.startSymbol);
+            shared_ptr<ParseForest::Impl> forest;
+            vector<size_t> terminalAt;      // Position -> terminal node there
+            vector<size_t> epsilonAt;       // Position -> epsilon node there
 
-                /* Use new productions. */
-                result.productions.assign(productions.begin(), productions.end());
+            /* Index of the given entry in a call's tables, growing them if need be. */
+            size_t cellOf(size_t gssNode, size_t position, size_t column) {
+                auto& node = gss[gssNode];
+                size_t width = gll.width[node.nonterminal];
+                size_t cell  = (position - node.position) * width + column;
 
-                return result;
+                if (cell >= node.seen.size()) {
+                    size_t size = (position - node.position + 1) * width;
+                    node.seen.resize(size);
+                    if (buildForest) node.nodes.resize(size, kNoNode);
+                }
+                return cell;
             }
 
-            /* Given a CFG, returns its "useful subset." This consists of the subset of
-             * the grammar that is (1) reachable from the start symbol and (2) includes
-             * only nonterminals that can produce something.
-             *
-             * This can be thought of as two fixed-point equations. The first one works
-             * by identifying nonterminals that can produce nonterminal-free strings
-             * and then propagating that information upward. Anything not reached this
-             * way can be removed.
-             *
-             * The second identifies nonterminals reachable from the start symbol. The
-             * start symbol is reachable from itself, as is everything transitively
-             * derived from there.
-             *
-             * At this point, everything that remains must be productive and reachable. Why?
-             * Everything is definitely reachable. So suppose something is not productive.
-             * At the end of the productivity search, it was productive, so this means that
-             * something must have been removed that makes it not productive. But the only
-             * things removed were ones that weren't reachable, and everything in a production
-             * that stems from this nonterminal is reachable, so nothing could be removed.
-             *
-             * This procedure may produce a CFG with no productions and no nonterminals.
-             * If that happens, the language is empty.
-             */
+            size_t terminalNode(size_t position) {
+                if (terminalAt[position] == kNoNode) {
+                    terminalAt[position] = forest->nodes.size();
+                    forest->nodes.push_back({ SPPFKind::TERMINAL, input[position], position, position + 1, {} });
+                }
+                return terminalAt[position];
+            }
 
-            CFG removeNonproductive(const CFG& cfg) {
-                bool changed;
-                set<char32_t> productive;
+            size_t epsilonNode(size_t position) {
+                if (epsilonAt[position] == kNoNode) {
+                    epsilonAt[position] = forest->nodes.size();
+                    forest->nodes.push_back({ SPPFKind::EPSILON, 0, position, position, {} });
+                }
+                return epsilonAt[position];
+            }
 
-                /* Fixed-point iteration. */
-                do {
-                    changed = false;
-                    for (const Production& p: cfg.productions) {
-                        /* Skip things we already know are productive. */
-                        if (productive.count(p.nonterminal)) continue;
-
-                        /* If production has only productive nonterminals, it's productive. */
-                        if (all_of(p.replacement.begin(), p.replacement.end(), [&](const Symbol& s) {
-                            return s.type == Symbol::Type::TERMINAL || productive.count(s.ch);
-                        })) {
-                            productive.insert(p.nonterminal);
-                            changed = true;
-                        }
-                    }
+            /* The paper's getNodeP. Given that we've just moved the dot to produce the given
+             * slot, running under the given call, and that w covers what came before the last
+             * symbol and z covers the last symbol, returns a node covering everything before
+             * the dot.
+             */
+            size_t nodeAfter(size_t slot, size_t gssNode, size_t w, size_t z) {
+                size_t production = grammar.productionOf[slot];
+                bool   atEnd      = grammar.postDot[slot] == kAtEnd;
 
-                } while (changed);
+                /* If there's just one symbol before the dot and it can't be empty, there's no
+                 * need for an intermediate node; z says everything.
+                 */
+                if (!atEnd && slot == grammar.firstDotted[production] + 1) {
+                    int first = grammar.postDot[slot - 1];
+                    if (first == kTerminal || !grammar.isNullable[first]) return z;
+                }
 
-                /* Remove these nonterminals. */
-                auto result = cfg;
-                result.nonterminals = productive;
+                size_t pivot = forest->nodes[z].left;
+                size_t right = forest->nodes[z].right;
+                size_t cell  = cellOf(gssNode, right, atEnd? 0 : gll.column[slot]);
 
-                result.productions.erase(remove_if(result.productions.begin(), result.productions.end(), [&](const Production& p) {
-                    return any_of(p.replacement.begin(), p.replacement.end(), [&](const Symbol& s) {
-                        return s.type == Symbol::Type::NONTERMINAL && !productive.count(s.ch);
-                    });
-                }), result.productions.end());
+                size_t result = gss[gssNode].nodes[cell];
+                if (result == kNoNode) {
+                    result = gss[gssNode].nodes[cell] = forest->nodes.size();
+                    forest->nodes.push_back({ atEnd? SPPFKind::NONTERMINAL : SPPFKind::INTERMEDIATE,
+                                              atEnd? grammar.lhsOf[slot] : slot,
+                                              gss[gssNode].position, right, {} });
+                }
 
+                forest->nodes[result].packed.push_back(forest->packed.size());
+                forest->packed.push_back({ slot, pivot, w, z });
                 return result;
             }
 
-            /* Cute little BFS. */
-            CFG removeUnreachable(const CFG& cfg) {
-                set<char32_t> reachable = { cfg.startSymbol };
-                queue<char32_t> worklist;
-                worklist.push(cfg.startSymbol);
+            void add(size_t slot, size_t gssNode, size_t position, size_t sppfNode) {
+                size_t cell = cellOf(gssNode, position, gll.column[slot]);
+                if (!gss[gssNode].seen[cell]) {
+                    gss[gssNode].seen[cell] = true;
+                    worklist.push_back({ slot, gssNode, position, sppfNode });
+                }
+            }
 
-                /* Discover everything reachable. */
-                while (!worklist.empty()) {
-                    auto curr = worklist.front();
-                    worklist.pop();
-
-                    for (const auto& p: cfg.productions) {
-                        if (p.nonterminal == curr) {
-                            for (const auto& s: p.replacement) {
-                                if (s.type == Symbol::Type::NONTERMINAL && !reachable.count(s.ch)) {
-                                    reachable.insert(s.ch);
-                                    worklist.push(s.ch);
-                                }
-                            }
-                        }
+            /* Returns the GSS node for a call of the given nonterminal at the given position,
+             * starting the call if it hasn't been made yet.
+             */
+            size_t callOf(size_t nonterminal, size_t position) {
+                size_t& result = callAt[nonterminal * (input.size() + 1) + position];
+                if (result == kNoNode) {
+                    result = gss.size();
+                    gss.push_back({ nonterminal, position, {}, {}, {}, {} });
+
+                    for (size_t production: grammar.productionsFor[nonterminal]) {
+                        add(grammar.firstDotted[production], result, position, kNoNode);
                     }
                 }
-
-                /* Nuke everything not here. */
-                auto result = cfg;
-                result.nonterminals = reachable;
-                result.productions.erase(remove_if(result.productions.begin(), result.productions.end(), [&](const Production& p) {
-                    return !reachable.count(p.nonterminal);
-                }), result.productions.end());
-
                 return result;
             }
 
-            /* Given a CFG, returns a "cleaned" version of the CFG in which each
-             * nonterminal both produces and can be produced. This eliminates all
-             * nonterminals and rules that have no chance of being used.
-             */
-            CFG clean(const CFG& cfg) {
-                return removeUnreachable(removeNonproductive(cfg));
+            /* Follows the given edge out of a call that returned at the given position. */
+            void returnAlong(const Edge& edge, size_t gssNode, size_t position) {
+                size_t sppfNode = kNoNode;
+                if (buildForest) {
+                    size_t cell = cellOf(gssNode, position, 0);
+                    sppfNode = nodeAfter(edge.slot, edge.parent, edge.sppfNode, gss[gssNode].nodes[cell]);
+                }
+                add(edge.slot, edge.parent, position, sppfNode);
             }
 
-            /* Given a CFG, prepares that CFG for use in the McKenzie generator.
-             * This puts the grammar into epsilon normal form - which removes epsilon
-             * from the list of productions - removes useless rules, then eliminates
-             * cycles by putting the grammar into unit normal form.
-             *
-             * We have to begin by putting things into epsilon normal form before we
-             * start cleaning things. Otherwise, we risk that the grammar ends up
-             * with useless productions. Here's an example. Consider this grammar:
-             *
-             *    S -> A
-             *    A -> B
-             *    B -> epsilon
-             *
-             * If we go to epsilon normal form, we'll remove the production B -> epsilon,
-             * leaving both (1) a transition from A to B that can't expand and (2) an
-             * official nonterminal B with no productions, which can break things later
-             * on. We therefore have to do that first, before we start wiping things out.
+            /* Returns from a call. If we're building the forest, the nonterminal node for
+             * what the call parsed has already been made.
              */
-            CFG mcKenziePrepare(const CFG& input, const Nulls& nullable) {
-                return unitNormalForm(clean(epsilonNormalFormOf(input, nullable)));
-            }
+            void pop(size_t gssNode, size_t position) {
+                size_t cell = cellOf(gssNode, position, 0);
+                if (gss[gssNode].seen[cell]) return;
+                gss[gssNode].seen[cell] = true;
+                gss[gssNode].popped.push_back(position);
+
+                if (gssNode == startCall && position == input.size()) {
+                    accepted = true;
+                }
 
-            size_t sumOf(const vector<size_t>& input) {
-                return accumulate(input.begin(), input.end(), 0);
+                for (size_t i = 0; i < gss[gssNode].edges.size(); i++) {
+                    returnAlong(gss[gssNode].edges[i], gssNode, position);
+                }
             }
 
-            /* Computes the table from the McKenzie paper.
-             *
-             * The basic idea behind this table is the following. We want to produce information
-             * about each nonterminal in a grammar that tells us how many strings of a given length
-             * it can produce (including multiplicity with ambiguity; remember, the problem of
-             * determining whether a grammar is ambiguous is undecidable). We assume there are no
-             * loops in the grammar and that there are no epsilon productions.
-             *
-             * So with that in mind, how many strings of length n can a given nonterminal S produce?
-             * Well, that would be
-             *
-             *      ---
-             *      \
-             *      /    # strings of length n P can produce.
-             *      ---
-             *   production
-             *  P = S -> alpha
-             *
-             * So that would tell us to start looking at the number of strings of length n that
-             * one specific production P could produce.
-             *
-             * Suppose that we have the production S -> X alpha. There are two cases to consider:
-             *
-             *   Case 1: X is a terminal. In that case, the number of strings of length n that
-             *           this production can produce is equal to the number of strings of length
-             *           n-1 that alpha produces.
-             *   Case 2: X is a nonterminal. In that case, the number of strings of length n that
-             *           this production can produce is equal to the number of strings of length
-             *           1 that X produces times the number of strings of length n-1 that alpha
-             *           produces, plus the number of strings of length 2 that X produces plus the
-             *           number of strings of length n-2 that alpha produces, etc.
-             *
-             * This gives us a nice recursive formulation for the problem. All of our subproblems
-             * have the following form:
-             *
-             *    Given a nonterminal S, a production S -> alpha, a decomposition of alpha
-             *    into alpha = gamma beta, and a length n, how many strings of length exactly
-             *    n can beta produce?
-             *
-             * It turns out that we need a slightly more general version of this problem.
-             * Specifically, we'll use this version:
-             *
-             *    Given a nonterminal S, a production S -> alpha, a decomposition of alpha into
-             *    alpha = gamma X beta, and a length n, produce a list of entries such that the
-             *    kth entry is the number of strings that X beta produces given that X produced
-             *    a string of length exactly k.
-             *
-             * The terminology in the McKenzie paper is a bit dense, so we'll use something a
-             * bit simpler. Every subproblem here can be parameterized in terms of the following:
-             *
-             *    1. S: Which nonterminal are you using?
-             *    2. n: What is the length you want to produce?
-             *    3. P: Which production of that nonterminal are you interested in?
-             *    4. i: What index in that production does the symbol X occur at?
-             *
-             * We can encode this as a table Tail[S][n][P][i]. The answer to the question "how many
-             * strings of length n can nonterminal S produce?," which we'll denote by Count[S][n], is
-             * then
-             *
-             *                +-      ---          ---                                  -+
-             *                |       \            \                       |             |
-             *                |       /            /     Tail[S][k][P][1]  |             |
-             * Count[S][n] =  |       ---          ---                     | 0 <= k < n  |
-             *                |    production                              |             |
-             *                |  P = S -> alpha                            |             |
-             *                +-                                                        -+
-             *
-             * The outer sum, hopefully, make sense - we're summing up over all the possible productions
-             * of the nonterminal. The value of Tail[S][n][P][1] is a vector saying "if the first symbol of
-             * the production produces exactly one character, how many strings of length i can we make? then,
-             * if first symbol of the production produces exactly two characters, how many strings of length
-             * k can we make? etc.", so the inner sum essentially evaluates to "how many strings of length
-             * k can this production make?"
-             */
+            void process(size_t slot, size_t gssNode, size_t position, size_t sppfNode) {
+                while (true) {
+                    int next = grammar.postDot[slot];
 
-            const bool kGeneratorVerbose = false;
+                    /* End of production: return. */
+                    if (next == kAtEnd) {
+                        /* Epsilon production. */
+                        if (buildForest && sppfNode == kNoNode) {
+                            nodeAfter(slot, gssNode, kNoNode, epsilonNode(position));
+                        }
+                        pop(gssNode, position);
+                        return;
+                    }
+                    /* Terminal: match it, or this thread dies. */
+                    else if (next == kTerminal) {
+                        if (position == input.size() || input[position] != grammar.terminal[slot]) return;
+
+                        position++;
+                        slot++;
+                        if (buildForest) {
+                            sppfNode = nodeAfter(slot, gssNode, sppfNode, terminalNode(position - 1));
+                        }
+                    }
+                    /* Nonterminal: call it, and if it's already returned, replay those returns
+                     * along the new edge.
+                     */
+                    else {
+                        size_t called = callOf(next, position);
+                        Edge edge = { slot + 1, sppfNode, gssNode };
+                        gss[called].edges.push_back(edge);
 
-            /* For debugging. */
-            string toString(const vector<size_t>& v) {
-                ostringstream builder;
-                builder << "[ ";
-                for (auto i: v) {
-                    builder << i << " ";
+                        for (size_t i = 0; i < gss[called].popped.size(); i++) {
+                            returnAlong(edge, called, gss[called].popped[i]);
+                        }
+                        return;
+                    }
                 }
-                builder << "]";
-                return builder.str();
             }
+        };
 
-            /* Computes and returns Count[S][n]. */
-            vector<size_t> computeCount(TailTable& table, const McKenzieGrammar& grammar,
-                                        char32_t nonterminal, size_t n, size_t indent = 2);
+        /* Matching doesn't need the forest, so none is built. */
+        Matcher gllMatcherFor(const CFG& cfg) {
+            auto gll = gllGrammarFor(cfg);
 
-            /* Computes and returns Tail[S][n][p][i]. */
-            const vector<size_t>& computeTail(TailTable& table,
-                                              const McKenzieGrammar& grammar,
-                                              char32_t nonterminal, size_t n,
-                                              const Production* prod, size_t index,
-                                              size_t indent = 2) {
-                /* Base case: Already known? Then just return it. */
-                auto& result = table[nonterminal][n][prod][index];
-                if (!result.empty()) return result;
+            return [=](const string& input) {
+                auto decoded = utf8Decode(input, gll->grammar->source->alphabet);
+                return GLLParser(gll, decoded, false).run();
+            };
+        }
+    }
 
+    ParseForest::ParseForest(shared_ptr<const Impl> impl) : impl(impl) {
 
-                /* Current production; just for simplicity. */
-                const auto& p = prod->replacement;
+    }
 
-                if (kGeneratorVerbose) cout << string(indent, ' ') << "Tail[" << toUTF8(nonterminal) << "][" << n << "][" << *prod << "][" << index << "]" << endl;
+    bool ParseForest::accepts() const {
+        return impl && impl->root != kNoNode;
+    }
 
+    size_t ParseForest::size() const {
+        return impl? impl->nodes.size() + impl->packed.size() : 0;
+    }
 
-                /* Base case: n = 0? That means we're asked to make no characters. */
-                if (n == 0) {
-                    /* If we're at the end of the production, there's one way to do this (do nothing
-                     * at all). If we aren't, then there is no way to do this.
-                     */
-                    result = { index == p.size() };
-                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
-                    return result;
-                }
+    bool ParseForest::isAmbiguous() const {
+        if (!accepts()) return false;
 
-                /* Base case: past the end? Then we can't do this. */
-                if (index == p.size()) {
-                    result = { 0 };
-                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
-                    return result;
+        /* Every packed node reachable from the root is part of some parse tree, so we're
+         * ambiguous exactly when some reachable node has a choice of packed nodes.
+         */
+        vector<char> visited(impl->nodes.size());
+        vector<size_t> worklist = { impl->root };
+        visited[impl->root] = true;
+
+        while (!worklist.empty()) {
+            const auto& node = impl->nodes[worklist.back()];
+            worklist.pop_back();
+
+            if (node.packed.size() > 1) return true;
+            for (size_t packed: node.packed) {
+                for (size_t child: { impl->packed[packed].leftChild, impl->packed[packed].rightChild }) {
+                    if (child != kNoNode && !visited[child]) {
+                        visited[child] = true;
+                        worklist.push_back(child);
+                    }
                 }
+            }
+        }
+        return false;
+    }
 
-                /* If we're a terminal, the answer is "zero if you want make to make zero characters,
-                 * whatever the rest produces if you want me to make one character, and zero for all
-                 * other options."
-                 *
-                 * There's a bit of special-case handling here in that the generator routine isn't going
-                 * to look at the indices, so we don't need to include them here.
-                 */
-                if (p[index].type == Symbol::Type::TERMINAL) {
-                    result = { sumOf(computeTail(table, grammar, nonterminal, n - 1, prod, index + 1)) };
-                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
-                    return result;
-                }
+    ParseForest::Enumerator ParseForest::derivations() const {
+        return Enumerator(impl);
+    }
 
-                /* Otherwise, we're a nonterminal. We're going to try to split the n characters across
-                 * this nonterminal and the tail of this production in all possible ways.
-                 *
-                 * Because each nonterminal produces at least one character, the loop bounds here
-                 * start at 1 (munching the first character) and stop when there's one character
-                 * left for each of the remaining symbols in the production. THIS IS CRITICAL TO
-                 * KEEPING THE RECURSION CORRECT! If we don't ensure there's a drop in n before
-                 * making these recursive calls, we could run into loops on
-                 * productions like S -> Sa.
-                 *
-                 * This necessitates some special-case handling for when we're at the very end of
-                 * a production with a nonterminal, since in that case the only option is to have
-                 * the nonterminal produce everything. This can't loop because the grammar has
-                 * no loops in it.
-                 *
-                 * It's weird that we construct the list to have just one item, and I definitely
-                 * had a double-take when reading the paper on this. Turns out the generation
-                 * routine special-cases the last nonterminal and doesn't use the indices the
-                 * same way the other ones are used, so it's okay that this is technically in
-                 * the slot for zero.
-                 */
-                if (index + 1 == p.size()) {
-                    result = { computeCount(table, grammar, p[index].ch, n) };
-                    if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
-                    return result;
-                }
+    ParseForest::Enumerator::Enumerator(shared_ptr<const Impl> impl) : impl(impl) {
+        done = !impl || impl->root == kNoNode;
+    }
 
-                result.push_back(0); // No ways to make the empty string.
-                for (size_t k = 1; k + p.size() - index - 1 <= n; k++) {
-                    size_t me   = sumOf(computeCount(table, grammar, p[index].ch, k, indent + 4));
-                    size_t them = sumOf(computeTail(table, grammar, nonterminal, n - k, prod, index + 1, indent + 4));
-                    result.push_back(me * them);
+    /* Enumeration works like an odometer. A parse tree is determined by which packed
+     * node we pick at each node we visit, so we walk the forest in preorder, recording
+     * each choice we make (whenever there's more than one option). To get the next tree,
+     * we bump the last choice that has options left, throw away the choices after it,
+     * and walk again, taking the first option at each new choice point.
+     *
+     * Walks that revisit a node already on the path from the root are abandoned, and we
+     * move on to the next set of choices.
+     */
+    bool ParseForest::Enumerator::next(Derivation& result) {
+        auto advance = [&] {
+            while (!choices.empty()) {
+                if (choices.back() + 1 < options.back()) {
+                    choices.back()++;
+                    return true;
                 }
-
-                if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
-                return result;
+                choices.pop_back();
+                options.pop_back();
             }
+            return false;
+        };
 
-            vector<size_t> computeCount(TailTable& table, const McKenzieGrammar& grammar,
-                                        char32_t nonterminal, size_t n, size_t indent) {
-                if (kGeneratorVerbose) cout << string(indent, ' ') << "C[" << toUTF8(nonterminal) << "][" << n << "]" << endl;
-
-                /* Add up all the tail values. */
-                vector<size_t> result;
-                for (const auto& prod: grammar.at(nonterminal)) {
-                    result.push_back(sumOf(computeTail(table, grammar, nonterminal, n, &prod, 0, indent + 4)));
+        if (done) return false;
+        if (started && !advance()) {
+            done = true;
+            return false;
+        }
+        started = true;
+
+        vector<char> onPath(impl->nodes.size());
+        while (true) {
+            result.clear();
+            fill(onPath.begin(), onPath.end(), false);
+
+            /* Preorder walk. Each entry is a node and whether we're leaving it. */
+            vector<pair<size_t, bool>> stack = { make_pair(impl->root, false) };
+            size_t choicePoint = 0;
+            bool failed = false;
+
+            while (!stack.empty() && !failed) {
+                auto entry = stack.back();
+                stack.pop_back();
+
+                const auto& node = impl->nodes[entry.first];
+                if (entry.second) {
+                    onPath[entry.first] = false;
+                    continue;
                 }
-                if (kGeneratorVerbose) cout << string(indent, ' ') << toString(result) << endl;
-                return result;
-            }
-
-            /* Procedure to generate a random string of the given length with uniform (modulo ambiguity)
-             * probability. The basic idea is the following:
-             *
-             * 1. Select a production. The weight assigned to each production should be the number of
-             *    strings it can derive of the given length.
-             * 2. Go through the production one symbol at a time. When you see a nonterminal, generate
-             *    it randomly. When you see a terminal, generate it.
-             */
-
-            pair<bool, string> generateNonterminal(TailTable& table,
-                                                   const McKenzieGrammar& grammar,
-                                                   char32_t nonterminal,
-                                                   size_t n);
-
-            pair<bool, string> generateProduction(TailTable& table,
-                                                  const McKenzieGrammar& grammar,
-                                                  char32_t nonterminal,
-                                                  size_t n,
-                                                  const Production* prod,
-                                                  size_t index) {
-                /* For convenience. */
-                auto& p = prod->replacement;
-
-                /* Base case: last character? */
-                if (index + 1 == p.size()) {
-                    /* Terminal? Just return it. */
-                    if (p[index].type == Symbol::Type::TERMINAL) {
-                        if (n != 1) abort(); // Logic error!
-                        return make_pair(true, toUTF8(p[index].ch));
-                    }
-                    /* Nonterminal? Generate it. */
-                    return generateNonterminal(table, grammar, p[index].ch, n);
-                }
-
-                /* Otherwise, there's more after us. */
-                if (p[index].type == Symbol::Type::TERMINAL) {
-                    auto result = generateProduction(table, grammar, nonterminal, n - 1, prod, index + 1);
-                    result.second = toUTF8(p[index].ch) + result.second;
-                    return result;
+                if (node.kind == SPPFKind::TERMINAL || node.kind == SPPFKind::EPSILON) continue;
+                if (onPath[entry.first]) {
+                    failed = true;
+                    continue;
                 }
 
-                /* Select how many characters to read. */
-                auto& options = table[nonterminal][n][prod][index];
-                size_t k = discrete_distribution<size_t>(options.begin(), options.end())(theGenerator);
-
-                auto lhs = generateNonterminal(table, grammar, p[index].ch, k);
-                auto rhs = generateProduction(table, grammar, nonterminal, n - k, prod, index + 1);
-                return make_pair(lhs.first && rhs.first, lhs.second + rhs.second);
-            }
-
-            pair<bool, string> generateNonterminal(TailTable& table,
-                                                   const McKenzieGrammar& grammar,
-                                                   char32_t nonterminal,
-                                                   size_t n) {
-                /* Get the relative frequencies of each production. */
-                vector<size_t> weights;
-                for (const auto& p: grammar.at(nonterminal)) {
-                    /* Number of strings of this length is given by
-                     * sum(Tail[nonterminal][n][p][0]) because that counts the number of
-                     * strings of length n we can make using all characters of the
-                     * production.
-                     */
-                    weights.push_back(sumOf(computeTail(table, grammar, nonterminal, n, &p, 0)));
+                /* Pick a packed node. */
+                size_t choice = 0;
+                if (node.packed.size() > 1) {
+                    if (choicePoint == choices.size()) {
+                        choices.push_back(0);
+                        options.push_back(node.packed.size());
+                    }
+                    choice = choices[choicePoint++];
                 }
+                const auto& packed = impl->packed[node.packed[choice]];
 
-                /* If we can't make anything of this length, report an error. */
-                if (all_of(weights.begin(), weights.end(), [](size_t val) {
-                    return val == 0;
-                })) {
-                    return make_pair(false, "");
+                if (node.kind == SPPFKind::NONTERMINAL) {
+                    size_t production = impl->grammar->productionOf[packed.slot];
+                    result.push_back(make_pair(*impl->grammar->productions[production], node.left));
                 }
 
-                /* Select a production, then generate it. */
-                auto* prod = &grammar.at(nonterminal)[discrete_distribution<size_t>(weights.begin(), weights.end())(theGenerator)];
-                return generateProduction(table, grammar, nonterminal, n, prod, 0);
+                onPath[entry.first] = true;
+                stack.push_back(make_pair(entry.first, true));
+                stack.push_back(make_pair(packed.rightChild, false));
+                if (packed.leftChild != kNoNode) stack.push_back(make_pair(packed.leftChild, false));
             }
-        }
-
-        McKenzieGenerator::McKenzieGenerator(const CFG& cfg) {
-            auto nullable = nullablesOf(cfg);
-            CFG g = mcKenziePrepare(cfg, nullable);
 
-            /* Remember the start symbol. */
-            start = g.startSymbol;
+            if (!failed) return true;
 
-            /* Build the productions table. */
-            for (const auto& p: g.productions) {
-                grammar[p.nonterminal].push_back(p);
+            /* Drop choices we never got to, then move on. */
+            choices.resize(choicePoint);
+            options.resize(choicePoint);
+            if (!advance()) {
+                done = true;
+                return false;
             }
-
-            /* We can produce epsilon if the start symbol is nullable. */
-            hasEpsilon = nullable.count(cfg.startSymbol);
         }
+    }
 
-        pair<bool, string> McKenzieGenerator::operator()(size_t n) const {
-            /* Edge case: If the grammar is empty, return nothing. */
-            if (grammar.empty()) return make_pair(false, "");
-
-            /* Edge case: If the length is zero, return epsilon iff the grammar
-             * can produce epsilon.
-             */
-            if (n == 0) return make_pair(hasEpsilon, "");
+    Parser parserFor(const CFG& cfg) {
+        auto gll = gllGrammarFor(cfg);
 
-            /* Otherwise, use the generator. */
-            return generateNonterminal(tail, grammar, start, n);
-        }
-    }
+        return [=](const string& input) {
+            auto decoded = utf8Decode(input, gll->grammar->source->alphabet);
 
-    Generator generatorFor(const CFG& cfg) {
-        return McKenzieGenerator(cfg);
+            GLLParser parser(gll, decoded, true);
+            parser.run();
+            return ParseForest(parser.parseForest());
+        };
     }
 
     /**************************************************************************
      **************************************************************************
-     ***                 Chomsky Normal Form Conversion                     ***
+     ***               McKenzie Generator Implementation                    ***
      **************************************************************************
      **************************************************************************
 
-     The logic below is for the algorithm to convert a grammar to Chomsky
-     Normal Form. This allows for use of the (faster) CYK parser compared with
-     the (slower but more general) Earley parser. (It's also just a nice
-     subroutine to have lying around for whenever you need it!)
-
-     The conversion to CNF follows this procedure:
+     The logic below is for the algorithm to generate random strings from a CFG
+     using McKenzie's algorithm.
 
-       1. Add a new start symbol.
-       2. Add nonterminals to rewrite all non-unit terminals as nonterminals.
-       3. Break long productions apart into binary productions.
-       4. Convert to epsilon normal form.
-       5. Convert to strong unit normal form.
+     Routines to sample strings from a CFG. I am indebted to former CS103 TA and
+     all-around superstar Kevin Gibbons for sourcing the paper "Generating
+     Strings at Random from a Context-Free Grammar" by Bruce McKenzie, for
+     spotting typos in the paper and correcting them, and for working out that
+     it's necessary to eliminate epsilon productions and self-loops in the
+     grammar before first running this algorithm.
 
      *************************************************************************/
+
     namespace {
-        /* Given a grammar, constructs a new grammar with a new start symbol appearing
-         * nowhere else in the grammar. This new start symbol will not necessarily have
-         * a Nice or Pretty Name.
+        /* Counts of strings are stored as natural logarithms. The number of strings of length n
+         * a grammar can produce is typically exponential in n, so fixed-width integers overflow
+         * (silently skewing the sampling) at surprisingly small lengths. Logs never overflow and
+         * keep about fifteen significant digits, which is plenty for choosing among options.
+         *
+         * A count of zero is represented by kLogZero.
          */
-        CFG addUniqueStartTo(const CFG& cfg) {
-            CFG result = cfg;
+        const double kLogZero = -numeric_limits<double>::infinity();
 
-            /* Find a character we haven't used. */
-            char32_t ch;
-            for (ch = 'A'; cfg.nonterminals.count(ch); ch++) {
-                // Intentionally empty
-            }
+        /* Sentinel marking a slot that doesn't hold a nonterminal. */
+        const size_t kNotNonterminal = size_t(-1);
 
-            result.productions.push_back( { ch, { Symbol{Symbol::Type::NONTERMINAL, cfg.startSymbol }} });
-            result.startSymbol = ch;
-            result.nonterminals.insert(ch);
+        /* Position within a production. Production P = A -> X1 X2 ... Xm has m + 1 slots, one
+         * before each symbol and one past the end, and slots for the same production are
+         * contiguous.
+         */
+        struct McKenzieSlot {
+            size_t   nonterminal; // Id of the nonterminal here, or kNotNonterminal.
+            char32_t terminal;    // Terminal here, if there is one.
+            size_t   remaining;   // Number of symbols from here to the end of the production.
+        };
 
-            return result;
-        }
+        /* The Tail and Count tables (see below), laid out densely by length so that extending
+         * them to a longer length just appends to the end.
+         *
+         *    tail[n * numSlots + s]         = # strings of length n derivable from slot s onward
+         *    count[n * numNonterminals + A] = # strings of length n derivable from A
+         *
+         * The generator stores these counts as logs. Other clients that need exact counts
+         * store them as integers.
+         */
+        template <typename Count> struct CountTable {
+            size_t lengths = 0;   // Lengths 0, 1, ..., lengths - 1 have been filled in.
+            vector<Count> tail;
+            vector<Count> count;
+        };
+        using McKenzieTable = CountTable<double>;
 
-        /* Given a grammar, restructures the grammar so that each production that isn't a
-         * terminal unit (one char on RHS, which is a terminal) has no terminals in it. This
-         * is done by introducing new nonterminals as needed with productions that produce
-         * units.
+        /* Number of samples generateBatch produces from each seed. */
+        const size_t kBatchBlockSize = 256;
+    }
+
+    /* Shared, read-only state behind a generator: the cleaned grammar plus the tables
+     * of counts. Copies of a generator (and all the workers of a batch) share one of
+     * these, which is why it's safe to use concurrently.
+     */
+    struct Generator::Impl {
+        explicit Impl(const CFG& cfg);
+
+        /* Cleaned grammar, with nonterminals numbered 0, 1, 2, ... The productions of
+         * nonterminal A are numbered productionsBegin[A] ... productionsBegin[A + 1] - 1,
+         * and production P's slots begin at slotBase[P].
          */
-        CFG indirectTerminals(const CFG& cfg) {
-            CFG result = cfg;
+        vector<size_t>       productionsBegin;
+        vector<size_t>       slotBase;
+        vector<McKenzieSlot> slots;
 
-            /* Next nonterminal name to try. */
-            char32_t next = 'A';
+        /* Nonterminals in an order where A appears after B whenever A -> B is a production. */
+        vector<size_t> countOrder;
 
-            /* Map from terminals to their unit nonterminal. */
-            map<char32_t, char32_t> replacements;
+        /* Start symbol, or kNotNonterminal if the grammar produces no nonempty strings. */
+        size_t start;
 
-            /* Rebuild the productoins. */
-            result.productions.clear();
-            for (auto prod: cfg.productions) { // By copy, not by reference
-                if (!isTerminalUnit(prod)) {
-                    /* For convenience. */
-                    auto& p = prod.replacement;
+        /* Grammar can generate empty string. Is that the case? */
+        bool hasEpsilon;
 
-                    /* Replace each terminal with a nonterminal. */
-                    for (Symbol& s: p) {
-                        if (s.type == Symbol::Type::TERMINAL) {
-                            if (!replacements.count(s.ch)) {
-                                /* Scoot to next available nonterminal. */
-                                while (result.nonterminals.count(next)) next++;
+        size_t numNonterminals() const {
+            return productionsBegin.size() - 1;
+        }
 
-                                /* Introduce A -> a as a production. */
-                                result.productions.push_back({ next, { s } });
-                                result.nonterminals.insert(next);
+        /* Returns tables covering at least lengths 0, 1, ..., maxLength, filling them in
+         * on demand. Tables are never modified once published; growing them builds a
+         * new, longer copy, so readers holding an older one are unaffected.
+         */
+        shared_ptr<const McKenzieTable> tablesFor(size_t maxLength) const;
 
-                                replacements[s.ch] = next;
-                            }
-                            s = { Symbol::Type::NONTERMINAL, replacements[s.ch] };
-                        }
-                    }
-                }
+        /* Samples a string of length n, returning whether one exists. */
+        bool generate(size_t n, mt19937& rng, string& result) const;
 
-                result.productions.push_back(prod);
-            }
+        /* Rough size of the grammar and the tables so far. */
+        size_t bytesUsed() const;
 
-            return result;
-        }
+        /* Key this is cached under, if it is, so that growing the tables can report the
+         * new size to the cache.
+         */
+        unique_ptr<const Cache::Key> cacheKey;
+
+    private:
+        mutable shared_ptr<const McKenzieTable> tables = make_shared<McKenzieTable>();
+        mutable mutex tablesLock;
+    };
+
+    namespace {
 
-        /* Rewrites productions so that all RHS's are at most two characters long. */
+        /* Rewrites productions so that all RHS's are at most two characters long. This
+         * needs to happen before converting to epsilon normal form; see below.
+         */
         CFG binarize(const CFG& cfg) {
             CFG result = cfg;
 
@@ -1566,507 +2288,2921 @@ namespace CFG {
             return result;
         }
 
-        /* Returns a reverse topological ordering of the given graph. */
-        vector<char32_t> reverseTopologicalOrderingOf(const Graph& g) {
-            /* DFS-based topological sort! */
-            vector<char32_t> order;
-            set<char32_t> visited;
-            for (const auto& entry: g) {
-                dfs(entry.first, g, order, visited);
-            }
-            return order;
+        /* Given a production, produces all nonempty productions that can be formed by
+         * taking subsets of the nullable nonterminals. There are 2^k of these for a
+         * production with k nullable nonterminals, so this is only safe to call on
+         * short productions.
+         */
+        void generateSubsetsOf(const Production& p,
+                               const GrammarAnalysis& analysis,
+                               set<Production>& result) {
+            std::function<void(Production&, size_t)> rec =
+            [&](Production& soFar, size_t index) {
+                /* If at end, add unless we're empty. */
+                if (index == p.replacement.size()) {
+                    if (!soFar.replacement.empty()) result.insert(soFar);
+                    return;
+                }
+                /* Include next character. */
+                soFar.replacement.push_back(p.replacement[index]);
+                rec(soFar, index+1);
+                soFar.replacement.pop_back();
+
+                /* If next is nullable, skip it. */
+                if (p.replacement[index].type == Symbol::Type::NONTERMINAL &&
+                    analysis.isNullable(p.replacement[index].ch)) {
+                    rec(soFar, index + 1);
+                }
+            };
+
+            Production builder;
+            builder.nonterminal = p.nonterminal;
+            rec(builder, 0);
         }
 
-        /* Converts the given grammar to "strong unit normal form," which is the above version of unit
-         * normal form (units may exist, but form a DAG) except that units are removed entirely. This
-         * means that if we have A -> B and B -> alpha, then we'll add A -> alpha as well (and eventually
-         * remove A -> B.
+        /* Given a CFG, returns the epsilon normal form of that CFG. This is formed by
+         * replacing all epsilon productions with new productions by "dropping out"
+         * nonterminals that are nullable in all (nonempty) combinations.
          *
-         * The basic procedure here is pretty similar to computing unit normal form. In fact, that's the
-         * first step! From there, we do a reverse topological sort, pulling each production up from
-         * the direct children as we go.
+         * Done directly, that's exponential in the length of the longest production:
+         * S -> AAAAAAAAAAAAAAAAAAAA with A nullable turns into about a million
+         * productions. Binarizing first (Lange and Leiss's "BIN before DEL") brings it
+         * down to at most three productions for each one that went in, at the cost of a
+         * linear number of new nonterminals, so everything that calls this binarizes
+         * the grammar beforehand.
+         *
+         * TODO: This is misleading because it doesn't add epsilon back in at the end
+         * if the start symbol is nullable. Be careful!
          */
-        CFG strongUnitNormalForm(const CFG& cfg) {
-            auto unit = unitNormalForm(cfg);
+        CFG epsilonNormalFormOf(const CFG& cfg) {
+            GrammarAnalysis analysis(cfg);
+            set<Production> newProds;
 
-            /* Restructure the grammar in a way that supports fast lookup of productions
-             * per nonterminal.
-             */
-            map<char32_t, set<Production>> productions;
-            for (const auto& prod: unit.productions) {
-                productions[prod.nonterminal].insert(prod);
+            for (const auto& prod: cfg.productions) {
+                generateSubsetsOf(prod, analysis, newProds);
             }
 
-            /* Run a reverse topological sort over the unit graph to copy things from
-             * children, removing units in the process.
-             */
-            for (char32_t nonterminal: reverseTopologicalOrderingOf(unitGraphOf(unit))) {
-                set<Production> next;
+            auto result = cfg;
+            result.productions.assign(newProds.begin(), newProds.end());
+            return result;
+        }
 
-                /* Copy non-units, replace units.
-                 *
-                 * We use square brackets here rather than .at because it's entirely
-                 * possible that the grammar we're working with has no production
-                 * for this nonterminal.
-                 */
-                for (const auto& prod: productions[nonterminal]) {
-                    /* Nonterminal units get replaced by all of the derived productions. */
-                    if (isNonterminalUnit(prod)) {
-                        /* If this is a self-loop, just skip it. */
-                        if (prod.replacement[0].ch != prod.nonterminal) {
-                            /* Copy, not reference. */
-                            for (auto derived: productions.at(prod.replacement[0].ch)) {
-                                derived.nonterminal = nonterminal;
-                                next.insert(derived);
-                            }
-                        }
-                    }
-                    /* Everything else is copied as usual. */
-                    else {
-                        next.insert(prod);
+        /* Returns whether something is a unit production. */
+        bool isNonterminalUnit(const Production& p) {
+            return p.replacement.size() == 1 && p.replacement[0].type == Symbol::Type::NONTERMINAL;
+        }
+        bool isTerminalUnit(const Production& p) {
+            return p.replacement.size() == 1 && p.replacement[0].type == Symbol::Type::TERMINAL;
+        }
+
+        /* Given a CFG in epsilon normal form, returns a new CFG such that if there any
+         * unit productions, they form a DAG.
+         *
+         * A unit production is one of the form A -> B. The basic idea is to replace all
+         * productions of the form A -> B by finding productions of the form B -> alpha
+         * and then directly writing A -> alpha, replacing the A -> B production.
+         *
+         * The challenge here is that we can have chains of nonterminals, such as
+         * A -> B -> C, where A needs to absorb items out of C.
+         *
+         * Making this more complicated, we also have to worry about chains of
+         * the form A -> B -> A, in which we get a cycle from a nonterminal back to
+         * itself. In that case, A needs to take on B's productions, and B needs to take
+         * on A's productions as well. (This includes a special case of A -> A, nonterminals
+         * that immediately produce themselves.)
+         *
+         * The most general version of this problem goes like this: we have a graph where
+         * each node is a nonterminal and there's an edge from A to B if A -> B is a unit
+         * production. We need to duplicate productions while also respecting cycles.
+         *
+         * Our approach is to use the strongly connected components of that graph, which the
+         * grammar analysis hands us, to find nonterminals that can produce one another. We'll
+         * then pick one representative of each of the nonterminals in an SCC (the smallest,
+         * so that the choice doesn't depend on how the SCCs were found) and combine all the
+         * productions together under that representative.
+         *
+         * The resulting graph may still have unit productions in it, but those units will
+         * form a DAG, which is all we need.
+         */
+        CFG unitNormalForm(const CFG& cfg) {
+            GrammarAnalysis analysis(cfg);
+
+            /* Map from each nonterminal to its representative. */
+            map<char32_t, char32_t> reps;
+
+            /* Loop over SCCs, combining productions together. */
+            for (const auto& scc: analysis.unitComponents()) {
+                char32_t rep = analysis.nonterminalAt(scc.front());
+                for (size_t id: scc) {
+                    rep = min(rep, analysis.nonterminalAt(id));
+                }
+                for (size_t id: scc) {
+                    reps[analysis.nonterminalAt(id)] = rep;
+                }
+            }
+
+            /* Rebuild the productions list. */
+            set<Production> productions;
+            for (const auto& p: cfg.productions) {
+                /* Replace all nonterminals with their representatives. */
+                auto newP = p;
+                newP.nonterminal = reps.at(newP.nonterminal);
+                for (auto& s: newP.replacement) {
+                    if (s.type == Symbol::Type::NONTERMINAL) {
+                        s.ch = reps.at(s.ch);
                     }
                 }
 
-                productions[nonterminal] = next;
+                /* If this is a unit, include it if it's not a loop. */
+                if (!isNonterminalUnit(newP) || newP.replacement[0].ch != newP.nonterminal) {
+                    productions.insert(newP);
+                }
             }
 
-            /* Rebuild the grammar. */
-            auto result = unit;
-            result.productions.clear();
-            for (const auto& entry: productions) {
-                for (const auto& prod: entry.second) {
-                    result.productions.push_back(prod);
-                }
+            /* Form the new grammar. */
+            auto result = cfg;
+
+            /* Nonterminals are the reps. */
+            result.nonterminals.clear();
+            for (const auto& entry: reps) {
+                result.nonterminals.insert(entry.second);
             }
 
+            /* Change start symbol to rep. */
+            result.startSymbol = reps.at(result.startSymbol);
+
+            /* Use new productions. */
+            result.productions.assign(productions.begin(), productions.end());
+
             return result;
         }
-    }
 
-    /* Generic routine to turn something into one of the CNF flavors. */
-    CFG toCNF(const CFG& cfg, CFG unitFormer(const CFG &)) {
-        auto nulls = nullablesOf(cfg);
-        auto transformed = unitFormer(clean(epsilonNormalFormOf(binarize(indirectTerminals(addUniqueStartTo(cfg))))));
+        /* Given a CFG, returns its "useful subset." This consists of the subset of
+         * the grammar that is (1) reachable from the start symbol and (2) includes
+         * only nonterminals that can produce something.
+         *
+         * This can be thought of as two fixed-point equations. The first one works
+         * by identifying nonterminals that can produce nonterminal-free strings
+         * and then propagating that information upward. Anything not reached this
+         * way can be removed.
+         *
+         * The second identifies nonterminals reachable from the start symbol, using
+         * only productions that don't mention anything unproductive. The start symbol
+         * is reachable from itself, as is everything transitively derived from there.
+         * The grammar analysis works out both of these; what's left is what it calls
+         * the useful nonterminals.
+         *
+         * At this point, everything that remains must be productive and reachable. Why?
+         * Everything is definitely reachable, and everything kept is productive using
+         * productions that only mention productive nonterminals, all of which are kept.
+         *
+         * This procedure may produce a CFG with no productions and no nonterminals other
+         * than the start symbol. If that happens, the language is empty.
+         */
+        CFG clean(const CFG& cfg, const GrammarAnalysis& analysis) {
+            const auto& useful = analysis.useful();
+
+            auto result = cfg;
+            result.nonterminals = { cfg.startSymbol };
+            useful.forEach([&](size_t id) {
+                result.nonterminals.insert(analysis.nonterminalAt(id));
+            });
+
+            /* A production survives if it's for a useful nonterminal and everything on its
+             * right-hand side is productive (and hence also useful).
+             */
+            result.productions.erase(remove_if(result.productions.begin(), result.productions.end(), [&](const Production& p) {
+                return !useful.contains(analysis.idOf(p.nonterminal)) ||
+                       any_of(p.replacement.begin(), p.replacement.end(), [&](const Symbol& s) {
+                           return s.type == Symbol::Type::NONTERMINAL && !analysis.productive().contains(analysis.idOf(s.ch));
+                       });
+            }), result.productions.end());
 
-        /* Add S -> epsilon if the original start symbol was nullable. */
-        if (nulls.count(cfg.startSymbol)) {
-            transformed.productions.push_back({ transformed.startSymbol, {} });
+            return result;
         }
 
-        CFG result;
-        result.alphabet = transformed.alphabet;
-        result.productions = transformed.productions;
-        result.startSymbol = transformed.startSymbol;
-        result.nonterminals = transformed.nonterminals;
-        return result;
-    }
+        /* Given a CFG, returns a "cleaned" version of the CFG in which each
+         * nonterminal both produces and can be produced. This eliminates all
+         * nonterminals and rules that have no chance of being used.
+         */
+        CFG clean(const CFG& cfg) {
+            return clean(cfg, GrammarAnalysis(cfg));
+        }
 
-    /* TODO: This doesn't handle the case where there are useless rules.
-     * Make sure to clean the grammar first.
-     */
-    CFG toCNF(const CFG& cfg) {
-        return toCNF(cfg, strongUnitNormalForm);
-    }
-
-    /* TODO: This doesn't handle the case where there are useless rules.
-     * Make sure to clean the grammar first.
-     *
-     * TODO: Refactor this and the above function.
-     */
-    CFG toWeakCNF(const CFG& cfg) {
-        return toCNF(cfg, unitNormalForm);
-    }
-
-    /**************************************************************************
-     **************************************************************************
-     ***                  CYK Algorithm Implementation                      ***
-     **************************************************************************
-     **************************************************************************
-
-     The CYK algorithm is a fast (O(n^3)) time recognition algorithm that works
-     on grammars encoded in CNF. This restriction means that it's not very good
-     at producing derivations of arbitrary grammars, but that it is fast when
-     we're allowed to do some preprocessing work on the grammars up front.
+        /* Given a CFG, prepares that CFG for use in the McKenzie generator.
+         * This binarizes the grammar, puts it into epsilon normal form - which
+         * removes epsilon from the list of productions - removes useless rules, then
+         * eliminates cycles by putting the grammar into unit normal form. Binarizing
+         * doesn't change how many derivations each string has, so it doesn't affect
+         * which strings get generated how often.
+         *
+         * We have to begin by putting things into epsilon normal form before we
+         * start cleaning things. Otherwise, we risk that the grammar ends up
+         * with useless productions. Here's an example. Consider this grammar:
+         *
+         *    S -> A
+         *    A -> B
+         *    B -> epsilon
+         *
+         * If we go to epsilon normal form, we'll remove the production B -> epsilon,
+         * leaving both (1) a transition from A to B that can't expand and (2) an
+         * official nonterminal B with no productions, which can break things later
+         * on. We therefore have to do that first, before we start wiping things out.
+         */
+        CFG mcKenziePrepare(const CFG& input) {
+            return unitNormalForm(clean(epsilonNormalFormOf(binarize(input))));
+        }
 
-     *************************************************************************/
+        /* Computes the table from the McKenzie paper.
+         *
+         * The basic idea behind this table is the following. We want to produce information
+         * about each nonterminal in a grammar that tells us how many strings of a given length
+         * it can produce (including multiplicity with ambiguity; remember, the problem of
+         * determining whether a grammar is ambiguous is undecidable). We assume there are no
+         * loops in the grammar and that there are no epsilon productions.
+         *
+         * So with that in mind, how many strings of length n can a given nonterminal S produce?
+         * Well, that would be
+         *
+         *      ---
+         *      \
+         *      /    # strings of length n P can produce.
+         *      ---
+         *   production
+         *  P = S -> alpha
+         *
+         * So that would tell us to start looking at the number of strings of length n that
+         * one specific production P could produce.
+         *
+         * Suppose that we have the production S -> X alpha. There are two cases to consider:
+         *
+         *   Case 1: X is a terminal. In that case, the number of strings of length n that
+         *           this production can produce is equal to the number of strings of length
+         *           n-1 that alpha produces.
+         *   Case 2: X is a nonterminal. In that case, the number of strings of length n that
+         *           this production can produce is equal to the number of strings of length
+         *           1 that X produces times the number of strings of length n-1 that alpha
+         *           produces, plus the number of strings of length 2 that X produces plus the
+         *           number of strings of length n-2 that alpha produces, etc.
+         *
+         * This gives us a nice recursive formulation for the problem. All of our subproblems
+         * have the following form:
+         *
+         *    Given a nonterminal S, a production S -> alpha, a decomposition of alpha
+         *    into alpha = gamma beta, and a length n, how many strings of length exactly
+         *    n can beta produce?
+         *
+         * It turns out that we need a slightly more general version of this problem.
+         * Specifically, we'll use this version:
+         *
+         *    Given a nonterminal S, a production S -> alpha, a decomposition of alpha into
+         *    alpha = gamma X beta, and a length n, produce a list of entries such that the
+         *    kth entry is the number of strings that X beta produces given that X produced
+         *    a string of length exactly k.
+         *
+         * The terminology in the McKenzie paper is a bit dense, so we'll use something a
+         * bit simpler. Every subproblem here can be parameterized in terms of the following:
+         *
+         *    1. S: Which nonterminal are you using?
+         *    2. n: What is the length you want to produce?
+         *    3. P: Which production of that nonterminal are you interested in?
+         *    4. i: What index in that production does the symbol X occur at?
+         *
+         * Since S is determined by P, and the table only ever needs the totals of these lists
+         * (the individual splits are cheap to recompute while generating), we store a table
+         * Tail[n][P][i] giving the number of strings of length n derivable from the symbols of
+         * P from index i onward. Then
+         *
+         *                 ---
+         *                 \
+         *   Count[S][n] = /    Tail[n][P][0]
+         *                 ---
+         *              production
+         *            P = S -> alpha
+         *
+         * and Tail itself satisfies
+         *
+         *   Tail[n][P][|P|] = 1 if n = 0 and 0 otherwise,
+         *   Tail[n][P][i]   = Tail[n - 1][P][i + 1]                    if P[i] is a terminal,
+         *   Tail[n][P][i]   = Count[P[i]][n]                           if P[i] is the last symbol,
+         *   Tail[n][P][i]   = sum over k of Count[P[i]][k] Tail[n - k][P][i + 1]   otherwise.
+         *
+         * Because there are no epsilon productions, each nonterminal produces at least one
+         * character, so the last sum runs from k = 1 up to the point where there's one character
+         * left for each remaining symbol. That means every entry for length n depends only on
+         * entries for shorter lengths, except for the two places where Count[A][n] and
+         * Tail[n][P][i] refer to one another directly. Those form a chain through the unit
+         * productions A -> B, which the cleanup phase has made acyclic, so we can fill in each
+         * length in one pass by visiting the nonterminals in topological order.
+         */
 
-    namespace {
-        /* Key in the CYK table: it's of the form [nonterminal, start, end) */
-        using CYKKey = tuple<char32_t, size_t, size_t>;
+        /* Returns log(sum of exp(term(i)) for begin <= i < end), scaling by the largest term
+         * so that nothing overflows or needlessly underflows.
+         */
+        template <typename Term> double logSumOf(size_t begin, size_t end, Term term) {
+            double largest = kLogZero;
+            for (size_t i = begin; i < end; i++) {
+                largest = max(largest, term(i));
+            }
+            if (largest == kLogZero) return kLogZero;
 
-        /* CYK parsing state. */
-        struct CYKState {
-            /* Direct terminal productions: S -> a */
-            map<char32_t, set<char32_t>> terminals;
+            double sum = 0;
+            for (size_t i = begin; i < end; i++) {
+                sum += exp(term(i) - largest);
+            }
+            return largest + log(sum);
+        }
 
-            /* Unit productions: S -> A */
-            map<char32_t, set<char32_t>> units;
+        /* Chooses an index i in [begin, end) with probability proportional to exp(weight(i)),
+         * given that the log of the total weight is logTotal.
+         */
+        template <typename Weight> size_t sampleFrom(mt19937& rng, size_t begin, size_t end,
+                                                     double logTotal, Weight weight) {
+            double target = uniform_real_distribution<double>(0, 1)(rng);
+
+            size_t lastViable = end;
+            for (size_t i = begin; i < end; i++) {
+                double w = weight(i);
+                if (w == kLogZero) continue;
+
+                lastViable = i;
+                target -= exp(w - logTotal);
+                if (target < 0) return i;
+            }
 
-            /* Binary productions: S -> AB */
-            map<char32_t, set<pair<char32_t, char32_t>>> binaries;
+            /* Roundoff can leave a sliver of probability unaccounted for; give it to the
+             * last option that could actually be chosen.
+             */
+            if (lastViable == end) abort(); // Logic error!
+            return lastViable;
+        }
 
-            /* Memoization table. */
-            map<CYKKey, bool> memo;
+        /* Arithmetic on counts stored as logs. */
+        struct LogArithmetic {
+            using Count = double;
+            static Count zero() { return kLogZero; }
+            static Count one()  { return 0; }
+            static Count times(Count lhs, Count rhs) { return lhs + rhs; }
+            template <typename Term> static Count sum(size_t begin, size_t end, Term term) {
+                return logSumOf(begin, end, term);
+            }
         };
 
-        /* CYK parser, implemented top-down via memoization. The idea is the following:
-         *
-         * 1. If the input length is one, we match iff (1) the current nonterminal
-         *    directly produces the terminal or (2) the nonterminal produces a unit that
-         *    produces the terminal.
-         * 2. Otherwise, we match iff (1) the current nonterminal has a binary production
-         *    that can match the range at some partition point or (2) the current nonterminal
-         *    has a unit produces the range.
-         *
-         * We assume the grammar is in weak CNF on entry to this function.
-         */
-        bool cyk(CYKState& state,
-                 const vector<char32_t>& input,
-                 char32_t nonterminal,
-                 size_t start, size_t end, size_t indent = 2) {
-            if (kParserVerbose) cout << string(indent, ' ') << toUTF8(nonterminal) << " [" << start << ", " << end << ")" << endl;
-
-            /* Base case: Memoized? Then return what we know. */
-            CYKKey key = make_tuple(nonterminal, start, end);
-            if (state.memo.count(key)) {
-                if (kParserVerbose) cout << string(indent, ' ') << "  Known; answer is " << state.memo[key] << endl;
-                return state.memo[key];
+        /* Arithmetic on exact counts, which saturate at kManyStrings rather than overflowing. */
+        const uint64_t kManyStrings = numeric_limits<uint64_t>::max();
+        struct ExactArithmetic {
+            using Count = uint64_t;
+            static Count zero() { return 0; }
+            static Count one()  { return 1; }
+            static Count times(Count lhs, Count rhs) {
+                if (lhs == 0 || rhs == 0) return 0;
+                return lhs > kManyStrings / rhs? kManyStrings : lhs * rhs;
+            }
+            template <typename Term> static Count sum(size_t begin, size_t end, Term term) {
+                Count result = 0;
+                for (size_t i = begin; i < end; i++) {
+                    Count next = term(i);
+                    result = next > kManyStrings - result? kManyStrings : result + next;
+                }
+                return result;
             }
+        };
 
-            /* For convenience. */
-            bool& result = state.memo[key];
+        /* Extends the tables so that they cover all lengths up through maxLength. */
+        template <typename Arithmetic>
+        void fillTable(const Generator::Impl& gen, CountTable<typename Arithmetic::Count>& table, size_t maxLength) {
+            const size_t numSlots = gen.slots.size();
+            const size_t numNonterminals = gen.numNonterminals();
 
-            /* Base case: Range has size one. */
-            if (start + 1 == end) {
-                if (kParserVerbose) cout << string(indent, ' ') << "  Single character, terminal " << toUTF8(input[start]) << endl;
+            auto tail  = [&](size_t n, size_t slot) -> auto& {
+                return table.tail[n * numSlots + slot];
+            };
+            auto count = [&](size_t n, size_t nonterminal) -> auto& {
+                return table.count[n * numNonterminals + nonterminal];
+            };
 
-                /* Can we immediately make this terminal? */
-                if (state.terminals[nonterminal].count(input[start])) {
-                    if (kParserVerbose) cout << string(indent, ' ') << "  We make this!" << endl;
-                    return result = true;
+            for (size_t n = table.lengths; n <= maxLength; n++) {
+                table.tail.resize((n + 1) * numSlots, Arithmetic::zero());
+                table.count.resize((n + 1) * numNonterminals, Arithmetic::zero());
+
+                /* Everything that only depends on shorter lengths. */
+                for (size_t s = 0; s < numSlots; s++) {
+                    const auto& slot = gen.slots[s];
+                    if (slot.remaining == 0) {
+                        tail(n, s) = (n == 0? Arithmetic::one() : Arithmetic::zero());
+                    } else if (slot.nonterminal == kNotNonterminal) {
+                        if (n > 0) tail(n, s) = tail(n - 1, s + 1);
+                    } else if (slot.remaining > 1 && n >= slot.remaining) {
+                        tail(n, s) = Arithmetic::sum(1, n - slot.remaining + 2, [&](size_t k) {
+                            return Arithmetic::times(count(k, slot.nonterminal), tail(n - k, s + 1));
+                        });
+                    }
                 }
 
-                if (kParserVerbose) cout << string(indent, ' ') << "  We don't make this; trying units." << endl;
-
-                /* Can we use a unit to get there? */
-                for (char32_t next: state.units[nonterminal]) {
-                    if (kParserVerbose) cout << string(indent, ' ') << "  Unit: " << toUTF8(next) << endl;
-                    if (cyk(state, input, next, start, end, indent + 4)) {
-                        if (kParserVerbose) cout << string(indent, ' ') << "  Unit worked, so we do too!" << endl;
-                        return result = true;
+                /* Counts, plus the Tail entries at the starts of unit productions. */
+                for (size_t nonterminal: gen.countOrder) {
+                    size_t begin = gen.productionsBegin[nonterminal];
+                    size_t end   = gen.productionsBegin[nonterminal + 1];
+                    for (size_t p = begin; p < end; p++) {
+                        const auto& slot = gen.slots[gen.slotBase[p]];
+                        if (slot.remaining == 1 && slot.nonterminal != kNotNonterminal) {
+                            tail(n, gen.slotBase[p]) = count(n, slot.nonterminal);
+                        }
                     }
+                    count(n, nonterminal) = Arithmetic::sum(begin, end, [&](size_t p) {
+                        return tail(n, gen.slotBase[p]);
+                    });
                 }
 
-                if (kParserVerbose) cout << string(indent, ' ') << "  We can't make this terminal." << endl;
+                /* Remaining nonterminals at the ends of productions. */
+                for (size_t s = 0; s < numSlots; s++) {
+                    const auto& slot = gen.slots[s];
+                    if (slot.remaining == 1 && slot.nonterminal != kNotNonterminal) {
+                        tail(n, s) = count(n, slot.nonterminal);
+                    }
+                }
 
-                /* Oops, nothing works. */
-                return result = false;
+                table.lengths = n + 1;
             }
+        }
 
-            if (kParserVerbose) cout << string(indent, ' ') << "  Range size > 1, trying binaries." << endl;
-
-            /* Otherwise, the range has size at least two. Try all binary productions
-             * and all splits.
-             */
-            for (auto next: state.binaries[nonterminal]) {
-                if (kParserVerbose) cout << string(indent, ' ') << "  " << toUTF8(next.first) << toUTF8(next.second) << endl;
-                for (size_t mid = start + 1; mid < end; mid++) {
-                    if (kParserVerbose) cout << string(indent, ' ') << "  [" << start << ", " << mid << ") and [" << mid << ", " << end << ")" << endl;
-                    /* Does this split work? */
-                    if (cyk(state, input, next.first,  start, mid, indent + 4) &&
-                        cyk(state, input, next.second, mid,   end, indent + 4)) {
-                        if (kParserVerbose) cout << string(indent, ' ') << "  Success!" << endl;
-                        return result = true;
+        /* Procedure to generate a random string of the given length with uniform (modulo ambiguity)
+         * probability. The basic idea is the following:
+         *
+         * 1. Select a production. The weight assigned to each production should be the number of
+         *    strings it can derive of the given length.
+         * 2. Go through the production one symbol at a time. When you see a nonterminal, choose
+         *    how many characters it produces (weighted by how many ways there are to finish the
+         *    string from there), then generate it randomly. When you see a terminal, generate it.
+         *
+         * This assumes the table has already been filled in out to length n and that the
+         * nonterminal can produce at least one string of length n.
+         */
+        void generateNonterminal(const Generator::Impl& gen, const McKenzieTable& table, mt19937& rng,
+                                 size_t nonterminal, size_t n, string& result) {
+            const size_t numSlots = gen.slots.size();
+            const size_t numNonterminals = gen.numNonterminals();
+
+            while (true) {
+                /* Select a production. */
+                size_t p = sampleFrom(rng, gen.productionsBegin[nonterminal], gen.productionsBegin[nonterminal + 1],
+                                      table.count[n * numNonterminals + nonterminal],
+                                      [&](size_t p) {
+                    return table.tail[n * numSlots + gen.slotBase[p]];
+                });
+
+                /* Walk across it. */
+                size_t s = gen.slotBase[p];
+                for (; gen.slots[s].remaining > 1 || gen.slots[s].nonterminal == kNotNonterminal; s++) {
+                    const auto& slot = gen.slots[s];
+                    if (slot.remaining == 0) return;
+
+                    if (slot.nonterminal == kNotNonterminal) {
+                        result += toUTF8(slot.terminal);
+                        n--;
+                    } else {
+                        /* Select how many characters to produce here. */
+                        size_t k = sampleFrom(rng, 1, n - slot.remaining + 2, table.tail[n * numSlots + s],
+                                              [&](size_t k) {
+                            return table.count[k * numNonterminals + slot.nonterminal] +
+                                   table.tail[(n - k) * numSlots + s + 1];
+                        });
+
+                        generateNonterminal(gen, table, rng, slot.nonterminal, k, result);
+                        n -= k;
                     }
                 }
-            }
 
-            /* If binaries fail, try units. */
-            if (kParserVerbose) cout << string(indent, ' ') << "  No binaries succeeded; trying units." << endl;
-            for (auto next: state.units[nonterminal]) {
-                if (kParserVerbose) cout << string(indent, ' ') << "  Trying unit " << toUTF8(next) << endl;
-                if (cyk(state, input, next, start, end, indent + 4)) {
-                    if (kParserVerbose) cout << string(indent, ' ') << "  Success!" << endl;
-                    return result = true;
-                }
+                /* We're at a nonterminal at the end of the production, which must produce
+                 * everything that's left. Loop around rather than recursing, so that
+                 * right-recursive grammars don't build up a deep call stack.
+                 */
+                nonterminal = gen.slots[s].nonterminal;
             }
-
-
-            return result = false;
         }
+    }
 
-        Matcher cykMatcherFor(const CFG& cfg) {
-            /* Convert to weak CNF to ensure all RHS's have the
-             * right sizes.
-             */
-            auto weakCNF = toWeakCNF(cfg);
-
-            cout << weakCNF << endl;
+    Generator::Impl::Impl(const CFG& cfg) {
+        GrammarAnalysis analysis(cfg);
+        CFG g = mcKenziePrepare(cfg);
 
-            /* Epsilon is a special case. */
-            bool hasEpsilon = nullablesOf(cfg).count(cfg.startSymbol);
+        /* Number the nonterminals. */
+        map<char32_t, size_t> ids;
+        for (char32_t nonterminal: g.nonterminals) {
+            ids.insert(make_pair(nonterminal, ids.size()));
+        }
 
-            /* Convert the grammar into a more usable form. */
-            CYKState state;
-            for (const auto& prod: weakCNF.productions) {
-                const auto& p = prod.replacement;
+        /* Group productions by nonterminal, then lay out their slots. */
+        vector<vector<const Production*>> productionsOf(ids.size());
+        for (const auto& p: g.productions) {
+            productionsOf[ids.at(p.nonterminal)].push_back(&p);
+        }
 
-                /* Classify production. */
-                if (p.size() == 2) {
-                    state.binaries[prod.nonterminal].insert(make_pair(p[0].ch, p[1].ch));
-                } else if (p.size() == 1 && p[0].type == Symbol::Type::TERMINAL) {
-                    state.terminals[prod.nonterminal].insert(p[0].ch);
-                } else if (p.size() == 1 && p[0].type == Symbol::Type::NONTERMINAL) {
-                    state.units[prod.nonterminal].insert(p[0].ch);
-                } else {
-                    throw runtime_error("Illegal production.");
+        for (const auto& prods: productionsOf) {
+            productionsBegin.push_back(slotBase.size());
+            for (auto* p: prods) {
+                slotBase.push_back(slots.size());
+                for (size_t i = 0; i < p->replacement.size(); i++) {
+                    const auto& symbol = p->replacement[i];
+                    if (symbol.type == Symbol::Type::TERMINAL) {
+                        slots.push_back({ kNotNonterminal, symbol.ch, p->replacement.size() - i });
+                    } else {
+                        slots.push_back({ ids.at(symbol.ch), 0, p->replacement.size() - i });
+                    }
                 }
+                slots.push_back({ kNotNonterminal, 0, 0 });
             }
+        }
+        productionsBegin.push_back(slotBase.size());
 
-            /* Start symbol. */
-            char32_t start = weakCNF.startSymbol;
-
-            return [=](const string& str) mutable {
-                auto input = utf8Decode(str, weakCNF.alphabet);
-                if (input.empty()) return hasEpsilon;
-
-                /* Wipe any previous memoization result. */
-                state.memo.clear();
-                return cyk(state, input, start, 0, input.size());
-            };
+        /* The unit components are singletons (the grammar has no unit cycles) with sinks
+         * first.
+         */
+        GrammarAnalysis prepared(g);
+        for (const auto& scc: prepared.unitComponents()) {
+            for (size_t id: scc) {
+                countOrder.push_back(ids.at(prepared.nonterminalAt(id)));
+            }
         }
 
-        /**************************************************************************
-         **************************************************************************
-         ***                LR(0)-Based Earley Implementtion                    ***
-         **************************************************************************
-         **************************************************************************
+        /* Remember the start symbol. */
+        start = g.productions.empty()? kNotNonterminal : ids.at(g.startSymbol);
 
-         An implementation of Earley's algorithm that's sped up by precomputing
-         which sorts of item sets will travel together as a unit. This works by
-         making what the paper "Practical Earley Parsing" by Aycock and Horspool
-         refer to as the "split LR(0) e-DFA."
+        /* We can produce epsilon if the start symbol is nullable. */
+        hasEpsilon = analysis.isNullable(cfg.startSymbol);
+    }
 
-         This implementation has been aggressively optimized to try to squeeze out
-         as much performance as possible, as we use it as our default matcher. This
-         means that the code may not be nearly as readable as you might like/hope.
-         Sorry about that!
+    shared_ptr<const McKenzieTable> Generator::Impl::tablesFor(size_t maxLength) const {
+        auto result = atomic_load(&tables);
+        if (result->lengths > maxLength) return result;
 
-         The basic idea is the following:
+        /* Someone else may have grown the tables while we waited for the lock. */
+        lock_guard<mutex> lock(tablesLock);
+        result = atomic_load(&tables);
+        if (result->lengths > maxLength) return result;
 
-           1. Build an automaton that essentially does all the work the predictor
-              usually does up-front so that instead of pushing around individual
-              productions, we're working with collapsed sets of LR(0) states.
-           2. Optimize the automaton so that its GOTO table is done purely using
-              some quick vector index lookups rather than using sets or maps or
-              anything like that.
+        auto grown = make_shared<McKenzieTable>(*result);
+        fillTable<LogArithmetic>(*this, *grown, maxLength);
+        atomic_store(&tables, shared_ptr<const McKenzieTable>(grown));
 
-         *************************************************************************/
+        if (cacheKey) Cache::resize(*cacheKey, this, bytesUsed());
+        return grown;
+    }
 
-        /* LR(0) item is a production and a dot position. */
-        struct LR0Item {
-            const Production* production;
-            size_t dotPos;
-        };
+    size_t Generator::Impl::bytesUsed() const {
+        auto table = atomic_load(&tables);
+        return sizeof(Generator::Impl) + bytesOf(productionsBegin) + bytesOf(slotBase) + bytesOf(slots) +
+               bytesOf(countOrder) + sizeof(McKenzieTable) + bytesOf(table->tail) + bytesOf(table->count);
+    }
 
-        bool operator< (const LR0Item& lhs, const LR0Item& rhs) {
-            if (lhs.production != rhs.production) return lhs.production < rhs.production;
-            return lhs.dotPos < rhs.dotPos;
-        }
+    bool Generator::Impl::generate(size_t n, mt19937& rng, string& result) const {
+        /* Edge case: If the length is zero, return epsilon iff the grammar
+         * can produce epsilon.
+         */
+        if (n == 0) return hasEpsilon;
 
-        ostream& operator<< (ostream& out, const LR0Item& item) {
-            ostringstream builder;
-            builder << Symbol{ Symbol::Type::NONTERMINAL, item.production->nonterminal } << " -> ";
-            for (size_t i = 0; i < item.dotPos; i++) {
-                builder << item.production->replacement[i];
-            }
-            builder << ".";
-            for (size_t i = item.dotPos; i < item.production->replacement.size(); i++) {
-                builder << item.production->replacement[i];
-            }
-            return out << builder.str();
-        }
+        /* Edge case: If the grammar is empty, return nothing. */
+        if (start == kNotNonterminal) return false;
 
-        /* For debugging. */
-        ostream& operator<< (ostream& out, const set<LR0Item>& set) {
-            for (auto item: set) {
-                out << item << endl;
-            }
-            return out;
-        }
+        /* If we can't make anything of this length, report an error. */
+        auto table = tablesFor(n);
+        if (table->count[n * numNonterminals() + start] == kLogZero) return false;
 
-        /* LR(0) e-DFA item. */
-        struct LR0EState {
-            /* Numeric index of this state. */
-            size_t index;
+        /* Otherwise, use the generator. */
+        generateNonterminal(*this, *table, rng, start, n, result);
+        return true;
+    }
 
-            /* Set of items here. This isn't strictly needed, but it's
-             * helpful for debugging.
-             */
-            set<LR0Item> items;
+    Generator::Generator(shared_ptr<const Impl> impl, uint_fast32_t seed) : impl(impl), rng(seed) {
 
-            /* Transitions to other LR(0) e-states. */
-            unordered_map<Symbol, LR0EState*> transitions;
+    }
 
-            /* Epsilon transition, if any. */
-            LR0EState* epsilon;
-        };
+    pair<bool, string> Generator::operator()(size_t length) {
+        if (!impl) throw runtime_error("Generator has no grammar.");
 
-        /* LR(0) e-DFA. This is the actual automaton representation, and it's designed to
-         * be as fast as we can make it, potentially at the expense of readability.
-         */
-        struct LR0EDFA {
-            /* Set of all states. */
-            set<shared_ptr<LR0EState>> states;
+        string result;
+        bool success = impl->generate(length, rng, result);
+        return make_pair(success, result);
+    }
 
-            /* Start state. */
-            LR0EState* start;
+    void Generator::seed(uint_fast32_t seed) {
+        rng.seed(seed);
+    }
 
-            /* A huge amount of our time is spent doing lookups of the form
-             * "given state X and symbol Y, what's the successor state?" To speed
-             * this up, we build a flat vector representing a 2D "goto" table for
-             * our automaton. We will number the symbols we might encounter 0, 1
-             * 2, 3, ..., n-1, then build an array of the form [goto for state 0],
-             * [goto for state 1], etc. by linearizing everything.
-             *
-             * To make this work, we first need a way of relabeling symbols with
-             * numbers, which is this first table.
-             */
-            unordered_map<Symbol, size_t> toIndex;
+    vector<string> Generator::generateBatch(size_t length, size_t count, size_t threads) {
+        if (!impl) throw runtime_error("Generator has no grammar.");
 
-            /* Multiplier to use to go from a state number to a table index. */
-            /* TODO: Would it be better to use a shift here? */
-            size_t multiplier;
+        /* Fill the tables in up front, so the workers don't all queue up on the lock. */
+        string probe;
+        if (!impl->generate(length, rng, probe)) return {};
 
-            /* Next, we need that linearized GOTO table. */
-            vector<const LR0EState*> goTo;
+        /* Samples are produced in fixed-size blocks, each with its own RNG seeded from
+         * a base seed and the block number. Which thread handles which block then
+         * doesn't matter, so the output depends only on this generator's state and
+         * not on the number of threads or how they happen to be scheduled.
+         */
+        const uint_fast32_t base = rng();
+        const size_t numBlocks = (count + kBatchBlockSize - 1) / kBatchBlockSize;
 
-            /* Map from state numbers to completed sets. */
-            vector<vector<size_t>> completed;
-        };
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        threads = min(threads, numBlocks);
 
-        /* Utility functions for working with LR(0) items. */
-        bool dotAtEnd(const LR0Item& item) {
-            return item.dotPos == item.production->replacement.size();
-        }
-        Symbol afterDot(const LR0Item& item) {
-            if (dotAtEnd(item)) abort(); // Logic error!
-            return item.production->replacement[item.dotPos];
-        }
-        LR0Item advanceDot(LR0Item item) {
-            if (dotAtEnd(item)) abort();
-            item.dotPos++;
-            return item;
-        }
+        vector<string> result(count);
+        atomic<size_t> nextBlock(0);
+        auto worker = [&] {
+            for (size_t block; (block = nextBlock++) < numBlocks; ) {
+                seed_seq seeds{ uint_fast32_t(base), uint_fast32_t(block & 0xFFFFFFFF), uint_fast32_t(uint64_t(block) >> 32) };
+                mt19937 blockRNG(seeds);
 
-        /* Advances the dot of each item in a set of LR(0) items. */
-        set<LR0Item> advanceDot(const set<LR0Item>& items, Symbol s) {
-            set<LR0Item> result;
-            for (const auto& item: items) {
-                if (!dotAtEnd(item) && afterDot(item) == s) {
-                    result.insert(advanceDot(item));
+                for (size_t i = block * kBatchBlockSize; i < count && i < (block + 1) * kBatchBlockSize; i++) {
+                    impl->generate(length, blockRNG, result[i]);
                 }
             }
-            return result;
-        }
-
-        /* Computes the LR(0) e-DFA closure of the given set of LR(0) items.
-         *
-         * There are two different types of closures. The first one yields
-         * the KERNEL STATE and is formed by only moving the dot forward
-         * over nullable nonterminals. The second closure yields NON-KERNEL
-         * STATES and is a combination of the previous rule and the regular
-         * LR(0) lookahead rules.
-         */
-        enum ClosureType {
-            KERNEL,
-            NON_KERNEL
         };
 
-        ostream& operator<< (ostream& out, ClosureType type) {
-            return out << (type == ClosureType::KERNEL? "Kernel" : "Non-Kernel");
+        vector<thread> workers;
+        for (size_t i = 1; i < threads; i++) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto& w: workers) {
+            w.join();
         }
 
-        set<LR0Item> closureOf(const set<LR0Item>& items,
-                               const CFG& cfg,
-                               const Nulls& nullable,
-                               ClosureType type) {
-            set<LR0Item> result;
+        return result;
+    }
 
-            /* Form a worklist of all items that have dots before nonterminals. */
-            queue<LR0Item> worklist;
+    Generator generatorFor(const CFG& cfg) {
+        return generatorFor(cfg, mt19937::default_seed);
+    }
 
-            /* The setup here differs based on the type of the closure.
-             *
-             * If this is a kernel closure, we preserve all the items already in the
-             * closure, then place all items with dots before nonterminals into the
-             * worklist.
-             *
-             * If this is a non-kernel closure, we do NOT preserve the items already
+    Generator generatorFor(const CFG& cfg, uint_fast32_t seed) {
+        /* The count tables are filled in later, as longer strings are asked for, and
+         * each time they grow the entry's size is updated to match.
+         */
+        auto key  = keyFor("McKenzie", cfg);
+        auto impl = Cache::lookup<Generator::Impl>(key, [&] {
+            auto result = make_shared<Generator::Impl>(cfg);
+            result->cacheKey.reset(new Cache::Key(key));
+            return make_pair(shared_ptr<const Generator::Impl>(result), result->bytesUsed());
+        });
+        return Generator(impl, seed);
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                 Chomsky Normal Form Conversion                     ***
+     **************************************************************************
+     **************************************************************************
+
+     The logic below is for the algorithm to convert a grammar to Chomsky
+     Normal Form. This allows for use of the (faster) CYK parser compared with
+     the (slower but more general) Earley parser. (It's also just a nice
+     subroutine to have lying around for whenever you need it!)
+
+     The conversion to CNF follows this procedure:
+
+       1. Add a new start symbol. (START)
+       2. Add nonterminals to rewrite all non-unit terminals as nonterminals. (TERM)
+       3. Break long productions apart into binary productions. (BIN)
+       4. Convert to epsilon normal form. (DEL)
+       5. Remove useless nonterminals and productions. (CLEAN)
+       6. Convert to strong unit normal form. (UNIT)
+
+     The order of steps 3 and 4 matters. Each of the other steps at most squares
+     the size of the grammar, but removing epsilon productions from a long
+     production is exponential in its length. Binarizing first keeps the whole
+     thing polynomial. This is the ordering recommended by Lange and Leiss in
+     "To CNF or not to CNF? An Efficient Yet Presentable Version of the CYK
+     Algorithm."
+
+     *************************************************************************/
+    namespace {
+        /* Given a grammar, constructs a new grammar with a new start symbol appearing
+         * nowhere else in the grammar. This new start symbol will not necessarily have
+         * a Nice or Pretty Name.
+         */
+        CFG addUniqueStartTo(const CFG& cfg) {
+            CFG result = cfg;
+
+            /* Find a character we haven't used. */
+            char32_t ch;
+            for (ch = 'A'; cfg.nonterminals.count(ch); ch++) {
+                // Intentionally empty
+            }
+
+            result.productions.push_back( { ch, { Symbol{Symbol::Type::NONTERMINAL, cfg.startSymbol }} });
+            result.startSymbol = ch;
+            result.nonterminals.insert(ch);
+
+            return result;
+        }
+
+        /* Given a grammar, restructures the grammar so that each production that isn't a
+         * terminal unit (one char on RHS, which is a terminal) has no terminals in it. This
+         * is done by introducing new nonterminals as needed with productions that produce
+         * units.
+         */
+        CFG indirectTerminals(const CFG& cfg) {
+            CFG result = cfg;
+
+            /* Next nonterminal name to try. */
+            char32_t next = 'A';
+
+            /* Map from terminals to their unit nonterminal. */
+            map<char32_t, char32_t> replacements;
+
+            /* Rebuild the productoins. */
+            result.productions.clear();
+            for (auto prod: cfg.productions) { // By copy, not by reference
+                if (!isTerminalUnit(prod)) {
+                    /* For convenience. */
+                    auto& p = prod.replacement;
+
+                    /* Replace each terminal with a nonterminal. */
+                    for (Symbol& s: p) {
+                        if (s.type == Symbol::Type::TERMINAL) {
+                            if (!replacements.count(s.ch)) {
+                                /* Scoot to next available nonterminal. */
+                                while (result.nonterminals.count(next)) next++;
+
+                                /* Introduce A -> a as a production. */
+                                result.productions.push_back({ next, { s } });
+                                result.nonterminals.insert(next);
+
+                                replacements[s.ch] = next;
+                            }
+                            s = { Symbol::Type::NONTERMINAL, replacements[s.ch] };
+                        }
+                    }
+                }
+
+                result.productions.push_back(prod);
+            }
+
+            return result;
+        }
+
+        /* Converts the given grammar to "strong unit normal form," which is the above version of unit
+         * normal form (units may exist, but form a DAG) except that units are removed entirely. This
+         * means that if we have A -> B and B -> alpha, then we'll add A -> alpha as well (and eventually
+         * remove A -> B.
+         *
+         * The basic procedure here is pretty similar to computing unit normal form. In fact, that's the
+         * first step! From there, we do a reverse topological sort, pulling each production up from
+         * the direct children as we go.
+         */
+        CFG strongUnitNormalForm(const CFG& cfg) {
+            auto unit = unitNormalForm(cfg);
+
+            /* Restructure the grammar in a way that supports fast lookup of productions
+             * per nonterminal.
+             */
+            map<char32_t, set<Production>> productions;
+            for (const auto& prod: unit.productions) {
+                productions[prod.nonterminal].insert(prod);
+            }
+
+            /* Walk the unit graph in reverse topological order to copy things from
+             * children, removing units in the process. There are no unit cycles left,
+             * so each component is a single nonterminal.
+             */
+            GrammarAnalysis analysis(unit);
+            for (const auto& scc: analysis.unitComponents()) {
+                char32_t nonterminal = analysis.nonterminalAt(scc.front());
+                set<Production> next;
+
+                /* Copy non-units, replace units.
+                 *
+                 * We use square brackets here rather than .at because it's entirely
+                 * possible that the grammar we're working with has no production
+                 * for this nonterminal.
+                 */
+                for (const auto& prod: productions[nonterminal]) {
+                    /* Nonterminal units get replaced by all of the derived productions. */
+                    if (isNonterminalUnit(prod)) {
+                        /* If this is a self-loop, just skip it. */
+                        if (prod.replacement[0].ch != prod.nonterminal) {
+                            /* Copy, not reference. */
+                            for (auto derived: productions.at(prod.replacement[0].ch)) {
+                                derived.nonterminal = nonterminal;
+                                next.insert(derived);
+                            }
+                        }
+                    }
+                    /* Everything else is copied as usual. */
+                    else {
+                        next.insert(prod);
+                    }
+                }
+
+                productions[nonterminal] = next;
+            }
+
+            /* Rebuild the grammar. */
+            auto result = unit;
+            result.productions.clear();
+            for (const auto& entry: productions) {
+                for (const auto& prod: entry.second) {
+                    result.productions.push_back(prod);
+                }
+            }
+
+            return result;
+        }
+    }
+
+    namespace {
+        /* Size of a grammar, counting each production's left-hand side as a symbol. */
+        size_t sizeOf(const CFG& cfg) {
+            size_t result = 0;
+            for (const auto& prod: cfg.productions) {
+                result += 1 + prod.replacement.size();
+            }
+            return result;
+        }
+
+        CNFStage stageFor(const string& name, const CFG& cfg, double seconds) {
+            return { name, cfg.nonterminals.size(), cfg.productions.size(), sizeOf(cfg), seconds };
+        }
+
+        /* Generic routine to turn something into one of the CNF flavors, noting how big
+         * the grammar is after each step. The analysis is of the original grammar.
+         */
+        CFG toCNF(const CFG& cfg, const GrammarAnalysis& analysis, CFG unitFormer(const CFG &),
+                  vector<CNFStage>& stages) {
+            const vector<pair<string, std::function<CFG(const CFG&)>>> steps = {
+                { "START", addUniqueStartTo },
+                { "TERM",  indirectTerminals },
+                { "BIN",   binarize },
+                { "DEL",   epsilonNormalFormOf },
+                { "CLEAN", [](const CFG& g) { return clean(g); } },
+                { "UNIT",  unitFormer },
+            };
+
+            stages = { stageFor("INPUT", cfg, 0) };
+
+            auto transformed = cfg;
+            for (const auto& step: steps) {
+                auto start = chrono::steady_clock::now();
+                transformed = step.second(transformed);
+                stages.push_back(stageFor(step.first, transformed,
+                                          chrono::duration<double>(chrono::steady_clock::now() - start).count()));
+            }
+
+            /* Add S -> epsilon if the original start symbol was nullable. That's part of
+             * putting epsilon back, so it's counted in the last step.
+             */
+            if (analysis.isNullable(cfg.startSymbol)) {
+                transformed.productions.push_back({ transformed.startSymbol, {} });
+                stages.back().productions++;
+                stages.back().size++;
+            }
+
+            CFG result;
+            result.alphabet = transformed.alphabet;
+            result.productions = transformed.productions;
+            result.startSymbol = transformed.startSymbol;
+            result.nonterminals = transformed.nonterminals;
+            return result;
+        }
+    }
+
+    /* TODO: This doesn't handle the case where there are useless rules.
+     * Make sure to clean the grammar first.
+     */
+    CFG toCNF(const CFG& cfg) {
+        vector<CNFStage> stages;
+        return toCNF(cfg, stages);
+    }
+    CFG toCNF(const CFG& cfg, vector<CNFStage>& stages) {
+        return toCNF(cfg, GrammarAnalysis(cfg), strongUnitNormalForm, stages);
+    }
+
+    /* TODO: This doesn't handle the case where there are useless rules.
+     * Make sure to clean the grammar first.
+     *
+     * TODO: Refactor this and the above function.
+     */
+    CFG toWeakCNF(const CFG& cfg) {
+        vector<CNFStage> stages;
+        return toWeakCNF(cfg, stages);
+    }
+    CFG toWeakCNF(const CFG& cfg, vector<CNFStage>& stages) {
+        return toCNF(cfg, GrammarAnalysis(cfg), unitNormalForm, stages);
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                  CYK Algorithm Implementation                      ***
+     **************************************************************************
+     **************************************************************************
+
+     The CYK algorithm is a fast (O(n^3)) time recognition algorithm that works
+     on grammars encoded in CNF. This restriction means that it's not very good
+     at producing derivations of arbitrary grammars, but that it is fast when
+     we're allowed to do some preprocessing work on the grammars up front.
+
+     *************************************************************************/
+
+    namespace {
+        /* CYK works bottom-up over a chart whose cells are sets of nonterminals. To make
+         * the inner loop fast, nonterminals are renumbered 0, 1, 2, ..., and each cell is
+         * stored as a bitset, a run of kCYKWords 64-bit words. Cells are laid out in one
+         * flat array, indexed by the span [start, end) they cover.
+         */
+        struct CYKGrammar {
+            /* Number of nonterminals, and how many words it takes to hold a set of them. */
+            size_t numNonterminals;
+            size_t numWords;
+
+            /* Dense id of the start symbol. */
+            size_t start;
+
+            /* For each terminal, the set of nonterminals that directly produce it. */
+            unordered_map<char32_t, vector<uint64_t>> terminals;
+
+            /* For each nonterminal B, the set of nonterminals that reach B by a chain of
+             * zero or more unit productions. Closing a cell under units is then a matter
+             * of OR-ing these together.
+             */
+            vector<vector<uint64_t>> unitClosure;
+
+            /* Binary productions A -> BC, grouped by B. For each B we store the set of
+             * all C's that can follow it (to quickly rule out a whole group), then for
+             * each such C the set of A's with A -> BC.
+             */
+            vector<vector<uint64_t>>                   rightsOf;
+            vector<vector<pair<size_t, vector<uint64_t>>>> pairsOf;
+
+            /* Whether the start symbol derives epsilon. */
+            bool hasEpsilon;
+        };
+
+        bool hasBit(const uint64_t* bits, size_t index) {
+            return bits[index >> 6] & (uint64_t(1) << (index & 63));
+        }
+        void setBit(uint64_t* bits, size_t index) {
+            bits[index >> 6] |= uint64_t(1) << (index & 63);
+        }
+        void orInto(uint64_t* dest, const uint64_t* source, size_t numWords) {
+            for (size_t i = 0; i < numWords; i++) {
+                dest[i] |= source[i];
+            }
+        }
+        bool intersects(const uint64_t* lhs, const uint64_t* rhs, size_t numWords) {
+            for (size_t i = 0; i < numWords; i++) {
+                if (lhs[i] & rhs[i]) return true;
+            }
+            return false;
+        }
+
+        /* Index of the lowest set bit in a nonzero word. */
+        size_t lowestBitOf(uint64_t word) {
+#if defined(__GNUC__)
+            return __builtin_ctzll(word);
+#else
+            size_t result = 0;
+            while (!(word & 1)) {
+                word >>= 1;
+                result++;
+            }
+            return result;
+#endif
+        }
+
+        /* Calls the given function on the index of each set bit. */
+        template <typename Callback> void forEachBit(const uint64_t* bits, size_t numWords, Callback callback) {
+            for (size_t i = 0; i < numWords; i++) {
+                for (uint64_t word = bits[i]; word != 0; word &= word - 1) {
+                    callback(i * 64 + lowestBitOf(word));
+                }
+            }
+        }
+
+        CYKGrammar toCYKGrammar(const CFG& cfg) {
+            /* Convert to weak CNF to ensure all RHS's have the right sizes. */
+            GrammarAnalysis analysis(cfg);
+            vector<CNFStage> stages;
+            auto weakCNF = toCNF(cfg, analysis, unitNormalForm, stages);
+
+            CYKGrammar result;
+            result.hasEpsilon = analysis.isNullable(cfg.startSymbol);
+
+            /* Number the nonterminals. */
+            unordered_map<char32_t, size_t> ids;
+            for (char32_t nonterminal: weakCNF.nonterminals) {
+                ids.insert(make_pair(nonterminal, ids.size()));
+            }
+            result.numNonterminals = ids.size();
+            result.numWords        = (ids.size() + 63) / 64;
+            result.start           = ids.at(weakCNF.startSymbol);
+
+            auto emptySet = [&] {
+                return vector<uint64_t>(result.numWords);
+            };
+
+            result.unitClosure.assign(ids.size(), emptySet());
+            result.rightsOf.assign(ids.size(), emptySet());
+            result.pairsOf.resize(ids.size());
+
+            /* Binary productions, grouped by their first symbol and then their second. */
+            vector<map<size_t, vector<uint64_t>>> pairs(ids.size());
+
+            /* Unit productions as (A, B) for A -> B. */
+            vector<pair<size_t, size_t>> units;
+
+            for (const auto& prod: weakCNF.productions) {
+                const auto& p = prod.replacement;
+                size_t lhs = ids.at(prod.nonterminal);
+
+                /* Classify production. */
+                if (p.size() == 2) {
+                    size_t first = ids.at(p[0].ch), second = ids.at(p[1].ch);
+
+                    auto& heads = pairs[first][second];
+                    if (heads.empty()) heads = emptySet();
+                    setBit(heads.data(), lhs);
+                    setBit(result.rightsOf[first].data(), second);
+                } else if (p.size() == 1 && p[0].type == Symbol::Type::TERMINAL) {
+                    auto& heads = result.terminals[p[0].ch];
+                    if (heads.empty()) heads = emptySet();
+                    setBit(heads.data(), lhs);
+                } else if (p.size() == 1 && p[0].type == Symbol::Type::NONTERMINAL) {
+                    units.push_back(make_pair(lhs, ids.at(p[0].ch)));
+                } else if (p.empty() && prod.nonterminal == weakCNF.startSymbol) {
+                    /* S -> epsilon; handled by hasEpsilon. */
+                } else {
+                    throw runtime_error("Illegal production.");
+                }
+            }
+
+            for (size_t first = 0; first < ids.size(); first++) {
+                result.pairsOf[first].assign(pairs[first].begin(), pairs[first].end());
+            }
+
+            /* Close units transitively: if A -> B, then everything reaching A by units
+             * also reaches B. Weak CNF makes the unit graph a DAG, but iterating to a
+             * fixed point is simple and safe regardless.
+             */
+            for (size_t i = 0; i < ids.size(); i++) {
+                setBit(result.unitClosure[i].data(), i);
+            }
+            for (bool changed = true; changed; ) {
+                changed = false;
+                for (const auto& unit: units) {
+                    auto& dest = result.unitClosure[unit.second];
+                    const auto& source = result.unitClosure[unit.first];
+                    for (size_t i = 0; i < result.numWords; i++) {
+                        if (source[i] & ~dest[i]) {
+                            dest[i] |= source[i];
+                            changed = true;
+                        }
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        /* Compiled grammar, shared between the CYK and Valiant matchers. */
+        shared_ptr<const CYKGrammar> cykGrammarFor(const CFG& cfg) {
+            return Cache::lookup<CYKGrammar>(keyFor("CYK", cfg), [&] {
+                auto result = make_shared<CYKGrammar>(toCYKGrammar(cfg));
+                size_t bytes = sizeof(CYKGrammar) + bytesOf(result->unitClosure) + bytesOf(result->rightsOf) +
+                               result->terminals.size() * (64 + result->numWords * sizeof(uint64_t));
+                for (const auto& pairs: result->pairsOf) {
+                    bytes += bytesOf(pairs);
+                    for (const auto& entry: pairs) {
+                        bytes += bytesOf(entry.second);
+                    }
+                }
+                return make_pair(shared_ptr<const CYKGrammar>(result), bytes);
+            });
+        }
+
+        /* Bottom-up CYK. The chart cell for span [start, end) lives at word offset
+         * (end * (end - 1) / 2 + start) * numWords, so the chart for n characters takes
+         * n(n + 1) / 2 cells. Spans are filled in order of increasing end and, within
+         * that, decreasing start, which guarantees both halves of every split are ready
+         * by the time we need them.
+         */
+        bool cyk(const CYKGrammar& grammar, const vector<char32_t>& input, vector<uint64_t>& chart) {
+            const size_t n = input.size();
+            const size_t numWords = grammar.numWords;
+
+            auto cell = [&](size_t start, size_t end) {
+                return chart.data() + (end * (end - 1) / 2 + start) * numWords;
+            };
+
+            /* Reuse the chart we were given where possible. */
+            size_t needed = n * (n + 1) / 2 * numWords;
+            if (chart.size() < needed) chart.resize(needed);
+            fill(chart.begin(), chart.begin() + needed, 0);
+
+            /* Scratch space for the nonterminals a span produces before closing
+             * under units.
+             */
+            vector<uint64_t> direct(numWords);
+
+            for (size_t end = 1; end <= n; end++) {
+                for (size_t start = end; start-- > 0; ) {
+                    fill(direct.begin(), direct.end(), 0);
+
+                    if (start + 1 == end) {
+                        auto itr = grammar.terminals.find(input[start]);
+                        if (itr != grammar.terminals.end()) {
+                            orInto(direct.data(), itr->second.data(), numWords);
+                        }
+                    } else {
+                        for (size_t mid = start + 1; mid < end; mid++) {
+                            const uint64_t* left  = cell(start, mid);
+                            const uint64_t* right = cell(mid, end);
+
+                            forEachBit(left, numWords, [&](size_t first) {
+                                if (!intersects(grammar.rightsOf[first].data(), right, numWords)) return;
+                                for (const auto& entry: grammar.pairsOf[first]) {
+                                    if (hasBit(right, entry.first)) {
+                                        orInto(direct.data(), entry.second.data(), numWords);
+                                    }
+                                }
+                            });
+                        }
+                    }
+
+                    uint64_t* result = cell(start, end);
+                    forEachBit(direct.data(), numWords, [&](size_t nonterminal) {
+                        orInto(result, grammar.unitClosure[nonterminal].data(), numWords);
+                    });
+                }
+            }
+
+            return hasBit(cell(0, n), grammar.start);
+        }
+
+        Matcher cykMatcherFor(const CFG& cfg) {
+            auto grammar  = cykGrammarFor(cfg);
+            auto alphabet = cfg.alphabet;
+
+            /* The chart is made fresh on each call so that one matcher can be shared
+             * between threads. Filling it takes cubic time anyway, so allocating it
+             * is cheap by comparison.
+             */
+            return [=](const string& str) {
+                auto input = utf8Decode(str, alphabet);
+                if (input.empty()) return grammar->hasEpsilon;
+
+                vector<uint64_t> chart;
+                return cyk(*grammar, input, chart);
+            };
+        }
+
+        /**************************************************************************
+         **************************************************************************
+         ***            Valiant-Style Matrix Multiplication Parsing             ***
+         **************************************************************************
+         **************************************************************************
+
+         Valiant showed that CNF recognition reduces to boolean matrix multiplication,
+         so it runs asymptotically as fast as matrix multiplication does. This is
+         an implementation of Okhotin's simplified version of that algorithm.
+
+         As with CYK, the table T holds, for each span [i, j) of the input, the set
+         of nonterminals deriving it. Alongside it is a table P holding, for each
+         span, the pairs BC (drawn from binary productions A -> BC) that are known to
+         derive it. Once P is complete for a span, T follows directly. The algorithm
+         carves the table up recursively into square-ish tiles and fills in P for a
+         whole tile at a time with a product of two already-finished tiles of T:
+
+            P[X, Z] |= T[X, Y] * T[Y, Z]
+
+         where X, Y, and Z are ranges of positions. The tiles are visited in an
+         order that guarantees each span's P entry is complete by the time the
+         recursion bottoms out at that span.
+
+         Each of T and P is stored as one bit matrix per nonterminal (or per pair),
+         so a product is done a row at a time with 64-bit words, and large products
+         are split across threads by rows. That makes this O(n^3 / 64) in practice,
+         rather than truly subcubic, but with far better constants than CYK once the
+         input gets to be a few thousand characters long. This is experimental;
+         for everyday inputs, the Earley matchers are faster.
+
+         *************************************************************************/
+
+        /* Square bit matrix, stored by rows. */
+        struct BitMatrix {
+            size_t wordsPerRow = 0;
+            vector<uint64_t> bits;
+
+            explicit BitMatrix(size_t size) : wordsPerRow((size + 63) / 64), bits(size * wordsPerRow) {}
+
+            uint64_t* row(size_t index) {
+                return bits.data() + index * wordsPerRow;
+            }
+            const uint64_t* row(size_t index) const {
+                return bits.data() + index * wordsPerRow;
+            }
+        };
+
+        /* Half-open range of positions [begin, end). */
+        struct Range {
+            size_t begin, end;
+
+            size_t size() const {
+                return end - begin;
+            }
+            Range lower() const {
+                return { begin, begin + size() / 2 };
+            }
+            Range upper() const {
+                return { begin + size() / 2, end };
+            }
+        };
+
+        /* Calls the given function on the index of each set bit of the row within
+         * the given range.
+         */
+        template <typename Callback> void forEachBitIn(const uint64_t* row, Range range, Callback callback) {
+            if (range.size() == 0) return;
+
+            size_t first = range.begin / 64, last = (range.end - 1) / 64;
+            for (size_t i = first; i <= last; i++) {
+                uint64_t word = row[i];
+                if (i == first)                   word &= ~uint64_t(0) << (range.begin % 64);
+                if (i == last && range.end % 64) word &= ~uint64_t(0) >> (64 - range.end % 64);
+
+                for (; word != 0; word &= word - 1) {
+                    callback(i * 64 + lowestBitOf(word));
+                }
+            }
+        }
+
+        /* Products with fewer word operations than this aren't worth spreading
+         * across threads.
+         */
+        const size_t kValiantParallelThreshold = 1 << 22;
+        const size_t kValiantThreads = thread::hardware_concurrency();
+
+        class ValiantParser {
+        public:
+            ValiantParser(const CYKGrammar& grammar, const vector<char32_t>& input) :
+                grammar(grammar), size(input.size() + 1) {
+
+                for (size_t i = 0; i < grammar.numNonterminals; i++) {
+                    T.emplace_back(size);
+                }
+                for (size_t first = 0; first < grammar.numNonterminals; first++) {
+                    for (const auto& entry: grammar.pairsOf[first]) {
+                        rules.push_back({ first, entry.first, entry.second.data() });
+                        P.emplace_back(size);
+                    }
+                }
+
+                /* Spans of length one come straight from the input. */
+                for (size_t i = 0; i < input.size(); i++) {
+                    auto itr = grammar.terminals.find(input[i]);
+                    if (itr != grammar.terminals.end()) {
+                        record(i, i + 1, itr->second.data());
+                    }
+                }
+            }
+
+            bool accepts() {
+                compute({ 0, size });
+                return hasBit(T[grammar.start].row(0), size - 1);
+            }
+
+        private:
+            /* A -> BC, with all the A's for a given BC merged into one set. */
+            struct Rule {
+                size_t first, second;
+                const uint64_t* heads;
+            };
+
+            const CYKGrammar& grammar;
+            size_t size;
+
+            vector<Rule> rules;
+            vector<BitMatrix> T; // One per nonterminal
+            vector<BitMatrix> P; // One per rule
+
+            /* Marks span [i, j) as derived by the given nonterminals and everything
+             * reaching them by units.
+             */
+            void record(size_t i, size_t j, const uint64_t* nonterminals) {
+                forEachBit(nonterminals, grammar.numWords, [&](size_t direct) {
+                    forEachBit(grammar.unitClosure[direct].data(), grammar.numWords, [&](size_t nonterminal) {
+                        setBit(T[nonterminal].row(i), j);
+                    });
+                });
+            }
+
+            /* Fills in T for every span within the given range. */
+            void compute(Range range) {
+                if (range.size() <= 1) return;
+
+                compute(range.lower());
+                compute(range.upper());
+                complete(range.lower(), range.upper());
+            }
+
+            /* Fills in T for spans [i, j) with i in rows and j in cols, assuming that all
+             * spans inside rows and inside cols are done and that P already accounts for
+             * all split points between the two ranges.
+             */
+            void complete(Range rows, Range cols) {
+                if (rows.size() == 1 && cols.size() == 1) {
+                    vector<uint64_t> direct(grammar.numWords);
+                    for (size_t r = 0; r < rules.size(); r++) {
+                        if (hasBit(P[r].row(rows.begin), cols.begin)) {
+                            orInto(direct.data(), rules[r].heads, grammar.numWords);
+                        }
+                    }
+                    record(rows.begin, cols.begin, direct.data());
+                } else if (rows.size() == 1) {
+                    complete(rows, cols.lower());
+                    multiply(rows, cols.lower(), cols.upper());
+                    complete(rows, cols.upper());
+                } else if (cols.size() == 1) {
+                    complete(rows.upper(), cols);
+                    multiply(rows.lower(), rows.upper(), cols);
+                    complete(rows.lower(), cols);
+                } else {
+                    auto B = rows.lower(), C = rows.upper();
+                    auto D = cols.lower(), E = cols.upper();
+
+                    complete(C, D);
+
+                    multiply(B, C, D);
+                    complete(B, D);
+
+                    multiply(C, D, E);
+                    complete(C, E);
+
+                    multiply(B, C, E);
+                    multiply(B, D, E);
+                    complete(B, E);
+                }
+            }
+
+            /* P[X, Z] |= T[X, Y] * T[Y, Z], for each rule. */
+            void multiply(Range X, Range Y, Range Z) {
+                size_t firstWord = Z.begin / 64, lastWord = (Z.end - 1) / 64;
+
+                auto multiplyRows = [&, this](size_t rowBegin, size_t rowEnd) {
+                    for (size_t r = 0; r < rules.size(); r++) {
+                        const auto& left  = T[rules[r].first];
+                        const auto& right = T[rules[r].second];
+                        auto& result = P[r];
+
+                        for (size_t i = rowBegin; i < rowEnd; i++) {
+                            uint64_t* dest = result.row(i);
+                            forEachBitIn(left.row(i), Y, [&](size_t k) {
+                                const uint64_t* source = right.row(k);
+                                for (size_t w = firstWord; w <= lastWord; w++) {
+                                    dest[w] |= source[w];
+                                }
+                            });
+                        }
+                    }
+                };
+
+                /* Bits set outside of Z aren't a problem: everything we put into P is
+                 * true, and P entries are only ever read once they're complete.
+                 */
+                size_t work     = X.size() * Y.size() * (lastWord - firstWord + 1) * rules.size();
+                if (work < kValiantParallelThreshold || kValiantThreads < 2 || X.size() < 2) {
+                    multiplyRows(X.begin, X.end);
+                    return;
+                }
+
+                size_t numThreads = min(kValiantThreads, X.size());
+
+                vector<thread> workers;
+                for (size_t t = 0; t < numThreads; t++) {
+                    workers.emplace_back(multiplyRows, X.begin + X.size() *  t      / numThreads,
+                                                       X.begin + X.size() * (t + 1) / numThreads);
+                }
+                for (auto& worker: workers) {
+                    worker.join();
+                }
+            }
+        };
+
+        Matcher valiantMatcherFor(const CFG& cfg) {
+            auto grammar  = cykGrammarFor(cfg);
+            auto alphabet = cfg.alphabet;
+
+            return [=](const string& str) {
+                auto input = utf8Decode(str, alphabet);
+                if (input.empty()) return grammar->hasEpsilon;
+
+                return ValiantParser(*grammar, input).accepts();
+            };
+        }
+
+        /**************************************************************************
+         **************************************************************************
+         ***                LR(0)-Based Earley Implementtion                    ***
+         **************************************************************************
+         **************************************************************************
+
+         An implementation of Earley's algorithm that's sped up by precomputing
+         which sorts of item sets will travel together as a unit. This works by
+         making what the paper "Practical Earley Parsing" by Aycock and Horspool
+         refer to as the "split LR(0) e-DFA."
+
+         This implementation has been aggressively optimized to try to squeeze out
+         as much performance as possible, as we use it as our default matcher. This
+         means that the code may not be nearly as readable as you might like/hope.
+         Sorry about that!
+
+         The basic idea is the following:
+
+           1. Build an automaton that essentially does all the work the predictor
+              usually does up-front so that instead of pushing around individual
+              productions, we're working with collapsed sets of LR(0) states.
+           2. Optimize the automaton so that its GOTO table is done purely using
+              some quick vector index lookups rather than using sets or maps or
+              anything like that.
+
+         *************************************************************************/
+
+        /* LR(0) item is a production and a dot position. */
+        struct LR0Item {
+            const Production* production;
+            size_t dotPos;
+        };
+
+        bool operator< (const LR0Item& lhs, const LR0Item& rhs) {
+            if (lhs.production != rhs.production) return lhs.production < rhs.production;
+            return lhs.dotPos < rhs.dotPos;
+        }
+
+        ostream& operator<< (ostream& out, const LR0Item& item) {
+            ostringstream builder;
+            builder << Symbol{ Symbol::Type::NONTERMINAL, item.production->nonterminal } << " -> ";
+            for (size_t i = 0; i < item.dotPos; i++) {
+                builder << item.production->replacement[i];
+            }
+            builder << ".";
+            for (size_t i = item.dotPos; i < item.production->replacement.size(); i++) {
+                builder << item.production->replacement[i];
+            }
+            return out << builder.str();
+        }
+
+        /* For debugging. */
+        ostream& operator<< (ostream& out, const set<LR0Item>& set) {
+            for (auto item: set) {
+                out << item << endl;
+            }
+            return out;
+        }
+
+        /* LR(0) e-DFA item. */
+        struct LR0EState {
+            /* Numeric index of this state. */
+            size_t index;
+
+            /* Set of items here. This isn't strictly needed, but it's
+             * helpful for debugging.
+             */
+            set<LR0Item> items;
+
+            /* Transitions to other LR(0) e-states. */
+            unordered_map<Symbol, LR0EState*> transitions;
+
+            /* Epsilon transition, if any. */
+            LR0EState* epsilon;
+        };
+
+        /* LR(0) e-DFA. This is the actual automaton representation, and it's designed to
+         * be as fast as we can make it, potentially at the expense of readability.
+         */
+        struct LR0EDFA {
+            /* Set of all states. */
+            set<shared_ptr<LR0EState>> states;
+
+            /* Start state. */
+            LR0EState* start;
+
+            /* A huge amount of our time is spent doing lookups of the form
+             * "given state X and symbol Y, what's the successor state?" To speed
+             * this up, we build a flat vector representing a 2D "goto" table for
+             * our automaton. We will number the symbols we might encounter 0, 1
+             * 2, 3, ..., n-1, then build an array of the form [goto for state 0],
+             * [goto for state 1], etc. by linearizing everything.
+             *
+             * To make this work, we first need a way of relabeling symbols with
+             * numbers, which is this first table.
+             */
+            unordered_map<Symbol, size_t> toIndex;
+
+            /* Multiplier to use to go from a state number to a table index. */
+            /* TODO: Would it be better to use a shift here? */
+            size_t multiplier;
+
+            /* Next, we need that linearized GOTO table. */
+            vector<const LR0EState*> goTo;
+
+            /* Map from state numbers to completed sets. */
+            vector<vector<size_t>> completed;
+        };
+
+        /* Utility functions for working with LR(0) items. */
+        bool dotAtEnd(const LR0Item& item) {
+            return item.dotPos == item.production->replacement.size();
+        }
+        Symbol afterDot(const LR0Item& item) {
+            if (dotAtEnd(item)) abort(); // Logic error!
+            return item.production->replacement[item.dotPos];
+        }
+        LR0Item advanceDot(LR0Item item) {
+            if (dotAtEnd(item)) abort();
+            item.dotPos++;
+            return item;
+        }
+
+        /* Advances the dot of each item in a set of LR(0) items. */
+        set<LR0Item> advanceDot(const set<LR0Item>& items, Symbol s) {
+            set<LR0Item> result;
+            for (const auto& item: items) {
+                if (!dotAtEnd(item) && afterDot(item) == s) {
+                    result.insert(advanceDot(item));
+                }
+            }
+            return result;
+        }
+
+        /* Computes the LR(0) e-DFA closure of the given set of LR(0) items.
+         *
+         * There are two different types of closures. The first one yields
+         * the KERNEL STATE and is formed by only moving the dot forward
+         * over nullable nonterminals. The second closure yields NON-KERNEL
+         * STATES and is a combination of the previous rule and the regular
+         * LR(0) lookahead rules.
+         */
+        enum ClosureType {
+            KERNEL,
+            NON_KERNEL
+        };
+
+        ostream& operator<< (ostream& out, ClosureType type) {
+            return out << (type == ClosureType::KERNEL? "Kernel" : "Non-Kernel");
+        }
+
+        set<LR0Item> closureOf(const set<LR0Item>& items,
+                               const CFG& cfg,
+                               const GrammarAnalysis& analysis,
+                               ClosureType type) {
+            set<LR0Item> result;
+
+            /* Form a worklist of all items that have dots before nonterminals. */
+            queue<LR0Item> worklist;
+
+            /* The setup here differs based on the type of the closure.
+             *
+             * If this is a kernel closure, we preserve all the items already in the
+             * closure, then place all items with dots before nonterminals into the
+             * worklist.
+             *
+             * If this is a non-kernel closure, we do NOT preserve the items already
              * in the closure. Instead, for each production S -> alpha . X beta, we
              * add the productions X -> .gamma into the worklist.
              */
-            if (type == ClosureType::KERNEL) {
-                for (const auto& item: items) {
-                    if (!dotAtEnd(item) && afterDot(item).type == Symbol::Type::NONTERMINAL) {
-                        worklist.push(item);
+            if (type == ClosureType::KERNEL) {
+                for (const auto& item: items) {
+                    if (!dotAtEnd(item) && afterDot(item).type == Symbol::Type::NONTERMINAL) {
+                        worklist.push(item);
+                    }
+                    result.insert(item);
+                }
+            } else {
+                for (const auto& item: items) {
+                    if (!dotAtEnd(item) && afterDot(item).type == Symbol::Type::NONTERMINAL) {
+                        /* Find all productions to use. */
+                        for (const auto& prod: cfg.productions) {
+                            if (prod.nonterminal == afterDot(item).ch) {
+                                /* Place the item in the result. */
+                                LR0Item item = { &prod, 0 };
+                                result.insert(item);
+
+                                /* And if the item at the beginning is a nonterminal, add it for further
+                                 * processing.
+                                 */
+                                if (!dotAtEnd(item) && afterDot(item).type == Symbol::Type::NONTERMINAL) {
+                                    worklist.push(item);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            /* Now, compute the closure of the initial set. */
+            while (!worklist.empty()) {
+                auto curr = worklist.front();
+                worklist.pop();
+                auto symbol = afterDot(curr);
+                if (symbol.type == Symbol::Type::TERMINAL) abort(); // Logic error!
+
+                /* If the nonterminal is nullable, shift the dot forward. */
+                if (analysis.isNullable(symbol.ch)) {
+                    auto next = advanceDot(curr);
+                    if (result.insert(next).second) {
+                        /* If the dot is before a nonterminal, add back for later processing. */
+                        if (!dotAtEnd(next) && afterDot(next).type == Symbol::Type::NONTERMINAL) {
+                            worklist.push(next);
+                        }
+                    }
+                }
+
+                /* If we're making the non-kernel state, do some predictions as
+                 * well.
+                 */
+                if (type == ClosureType::NON_KERNEL) {
+                    /* For each production S -> alpha, add S -> .alpha. */
+                    for (const Production& prod: cfg.productions) {
+                        if (prod.nonterminal == symbol.ch) {
+                            LR0Item next = { &prod, 0 };
+                            if (result.insert(next).second) {
+                                if (!dotAtEnd(next) && afterDot(next).type == Symbol::Type::NONTERMINAL) {
+                                    worklist.push(next);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        /* Constructs the LR(0) e-state(s) associated with the given closure.
+         * If the provided closure is a kernel closure, we'll also build the
+         * non-kernel closure and link it in with the rest of things, though
+         * it won't be returned.
+         */
+        LR0EState*
+        buildStateFor(const set<LR0Item>& closure,
+                      ClosureType type,
+                      const CFG& cfg,
+                      const GrammarAnalysis& analysis,
+                      map<set<LR0Item>, shared_ptr<LR0EState>>& states,
+                      size_t indent = 2) {
+            /* If we already know this one, there's nothing to do. */
+            if (states.count(closure)) return states[closure].get();
+
+            if (kParserVerbose) {
+                cout << string(indent, ' ') << "State: (" << type << ")" << endl;
+                for (const auto& item: closure) {
+                    cout << string(indent, ' ') << "  " << item << endl;
+                }
+            }
+
+            auto state = make_shared<LR0EState>();
+            state->items = closure;
+            state->index = states.size(); // Next free number
+
+            if (kParserVerbose) cout << string(indent, ' ') << "Number " << state->index << endl;
+
+            /* Store the state now so we don't infinitely loop. :-) */
+            states[closure] = state;
+
+            /* Fill in transitions. */
+            vector<Symbol> follows;
+            for (char32_t ch: cfg.nonterminals) {
+                follows.push_back({ Symbol::Type::NONTERMINAL, ch });
+            }
+            for (char32_t ch: cfg.alphabet) {
+                follows.push_back({ Symbol::Type::TERMINAL, ch });
+            }
+
+            for (Symbol s: follows) {
+                /* See if there's anything resulting from a dot shift here. */
+                auto next = closureOf(advanceDot(closure, s), cfg, analysis, ClosureType::KERNEL);
+                if (next.empty()) {
+                    state->transitions[s] = nullptr;
+                } else {
+                    if (kParserVerbose) {
+                        cout << string(indent, ' ') << "On " << s << ", we go here: " << endl;
+                        for (const auto& item: next) {
+                            cout << string(indent, ' ') << "  " << item << endl;
+                        }
+                    }
+
+                    state->transitions[s] = buildStateFor(next, ClosureType::KERNEL, cfg, analysis, states, indent + 4);
+                }
+            }
+
+            /* If this is a kernel state, create the non-kernel state for it as well. */
+            if (type == ClosureType::KERNEL) {
+                /* Get the non-kernel closure. It may be empty, which would happen if we
+                 * have no dots before nonterminals.
+                 */
+                auto next = closureOf(closure, cfg, analysis, ClosureType::NON_KERNEL);
+                if (next.empty()) {
+                    state->epsilon = nullptr;
+                    if (kParserVerbose) cout << string(indent, ' ') << "  No epsilon." << endl;
+                } else {
+                    if (kParserVerbose) cout << string(indent, ' ') << "  Epsilon exists. Processing." << endl;
+                    state->epsilon = buildStateFor(next, ClosureType::NON_KERNEL, cfg, analysis, states, indent + 4);
+                }
+            }
+            /* Otherwise, we have no epsilon. */
+            else {
+                state->epsilon = nullptr;
+            }
+
+            return state.get();
+        }
+
+        struct EDFAEarleyItem {
+            const LR0EState* state;
+            size_t itemPos;
+        };
+    }
+}
+namespace std {
+    template <> struct hash<CFG::EDFAEarleyItem> {
+        size_t operator()(const CFG::EDFAEarleyItem& e) const {
+            return size_t(e.state) + e.itemPos * 0xFFFF;
+        }
+    };
+}
+namespace CFG {
+    namespace {
+        /* For debugging. */
+        ostream& operator<< (ostream& out, const EDFAEarleyItem& item) {
+            for (const auto& lri: item.state->items) {
+                out << lri << " @" << item.itemPos << endl;
+            }
+            return out;
+        }
+
+        void printItems(const vector<vector<EDFAEarleyItem>>& items, size_t index) {
+            cout << "=== Items at index " << index << " === " << endl;
+            for (const auto& item: items[index]) {
+                for (const auto& lri: item.state->items) {
+                    cout << "  " << lri << " @" << item.itemPos << endl;
+                }
+                cout << endl;
+            }
+            cout << "=========================" << endl;
+        }
+
+        /* The "hot" part of the code here consists of inserting and tracking previous
+         * Earley items. Specifically, we need to be able to perform the following
+         * operations quickly:
+         *
+         *   1. Determine whether a particular triple of (state + @n + item index)
+         *      exists. (This is done during the scan/complete/predict steps.)
+         *   2. Add such a triplet to the collection.
+         *   3. Iterate over all (state + @n) items in a given index.
+         *
+         * Originally, we did this by having a vector<unordered_set<EDFAEarleyItem>>
+         * that held everything. The problem here is that the unordered_set was taking
+         * a while - I guess it doesn't have the best performance and the cost of
+         * hashing is a bit high?
+         *
+         * Instead, we're going to make a time/space tradeoff. Empirically, we usually
+         * have something like ~50 states, and our strings are short (say, 25 characters
+         * long). If we store all possible state/pos/pos pairs, that requies us to use
+         * about 50 * 25 * 25 = 31,250 combinations. An item in column i never starts
+         * after position i, so only the triangle of (pos, pos) pairs with origin <= index
+         * can ever be used, which cuts this roughly in half. If we imagine that each
+         * combination is a single bit, then we need about 2k memory, tops, to hold all
+         * of these combinations.
+         *
+         * As an optimization, we'll allocate that array and then use it instead of a
+         * hash table. We'll then use a simpler vector<vector<EDFAEarleyItem>> to hold
+         * the actual items, still letting us scan over things if we need them.
+         *
+         * That stops working on long inputs, since the triangle still grows quadratically
+         * (a 10,000-character string and 50 states is about 300MB of bits, nearly all of
+         * them zero). Past kMaxBitmapBits, we instead give each column its own small
+         * open-addressing hash set keyed on (state, origin). Those grow with the number
+         * of items actually present, which for most grammars is far smaller.
+         */
+        const size_t kMaxBitmapBits = size_t(1) << 26; // 8MB
+
+        /* Dense triangular bitmap. Column i holds (i + 1) bits per state, one for each
+         * possible origin, and starts right after columns 0, 1, ..., i - 1.
+         */
+        struct TriangularBitmap {
+            vector<uint64_t> bits;
+            size_t numStates = 0;
+
+            /* Number of bits needed for the given number of columns. */
+            static size_t bitsFor(size_t columns, size_t states) {
+                return states * (columns * (columns + 1) / 2);
+            }
+
+            /* Sets the dimensions, growing the bitmap if it's too small. Every bit must
+             * already be clear.
+             */
+            void reshape(size_t columns, size_t states) {
+                size_t needed = (bitsFor(columns, states) + 63) / 64;
+                if (bits.size() < needed) bits.resize(needed);
+                numStates = states;
+            }
+
+            size_t positionOf(size_t index, const EDFAEarleyItem& item) const {
+                return numStates * (index * (index + 1) / 2) + item.state->index * (index + 1) + item.itemPos;
+            }
+
+            /* Sets the bit for the item, returning whether it was previously clear. */
+            bool insert(size_t index, const EDFAEarleyItem& item) {
+                size_t   pos     = positionOf(index, item);
+                size_t   arrSlot = pos >> 6;                  // Pos / 64
+                uint64_t bit     = uint64_t(1) << (pos & 63); // Pos % 64
+
+                if (bits[arrSlot] & bit) return false;
+                bits[arrSlot] |= bit;
+                return true;
+            }
+
+            void erase(size_t index, const EDFAEarleyItem& item) {
+                size_t pos = positionOf(index, item);
+                bits[pos >> 6] &= ~(uint64_t(1) << (pos & 63));
+            }
+        };
+
+        /* Open-addressing hash set of nonnegative integers, using linear probing. The
+         * capacity is always a power of two and at least twice the size.
+         */
+        class ColumnHashSet {
+        public:
+            /* Adds the key, returning whether it wasn't already there. */
+            bool insert(uint64_t key) {
+                if (2 * (numKeys + 1) > slots.size()) grow();
+
+                size_t mask = slots.size() - 1;
+                for (size_t slot = slotFor(key); ; slot = (slot + 1) & mask) {
+                    if (slots[slot] == key) return false;
+                    if (slots[slot] == kEmptySlot) {
+                        slots[slot] = key;
+                        numKeys++;
+                        return true;
+                    }
+                }
+            }
+
+            /* Empties the set, keeping its capacity. */
+            void clear() {
+                if (numKeys == 0) return;
+                fill(slots.begin(), slots.end(), kEmptySlot);
+                numKeys = 0;
+            }
+
+        private:
+            static constexpr uint64_t kEmptySlot   = numeric_limits<uint64_t>::max();
+            static constexpr size_t   kMinCapacity = 8;
+
+            vector<uint64_t> slots;
+            size_t numKeys = 0;
+            size_t logCapacity = 0;
+
+            /* Fibonacci hashing: the top bits of key * 2^64 / phi. */
+            size_t slotFor(uint64_t key) const {
+                return size_t((key * 0x9E3779B97F4A7C15ull) >> (64 - logCapacity));
+            }
+
+            void grow() {
+                vector<uint64_t> old(max(kMinCapacity, 2 * slots.size()), kEmptySlot);
+                swap(old, slots);
+                logCapacity = 0;
+                while ((size_t(1) << logCapacity) < slots.size()) logCapacity++;
+
+                numKeys = 0;
+                for (uint64_t key: old) {
+                    if (key != kEmptySlot) insert(key);
+                }
+            }
+        };
+
+        /* Tracks which items are present in which column, using whichever of the above
+         * representations makes sense for the input length.
+         */
+        class EarleyItemIndex {
+        public:
+            /* Prepares for a run with the given number of columns. The index must be
+             * empty.
+             */
+            void reshape(size_t columns, size_t states) {
+                /* Only use the bitmap if it'd fit under our budget. This is arranged
+                 * so that it can't overflow on absurdly long inputs.
+                 */
+                isSparse = columns > kMaxBitmapBits ||
+                           columns * (columns + 1) / 2 > kMaxBitmapBits / max(states, size_t(1));
+                numStates = states;
+
+                if (isSparse) {
+                    if (columns > hashSets.size()) hashSets.resize(columns);
+                } else {
+                    bitmap.reshape(columns, states);
+                }
+            }
+
+            /* Adds the item, returning whether it wasn't already there. */
+            bool insert(size_t index, const EDFAEarleyItem& item) {
+                if (isSparse) return hashSets[index].insert(uint64_t(item.itemPos) * numStates + item.state->index);
+                return bitmap.insert(index, item);
+            }
+
+            /* Removes everything from the last run. Clearing just the items we set is
+             * much cheaper than clearing the whole bitmap.
+             */
+            void clear(const vector<vector<EDFAEarleyItem>>& items, size_t columnsUsed) {
+                for (size_t i = 0; i < columnsUsed; i++) {
+                    if (isSparse) {
+                        hashSets[i].clear();
+                    } else {
+                        for (const auto& item: items[i]) {
+                            bitmap.erase(i, item);
+                        }
+                    }
+                }
+            }
+
+        private:
+            bool isSparse = false;
+            size_t numStates = 0;
+            TriangularBitmap bitmap;
+            vector<ColumnHashSet> hashSets;
+        };
+
+        /* Memory used by eDFAEarley. Allocating this afresh for each string is surprisingly
+         * expensive for short strings, so callers matching lots of strings can hold on to
+         * one of these and pass it in each time. Vectors are only ever cleared, never
+         * shrunk, so after a while it has enough room for anything.
+         */
+        struct EDFAEarleyScratch {
+            vector<vector<EDFAEarleyItem>> items;
+            size_t columnsUsed = 0;   // Number of columns of items from the last run
+
+            /* Empty except for the items from the last run. */
+            EarleyItemIndex index;
+
+            vector<EDFAEarleyItem> worklist;
+
+            /* Input, translated to symbol indices. */
+            vector<size_t> input;
+        };
+
+        bool insert(vector<vector<EDFAEarleyItem>>& items,
+                    EarleyItemIndex& itemIndex,
+                    size_t index, const EDFAEarleyItem& item) {
+            if (kParserVerbose) cout << "Attempting to add this item to slot " << index << ":" << endl;
+            if (kParserVerbose) cout << item << endl;
+
+            if (!itemIndex.insert(index, item)) {
+                if (kParserVerbose) cout << "Already exists." << endl;
+                return false;
+            }
+
+            if (kParserVerbose) cout << "This is new, and is added." << endl;
+
+            items[index].push_back(item);
+            return true;
+        }
+
+        /* Runs the e-DFA-backed version of Earley on scratch.input. */
+        bool eDFAEarley(const LR0EDFA& eDFA, size_t startSymbol, EDFAEarleyScratch& scratch) {
+            const auto& input = scratch.input;
+
+            /* Item storage per slot. */
+            auto& items = scratch.items;
+
+            /* Item lookup, as described above. */
+            auto& itemIndex = scratch.index;
+
+            /* Undo the last run. */
+            itemIndex.clear(items, scratch.columnsUsed);
+            for (size_t i = 0; i < scratch.columnsUsed; i++) {
+                items[i].clear();
+            }
+
+            if (items.size() < input.size() + 1) items.resize(input.size() + 1);
+            scratch.columnsUsed = input.size() + 1;
+            itemIndex.reshape(input.size() + 1, eDFA.states.size());
+
+            /* Seed with the initial state, and its epsilon if it has one. */
+            insert(items, itemIndex, 0, { eDFA.start, 0 });
+            //items[0].insert({ eDFA.start, 0 });
+            if (eDFA.start->epsilon) {
+                //items[0].insert({ eDFA.start->epsilon, 0 });
+                insert(items, itemIndex, 0, { eDFA.start->epsilon, 0 });
+            }
+
+            /* Run the main loop. Note that the traditional roles of "scan," "complete,"
+             * and "predict" have been fused together in several ways.
+             *
+             * This loop is unusual in that it needs to run one more time than what
+             * we'd usually expect to see, because some of the "predict" logic has been
+             * offloaded into the very last iteration.
+             */
+            for (size_t i = 0; i <= input.size(); i++) {
+                if (kParserVerbose) cout << "Before: " << endl;
+                if (kParserVerbose) printItems(items, i);
+
+                /* Create a worklist of what we need to process in this column. This is
+                 * a queue, with the front at index head.
+                 */
+                auto& worklist = scratch.worklist;
+                worklist.assign(items[i].begin(), items[i].end());
+
+                for (size_t head = 0; head < worklist.size(); head++) {
+                    auto curr = worklist[head];
+
+                    if (kParserVerbose) cout << "Processing this state:" << endl;
+                    if (kParserVerbose) cout << curr << endl;
+
+                    /* Do not do a scan step if we are in the last column. */
+                    if (i != input.size()) {
+                        /* "Scan" step. Shift each dot over the current symbol. */
+                        //auto* next = curr.state->transitions.at({ Symbol::Type::TERMINAL, input[i]});
+                        auto* next = eDFA.goTo.at(curr.state->index * eDFA.multiplier + input[i]);
+                        if (next != nullptr) {
+                            if (kParserVerbose) cout << "Scanning produces this state:" << endl;
+                            if (kParserVerbose) cout << next->items << endl;
+
+                            /* Item position hasn't changed; we're still scanning from the same
+                             * start position.
+                             */
+                            //items[i + 1].insert({ next, curr.itemPos });
+                            insert(items, itemIndex, i + 1, { next, curr.itemPos });
+
+                            /* We may have an epsilon, too! If we do, this corresponds to a "predict"
+                             * step and the items start at the next position.
+                             */
+                            if (next->epsilon) {
+                                if (kParserVerbose) cout << "This has an epsilon production in it." << endl;
+                                if (kParserVerbose) cout << next->epsilon->items << endl;
+
+                                //items[i + 1].insert({ next->epsilon, i + 1 });
+                                insert(items, itemIndex, i + 1, { next->epsilon, i + 1 });
+                            }
+                        } else {
+                            if (kParserVerbose) cout << "Nothing here transitions on " << toUTF8(input[i]) << endl;
+                        }
+                    }
+
+                    /* "Complete" step. This is a bit different from usual. In particular:
+                     *
+                     * 1. We will be updating the CURRENT set, not the next one. The reason
+                     *    for this is that we aren't doing explicit "predict" steps, meaning
+                     *    that the sets we set up in the previous step might not have been
+                     *    fully expanded out.
+                     * 2. We have to factor in epsilon transitions in the automaton, which
+                     *    represent that missing "predict" step.
+                     * 3. We don't process any items that begin at the current location. The
+                     *    reason for this is that any completed items that occur at the current
+                     *    location correspond to items that were completed via nulling, and
+                     *    we've already precomputed everything that's going to happen as a result.
+                     *    (Plus, from an automaton perspective, we don't want to shift the
+                     *    nonterminals here without having read something).
+                     */
+                    if (curr.itemPos == i) continue;
+
+                    if (kParserVerbose) cout << "Looking for completions." << endl;
+                    for (size_t completed: eDFA.completed[curr.state->index]) {
+                        if (kParserVerbose) cout << "Nonterminal index " << completed << " is completed." << endl;
+
+                        /* Find items to shift over. */
+                        for (const auto& prev: items[curr.itemPos]) {
+                            /* See where to go; if the answer is "nowhere," skip this. */
+                            //auto next = prev.state->transitions.at({Symbol::Type::NONTERMINAL, completed});
+
+                            auto next = eDFA.goTo.at(prev.state->index * eDFA.multiplier + completed);
+                            if (!next) continue;
+
+                            /* Standard "complete" step: the item position hasn't
+                             * changed; we've just made more progress.
+                             */
+                            //if (items[i].insert({ next, prev.itemPos }).second) {
+                            if (insert(items, itemIndex, i, { next, prev.itemPos })) {
+                                worklist.push_back({ next, prev.itemPos });
+
+                                /* "Predict" step. Check if there's an epsilon and,
+                                 * if so, those items start here because they
+                                 * correspond to expanding out something that appears
+                                 * after a dot in a non-epsilon way.
+                                 */
+                                if (next->epsilon) {
+                                    //if (items[i].insert({ next->epsilon, i }).second) {
+                                    if (insert(items, itemIndex, i, { next->epsilon, i })) {
+                                        worklist.push_back({ next->epsilon, i });
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+
+                if (kParserVerbose) cout << "After: " << endl;
+                if (kParserVerbose) printItems(items, i);
+            }
+
+            /* See if anything completes the start. */
+            for (const auto& item: items[input.size()]) {
+                if (item.itemPos == 0) {
+                    const auto& completed = eDFA.completed.at(item.state->index);
+                    if (find(completed.begin(), completed.end(), startSymbol) != completed.end()) {
+                        return true;
+                    }
+                }
+            }
+
+            return false;
+        }
+
+        /* Builds the index used by the DFA matcher to translate from symbols to indices. */
+        void buildIndex(LR0EDFA& eDFA, const CFG& cfg) {
+            /* Lay them out linearly. */
+            for (char32_t ch: cfg.nonterminals) {
+                eDFA.toIndex.insert(make_pair(Symbol{ Symbol::Type::NONTERMINAL, ch }, eDFA.toIndex.size()));
+            }
+            for (char32_t ch: cfg.alphabet) {
+                eDFA.toIndex.insert(make_pair(Symbol{ Symbol::Type::TERMINAL, ch }, eDFA.toIndex.size()));
+            }
+
+            eDFA.multiplier = eDFA.toIndex.size();
+        }
+
+        /* Builds the GOTO table for the given eDFA. This works by linearizing the individual
+         * transition tables based on the ordering given in the index.
+         */
+        void buildGoToTable(LR0EDFA& eDFA) {
+            /* We have one slot per symbol (eDFA.toIndex.size()) per state. */
+            eDFA.goTo.resize(eDFA.states.size() * eDFA.multiplier);
+            for (const auto& state: eDFA.states) {
+                for (const auto& entry: eDFA.toIndex) {
+                    size_t index = state->index * eDFA.multiplier + entry.second;
+                    eDFA.goTo.at(index) = state->transitions[entry.first];
+                }
+            }
+        }
+
+        /* Builds the 'completed' table for the given eDFA. This maps each state to the set
+         * of nonterminals that end there. However, for efficiency each nonterminal is replaced
+         * by an index.
+         */
+        void buildCompletedTable(LR0EDFA& eDFA) {
+            eDFA.completed.resize(eDFA.states.size());
+            for (const auto& state: eDFA.states) {
+                /* Look at all items here and find the completed ones. */
+                set<size_t> completed;
+                for (const auto& item: state->items) {
+                    /* If completed, this nonterminal - or at least, its translated version - is completed. */
+                    if (dotAtEnd(item)) {
+                        completed.insert(eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, item.production->nonterminal }));
+                    }
+                }
+
+                eDFA.completed.at(state->index).assign(completed.begin(), completed.end());
+            }
+        }
+    }
+
+    struct CompiledGrammar::Impl {
+        /* Clone of the grammar. The LR(0) items point into its productions. */
+        shared_ptr<const CFG> cfg;
+
+        LR0EDFA eDFA;
+
+        /* Index of the start symbol. */
+        size_t startSymbol;
+
+        /* Indices of terminals, for translating input strings. */
+        unordered_map<char32_t, size_t> terminalIndices;
+
+        size_t indexOf(char32_t terminal) const {
+            auto itr = terminalIndices.find(terminal);
+            if (itr == terminalIndices.end()) throw runtime_error("Invalid character: " + toUTF8(terminal));
+            return itr->second;
+        }
+    };
+
+    /* Memory reused from one match to the next. */
+    struct CompiledGrammar::Scratch {
+        EDFAEarleyScratch earley;
+    };
+
+    CompiledGrammar::CompiledGrammar(const CFG& cfg) : scratch(new Scratch()) {
+        impl = Cache::lookup<Impl>(keyFor("Earley LR(0)", cfg), [&] {
+            auto impl = make_shared<Impl>();
+
+            /* Clone the grammar so we have a persistent copy. */
+            auto ourCFG = make_shared<CFG>(addUniqueStartTo(cfg));
+            impl->cfg = ourCFG;
+
+            /* Need to know what's nullable to do dot shifts. */
+            GrammarAnalysis analysis(*ourCFG);
+
+            /* Map from LR(0) e-configurating sets to states. */
+            map<set<LR0Item>, shared_ptr<LR0EState>> states;
+
+            /* Seed the initial state with all productions from the start
+             * symbol.
+             */
+            set<LR0Item> initial;
+            for (const auto& prod: ourCFG->productions) {
+                if (prod.nonterminal == ourCFG->startSymbol) {
+                    initial.insert({ &prod, 0 });
+                }
+            }
+
+            /* Construct the automaton. We seed things with the kernel state corresponding to
+             * the start configuration.
+             */
+            auto& eDFA = impl->eDFA;
+            eDFA.start = buildStateFor(closureOf(initial, *ourCFG, analysis, ClosureType::KERNEL),
+                                       ClosureType::KERNEL,
+                                       *ourCFG,
+                                       analysis,
+                                       states);
+
+            /* Form a proper automaton. Copy the states over. */
+            for (const auto& entry: states) {
+                eDFA.states.insert(entry.second);
+            }
+
+            /* Form the linear ordering used in the GOTO table. */
+            buildIndex(eDFA, *ourCFG);
+
+            /* Build the GOTO table. */
+            buildGoToTable(eDFA);
+
+            /* And the completed table, too! */
+            buildCompletedTable(eDFA);
+
+            /* Set up the translation from characters to indices. */
+            impl->startSymbol = eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, ourCFG->startSymbol });
+            for (char32_t terminal: ourCFG->alphabet) {
+                impl->terminalIndices[terminal] = eDFA.toIndex.at({ Symbol::Type::TERMINAL, terminal });
+            }
+
+            /* Roughly: each state holds its items and transitions in tree or hash nodes. */
+            size_t bytes = sizeof(Impl) + bytesOf(*ourCFG) + bytesOf(eDFA.goTo) + bytesOf(eDFA.completed) +
+                           48 * (eDFA.toIndex.size() + impl->terminalIndices.size());
+            for (const auto& state: eDFA.states) {
+                bytes += sizeof(LR0EState) + 48 * (state->items.size() + state->transitions.size());
+            }
+            return make_pair(shared_ptr<const Impl>(impl), bytes);
+        });
+    }
+
+    CompiledGrammar::CompiledGrammar(const CompiledGrammar& rhs) : impl(rhs.impl), scratch(new Scratch()) {
+
+    }
+
+    CompiledGrammar::CompiledGrammar(CompiledGrammar&& rhs) = default;
+    CompiledGrammar::~CompiledGrammar() = default;
+
+    CompiledGrammar& CompiledGrammar::operator= (CompiledGrammar rhs) {
+        swap(impl, rhs.impl);
+        swap(scratch, rhs.scratch);
+        return *this;
+    }
+
+    bool CompiledGrammar::match(u32string_view input) {
+        auto& indices = scratch->earley.input;
+        indices.clear();
+        for (char32_t ch: input) {
+            if (isSpace(ch)) continue;
+            indices.push_back(impl->indexOf(ch));
+        }
+        return eDFAEarley(impl->eDFA, impl->startSymbol, scratch->earley);
+    }
+
+    bool CompiledGrammar::match(const string& input) {
+        auto& indices = scratch->earley.input;
+        indices.clear();
+        for (char32_t ch: utf8Reader(input)) {
+            if (isSpace(ch)) continue;
+            indices.push_back(impl->indexOf(ch));
+        }
+        return eDFAEarley(impl->eDFA, impl->startSymbol, scratch->earley);
+    }
+
+    vector<bool> CompiledGrammar::matchBatch(const vector<string>& inputs) {
+        vector<bool> result;
+        result.reserve(inputs.size());
+        for (const auto& input: inputs) {
+            result.push_back(match(input));
+        }
+        return result;
+    }
+
+    namespace {
+        /* Matchers may be called from several threads at once, but a CompiledGrammar may
+         * not. The EARLEY_LR0 matcher therefore keeps a pool of copies of the compiled
+         * grammar (which share everything but their scratch space), and each call borrows
+         * one for as long as it needs it. There are never more copies than there have
+         * been simultaneous calls, and each one keeps its scratch space between uses.
+         */
+        class CompiledGrammarPool {
+        public:
+            explicit CompiledGrammarPool(const CFG& cfg) : prototype(cfg) {
+
+            }
+
+            bool match(const string& input) {
+                auto compiled = borrow();
+                try {
+                    bool result = compiled->match(input);
+                    giveBack(std::move(compiled));
+                    return result;
+                } catch (...) {
+                    giveBack(std::move(compiled));
+                    throw;
+                }
+            }
+
+        private:
+            const CompiledGrammar prototype; // Never matched against, only copied
+            mutex lock;
+            vector<unique_ptr<CompiledGrammar>> idle;
+
+            unique_ptr<CompiledGrammar> borrow() {
+                {
+                    lock_guard<mutex> guard(lock);
+                    if (!idle.empty()) {
+                        auto result = std::move(idle.back());
+                        idle.pop_back();
+                        return result;
                     }
-                    result.insert(item);
                 }
-            } else {
-                for (const auto& item: items) {
-                    if (!dotAtEnd(item) && afterDot(item).type == Symbol::Type::NONTERMINAL) {
-                        /* Find all productions to use. */
-                        for (const auto& prod: cfg.productions) {
-                            if (prod.nonterminal == afterDot(item).ch) {
-                                /* Place the item in the result. */
-                                LR0Item item = { &prod, 0 };
-                                result.insert(item);
+                return make_unique<CompiledGrammar>(prototype);
+            }
 
-                                /* And if the item at the beginning is a nonterminal, add it for further
-                                 * processing.
-                                 */
-                                if (!dotAtEnd(item) && afterDot(item).type == Symbol::Type::NONTERMINAL) {
-                                    worklist.push(item);
-                                }
+            void giveBack(unique_ptr<CompiledGrammar> compiled) {
+                lock_guard<mutex> guard(lock);
+                idle.push_back(std::move(compiled));
+            }
+        };
+
+        Matcher earleyLR0MatcherFor(const CFG& cfg) {
+            auto pool = make_shared<CompiledGrammarPool>(cfg);
+            return [pool](const string& str) {
+                return pool->match(str);
+            };
+        }
+    }
+
+    /**************************************************************************
+     **************************************************************************
+     ***                 Deterministic Matcher Fast Paths                   ***
+     **************************************************************************
+     **************************************************************************
+
+     Plenty of the grammars we see don't need a general parser. Before falling
+     back on Earley, the AUTOMATIC matcher checks whether the grammar is in one
+     of the classic deterministic classes, in this order:
+
+       1. Regular: every production is right-linear (A -> wB or A -> w), or
+          every production is left-linear (A -> Bw or A -> w). These turn into
+          an NFA in the usual way, which we then make into a minimal DFA.
+       2. LL(1): no two productions for the same nonterminal are predicted by
+          the same lookahead, using the FIRST and FOLLOW sets from the grammar
+          analysis. These get a table-driven predictive parser.
+       3. LR(0), SLR(1), or LALR(1): the canonical LR(0) automaton has no
+          conflicts when reductions are placed on every lookahead, on the
+          FOLLOW set of the production's nonterminal, or on the LALR(1)
+          lookaheads, respectively. These get a shift-reduce parser.
+
+     Each of these does a bounded amount of work per character, so matching
+     is linear-time with small constants.
+
+     The LR(0) e-DFA used by the Earley matcher can't be reused for step 3: its
+     closures skip over nullable nonterminals, which is great for Earley but
+     isn't something a shift-reduce parser can act on. We build the canonical
+     automaton here instead.
+
+     Everything is checked against a cleaned copy of the grammar with duplicate
+     productions removed, since neither changes the language but both can
+     cause spurious conflicts.
+
+     *************************************************************************/
+    namespace {
+        /* Largest DFA we're willing to build for a regular grammar. The subset
+         * construction can blow up exponentially, and if it does, one of the
+         * parsers is a better bet anyway.
+         */
+        const size_t kMaxDFAStates = 1 << 12;
+
+        /* Table entry meaning "nothing here." */
+        const size_t kNoEntry = numeric_limits<size_t>::max();
+
+        /* The grammar as seen by all the fast paths: cleaned, deduplicated, and with a
+         * new start symbol S' -> S. Symbols are numbered using the grammar analysis.
+         * On right-hand sides, terminal t is encoded as t and nonterminal A as
+         * numTerminals + A.
+         */
+        struct DeterministicGrammar {
+            CFG cfg;
+            GrammarAnalysis analysis;
+
+            size_t numTerminals;    // Terminal numbers, plus one for end of input
+            size_t numNonterminals;
+            size_t start;
+
+            vector<size_t> lhs;
+            vector<vector<size_t>> rhs;
+            vector<vector<size_t>> productionsOf;
+
+            explicit DeterministicGrammar(const CFG& input);
+
+            bool isTerminal(size_t symbol) const {
+                return symbol < numTerminals;
+            }
+        };
+
+        CFG deterministicFormOf(const CFG& input) {
+            auto result = clean(input);
+            set<Production> unique(result.productions.begin(), result.productions.end());
+            result.productions.assign(unique.begin(), unique.end());
+            return addUniqueStartTo(result);
+        }
+
+        DeterministicGrammar::DeterministicGrammar(const CFG& input) :
+            cfg(deterministicFormOf(input)), analysis(cfg) {
+            numTerminals    = analysis.numTerminals();
+            numNonterminals = analysis.numNonterminals();
+            start           = analysis.idOf(cfg.startSymbol);
+
+            productionsOf.resize(numNonterminals);
+            for (const auto& prod: cfg.productions) {
+                productionsOf[analysis.idOf(prod.nonterminal)].push_back(lhs.size());
+                lhs.push_back(analysis.idOf(prod.nonterminal));
+
+                rhs.emplace_back();
+                for (const auto& s: prod.replacement) {
+                    rhs.back().push_back(s.type == Symbol::Type::TERMINAL? analysis.terminalIdOf(s.ch)
+                                                                         : numTerminals + analysis.idOf(s.ch));
+                }
+            }
+        }
+
+        /* Translates input strings into terminal numbers. As with the other matchers,
+         * whitespace is skipped and characters outside the alphabet are an error.
+         */
+        struct TerminalDecoder {
+            unordered_map<char32_t, size_t> ids;
+
+            void decode(const string& input, vector<size_t>& result) const {
+                result.clear();
+                for (char32_t ch: utf8Reader(input)) {
+                    if (isSpace(ch)) continue;
+
+                    auto itr = ids.find(ch);
+                    if (itr == ids.end()) throw runtime_error("Invalid character: " + toUTF8(ch));
+                    result.push_back(itr->second);
+                }
+            }
+        };
+
+        /* Wraps up one of the automata below as a Matcher. The buffers are per thread
+         * rather than per matcher, so that one matcher can be used from several threads
+         * at once. (Matching never calls another matcher, so one set per thread is
+         * enough.)
+         */
+        template <typename Automaton>
+        Matcher matcherUsing(shared_ptr<const TerminalDecoder> decoder, shared_ptr<const Automaton> automaton) {
+            return [=](const string& str) {
+                thread_local vector<size_t> input, stack;
+                decoder->decode(str, input);
+                return automaton->match(input, stack);
+            };
+        }
+
+        /***** Regular grammars *****/
+
+        /* Minimal DFA as a flat transition table. */
+        struct DFATable {
+            size_t numTerminals;
+            size_t start;
+            vector<size_t> next; // next[state * numTerminals + terminal]
+            vector<char> accepting;
+
+            bool match(const vector<size_t>& input, vector<size_t>&) const {
+                size_t state = start;
+                for (size_t terminal: input) {
+                    state = next[state * numTerminals + terminal];
+                }
+                return accepting[state];
+            }
+        };
+
+        /* Merges equivalent states of a complete DFA by repeatedly splitting states apart
+         * based on which groups their transitions lead to (Moore's algorithm).
+         */
+        DFATable minimize(const DFATable& dfa) {
+            size_t numStates = dfa.accepting.size();
+
+            vector<size_t> group(dfa.accepting.begin(), dfa.accepting.end());
+            size_t numGroups = 0;
+            while (true) {
+                map<vector<size_t>, size_t> groupOf;
+                vector<size_t> nextGroup(numStates);
+                for (size_t state = 0; state < numStates; state++) {
+                    vector<size_t> signature = { group[state] };
+                    for (size_t t = 0; t < dfa.numTerminals; t++) {
+                        signature.push_back(group[dfa.next[state * dfa.numTerminals + t]]);
+                    }
+                    nextGroup[state] = groupOf.insert(make_pair(signature, groupOf.size())).first->second;
+                }
+
+                group = nextGroup;
+                if (groupOf.size() == numGroups) break;
+                numGroups = groupOf.size();
+            }
+
+            DFATable result;
+            result.numTerminals = dfa.numTerminals;
+            result.start        = group[dfa.start];
+            result.next.resize(numGroups * dfa.numTerminals);
+            result.accepting.resize(numGroups);
+            for (size_t state = 0; state < numStates; state++) {
+                result.accepting[group[state]] = dfa.accepting[state];
+                for (size_t t = 0; t < dfa.numTerminals; t++) {
+                    result.next[group[state] * dfa.numTerminals + t] = group[dfa.next[state * dfa.numTerminals + t]];
+                }
+            }
+            return result;
+        }
+
+        /* If the grammar is right-linear or left-linear, builds a minimal DFA for it. */
+        bool regularFastPath(const DeterministicGrammar& g, DFATable& result) {
+            /* Which way, if either, is the grammar linear? */
+            bool rightLinear = true, leftLinear = true;
+            for (const auto& rhs: g.rhs) {
+                for (size_t i = 0; i < rhs.size(); i++) {
+                    if (g.isTerminal(rhs[i])) continue;
+                    if (i + 1 != rhs.size()) rightLinear = false;
+                    if (i != 0)              leftLinear  = false;
+                }
+            }
+            if (!rightLinear && !leftLinear) return false;
+
+            /* Build an NFA. There's one state per nonterminal, plus one more: for a right-
+             * linear grammar, it's the accepting state reached once a production has no
+             * nonterminal left to expand, and for a left-linear grammar it's the start
+             * state, from which we read the terminals of some A -> w to get to A. Edges
+             * are (terminal, destination) pairs, with numTerminals meaning epsilon.
+             */
+            size_t extra = g.numNonterminals;
+            vector<vector<pair<size_t, size_t>>> edges(extra + 1);
+            auto addPath = [&](size_t from, const vector<size_t>& word, size_t to) {
+                if (word.empty()) {
+                    edges[from].push_back(make_pair(g.numTerminals, to));
+                    return;
+                }
+                for (size_t i = 0; i < word.size(); i++) {
+                    size_t next = to;
+                    if (i + 1 != word.size()) {
+                        next = edges.size();
+                        edges.emplace_back();
+                    }
+                    edges[from].push_back(make_pair(word[i], next));
+                    from = next;
+                }
+            };
+
+            for (size_t p = 0; p < g.rhs.size(); p++) {
+                const auto& rhs = g.rhs[p];
+                if (rightLinear) {
+                    if (!rhs.empty() && !g.isTerminal(rhs.back())) {
+                        addPath(g.lhs[p], vector<size_t>(rhs.begin(), rhs.end() - 1), rhs.back() - g.numTerminals);
+                    } else {
+                        addPath(g.lhs[p], rhs, extra);
+                    }
+                } else {
+                    if (!rhs.empty() && !g.isTerminal(rhs.front())) {
+                        addPath(rhs.front() - g.numTerminals, vector<size_t>(rhs.begin() + 1, rhs.end()), g.lhs[p]);
+                    } else {
+                        addPath(extra, rhs, g.lhs[p]);
+                    }
+                }
+            }
+            size_t nfaStart  = rightLinear? g.start : extra;
+            size_t nfaAccept = rightLinear? extra   : g.start;
+
+            /* Epsilon closures of each NFA state. */
+            vector<vector<size_t>> closures(edges.size());
+            for (size_t state = 0; state < edges.size(); state++) {
+                vector<char> seen(edges.size());
+                vector<size_t> worklist = { state };
+                seen[state] = true;
+                while (!worklist.empty()) {
+                    size_t curr = worklist.back();
+                    worklist.pop_back();
+                    closures[state].push_back(curr);
+
+                    for (const auto& edge: edges[curr]) {
+                        if (edge.first == g.numTerminals && !seen[edge.second]) {
+                            seen[edge.second] = true;
+                            worklist.push_back(edge.second);
+                        }
+                    }
+                }
+                sort(closures[state].begin(), closures[state].end());
+            }
+
+            /* Subset construction, giving up if it gets too big. The empty set is a state
+             * like any other, so the result is complete.
+             */
+            DFATable dfa;
+            dfa.numTerminals = g.numTerminals;
+            dfa.start        = 0;
+
+            map<vector<size_t>, size_t> stateOf;
+            vector<vector<size_t>> subsets;
+            auto stateFor = [&](const vector<size_t>& subset) {
+                auto itr = stateOf.find(subset);
+                if (itr != stateOf.end()) return itr->second;
+
+                stateOf.insert(make_pair(subset, subsets.size()));
+                subsets.push_back(subset);
+                dfa.accepting.push_back(binary_search(subset.begin(), subset.end(), nfaAccept));
+                return subsets.size() - 1;
+            };
+            stateFor(closures[nfaStart]);
+
+            for (size_t curr = 0; curr < subsets.size(); curr++) {
+                if (subsets.size() > kMaxDFAStates) return false;
+
+                for (size_t t = 0; t < g.numTerminals; t++) {
+                    vector<size_t> successor;
+                    for (size_t state: subsets[curr]) {
+                        for (const auto& edge: edges[state]) {
+                            if (edge.first == t) {
+                                successor.insert(successor.end(), closures[edge.second].begin(), closures[edge.second].end());
                             }
                         }
                     }
+                    sort(successor.begin(), successor.end());
+                    successor.erase(unique(successor.begin(), successor.end()), successor.end());
+
+                    dfa.next.push_back(stateFor(successor));
+                }
+            }
+
+            result = minimize(dfa);
+            return true;
+        }
+
+        /***** LL(1) grammars *****/
+
+        /* Predictive parsing table, with right-hand sides stored backwards so they can
+         * be pushed onto the stack directly.
+         */
+        struct LL1Table {
+            size_t numTerminals;
+            size_t start;
+            vector<size_t> predict; // predict[nonterminal * (numTerminals + 1) + lookahead]
+            vector<vector<size_t>> reversedRHS;
+
+            bool match(const vector<size_t>& input, vector<size_t>& stack) const {
+                stack.assign(1, numTerminals + start);
+
+                size_t pos = 0;
+                while (!stack.empty()) {
+                    size_t top = stack.back();
+                    stack.pop_back();
+
+                    /* Terminals have to match the input. */
+                    if (top < numTerminals) {
+                        if (pos == input.size() || input[pos] != top) return false;
+                        pos++;
+                    }
+                    /* Nonterminals get expanded based on the lookahead. */
+                    else {
+                        size_t lookahead  = pos == input.size()? numTerminals : input[pos];
+                        size_t production = predict[(top - numTerminals) * (numTerminals + 1) + lookahead];
+                        if (production == kNoEntry) return false;
+
+                        stack.insert(stack.end(), reversedRHS[production].begin(), reversedRHS[production].end());
+                    }
+                }
+                return pos == input.size();
+            }
+        };
+
+        /* FIRST set of a string of symbols, along with whether the whole string is
+         * nullable.
+         */
+        GrammarAnalysis::Bitset firstOf(const DeterministicGrammar& g,
+                                        vector<size_t>::const_iterator begin,
+                                        vector<size_t>::const_iterator end,
+                                        bool& nullable) {
+            GrammarAnalysis::Bitset result(g.numTerminals + 1);
+            for (; begin != end; ++begin) {
+                if (g.isTerminal(*begin)) {
+                    result.insert(*begin);
+                    nullable = false;
+                    return result;
+                }
+
+                /* FIRST sets don't have room for the end of input, so they can't be
+                 * merged in wholesale.
+                 */
+                size_t nonterminal = *begin - g.numTerminals;
+                g.analysis.first(nonterminal).forEach([&](size_t terminal) {
+                    result.insert(terminal);
+                });
+                if (!g.analysis.nullable().contains(nonterminal)) {
+                    nullable = false;
+                    return result;
+                }
+            }
+            nullable = true;
+            return result;
+        }
+
+        bool ll1FastPath(const DeterministicGrammar& g, LL1Table& result) {
+            result.numTerminals = g.numTerminals;
+            result.start        = g.start;
+            result.predict.assign(g.numNonterminals * (g.numTerminals + 1), kNoEntry);
+
+            for (size_t p = 0; p < g.rhs.size(); p++) {
+                /* Predict this production on FIRST of its right-hand side, plus FOLLOW of
+                 * its nonterminal if the right-hand side can vanish.
+                 */
+                bool nullable;
+                auto lookaheads = firstOf(g, g.rhs[p].begin(), g.rhs[p].end(), nullable);
+                if (nullable) lookaheads.insertAll(g.analysis.follow(g.lhs[p]));
+
+                bool conflict = false;
+                lookaheads.forEach([&](size_t lookahead) {
+                    auto& entry = result.predict[g.lhs[p] * (g.numTerminals + 1) + lookahead];
+                    if (entry != kNoEntry) conflict = true;
+                    entry = p;
+                });
+                if (conflict) return false;
+
+                result.reversedRHS.emplace_back(g.rhs[p].rbegin(), g.rhs[p].rend());
+            }
+            return true;
+        }
+
+        /***** LR(0), SLR(1), and LALR(1) grammars *****/
+
+        /* Canonical LR(0) automaton. Items are numbered so that item itemBase[p] + k is
+         * production p with the dot before symbol k.
+         */
+        struct LR0Automaton {
+            vector<size_t> itemBase;
+            vector<size_t> productionOf; // By item
+            vector<size_t> dotOf;        // By item
+
+            vector<vector<size_t>> states; // Sorted closed item sets
+            vector<map<size_t, size_t>> transitions; // Symbol to state
+
+            /* Position of an item in a state, which must contain it. */
+            size_t positionOf(size_t state, size_t item) const {
+                const auto& items = states[state];
+                return lower_bound(items.begin(), items.end(), item) - items.begin();
+            }
+        };
+
+        LR0Automaton lr0AutomatonFor(const DeterministicGrammar& g) {
+            LR0Automaton result;
+            for (size_t p = 0; p < g.rhs.size(); p++) {
+                result.itemBase.push_back(result.productionOf.size());
+                for (size_t dot = 0; dot <= g.rhs[p].size(); dot++) {
+                    result.productionOf.push_back(p);
+                    result.dotOf.push_back(dot);
+                }
+            }
+            auto afterDot = [&](size_t item) {
+                size_t p = result.productionOf[item];
+                return result.dotOf[item] == g.rhs[p].size()? kNoEntry : g.rhs[p][result.dotOf[item]];
+            };
+
+            /* Adds X -> .gamma for each item with the dot before X, repeatedly. */
+            vector<char> inClosure(result.productionOf.size());
+            auto closureOf = [&](vector<size_t> items) {
+                for (size_t item: items) inClosure[item] = true;
+                for (size_t i = 0; i < items.size(); i++) {
+                    size_t symbol = afterDot(items[i]);
+                    if (symbol == kNoEntry || g.isTerminal(symbol)) continue;
+
+                    for (size_t p: g.productionsOf[symbol - g.numTerminals]) {
+                        if (!inClosure[result.itemBase[p]]) {
+                            inClosure[result.itemBase[p]] = true;
+                            items.push_back(result.itemBase[p]);
+                        }
+                    }
+                }
+                for (size_t item: items) inClosure[item] = false;
+
+                sort(items.begin(), items.end());
+                return items;
+            };
+
+            /* States are identified by their kernels. */
+            map<vector<size_t>, size_t> stateOf;
+            auto stateFor = [&](const vector<size_t>& kernel) {
+                auto itr = stateOf.find(kernel);
+                if (itr != stateOf.end()) return itr->second;
+
+                stateOf.insert(make_pair(kernel, result.states.size()));
+                result.states.push_back(closureOf(kernel));
+                result.transitions.emplace_back();
+                return result.states.size() - 1;
+            };
+            stateFor({ result.itemBase[g.productionsOf[g.start].front()] });
+
+            for (size_t state = 0; state < result.states.size(); state++) {
+                map<size_t, vector<size_t>> kernels;
+                for (size_t item: result.states[state]) {
+                    size_t symbol = afterDot(item);
+                    if (symbol != kNoEntry) kernels[symbol].push_back(item + 1);
+                }
+                for (const auto& entry: kernels) {
+                    size_t target = stateFor(entry.second);
+                    result.transitions[state][entry.first] = target;
                 }
             }
 
-            /* Now, compute the closure of the initial set. */
+            return result;
+        }
+
+        /* LALR(1) lookaheads for each item in each state, found by propagating lookaheads
+         * through the LR(0) automaton until nothing changes. Within a state, an item
+         * A -> alpha . B beta with lookaheads L gives each B -> .gamma the lookaheads
+         * FIRST(beta), plus L if beta is nullable. Across states, items keep their
+         * lookaheads when the dot moves.
+         */
+        vector<vector<GrammarAnalysis::Bitset>> lalrLookaheadsFor(const DeterministicGrammar& g,
+                                                                  const LR0Automaton& automaton) {
+            vector<vector<GrammarAnalysis::Bitset>> result;
+            for (const auto& items: automaton.states) {
+                result.emplace_back(items.size(), GrammarAnalysis::Bitset(g.numTerminals + 1));
+            }
+
+            /* FIRST(beta) and whether beta is nullable, for each item with beta after the
+             * symbol following the dot.
+             */
+            vector<GrammarAnalysis::Bitset> firstAfter;
+            vector<char> nullableAfter;
+            for (size_t item = 0; item < automaton.productionOf.size(); item++) {
+                const auto& rhs = g.rhs[automaton.productionOf[item]];
+                size_t dot = automaton.dotOf[item];
+
+                bool nullable = true;
+                firstAfter.push_back(dot < rhs.size()? firstOf(g, rhs.begin() + dot + 1, rhs.end(), nullable)
+                                                     : GrammarAnalysis::Bitset(g.numTerminals + 1));
+                nullableAfter.push_back(nullable);
+            }
+
+            /* S' -> .S is followed by the end of the input. */
+            result[0][automaton.positionOf(0, automaton.itemBase[g.productionsOf[g.start].front()])].insert(g.numTerminals);
+
+            deque<size_t> worklist = { 0 };
+            vector<char> queued(automaton.states.size());
+            queued[0] = true;
             while (!worklist.empty()) {
-                auto curr = worklist.front();
-                worklist.pop();
-                auto symbol = afterDot(curr);
-                if (symbol.type == Symbol::Type::TERMINAL) abort(); // Logic error!
+                size_t state = worklist.front();
+                worklist.pop_front();
+                queued[state] = false;
 
-                /* If the nonterminal is nullable, shift the dot forward. */
-                if (nullable.count(symbol.ch)) {
-                    auto next = advanceDot(curr);
-                    if (result.insert(next).second) {
-                        /* If the dot is before a nonterminal, add back for later processing. */
-                        if (!dotAtEnd(next) && afterDot(next).type == Symbol::Type::NONTERMINAL) {
-                            worklist.push(next);
+                const auto& items = automaton.states[state];
+                auto& lookaheads  = result[state];
+
+                /* Spread lookaheads to predicted items. */
+                for (bool changed = true; changed; ) {
+                    changed = false;
+                    for (size_t i = 0; i < items.size(); i++) {
+                        const auto& rhs = g.rhs[automaton.productionOf[items[i]]];
+                        size_t dot = automaton.dotOf[items[i]];
+                        if (dot == rhs.size() || g.isTerminal(rhs[dot])) continue;
+
+                        auto spread = firstAfter[items[i]];
+                        if (nullableAfter[items[i]]) spread.insertAll(lookaheads[i]);
+
+                        for (size_t p: g.productionsOf[rhs[dot] - g.numTerminals]) {
+                            if (lookaheads[automaton.positionOf(state, automaton.itemBase[p])].insertAll(spread)) {
+                                changed = true;
+                            }
                         }
                     }
                 }
 
-                /* If we're making the non-kernel state, do some predictions as
-                 * well.
-                 */
-                if (type == ClosureType::NON_KERNEL) {
-                    /* For each production S -> alpha, add S -> .alpha. */
-                    for (const Production& prod: cfg.productions) {
-                        if (prod.nonterminal == symbol.ch) {
-                            LR0Item next = { &prod, 0 };
-                            if (result.insert(next).second) {
-                                if (!dotAtEnd(next) && afterDot(next).type == Symbol::Type::NONTERMINAL) {
-                                    worklist.push(next);
-                                }
-                            }
-                        }
+                /* Carry them along transitions. */
+                for (size_t i = 0; i < items.size(); i++) {
+                    const auto& rhs = g.rhs[automaton.productionOf[items[i]]];
+                    size_t dot = automaton.dotOf[items[i]];
+                    if (dot == rhs.size()) continue;
+
+                    size_t target = automaton.transitions[state].at(rhs[dot]);
+                    if (result[target][automaton.positionOf(target, items[i] + 1)].insertAll(lookaheads[i]) &&
+                        !queued[target]) {
+                        queued[target] = true;
+                        worklist.push_back(target);
                     }
                 }
             }
@@ -2074,446 +5210,609 @@ namespace CFG {
             return result;
         }
 
-        /* Constructs the LR(0) e-state(s) associated with the given closure.
-         * If the provided closure is a kernel closure, we'll also build the
-         * non-kernel closure and link it in with the rest of things, though
-         * it won't be returned.
+        /* Shift-reduce parsing tables. Actions are encoded as kNoEntry for an error,
+         * 2s for a shift to state s, and 2p + 1 for a reduction by production p.
          */
-        LR0EState*
-        buildStateFor(const set<LR0Item>& closure,
-                      ClosureType type,
-                      const CFG& cfg,
-                      const Nulls& nullable,
-                      map<set<LR0Item>, shared_ptr<LR0EState>>& states,
-                      size_t indent = 2) {
-            /* If we already know this one, there's nothing to do. */
-            if (states.count(closure)) return states[closure].get();
+        struct LRTable {
+            size_t numTerminals;
+            size_t numNonterminals;
+            size_t accept; // The production S' -> S
+
+            vector<size_t> action; // action[state * (numTerminals + 1) + lookahead]
+            vector<size_t> goTo;   // goTo[state * numNonterminals + nonterminal]
+
+            vector<size_t> lhs;
+            vector<size_t> length;
+
+            bool match(const vector<size_t>& input, vector<size_t>& stack) const {
+                stack.assign(1, 0);
+
+                size_t pos = 0;
+                while (true) {
+                    size_t lookahead = pos == input.size()? numTerminals : input[pos];
+                    size_t entry = action[stack.back() * (numTerminals + 1) + lookahead];
+                    if (entry == kNoEntry) return false;
+
+                    /* Shift. */
+                    if (entry % 2 == 0) {
+                        stack.push_back(entry / 2);
+                        pos++;
+                    }
+                    /* Reduce. Reducing the start production means we're done, provided
+                     * that's the end of the input.
+                     */
+                    else {
+                        size_t production = entry / 2;
+                        if (production == accept) return pos == input.size();
 
-            if (kParserVerbose) {
-                cout << string(indent, ' ') << "State: (" << type << ")" << endl;
-                for (const auto& item: closure) {
-                    cout << string(indent, ' ') << "  " << item << endl;
+                        stack.resize(stack.size() - length[production]);
+                        stack.push_back(goTo[stack.back() * numNonterminals + lhs[production]]);
+                    }
                 }
             }
+        };
 
-            auto state = make_shared<LR0EState>();
-            state->items = closure;
-            state->index = states.size(); // Next free number
+        /* Fills in the parsing tables, placing each reduction on the lookaheads given by
+         * the callback. Returns whether there were no conflicts.
+         */
+        template <typename Lookaheads>
+        bool lrTableFor(const DeterministicGrammar& g, const LR0Automaton& automaton,
+                        Lookaheads lookaheadsFor, LRTable& result) {
+            size_t numStates = automaton.states.size();
+
+            result.numTerminals    = g.numTerminals;
+            result.numNonterminals = g.numNonterminals;
+            result.accept          = g.productionsOf[g.start].front();
+            result.action.assign(numStates * (g.numTerminals + 1), kNoEntry);
+            result.goTo.assign(numStates * g.numNonterminals, kNoEntry);
+            result.lhs = g.lhs;
+            result.length.clear();
+            for (const auto& rhs: g.rhs) {
+                result.length.push_back(rhs.size());
+            }
 
-            if (kParserVerbose) cout << string(indent, ' ') << "Number " << state->index << endl;
+            for (size_t state = 0; state < numStates; state++) {
+                for (const auto& transition: automaton.transitions[state]) {
+                    if (g.isTerminal(transition.first)) {
+                        result.action[state * (g.numTerminals + 1) + transition.first] = 2 * transition.second;
+                    } else {
+                        result.goTo[state * g.numNonterminals + transition.first - g.numTerminals] = transition.second;
+                    }
+                }
 
-            /* Store the state now so we don't infinitely loop. :-) */
-            states[closure] = state;
+                const auto& items = automaton.states[state];
+                for (size_t i = 0; i < items.size(); i++) {
+                    size_t production = automaton.productionOf[items[i]];
+                    if (automaton.dotOf[items[i]] != g.rhs[production].size()) continue;
 
-            /* Fill in transitions. */
-            vector<Symbol> follows;
-            for (char32_t ch: cfg.nonterminals) {
-                follows.push_back({ Symbol::Type::NONTERMINAL, ch });
-            }
-            for (char32_t ch: cfg.alphabet) {
-                follows.push_back({ Symbol::Type::TERMINAL, ch });
+                    bool conflict = false;
+                    lookaheadsFor(state, i, production).forEach([&](size_t lookahead) {
+                        auto& entry = result.action[state * (g.numTerminals + 1) + lookahead];
+                        if (entry != kNoEntry) conflict = true;
+                        entry = 2 * production + 1;
+                    });
+                    if (conflict) return false;
+                }
             }
+            return true;
+        }
 
-            for (Symbol s: follows) {
-                /* See if there's anything resulting from a dot shift here. */
-                auto next = closureOf(advanceDot(closure, s), cfg, nullable, ClosureType::KERNEL);
-                if (next.empty()) {
-                    state->transitions[s] = nullptr;
-                } else {
-                    if (kParserVerbose) {
-                        cout << string(indent, ' ') << "On " << s << ", we go here: " << endl;
-                        for (const auto& item: next) {
-                            cout << string(indent, ' ') << "  " << item << endl;
-                        }
-                    }
+        /* Tries LR(0), then SLR(1), then LALR(1), reporting which one worked. */
+        bool lrFastPath(const DeterministicGrammar& g, LRTable& result, GrammarClass& kind) {
+            auto automaton = lr0AutomatonFor(g);
 
-                    state->transitions[s] = buildStateFor(next, ClosureType::KERNEL, cfg, nullable, states, indent + 4);
-                }
+            GrammarAnalysis::Bitset everything(g.numTerminals + 1);
+            for (size_t t = 0; t <= g.numTerminals; t++) {
+                everything.insert(t);
+            }
+            if (lrTableFor(g, automaton, [&](size_t, size_t, size_t) -> const GrammarAnalysis::Bitset& {
+                return everything;
+            }, result)) {
+                kind = GrammarClass::LR0;
+                return true;
             }
 
-            /* If this is a kernel state, create the non-kernel state for it as well. */
-            if (type == ClosureType::KERNEL) {
-                /* Get the non-kernel closure. It may be empty, which would happen if we
-                 * have no dots before nonterminals.
-                 */
-                auto next = closureOf(closure, cfg, nullable, ClosureType::NON_KERNEL);
-                if (next.empty()) {
-                    state->epsilon = nullptr;
-                    if (kParserVerbose) cout << string(indent, ' ') << "  No epsilon." << endl;
-                } else {
-                    if (kParserVerbose) cout << string(indent, ' ') << "  Epsilon exists. Processing." << endl;
-                    state->epsilon = buildStateFor(next, ClosureType::NON_KERNEL, cfg, nullable, states, indent + 4);
-                }
+            if (lrTableFor(g, automaton, [&](size_t, size_t, size_t production) -> const GrammarAnalysis::Bitset& {
+                return g.analysis.follow(g.lhs[production]);
+            }, result)) {
+                kind = GrammarClass::SLR1;
+                return true;
             }
-            /* Otherwise, we have no epsilon. */
-            else {
-                state->epsilon = nullptr;
+
+            auto lookaheads = lalrLookaheadsFor(g, automaton);
+            if (lrTableFor(g, automaton, [&](size_t state, size_t index, size_t) -> const GrammarAnalysis::Bitset& {
+                return lookaheads[state][index];
+            }, result)) {
+                kind = GrammarClass::LALR1;
+                return true;
             }
 
-            return state.get();
+            return false;
         }
 
-        struct EDFAEarleyItem {
-            const LR0EState* state;
-            size_t itemPos;
+        /* The most specific class a grammar falls into, along with a matcher for it. For
+         * GENERAL grammars, there's no matcher. Copies of the matcher share its tables.
+         */
+        struct FastPath {
+            GrammarClass kind;
+            Matcher matcher;
         };
-    }
-}
-namespace std {
-    template <> struct hash<CFG::EDFAEarleyItem> {
-        size_t operator()(const CFG::EDFAEarleyItem& e) const {
-            return size_t(e.state) + e.itemPos * 0xFFFF;
+
+        shared_ptr<const FastPath> fastPathFor(const CFG& cfg) {
+            return Cache::lookup<FastPath>(keyFor("Fast path", cfg), [&] {
+                DeterministicGrammar g(cfg);
+                auto result = make_shared<FastPath>();
+
+                auto decoder = make_shared<TerminalDecoder>();
+                for (char32_t ch: g.cfg.alphabet) {
+                    decoder->ids[ch] = g.analysis.terminalIdOf(ch);
+                }
+                size_t bytes = sizeof(FastPath) + sizeof(TerminalDecoder) + 32 * decoder->ids.size();
+
+                auto dfa = make_shared<DFATable>();
+                auto ll1 = make_shared<LL1Table>();
+                auto lr  = make_shared<LRTable>();
+                if (regularFastPath(g, *dfa)) {
+                    result->kind    = GrammarClass::REGULAR;
+                    result->matcher = matcherUsing<DFATable>(decoder, dfa);
+                    bytes += sizeof(DFATable) + bytesOf(dfa->next) + bytesOf(dfa->accepting);
+                } else if (ll1FastPath(g, *ll1)) {
+                    result->kind    = GrammarClass::LL1;
+                    result->matcher = matcherUsing<LL1Table>(decoder, ll1);
+                    bytes += sizeof(LL1Table) + bytesOf(ll1->predict) + bytesOf(ll1->reversedRHS);
+                } else if (lrFastPath(g, *lr, result->kind)) {
+                    result->matcher = matcherUsing<LRTable>(decoder, lr);
+                    bytes += sizeof(LRTable) + bytesOf(lr->action) + bytesOf(lr->goTo) +
+                             bytesOf(lr->lhs) + bytesOf(lr->length);
+                } else {
+                    result->kind = GrammarClass::GENERAL;
+                }
+
+                return make_pair(shared_ptr<const FastPath>(result), bytes);
+            });
         }
-    };
-}
-namespace CFG {
-    namespace {
-        /* For debugging. */
-        ostream& operator<< (ostream& out, const EDFAEarleyItem& item) {
-            for (const auto& lri: item.state->items) {
-                out << lri << " @" << item.itemPos << endl;
-            }
-            return out;
+
+        Matcher automaticMatcherFor(const CFG& cfg) {
+            auto fastPath = fastPathFor(cfg);
+            return fastPath->matcher? fastPath->matcher : earleyLR0MatcherFor(cfg);
         }
+    }
 
-        void printItems(const vector<vector<EDFAEarleyItem>>& items, size_t index) {
-            cout << "=== Items at index " << index << " === " << endl;
-            for (const auto& item: items[index]) {
-                for (const auto& lri: item.state->items) {
-                    cout << "  " << lri << " @" << item.itemPos << endl;
-                }
-                cout << endl;
-            }
-            cout << "=========================" << endl;
+    GrammarClass classify(const CFG& cfg) {
+        return fastPathFor(cfg)->kind;
+    }
+
+    Matcher matcherFor(const CFG& cfg, MatcherType type) {
+        if (type == MatcherType::EARLEY) {
+            return earleyMatcherFor(cfg);
+        } else if (type == MatcherType::CYK) {
+            return cykMatcherFor(cfg);
+        } else if (type == MatcherType::VALIANT) {
+            return valiantMatcherFor(cfg);
+        } else if (type == MatcherType::GLL) {
+            return gllMatcherFor(cfg);
+        } else if (type == MatcherType::EARLEY_LR0) {
+            return earleyLR0MatcherFor(cfg);
+        } else if (type == MatcherType::AUTOMATIC) {
+            return automaticMatcherFor(cfg);
+        } else {
+            throw runtime_error("Unknown matcher type.");
         }
+    }
 
-        /* The "hot" part of the code here consists of inserting and tracking previous
-         * Earley items. Specifically, we need to be able to perform the following
-         * operations quickly:
-         *
-         *   1. Determine whether a particular triple of (state + @n + item index)
-         *      exists. (This is done during the scan/complete/predict steps.)
-         *   2. Add such a triplet to the collection.
-         *   3. Iterate over all (state + @n) items in a given index.
-         *
-         * Originally, we did this by having a vector<unordered_set<EDFAEarleyItem>>
-         * that held everything. The problem here is that the unordered_set was taking
-         * a while - I guess it doesn't have the best performance and the cost of
-         * hashing is a bit high?
-         *
-         * Instead, we're going to make a time/space tradeoff. Empirically, we usually
-         * have something like ~50 states, and our strings are short (say, 25 characters
-         * long). If we store all possible state/pos/pos pairs, that requies us to use
-         * about 50 * 25 * 25 = 31,250 combinations. (We could potentially halve this if
-         * we wanted to because we know that the indices are always sorted, but let's
-         * ignore that for now). If we imagine that each combination is a single bit,
-         * then we need about 4k memory, tops, to hold all of these combinations.
-         *
-         * As an optimization, we'll allocate that array and then use it instead of a
-         * hash table. We'll then use a simpler vector<vector<EDFAEarleyItem>> to hold
-         * the actual items, still letting us scan over things if we need them.
+    namespace {
+        /* Base index for Unicode characters for nonterminals. Just for fun, I've
+         * picked it to be near a bunch of cute symbols and emojis. :-)
          */
-        struct Bitmap3D {
-            vector<uint64_t> bits;
-            size_t widthMultiplier;
-            size_t depthMultiplier;
+        const char32_t kBaseUnicode = 0x1F300;
 
-            Bitmap3D(size_t w, size_t d, size_t h) : bits((w * d * h + 63) / 64),
-                                                     widthMultiplier(d * h),
-                                                     depthMultiplier(h) {
-                // (w * d * h + 63) / 64 is ceil(wdh / 64).
-                // Index calculation is (x, y, z) -> x * d * h + y * h + z,
-                // so we store dh and h.
-            }
-        };
+        /* Largest valid Unicode code point. */
+        const char32_t kMaxUnicode = 0x10FFFF;
+    }
 
-        bool insert(vector<vector<EDFAEarleyItem>>& items,
-                    Bitmap3D& bitmap,
-                    size_t index, const EDFAEarleyItem& item) {
-            size_t   pos     = index * bitmap.widthMultiplier + item.state->index * bitmap.depthMultiplier + item.itemPos;
-            size_t   arrSlot = pos >> 6;                  // Pos / 64
-            uint64_t bit     = uint64_t(1) << (pos & 63); // Pos % 64
+    /**************************************************************************
+     **************************************************************************
+     ***                      Equivalence Checking                          ***
+     **************************************************************************
+     **************************************************************************/
 
-            if (kParserVerbose) cout << "Attempting to add this item to slot " << index << ":" << endl;
-            if (kParserVerbose) cout << item << endl;
-            if (kParserVerbose) cout << "Position: " << pos << endl;
-            if (kParserVerbose) cout << "ArrSlot:  " << arrSlot << endl;
-            if (kParserVerbose) cout << "Bit:      " << (pos & 63) << endl;
+    namespace {
+        /* Number of trials making up one unit of work handed to a thread. */
+        const size_t kTrialsPerTask = 50;
 
-            if (bitmap.bits[arrSlot] & bit) {
-                if (kParserVerbose) cout << "Already exists." << endl;
-                return false;
+        /* Seconds elapsed since the given time. */
+        double secondsSince(chrono::steady_clock::time_point start) {
+            return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+
+        /* Strings of one length already confirmed to be in both languages, shared
+         * across threads.
+         */
+        struct TestedStrings {
+            mutex lock;
+            unordered_set<string> strings;
+
+            /* Records a string, returning whether it's new. */
+            bool add(const string& str) {
+                lock_guard<mutex> guard(lock);
+                return strings.insert(str).second;
             }
+        };
+    }
 
-            if (kParserVerbose) cout << "This is new, and is added." << endl;
+    EquivalenceReport probablyEquivalent(const CFG& one, const CFG& two, const EquivalenceOptions& options) {
+        EquivalenceReport result;
 
-            bitmap.bits[arrSlot] |= bit;
-            items[index].push_back(item);
-            return true;
-        }
+        auto start = chrono::steady_clock::now();
+        auto match1 = matcherFor(one, options.matcherType);
+        auto match2 = matcherFor(two, options.matcherType);
+        result.matcherSeconds = secondsSince(start);
 
-        /* Runs the e-DFA-backed version of Earley. */
-        bool eDFAEarley(const LR0EDFA& eDFA, size_t startSymbol, const vector<size_t>& input) {
-            /* Item storage per slot. */
-            vector<vector<EDFAEarleyItem>> items(input.size() + 1);
+        start = chrono::steady_clock::now();
+        auto gen1 = generatorFor(one, options.seed);
+        auto gen2 = generatorFor(two, options.seed);
+        result.generatorSeconds = secondsSince(start);
 
-            /* Bitmap, as described above. Dimensions are index / state # / item position. */
-            Bitmap3D bitmap(input.size() + 1, eDFA.states.size(), input.size() + 1);
+        start = chrono::steady_clock::now();
 
-            /* Seed with the initial state, and its epsilon if it has one. */
-            insert(items, bitmap, 0, { eDFA.start, 0 });
-            //items[0].insert({ eDFA.start, 0 });
-            if (eDFA.start->epsilon) {
-                //items[0].insert({ eDFA.start->epsilon, 0 });
-                insert(items, bitmap, 0, { eDFA.start->epsilon, 0 });
-            }
+        /* Work is divided into tasks, each a batch of trials at a single length, ordered so
+         * that short lengths come first. Each task seeds its generators from the task number,
+         * so the strings tried don't depend on which thread picks it up.
+         */
+        const size_t tasksPerLength = (options.trialsPerLength + kTrialsPerTask - 1) / kTrialsPerTask;
+        const size_t numTasks = options.maxLength * tasksPerLength;
+
+        vector<TestedStrings> tested(options.maxLength);
+        atomic<size_t> nextTask(0);
+        atomic<size_t> stringsTested(0);
+        atomic<bool>   done(false);
+        mutex resultLock;
+
+        exception_ptr error;
+        auto worker = [&] {
+            try {
+                /* Each thread gets its own generators, since each has its own random number
+                 * generator. They share their tables. Matchers can be shared as they are.
+                 */
+                auto ourGen1 = gen1, ourGen2 = gen2;
 
-            /* Run the main loop. Note that the traditional roles of "scan," "complete,"
-             * and "predict" have been fused together in several ways.
-             *
-             * This loop is unusual in that it needs to run one more time than what
-             * we'd usually expect to see, because some of the "predict" logic has been
-             * offloaded into the very last iteration.
-             */
-            for (size_t i = 0; i <= input.size(); i++) {
-                if (kParserVerbose) cout << "Before: " << endl;
-                if (kParserVerbose) printItems(items, i);
+                /* Returns whether str, generated by one grammar, is generated by the other. */
+                auto check = [&](size_t length, const string& str, const Matcher& other) {
+                    if (!tested[length].add(str)) return true;
+                    stringsTested++;
 
-                /* Create a worklist of what we need to process in this column.
-                 *
-                 * TODO: This could conceivably be done by just iterating over the items in
-                 * the current column. In fact, that would probably be faster!
-                 */
-                queue<EDFAEarleyItem> worklist;
-                for (const auto& item: items[i]) {
-                    worklist.push(item);
-                }
+                    if (other(str)) return true;
 
-                while (!worklist.empty()) {
-                    auto curr = worklist.front();
-                    worklist.pop();
+                    lock_guard<mutex> guard(resultLock);
+                    if (!done.exchange(true)) {
+                        result.equivalent = false;
+                        result.counterexample = str;
+                    }
+                    return false;
+                };
 
-                    if (kParserVerbose) cout << "Processing this state:" << endl;
-                    if (kParserVerbose) cout << curr << endl;
+                for (size_t task; !done && (task = nextTask++) < numTasks; ) {
+                    size_t length = task / tasksPerLength;
+                    size_t first  = (task % tasksPerLength) * kTrialsPerTask;
+                    size_t last   = min(first + kTrialsPerTask, options.trialsPerLength);
+
+                    seed_seq seeds{ uint_fast32_t(options.seed), uint_fast32_t(task) };
+                    uint_fast32_t taskSeeds[2];
+                    seeds.generate(taskSeeds, taskSeeds + 2);
+                    ourGen1.seed(taskSeeds[0]);
+                    ourGen2.seed(taskSeeds[1]);
+
+                    for (size_t trial = first; trial < last && !done; trial++) {
+                        /* L(one) subset L(two)? */
+                        auto str1 = ourGen1(length);
+                        if (str1.first && !check(length, str1.second, match2)) return;
+
+                        /* L(two) subset L(one)? */
+                        auto str2 = ourGen2(length);
+                        if (str2.first && !check(length, str2.second, match1)) return;
+                    }
+                }
+            } catch (...) {
+                /* Pass the problem back to the calling thread. */
+                lock_guard<mutex> guard(resultLock);
+                if (!error) error = current_exception();
+                done = true;
+            }
+        };
 
-                    /* Do not do a scan step if we are in the last column. */
-                    if (i != input.size()) {
-                        /* "Scan" step. Shift each dot over the current symbol. */
-                        //auto* next = curr.state->transitions.at({ Symbol::Type::TERMINAL, input[i]});
-                        auto* next = eDFA.goTo.at(curr.state->index * eDFA.multiplier + input[i]);
-                        if (next != nullptr) {
-                            if (kParserVerbose) cout << "Scanning produces this state:" << endl;
-                            if (kParserVerbose) cout << next->items << endl;
+        size_t threads = options.threads;
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        threads = min(threads, numTasks);
 
-                            /* Item position hasn't changed; we're still scanning from the same
-                             * start position.
-                             */
-                            //items[i + 1].insert({ next, curr.itemPos });
-                            insert(items, bitmap, i + 1, { next, curr.itemPos });
+        vector<thread> workers;
+        for (size_t i = 1; i < threads; i++) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto& w: workers) {
+            w.join();
+        }
+        if (error) rethrow_exception(error);
 
-                            /* We may have an epsilon, too! If we do, this corresponds to a "predict"
-                             * step and the items start at the next position.
-                             */
-                            if (next->epsilon) {
-                                if (kParserVerbose) cout << "This has an epsilon production in it." << endl;
-                                if (kParserVerbose) cout << next->epsilon->items << endl;
+        result.stringsTested  = stringsTested;
+        result.testingSeconds = secondsSince(start);
+        return result;
+    }
 
-                                //items[i + 1].insert({ next->epsilon, i + 1 });
-                                insert(items, bitmap, i + 1, { next->epsilon, i + 1 });
-                            }
-                        } else {
-                            if (kParserVerbose) cout << "Nothing here transitions on " << toUTF8(input[i]) << endl;
-                        }
-                    }
+    namespace {
+        /* Exact counts, by length, of the derivations of a grammar (after the same cleanup the
+         * generator does), along with routines to list the strings they derive.
+         */
+        class LengthCounts {
+        public:
+            LengthCounts(const CFG& cfg, size_t maxLength) : grammar(cfg) {
+                fillTable<ExactArithmetic>(grammar, table, maxLength);
+            }
 
-                    /* "Complete" step. This is a bit different from usual. In particular:
-                     *
-                     * 1. We will be updating the CURRENT set, not the next one. The reason
-                     *    for this is that we aren't doing explicit "predict" steps, meaning
-                     *    that the sets we set up in the previous step might not have been
-                     *    fully expanded out.
-                     * 2. We have to factor in epsilon transitions in the automaton, which
-                     *    represent that missing "predict" step.
-                     * 3. We don't process any items that begin at the current location. The
-                     *    reason for this is that any completed items that occur at the current
-                     *    location correspond to items that were completed via nulling, and
-                     *    we've already precomputed everything that's going to happen as a result.
-                     *    (Plus, from an automaton perspective, we don't want to shift the
-                     *    nonterminals here without having read something).
-                     */
-                    if (curr.itemPos == i) continue;
+            /* Number of derivations of strings of length n. This is at least the number of
+             * such strings, and exactly that if the grammar is unambiguous.
+             */
+            uint64_t countOf(size_t n) const {
+                if (n == 0) return grammar.hasEpsilon;
+                if (grammar.start == kNotNonterminal) return 0;
+                return count(n, grammar.start);
+            }
 
-                    if (kParserVerbose) cout << "Looking for completions." << endl;
-                    for (size_t completed: eDFA.completed[curr.state->index]) {
-                        if (kParserVerbose) cout << "Nonterminal index " << completed << " is completed." << endl;
+            /* All strings of length n. Strings derived from each nonterminal and from each
+             * slot onward are memoized by length, so each is assembled once from its parts
+             * however many derivations it has.
+             */
+            const set<string>& stringsOf(size_t n) {
+                static const set<string> kNone, kJustEpsilon = { "" };
 
-                        /* Find items to shift over. */
-                        for (const auto& prev: items[curr.itemPos]) {
-                            /* See where to go; if the answer is "nowhere," skip this. */
-                            //auto next = prev.state->transitions.at({Symbol::Type::NONTERMINAL, completed});
+                if (countOf(n) == 0) return kNone;
+                if (n == 0) return kJustEpsilon;
+                return stringsOf(grammar.start, n);
+            }
 
-                            auto next = eDFA.goTo.at(prev.state->index * eDFA.multiplier + completed);
-                            if (!next) continue;
+            /* The first string of length n we can find, which must exist. */
+            string someStringOf(size_t n) const {
+                if (countOf(n) == 0) abort(); // Logic error!
 
-                            /* Standard "complete" step: the item position hasn't
-                             * changed; we've just made more progress.
-                             */
-                            //if (items[i].insert({ next, prev.itemPos }).second) {
-                            if (insert(items, bitmap, i, { next, prev.itemPos })) {
-                                worklist.push({ next, prev.itemPos });
+                string result;
+                if (n > 0) someStringOf(grammar.start, n, result);
+                return result;
+            }
 
-                                /* "Predict" step. Check if there's an epsilon and,
-                                 * if so, those items start here because they
-                                 * correspond to expanding out something that appears
-                                 * after a dot in a non-epsilon way.
-                                 */
-                                if (next->epsilon) {
-                                    //if (items[i].insert({ next->epsilon, i }).second) {
-                                    if (insert(items, bitmap, i, { next->epsilon, i })) {
-                                        worklist.push({ next->epsilon, i });
-                                    }
+        private:
+            Generator::Impl grammar;
+            CountTable<uint64_t> table;
+            map<pair<size_t, size_t>, set<string>> stringsCache; // By (nonterminal, length)
+            map<pair<size_t, size_t>, set<string>> tailCache;    // By (slot, length)
+
+            uint64_t count(size_t n, size_t nonterminal) const {
+                return table.count[n * grammar.numNonterminals() + nonterminal];
+            }
+            uint64_t tail(size_t n, size_t slot) const {
+                return table.tail[n * grammar.slots.size() + slot];
+            }
+
+            const set<string>& stringsOf(size_t nonterminal, size_t n) {
+                auto key = make_pair(nonterminal, n);
+                if (!stringsCache.count(key)) {
+                    set<string> result;
+                    for (size_t p = grammar.productionsBegin[nonterminal]; p < grammar.productionsBegin[nonterminal + 1]; p++) {
+                        const auto& strings = stringsFrom(grammar.slotBase[p], n);
+                        result.insert(strings.begin(), strings.end());
+                    }
+                    stringsCache[key] = std::move(result);
+                }
+                return stringsCache[key];
+            }
+
+            /* Every string of length n derived from the given slot onward. */
+            const set<string>& stringsFrom(size_t s, size_t n) {
+                auto key = make_pair(s, n);
+                if (!tailCache.count(key)) {
+                    const auto& slot = grammar.slots[s];
+
+                    set<string> result;
+                    if (tail(n, s) == 0) {
+                        // Nothing to find
+                    } else if (slot.remaining == 0) {
+                        result.insert("");
+                    } else if (slot.nonterminal == kNotNonterminal) {
+                        for (const auto& rest: stringsFrom(s + 1, n - 1)) {
+                            result.insert(toUTF8(slot.terminal) + rest);
+                        }
+                    } else {
+                        /* Split the length between this nonterminal and everything after it. */
+                        for (size_t k = 1; k + slot.remaining - 1 <= n; k++) {
+                            if (count(k, slot.nonterminal) == 0 || tail(n - k, s + 1) == 0) continue;
+
+                            const auto& rests = stringsFrom(s + 1, n - k);
+                            for (const auto& first: stringsOf(slot.nonterminal, k)) {
+                                for (const auto& rest: rests) {
+                                    result.insert(first + rest);
                                 }
                             }
                         }
                     }
+                    tailCache[key] = std::move(result);
                 }
-
-                if (kParserVerbose) cout << "After: " << endl;
-                if (kParserVerbose) printItems(items, i);
+                return tailCache[key];
             }
 
-            /* See if anything completes the start. */
-            for (const auto& item: items.back()) {
-                if (item.itemPos == 0) {
-                    const auto& completed = eDFA.completed.at(item.state->index);
-                    if (find(completed.begin(), completed.end(), startSymbol) != completed.end()) {
-                        return true;
+            /* Like generateNonterminal, but always takes the first viable option. */
+            void someStringOf(size_t nonterminal, size_t n, string& result) const {
+                size_t p = grammar.productionsBegin[nonterminal];
+                while (tail(n, grammar.slotBase[p]) == 0) p++;
+
+                for (size_t s = grammar.slotBase[p]; grammar.slots[s].remaining != 0; s++) {
+                    const auto& slot = grammar.slots[s];
+                    if (slot.nonterminal == kNotNonterminal) {
+                        result += toUTF8(slot.terminal);
+                        n--;
+                    } else if (slot.remaining == 1) {
+                        someStringOf(slot.nonterminal, n, result);
+                        n = 0;
+                    } else {
+                        size_t k = 1;
+                        while (count(k, slot.nonterminal) == 0 || tail(n - k, s + 1) == 0) k++;
+
+                        someStringOf(slot.nonterminal, k, result);
+                        n -= k;
                     }
                 }
             }
+        };
 
-            return false;
-        }
+        /* Returns a DFA for the strings of exactly the given length that begin with the
+         * given prefix.
+         */
+        Automata::DFA lengthDFA(const Languages::Alphabet& alphabet, size_t length, const u32string& prefix) {
+            Automata::DFA result;
+            result.alphabet = alphabet;
 
-        /* Builds the index used by the DFA matcher to translate from symbols to indices. */
-        void buildIndex(LR0EDFA& eDFA, const CFG& cfg) {
-            /* Lay them out linearly. */
-            for (char32_t ch: cfg.nonterminals) {
-                eDFA.toIndex.insert(make_pair(Symbol{ Symbol::Type::NONTERMINAL, ch }, eDFA.toIndex.size()));
+            vector<Automata::State*> states;
+            for (size_t i = 0; i <= length; i++) {
+                states.push_back(result.newState("q" + to_string(i), i == 0, i == length));
             }
-            for (char32_t ch: cfg.alphabet) {
-                eDFA.toIndex.insert(make_pair(Symbol{ Symbol::Type::TERMINAL, ch }, eDFA.toIndex.size()));
-            }
-
-            eDFA.multiplier = eDFA.toIndex.size();
-        }
+            auto* dead = result.newState("dead");
 
-        /* Builds the GOTO table for the given eDFA. This works by linearizing the individual
-         * transition tables based on the ordering given in the index.
-         */
-        void buildGoToTable(LR0EDFA& eDFA) {
-            /* We have one slot per symbol (eDFA.toIndex.size()) per state. */
-            eDFA.goTo.resize(eDFA.states.size() * eDFA.multiplier);
-            for (const auto& state: eDFA.states) {
-                for (const auto& entry: eDFA.toIndex) {
-                    size_t index = state->index * eDFA.multiplier + entry.second;
-                    eDFA.goTo.at(index) = state->transitions[entry.first];
+            for (size_t i = 0; i <= length; i++) {
+                for (char32_t ch: alphabet) {
+                    bool ok = i < length && (i >= prefix.size() || prefix[i] == ch);
+                    states[i]->transitions.insert(make_pair(ch, ok? states[i + 1] : dead));
                 }
             }
+            for (char32_t ch: alphabet) {
+                dead->transitions.insert(make_pair(ch, dead));
+            }
+
+            return result;
         }
 
-        /* Builds the 'completed' table for the given eDFA. This maps each state to the set
-         * of nonterminals that end there. However, for efficiency each nonterminal is replaced
-         * by an index.
+        /* A block of strings of one length sharing a common prefix, along with each grammar
+         * restricted to just those strings.
          */
-        void buildCompletedTable(LR0EDFA& eDFA) {
-            eDFA.completed.resize(eDFA.states.size());
-            for (const auto& state: eDFA.states) {
-                /* Look at all items here and find the completed ones. */
-                set<size_t> completed;
-                for (const auto& item: state->items) {
-                    /* If completed, this nonterminal - or at least, its translated version - is completed. */
-                    if (dotAtEnd(item)) {
-                        completed.insert(eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, item.production->nonterminal }));
-                    }
-                }
-
-                eDFA.completed.at(state->index).assign(completed.begin(), completed.end());
-            }
-        }
+        struct StringBlock {
+            u32string prefix;
+            shared_ptr<LengthCounts> lhs, rhs;
+        };
+    }
 
-        Matcher earleyLR0MatcherFor(const CFG& cfg) {
-            /* Clone the grammar so we have a persistent copy. */
-            auto ourCFG = make_shared<CFG>(addUniqueStartTo(cfg));
+    BoundedEquivalenceReport boundedEquivalent(const CFG& one, const CFG& two, size_t maxLength,
+                                               const BoundedEquivalenceOptions& options) {
+        if (one.alphabet != two.alphabet) throw runtime_error("Alphabets don't match.");
 
-            /* Need to know what's nullable to do dot shifts. */
-            auto nulls = nullablesOf(*ourCFG);
+        BoundedEquivalenceReport result;
+        if (maxLength == 0) return result;
 
-            /* Map from LR(0) e-configurating sets to states. */
-            map<set<LR0Item>, shared_ptr<LR0EState>> states;
+        auto whole1 = make_shared<LengthCounts>(one, maxLength - 1);
+        auto whole2 = make_shared<LengthCounts>(two, maxLength - 1);
 
-            /* Seed the initial state with all productions from the start
-             * symbol.
+        for (size_t n = 0; n < maxLength; n++) {
+            /* Blocks still to examine. Blocks where the counts disagree go up front, since
+             * that's where any difference is most likely to be.
              */
-            set<LR0Item> initial;
-            for (const auto& prod: ourCFG->productions) {
-                if (prod.nonterminal == ourCFG->startSymbol) {
-                    initial.insert({ &prod, 0 });
+            deque<StringBlock> blocks;
+            blocks.push_back({ U"", whole1, whole2 });
+
+            for (size_t examined = 0; !blocks.empty(); examined++) {
+                /* Out of patience? */
+                if (examined == options.prefixLimit) {
+                    result.unsettledLengths.push_back(n);
+                    break;
                 }
-            }
 
-            /* Construct the automaton. We seed things with the kernel state corresponding to
-             * the start configuration.
-             */
-            LR0EDFA eDFA;
-            eDFA.start = buildStateFor(closureOf(initial, *ourCFG, nulls, ClosureType::KERNEL),
-                                       ClosureType::KERNEL,
-                                       *ourCFG,
-                                       nulls,
-                                       states);
+                auto block = blocks.front();
+                blocks.pop_front();
 
-            /* Form a proper automaton. Copy the states over. */
-            for (const auto& entry: states) {
-                eDFA.states.insert(entry.second);
-            }
+                uint64_t count1 = block.lhs->countOf(n);
+                uint64_t count2 = block.rhs->countOf(n);
 
-            /* Form the linear ordering used in the GOTO table. */
-            buildIndex(eDFA, *ourCFG);
+                /* Nothing here? Then nothing to disagree about. */
+                if (count1 == 0 && count2 == 0) continue;
 
-            /* Build the GOTO table. */
-            buildGoToTable(eDFA);
+                /* Only one has strings here? Then we've found a difference. */
+                if (count1 == 0 || count2 == 0) {
+                    result.equivalent = false;
+                    result.firstDifference = n;
+                    result.counterexample = (count1 == 0? block.rhs : block.lhs)->someStringOf(n);
+                    return result;
+                }
 
-            /* And the completed table, too! */
-            buildCompletedTable(eDFA);
+                /* Few enough strings to list? Then compare them directly. Once the prefix is the
+                 * whole string, there's at most one string on each side, so we always land here.
+                 */
+                if ((count1 <= options.enumerationLimit && count2 <= options.enumerationLimit) ||
+                    block.prefix.size() == n) {
+                    const auto& strings1 = block.lhs->stringsOf(n);
+                    const auto& strings2 = block.rhs->stringsOf(n);
+                    if (strings1 == strings2) continue;
+
+                    vector<string> difference;
+                    set_symmetric_difference(strings1.begin(), strings1.end(),
+                                             strings2.begin(), strings2.end(),
+                                             back_inserter(difference));
+
+                    result.equivalent = false;
+                    result.firstDifference = n;
+                    result.counterexample = difference.front();
+                    return result;
+                }
 
-            return [=](const string& str) {
-                /* Translate input characters to their indices. */
-                vector<size_t> input;
-                for (char32_t terminal: utf8Decode(str, ourCFG->alphabet)) {
-                    input.push_back(eDFA.toIndex.at({ Symbol::Type::TERMINAL, terminal }));
+                /* Otherwise, split things up by the next character. */
+                for (char32_t ch: one.alphabet) {
+                    auto prefix = block.prefix + ch;
+                    auto dfa = lengthDFA(one.alphabet, n, prefix);
+
+                    StringBlock next = {
+                        prefix,
+                        make_shared<LengthCounts>(intersect(one, dfa), n),
+                        make_shared<LengthCounts>(intersect(two, dfa), n)
+                    };
+                    if (next.lhs->countOf(n) != next.rhs->countOf(n)) {
+                        blocks.push_front(next);
+                    } else {
+                        blocks.push_back(next);
+                    }
                 }
-                return eDFAEarley(eDFA, eDFA.toIndex.at({ Symbol::Type::NONTERMINAL, ourCFG->startSymbol }), input);
-            };
+            }
         }
+
+        return result;
     }
 
-    Matcher matcherFor(const CFG& cfg, MatcherType type) {
-        if (type == MatcherType::EARLEY) {
-            return earleyMatcherFor(cfg);
-        } else if (type == MatcherType::CYK) {
-            return cykMatcherFor(cfg);
-        } else if (type == MatcherType::EARLEY_LR0) {
-            return earleyLR0MatcherFor(cfg);
-        } else {
-            throw runtime_error("Unknown matcher type.");
+    /* The enumerator's memoized sets are just the ones LengthCounts keeps for listing the
+     * strings of one length.
+     */
+    struct LanguageEnumerator::Impl {
+        LengthCounts counts;
+        size_t maxLength;
+
+        Impl(const CFG& cfg, size_t maxLength) : counts(cfg, maxLength), maxLength(maxLength) {
+
         }
+    };
+
+    LanguageEnumerator::LanguageEnumerator(shared_ptr<Impl> impl) : impl(impl) {
+
     }
 
-    namespace {
-        /* Base index for Unicode characters for nonterminals. Just for fun, I've
-         * picked it to be near a bunch of cute symbols and emojis. :-)
+    bool LanguageEnumerator::next(string& result) {
+        /* Move on to the next length with any strings, if there is one. The memoized sets
+         * are never changed or thrown away once made, so our iterator into one stays good.
          */
-        const char32_t kBaseUnicode = 0x1F300;
+        while (strings == nullptr || position == strings->end()) {
+            if (length > impl->maxLength) return false;
+
+            strings  = &impl->counts.stringsOf(length++);
+            position = strings->begin();
+        }
+
+        result = *position++;
+        return true;
+    }
+
+    LanguageEnumerator enumerate(const CFG& cfg, size_t maxLength) {
+        return LanguageEnumerator(make_shared<LanguageEnumerator::Impl>(cfg, maxLength));
     }
 
     /**************************************************************************
@@ -2644,26 +5943,35 @@ namespace CFG {
      * be something in the CFG (derived from S) and also something accepted
      * by the DFA (getting us from q0 to qf).
      *
-     * This grammar will have a LOT of nonterminals in it, many of which will
-     * be completely unreachable. To be a good citizen about it, as a final
-     * postprocessing step we convert things to weak CNF, which has the effect
-     * of cleaning up the grammar a bit.
+     * Most of those triples are useless: either no string takes the DFA from qx
+     * to qy while being derived from A, or the triple is never needed to build up
+     * a string from S'. Rather than emitting every combination and cleaning up
+     * afterwards, we build things bottom-up from a worklist, starting with the
+     * triples for terminals and epsilon and only ever combining triples already
+     * known to be derivable. That gives us exactly the productive triples. Then
+     * we walk down from S' and keep only the triples it can reach. Triples are
+     * given dense ids through a hash table, so they can be stored in flat arrays.
      */
     namespace {
-        /* Given a DFA, return its start state. */
-        const Automata::State* startOf(const Automata::DFA& dfa) {
-            for (auto state: dfa.states) {
-                if (state->isStart) return state.get();
-            }
-            abort(); // Logic error!
-        }
+        /* Sentinel for "no triple here." */
+        const size_t kNoSpan = size_t(-1);
 
-        /* Delta function for a DFA. */
-        const Automata::State* delta(const Automata::State* state, char32_t ch) {
-            return state->transitions.find(ch)->second;
-        }
+        /* A triple [A, qx, qy], with the nonterminal and states as indices. */
+        struct Span {
+            size_t nonterminal;
+            size_t from, to;
+        };
 
-        const bool kIntersectVerbose = false;
+        /* A production of the intersection grammar, in terms of triple ids. Each has
+         * zero, one, or two triples on its right-hand side, or a single terminal.
+         */
+        struct SpanProduction {
+            size_t lhs;
+            size_t left  = kNoSpan;
+            size_t right = kNoSpan;
+            bool hasTerminal = false;
+            char32_t terminal = 0;
+        };
     }
 
     CFG intersect(const CFG& input, const Automata::DFA& dfa) {
@@ -2671,112 +5979,197 @@ namespace CFG {
 
         /* Place the grammar into weak CNF. */
         auto cfg = toWeakCNF(input);
-        CFG result;
 
-        /* Map from (nonterminal, start, end) to new nonterminal names. */
-        map<tuple<char32_t, const Automata::State*, const Automata::State*>, char32_t> names;
-        char32_t next = kBaseUnicode;
-        auto symbolFor = [&](char32_t nonterminal, const Automata::State* from, const Automata::State* to) {
-            auto key = make_tuple(nonterminal, from, to);
-            if (!names.count(key)) {
-                /* Skip to next free nonterminal name.
-                 *
-                 * TODO: This isn't necessary, right? Because we're producing an entirely
-                 * new set of nonterminal names?
-                 */
-                while (cfg.nonterminals.count(next)) next++;
+        /* Number the nonterminals and the DFA states. */
+        map<char32_t, size_t> nonterminalIds;
+        for (char32_t nonterminal: cfg.nonterminals) {
+            nonterminalIds.insert(make_pair(nonterminal, nonterminalIds.size()));
+        }
 
-                names[key] = next;
-                result.nonterminals.insert(next);
-                next++;
-                if (kIntersectVerbose) cout << "  Symbol " << toUTF8(names[key]) << " denotes [" << toUTF8(nonterminal) << ", " << from->name << ", " << to->name << "]" << endl;
+        vector<const Automata::State*> states;
+        unordered_map<const Automata::State*, size_t> stateIds;
+        size_t q0 = kNoSpan;
+        for (const auto& state: dfa.states) {
+            if (state->isStart) q0 = states.size();
+            stateIds[state.get()] = states.size();
+            states.push_back(state.get());
+        }
+        if (q0 == kNoSpan) abort(); // Logic error!
+
+        const size_t numNonterminals = nonterminalIds.size();
+        const size_t numStates = states.size();
+
+        /* Index the productions by the nonterminals on their right-hand sides. */
+        vector<vector<size_t>>              unitParents(numNonterminals);  // A -> B, indexed by B
+        vector<vector<pair<size_t, size_t>>> asLeftChild(numNonterminals); // A -> BC as (A, C), indexed by B
+        vector<vector<pair<size_t, size_t>>> asRightChild(numNonterminals);// A -> BC as (A, B), indexed by C
+        for (const auto& prod: cfg.productions) {
+            const auto& p = prod.replacement;
+            size_t lhs = nonterminalIds.at(prod.nonterminal);
+            if (p.size() == 1 && p[0].type == Symbol::Type::NONTERMINAL) {
+                unitParents[nonterminalIds.at(p[0].ch)].push_back(lhs);
+            } else if (p.size() == 2) {
+                size_t first = nonterminalIds.at(p[0].ch), second = nonterminalIds.at(p[1].ch);
+                asLeftChild[first].push_back(make_pair(lhs, second));
+                asRightChild[second].push_back(make_pair(lhs, first));
             }
-            return names[key];
-        };
+        }
 
-        result.alphabet = cfg.alphabet;
-        auto q0 = startOf(dfa);
+        /* Triples discovered so far, and the ids we've given them. */
+        vector<Span> spans;
+        unordered_map<uint64_t, size_t> spanIds;
+        queue<size_t> worklist;
 
-        /* Transform all productions. */
+        vector<SpanProduction> productions;
+
+        /* Records a production for the triple [A, qx, qy], adding the triple to the
+         * worklist if it's new.
+         */
+        auto emit = [&](size_t nonterminal, size_t from, size_t to, SpanProduction production) {
+            uint64_t key = (uint64_t(nonterminal) * numStates + from) * numStates + to;
+            auto result = spanIds.insert(make_pair(key, spans.size()));
+            if (result.second) {
+                spans.push_back({ nonterminal, from, to });
+                worklist.push(result.first->second);
+            }
+
+            production.lhs = result.first->second;
+            productions.push_back(production);
+        };
+
+        /* Seed things with the triples that derive strings directly. */
         for (const auto& prod: cfg.productions) {
             const auto& p = prod.replacement;
-            if (kIntersectVerbose) cout << prod << endl;
-
-            /* Epsilon? */
-            if (p.size() == 0) {
-                if (kIntersectVerbose) cout << "  Epsilon production." << endl;
-                /* Add [S, q0, q0] -> epsilon, but only if q0 is accepting. */
-                if (q0->isAccepting) {
-                    result.productions.push_back({ symbolFor(prod.nonterminal, q0, q0), { } });
-                    if (kIntersectVerbose) cout << "  Made " << result.productions.back() << endl;
-                } else {
-                    if (kIntersectVerbose) cout << "  Start state isn't accepting." << endl;
+            size_t lhs = nonterminalIds.at(prod.nonterminal);
+
+            /* [A, qx, qx] -> epsilon */
+            if (p.empty()) {
+                for (size_t q = 0; q < numStates; q++) {
+                    emit(lhs, q, q, {});
                 }
             }
-            /* Terminal unit? */
+            /* [A, qx, delta(qx, a)] -> a */
             else if (p.size() == 1 && p[0].type == Symbol::Type::TERMINAL) {
-                if (kIntersectVerbose) cout << "  Unit terminal." << endl;
-                /* Add [A, qx, delta(qx, a)] -> a for all states qx. */
-                for (const auto& from: dfa.states) {
-                    auto* to = delta(from.get(), p[0].ch);
-
-                    result.productions.push_back({ symbolFor(prod.nonterminal, from.get(), to), { p[0] } });
-                    if (kIntersectVerbose) cout << "  Made " << result.productions.back() << endl;
+                SpanProduction production;
+                production.hasTerminal = true;
+                production.terminal = p[0].ch;
+
+                for (size_t q = 0; q < numStates; q++) {
+                    auto next = states[q]->transitions.find(p[0].ch);
+                    if (next == states[q]->transitions.end()) throw runtime_error("DFA is missing a transition.");
+                    emit(lhs, q, stateIds.at(next->second), production);
                 }
             }
-            /* Nonterminal unit? */
-            else if (p.size() == 1 && p[0].type == Symbol::Type::NONTERMINAL) {
-                if (kIntersectVerbose) cout << "  Unit nonterminal." << endl;
+        }
 
-                /* Add [A, qx, qy] -> [B, qx, qy] for all states qx, qy. */
-                for (const auto& qx: dfa.states) {
-                    for (const auto& qy: dfa.states) {
-                        auto lhs = symbolFor(prod.nonterminal, qx.get(), qy.get());
-                        auto rhs = symbolFor(p[0].ch, qx.get(), qy.get());
+        /* Combine derivable triples into larger ones. Each triple gets filed by where it
+         * starts and where it ends once it's processed, and each pair of triples is
+         * combined when the later of the two is processed.
+         */
+        vector<vector<size_t>> startingAt(numNonterminals * numStates); // [B, qx, *], indexed by (B, qx)
+        vector<vector<size_t>> endingAt(numNonterminals * numStates);   // [B, *, qy], indexed by (B, qy)
+
+        while (!worklist.empty()) {
+            size_t id = worklist.front();
+            worklist.pop();
+
+            /* Copy, since emitting can grow the spans list. */
+            auto span = spans[id];
+            startingAt[span.nonterminal * numStates + span.from].push_back(id);
+            endingAt[span.nonterminal * numStates + span.to].push_back(id);
+
+            /* [A, qx, qy] -> [B, qx, qy] */
+            for (size_t parent: unitParents[span.nonterminal]) {
+                SpanProduction production;
+                production.left = id;
+                emit(parent, span.from, span.to, production);
+            }
 
-                        result.productions.push_back({ lhs, { nonterminal(rhs) } });
-                        if (kIntersectVerbose) cout << "  Made " << result.productions.back() << endl;
-                    }
+            /* [A, qx, qy] -> [B, qx, qz] [C, qz, qy], where we're [B, qx, qz]. */
+            for (const auto& rule: asLeftChild[span.nonterminal]) {
+                for (size_t partner: startingAt[rule.second * numStates + span.to]) {
+                    SpanProduction production;
+                    production.left  = id;
+                    production.right = partner;
+                    emit(rule.first, span.from, spans[partner].to, production);
                 }
             }
-            /* Binary production? */
-            else if (p.size() == 2) {
-                if (kIntersectVerbose) cout << "  Binary production." << endl;
-
-                /* Add [A, qx, qy] -> [B, qx, qz] [C, qz, qy] for all states qx, qy, qz. */
-                for (const auto& qx: dfa.states) {
-                    for (const auto& qy: dfa.states) {
-                        for (const auto& qz: dfa.states) {
-                            auto lhs  = symbolFor(prod.nonterminal, qx.get(), qy.get());
-                            auto rhs1 = symbolFor(p[0].ch, qx.get(), qz.get());
-                            auto rhs2 = symbolFor(p[1].ch, qz.get(), qy.get());
 
-                            result.productions.push_back({ lhs, { nonterminal(rhs1), nonterminal(rhs2) } });
-                            if (kIntersectVerbose) cout << "  Made " << result.productions.back() << endl;
-                        }
-                    }
+            /* [A, qx, qy] -> [B, qx, qz] [C, qz, qy], where we're [C, qz, qy]. (If we're
+             * also the [B, qx, qz], the loop above already handled it.)
+             */
+            for (const auto& rule: asRightChild[span.nonterminal]) {
+                for (size_t partner: endingAt[rule.second * numStates + span.from]) {
+                    if (partner == id) continue;
+
+                    SpanProduction production;
+                    production.left  = partner;
+                    production.right = id;
+                    emit(rule.first, spans[partner].from, span.to, production);
                 }
             }
-            /* Oops, that's impossible. */
-            else {
-                abort(); // Logic error!
+        }
+
+        /* Group the productions by their left-hand sides. */
+        vector<vector<size_t>> productionsFor(spans.size());
+        for (size_t i = 0; i < productions.size(); i++) {
+            productionsFor[productions[i].lhs].push_back(i);
+        }
+
+        /* Walk down from the start triples, naming each reachable triple as we go. */
+        vector<char32_t> names(spans.size(), 0);
+        char32_t next = kBaseUnicode;
+        queue<size_t> reachable;
+        auto reach = [&](size_t id) {
+            if (names[id] != 0) return;
+            if (next > kMaxUnicode) throw runtime_error("Intersection has too many nonterminals.");
+
+            names[id] = next++;
+            reachable.push(id);
+        };
+
+        size_t start = nonterminalIds.at(cfg.startSymbol);
+        vector<size_t> startSpans;
+        for (size_t qf = 0; qf < numStates; qf++) {
+            if (!states[qf]->isAccepting) continue;
+
+            auto itr = spanIds.find((uint64_t(start) * numStates + q0) * numStates + qf);
+            if (itr != spanIds.end()) {
+                startSpans.push_back(itr->second);
+                reach(itr->second);
             }
         }
 
-        /* Set up the start symbol. */
-        result.startSymbol = next;
-        result.nonterminals.insert(result.startSymbol);
+        CFG result;
+        result.alphabet = cfg.alphabet;
+
+        while (!reachable.empty()) {
+            size_t id = reachable.front();
+            reachable.pop();
+            result.nonterminals.insert(names[id]);
 
-        /* Productions for the start nonterminal. */
-        for (const auto& qf: dfa.states) {
-            /* Add S' -> [S, q0, qf] for each accepting qf. */
-            if (qf->isAccepting) {
-                auto rhs = symbolFor(cfg.startSymbol, q0, qf.get());
-                result.productions.push_back({ result.startSymbol, { nonterminal(rhs) } });
-                if (kIntersectVerbose) cout << "  Start: Made " << result.productions.back() << endl;
+            for (size_t index: productionsFor[id]) {
+                const auto& production = productions[index];
+
+                vector<Symbol> replacement;
+                if (production.hasTerminal) replacement.push_back(terminal(production.terminal));
+                for (size_t child: { production.left, production.right }) {
+                    if (child == kNoSpan) continue;
+
+                    reach(child);
+                    replacement.push_back(nonterminal(names[child]));
+                }
+                result.productions.push_back({ names[id], replacement });
             }
         }
 
-        return clean(result);
+        /* Set up the start symbol, with S' -> [S, q0, qf] for each accepting qf. */
+        result.startSymbol = next;
+        result.nonterminals.insert(result.startSymbol);
+        for (size_t id: startSpans) {
+            result.productions.push_back({ result.startSymbol, { nonterminal(names[id]) } });
+        }
+
+        return result;
     }
 }
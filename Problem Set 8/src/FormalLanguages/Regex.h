@@ -4,6 +4,12 @@
 #include <string>
 #include <memory>
 #include <ostream>
+#include <unordered_map>
+#include <functional>
+
+namespace Automata {
+    struct NFA;
+}
 
 namespace Regex {
     /* Visitor type. */
@@ -173,6 +179,83 @@ namespace Regex {
         Result last;
     };
 
+    /* Factory for regexes that hash-conses its nodes: building the same expression
+     * twice from the same factory gives back the same node, so regexes from one
+     * factory can be compared by pointer and share all common subexpressions.
+     *
+     * Each constructor applies a few algebraic identities before building anything
+     * (εr = rε = r, ∅r = r∅ = ∅, ∅ ∪ r = r, r ∪ r = r, r** = r*, r?* = r*, etc.),
+     * and the factory remembers per-node facts like nullability, size, and core
+     * alphabet so they never need to be recomputed. Constructors only ever produce
+     * node types at least as basic as the one requested, so building with the core
+     * operators yields a core regex.
+     *
+     * Regexes made elsewhere (say, by the parser) can be brought in with intern().
+     */
+    class Factory {
+    public:
+        Factory();
+
+        Regex character(char32_t ch);
+        Regex sigma();
+        Regex epsilon();
+        Regex emptySet();
+
+        Regex unionOf(Regex lhs, Regex rhs);
+        Regex concat(Regex lhs, Regex rhs);
+        Regex star(Regex expr);
+        Regex plus(Regex expr);
+        Regex question(Regex expr);
+        Regex power(Regex expr, std::size_t repeats);
+
+        /* Returns the node in this factory structurally equal to the given regex. */
+        Regex intern(Regex regex);
+
+        /* Facts about regexes built by this factory. Passing in a regex from
+         * anywhere else is a logic error.
+         */
+        bool        isNullable(Regex regex);
+        std::size_t sizeOf(Regex regex);   // Occurrences of characters and Σ
+        const Languages::Alphabet& coreAlphabetOf(Regex regex);
+
+    private:
+        enum class Kind {
+            CHARACTER, SIGMA, EPSILON, EMPTY_SET, UNION, CONCAT, STAR, PLUS, QUESTION, POWER
+        };
+
+        /* Identifies a node by its kind and its (already interned) children. */
+        struct Key {
+            Kind        kind;
+            ASTNode*    left;
+            ASTNode*    right;
+            std::size_t value;  // Character or repeat count
+
+            bool operator== (const Key& rhs) const;
+        };
+        struct KeyHash {
+            std::size_t operator() (const Key& key) const;
+        };
+
+        struct Info {
+            Kind        kind;
+            std::size_t value;
+            Regex       left, right;
+            std::size_t size;
+            bool        isNullable;
+            std::shared_ptr<const Languages::Alphabet> alphabet;  // Computed lazily
+        };
+
+        std::unordered_map<Key, Regex, KeyHash> nodes;
+        std::unordered_map<ASTNode*, Info> info;
+        Regex theSigma, theEpsilon, theEmptySet;
+
+        const Info& infoFor(Regex regex);
+        std::shared_ptr<const Languages::Alphabet> alphabetOf(Regex regex);
+        Regex make(const Key& key, std::function<Regex()> create,
+                   Regex left, Regex right, std::size_t size, bool isNullable);
+        bool isAlternativeOf(Regex needle, Regex haystack);
+    };
+
     /* Utility functions on regexes. */
     std::ostream& operator<< (std::ostream& out, const Regex& regex);
 
@@ -183,10 +266,18 @@ namespace Regex {
     Languages::Alphabet coreAlphabetOf(Regex);
 
     /* "Desugars" a regex by replacing all syntax sugars (sigma, ?, +, and repeats)
-     * with simpler basic regexes.
+     * with simpler basic regexes. The result is hash-consed, so Σ expands to one
+     * shared union and r^n is built by repeated squaring in O(log n) nodes.
      */
     Regex desugar(Regex regex, const Languages::Alphabet& alphabet);
 
+    /* Converts an automaton into a regex for the same language using state
+     * elimination. States are eliminated cheapest-first, the intermediate regexes
+     * are simplified as they're built, and structurally equal subexpressions are
+     * shared rather than duplicated.
+     */
+    Regex fromAutomaton(const Automata::NFA& nfa);
+
 
 
     /* * * * * Implementation Below This Point * * * * */
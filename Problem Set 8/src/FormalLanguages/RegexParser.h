@@ -3,6 +3,7 @@
 
 #include "RegexScanner.h"
 #include <queue>
+#include <vector>
 #include <memory>
 #include "Regex.h"
 #include "Utilities/Unicode.h"
@@ -11,6 +12,11 @@
 namespace Regex {
     std::shared_ptr<ASTNode> parse(std::queue<Token>& q);
     std::shared_ptr<ASTNode> parse(std::queue<Token>&& q);
+
+    /* Parses a token stream from the in-place scanner, reading the tokens by index
+     * without copying or consuming them.
+     */
+    std::shared_ptr<ASTNode> parse(const std::vector<TokenView>& tokens);
 }
 
 #endif
@@ -3,6 +3,7 @@
 #include "StrUtils/StrUtils.h"
 #include <unordered_map>
 #include <sstream>
+#include <iterator>
 using namespace std;
 
 namespace Regex {
@@ -42,6 +43,30 @@ namespace Regex {
             { "⁹", "9" },
         };
 
+        /* The same tables, keyed by code point rather than by UTF-8 string, so that
+         * the scanner can classify characters without building strings.
+         */
+        unordered_map<char32_t, TokenType> tokenTypesByChar() {
+            unordered_map<char32_t, TokenType> result;
+            for (const auto& entry: kTokens) {
+                result[fromUTF8(entry.first)] = entry.second;
+            }
+            return result;
+        }
+        unordered_map<char32_t, size_t> superscriptValuesByChar() {
+            unordered_map<char32_t, size_t> result;
+            for (const auto& entry: kSuperscripts) {
+                result[fromUTF8(entry.first)] = stoul(entry.second);
+            }
+            return result;
+        }
+        const unordered_map<char32_t, TokenType> kTokenTypes       = tokenTypesByChar();
+        const unordered_map<char32_t, size_t>    kSuperscriptDigits = superscriptValuesByChar();
+
+        /* Text of the tokens that don't correspond to anything in the source. */
+        const string_view kImplicitPower = "^";
+        const string_view kEOFText       = "(EOF)";
+
         /* Replacements for <cctype>, given that we're working with
          * Unicode characters.
          */
@@ -55,89 +80,118 @@ namespace Regex {
             return isASCII(ch) && isdigit(static_cast<int>(ch));
         }
         bool isSuperscriptDigit(char32_t ch) {
-            return kSuperscripts.count(toUTF8(ch));
+            return kSuperscriptDigits.count(ch);
         }
         bool isEscape(char32_t ch) {
             return ch == '\\';
         }
 
-        /* Maximum number of repeats permitted; anything above this is excessive. :-) */
-        const size_t kMaxRepeats = 20;
-
-        /* Given a numeric value represented as a string, checks whether it's
-         * something we can use as an integer and, if so, returns its numeric
-         * value.
+        /* Maximum number of repeats permitted; anything above this is excessive. :-)
+         *
+         * Automata for r^n are linear in n (see fromRegex), so this can be fairly
+         * generous. Nested repetitions multiply, though, so the parser separately
+         * limits how big the regex gets once they're all expanded.
          */
-        int checkNumericValue(const string& sequence) {
-            istringstream converter(sequence);
-            size_t value;
+        const size_t kMaxRepeats = 1000;
 
-            if (!(converter >> value) || value > kMaxRepeats) {
-                throw runtime_error("Number too large: " + sequence);
+        /* Position within the text being scanned. */
+        struct Cursor {
+            string_view text;
+            size_t pos = 0;
+
+            bool atEnd() const {
+                return pos == text.size();
+            }
+            char32_t peek() const {
+                size_t next = pos;
+                return readChar(text, next);
             }
+            char32_t read() {
+                return readChar(text, pos);
+            }
+        };
 
+        /* Accumulates one more digit into a repeat count, checking that the count
+         * stays in range. The digits read so far are used to report errors.
+         */
+        size_t addDigit(size_t value, size_t digit, const string& digits) {
+            value = value * 10 + digit;
+            if (value > kMaxRepeats) {
+                throw runtime_error("Number too large: " + digits);
+            }
             return value;
         }
 
-        void scanDigitSequence(queue<Token>& result, istream& input) {
-            string sequence;
-            while (input.peek() != EOF && isDigit(peekChar(input))) {
-                sequence += readChar(input);
+        void scanDigitSequence(vector<TokenView>& result, Cursor& input) {
+            size_t start = input.pos;
+            string digits;
+            size_t value = 0;
+            while (!input.atEnd() && isDigit(input.peek())) {
+                char digit = char(input.read());
+                digits += digit;
+                value = addDigit(value, digit - '0', digits);
             }
 
-            int value = checkNumericValue(sequence);
-            result.push({ TokenType::NUMBER, std::to_string(value) });
+            result.push_back({ TokenType::NUMBER, input.text.substr(start, input.pos - start), value });
         }
 
-        void scanSuperscriptDigitSequence(queue<Token>& result, istream& input) {
-            string sequence;
-            while (input.peek() != EOF && isSuperscriptDigit(peekChar(input))) {
-                sequence += kSuperscripts.at(toUTF8(readChar(input)));
+        void scanSuperscriptDigitSequence(vector<TokenView>& result, Cursor& input) {
+            size_t start = input.pos;
+            string digits;
+            size_t value = 0;
+            while (!input.atEnd() && isSuperscriptDigit(input.peek())) {
+                size_t digit = kSuperscriptDigits.at(input.read());
+                digits += char('0' + digit);
+                value = addDigit(value, digit, digits);
             }
 
-            int value = checkNumericValue(sequence);
-
             /* Treat this as though we implicitly raised something to a power. */
-            result.push({ TokenType::POWER,  "^"});
-            result.push({ TokenType::NUMBER, std::to_string(value) });
+            result.push_back({ TokenType::POWER,  kImplicitPower, 0 });
+            result.push_back({ TokenType::NUMBER, input.text.substr(start, input.pos - start), value });
         }
 
-        void scanCharacter(queue<Token>& result, istream& input) {
-            string read = toUTF8(readChar(input));
+        void scanCharacter(vector<TokenView>& result, Cursor& input) {
+            size_t start = input.pos;
+            char32_t read = input.read();
+            string_view text = input.text.substr(start, input.pos - start);
 
             /* This is either a special character or just a regular
              * ordinary character.
              */
-            auto itr = kTokens.find(read);
-            if (itr != kTokens.end()) {
-                result.push({ itr->second, read });
+            auto itr = kTokenTypes.find(read);
+            if (itr != kTokenTypes.end()) {
+                result.push_back({ itr->second, text, 0 });
             } else {
-                result.push({ TokenType::CHARACTER, read });
+                result.push_back({ TokenType::CHARACTER, text, 0 });
             }
         }
 
-        void scanEscape(queue<Token>& result, istream& input) {
+        void scanEscape(vector<TokenView>& result, Cursor& input) {
             /* Grab and skip the next character. */
-            (void) readChar(input);
+            (void) input.read();
 
             /* The next character is the one we're looking for. */
-            if (input.peek() == EOF) {
+            if (input.atEnd()) {
                 throw runtime_error("Saw escape character at end of input.");
             }
 
-            result.push({ TokenType::CHARACTER, toUTF8(readChar(input)) });
+            size_t start = input.pos;
+            (void) input.read();
+            result.push_back({ TokenType::CHARACTER, input.text.substr(start, input.pos - start), 0 });
         }
     }
 
-    queue<Token> scan(istream& input) {
-        queue<Token> result;
-        while (input.peek() != EOF) {
+    void scan(string_view sourceText, vector<TokenView>& result) {
+        result.clear();
+
+        Cursor input{ sourceText };
+        while (!input.atEnd()) {
             /* Grab the next character to see what to do with it. */
-            char32_t next = peekChar(input);
+            char32_t next = input.peek();
 
             /* Skip whitespace. */
             if (isSpace(next)) {
-                (void) readChar(input);
+                (void) input.read();
             }
             /* If this is an escape, read it as such. */
             else if (isEscape(next)) {
@@ -160,7 +214,24 @@ namespace Regex {
         }
 
         /* Tack on an EOF marker. */
-        result.push({ TokenType::SCAN_EOF, "(EOF)" });
+        result.push_back({ TokenType::SCAN_EOF, kEOFText, 0 });
+    }
+
+    /* The owning token stream is a copy of the in-place one. */
+    queue<Token> scan(istream& input) {
+        string sourceText(istreambuf_iterator<char>(input), {});
+
+        vector<TokenView> tokens;
+        scan(sourceText, tokens);
+
+        queue<Token> result;
+        for (const auto& token: tokens) {
+            if (token.type == TokenType::NUMBER) {
+                result.push({ token.type, std::to_string(token.value) });
+            } else {
+                result.push({ token.type, string(token.data) });
+            }
+        }
         return result;
     }
 
@@ -173,10 +244,14 @@ namespace Regex {
         return t.data;
     }
 
+    string to_string(const TokenView& t) {
+        return string(t.data);
+    }
+
     bool isSpecialChar(char32_t ch) {
         /* It's a special character if it's in our table, it's a digit, or it's a superscript
          * digit.
          */
-        return isDigit(ch) || kSuperscripts.count(toUTF8(ch)) || kTokens.count(toUTF8(ch));
+        return isDigit(ch) || kSuperscriptDigits.count(ch) || kTokenTypes.count(ch);
     }
 }
@@ -444,9 +444,7 @@ namespace MiniData_JSONImpl {
     inline void printString(std::ostream& out, const std::string& str) {
         out << '"';
     
-        std::istringstream extractor(str);
-        while (extractor.peek() != EOF) {
-            char32_t ch = readChar(extractor);
+        for (char32_t ch: decodeUTF8(str)) {
             
             /* See how we need to encode this character. */
             if      (ch == '"')  out << "\\\"";
@@ -995,6 +993,28 @@ namespace MiniData_JSONImpl {
         parseError("Not sure how to handle value starting with character " + toUTF8(next));
     }
 
+    /* Confirms that a run of bytes read from a string is valid UTF-8 for characters in
+     * the range JSON allows.
+     */
+    inline void checkEncoding(std::string_view run) {
+        /* Four-byte sequences can encode values past the end of Unicode. */
+        auto inRange = [&] {
+            for (std::size_t i = 0; i + 1 < run.size(); i++) {
+                unsigned char byte = run[i];
+                unsigned char next = run[i + 1];
+                if (byte > 0xF4 || (byte == 0xF4 && next >= 0x90)) return false;
+            }
+            return true;
+        };
+        if (isValidUTF8(run) && inRange()) return;
+
+        /* Something's wrong. Decode one character at a time to report the first problem. */
+        for (std::size_t pos = 0; pos < run.size(); ) {
+            char32_t ch = readChar(run, pos);
+            if (ch > 0x10FFFF) parseError("Illegal character: " + toUTF8(ch));
+        }
+    }
+
     inline std::string readString(std::istream& input) {
         std::string result;
 
@@ -1002,17 +1022,33 @@ namespace MiniData_JSONImpl {
 
         /* Keep reading characters as we find them. */
         while (true) {
-            char32_t next = readChar(input);
-            
+            /* Copy over raw bytes up to the next quote, backslash, or control character. None
+             * of those can appear inside a multibyte UTF-8 sequence, so this never splits a
+             * character, and we can check the whole run's encoding in one pass afterwards.
+             */
+            std::size_t runStart = result.size();
+            char next;
+            while (true) {
+                if (!input.get(next)) {
+                    checkEncoding(std::string_view(result).substr(runStart));
+                    MiniData_UnicodeImpl::utfError("Unexpected end of stream.");
+                }
+                result += next;
+                if (next == '"' || next == '\\' || static_cast<unsigned char>(next) < 0x20) break;
+            }
+
+            /* Check the run along with the byte that ended it, which is what a truncated
+             * character at the end of the run would have run into.
+             */
+            checkEncoding(std::string_view(result).substr(runStart));
+            result.pop_back();
+
             /* Only a certain character range is valid. */
-            if (next < 0x20 || next > 0x10FFFF) parseError("Illegal character: " + toUTF8(next));
+            if (static_cast<unsigned char>(next) < 0x20) parseError("Illegal character: " + toUTF8(next));
 
             /* We're done if this is a close quote. */
             if (next == '"') return result;
 
-            /* If this isn't an escape sequence, just append it. */
-            if (next != '\\') result += toUTF8(next);
-
             /* Otherwise, read it as an escape. */
             else {
                 char32_t escaped = readChar(input);